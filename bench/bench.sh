@@ -0,0 +1,146 @@
+#!/bin/sh
+# Runs the standard benchmark matrix against a local webserv instance.
+#
+#   make bench                      # from the repository root
+#   BENCH_DURATION=30 make bench    # longer runs
+#
+# Environment:
+#   BENCH_DURATION     measured seconds per run (5)
+#   BENCH_WARMUP       unmeasured seconds per run (1)
+#   BENCH_CONNECTIONS  concurrent connections (16)
+#   BENCH_RATE         open-loop request rate in req/s (500)
+#   BENCH_SCENARIOS    mixes to run (all files in bench/mixes)
+#   BENCH_CONFIG       server config (config/bench.conf)
+#   BENCH_BACKENDS     event backends to compare (poll io_uring)
+#   BENCH_OUT          results directory (bench/out)
+#
+# Results are written as a JSON array to $BENCH_OUT/results.json, one object
+# per (backend, scenario, mode) run. The server is restarted for each
+# backend; one that is unavailable falls back to poll (see webserv-*.log).
+
+set -u
+
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+cd "$ROOT" || exit 1
+
+DURATION=${BENCH_DURATION:-5}
+WARMUP=${BENCH_WARMUP:-1}
+CONNECTIONS=${BENCH_CONNECTIONS:-16}
+RATE=${BENCH_RATE:-500}
+CONFIG=${BENCH_CONFIG:-config/bench.conf}
+OUT=${BENCH_OUT:-bench/out}
+SCENARIOS=${BENCH_SCENARIOS:-$(ls bench/mixes | sed 's/\.mix$//')}
+BACKENDS=${BENCH_BACKENDS:-poll io_uring}
+SERVER=./webserv
+LOADGEN=./loadgen
+
+PORT=$(sed -n 's/^[[:space:]]*listen[[:space:]]*[^:;]*:\{0,1\}\([0-9][0-9]*\);.*/\1/p' "$CONFIG" | head -n 1)
+HOST=127.0.0.1
+
+if [ ! -x "$SERVER" ] || [ ! -x "$LOADGEN" ]; then
+    echo "bench: build webserv and loadgen first (make bench)" >&2
+    exit 1
+fi
+
+# --- fixtures ---------------------------------------------------------------
+mkdir -p bench/www/static bench/www/listing "$OUT"
+head -c 1024 /dev/zero | tr '\0' 'x' > bench/www/static/small.html
+head -c 65536 /dev/zero | tr '\0' 'y' > bench/www/static/medium.css
+if [ ! -f bench/www/static/large.bin ]; then
+    head -c 8388608 /dev/urandom > bench/www/static/large.bin
+fi
+if [ ! -f bench/www/listing/file_0499.txt ]; then
+    i=0
+    while [ $i -lt 500 ]; do
+        : > "bench/www/listing/$(printf 'file_%04d.txt' $i)"
+        i=$((i + 1))
+    done
+fi
+
+# --- server -----------------------------------------------------------------
+mkdir -p www/uploads
+MARKER="$OUT/.start"
+: > "$MARKER"
+UPSTREAM_PIDS=""
+for upstream_port in 18181 18182; do
+    python3 bench/stub_upstream.py $upstream_port > /dev/null 2>&1 &
+    UPSTREAM_PIDS="$UPSTREAM_PIDS $!"
+done
+SERVER_PID=""
+
+cleanup() {
+    kill $SERVER_PID $UPSTREAM_PIDS 2>/dev/null
+    wait $SERVER_PID $UPSTREAM_PIDS 2>/dev/null
+    # Remove what the upload scenario wrote into the real upload directory.
+    find www/uploads -maxdepth 1 -type f -newer "$MARKER" -exec rm -f {} + 2>/dev/null
+    rm -f "$MARKER" "$OUT"/bench-*.conf
+}
+trap cleanup EXIT INT TERM
+
+wait_ready() {
+    for ready_port in "$@"; do
+        tries=0
+        until $LOADGEN --host $HOST --port "$ready_port" -c 1 -d 0.1 --warmup 0 -o /dev/null 2>/dev/null; do
+            tries=$((tries + 1))
+            if [ $tries -ge 50 ] || { [ -n "$SERVER_PID" ] && ! kill -0 "$SERVER_PID" 2>/dev/null; }; then
+                echo "bench: nothing came up on $HOST:$ready_port (see $OUT/webserv-*.log)" >&2
+                exit 1
+            fi
+            sleep 0.1
+        done
+    done
+}
+wait_ready 18181 18182
+
+# --- matrix -----------------------------------------------------------------
+RAW="$OUT/results.jsonl"
+RUN="$OUT/run.jsonl"
+: > "$RAW"
+COMMON="--host $HOST --port $PORT -d $DURATION --warmup $WARMUP -o $RUN"
+
+for backend in $BACKENDS; do
+    { echo "event_backend $backend;"; cat "$CONFIG"; } > "$OUT/bench-$backend.conf"
+    $SERVER "$OUT/bench-$backend.conf" > "$OUT/webserv-$backend.log" 2>&1 &
+    SERVER_PID=$!
+    wait_ready "$PORT"
+    : > "$RUN"
+
+    for scenario in $SCENARIOS; do
+        mix="bench/mixes/$scenario.mix"
+        echo "bench: [$backend] $scenario (closed loop, $CONNECTIONS connections)"
+        $LOADGEN $COMMON --mix "$mix" --scenario "$scenario" --mode closed -c "$CONNECTIONS"
+        echo "bench: [$backend] $scenario (closed loop, keep-alive, pipeline 4)"
+        $LOADGEN $COMMON --mix "$mix" --scenario "$scenario" --mode closed -c "$CONNECTIONS" -k -p 4
+        echo "bench: [$backend] $scenario (open loop, $RATE req/s)"
+        $LOADGEN $COMMON --mix "$mix" --scenario "$scenario" --mode open -r "$RATE" -c "$CONNECTIONS"
+    done
+
+    sed "s/^{/{\"backend\":\"$backend\",/" "$RUN" >> "$RAW"
+    kill "$SERVER_PID" 2>/dev/null
+    wait "$SERVER_PID" 2>/dev/null
+    SERVER_PID=""
+done
+rm -f "$RUN"
+
+{
+    echo "["
+    sed '$!s/$/,/' "$RAW"
+    echo "]"
+} > "$OUT/results.json"
+rm -f "$RAW"
+
+echo "bench: results in $OUT/results.json"
+awk -F'"throughput_rps":' '{
+    split($0, b, "\"backend\":\""); split(b[2], bb, "\"");
+    split($0, s, "\"scenario\":\""); split(s[2], n, "\"");
+    split($0, m, "\"mode\":\""); split(m[2], mm, "\"");
+    split($0, k, "\"keepalive\":"); split(k[2], kk, ",");
+    split($2, t, ",");
+    split($0, l, "\"latency_us\":\\{"); split(l[2], p, "\"p50\":"); split(p[2], p50, ",");
+    split(l[2], q, "\"p99\":"); split(q[2], p99, ",");
+    split(l[2], r, "\"p999\":"); split(r[2], p999, ",");
+    split($0, e, "\"errors\":"); split(e[2], ee, ",");
+    if (NF > 1)
+        printf "  %-8s %-14s %-6s ka=%-5s %10s req/s  p50=%9sus p99=%9sus p999=%9sus errors=%s\n",
+               bb[1], n[1], mm[1], kk[1], t[1], p50[1], p99[1], p999[1], ee[1];
+}' "$OUT/results.json"
@@ -0,0 +1,1243 @@
+/* ************************************************************************** */
+/*                                                                            */
+/*   loadgen.cpp - HTTP/1.1 load generator for webserv                        */
+/*                                                                            */
+/*   Closed-loop: every connection sends its next request as soon as the      */
+/*   previous one completes (up to --pipeline requests in flight).            */
+/*   Open-loop: requests are scheduled at a fixed --rate; latency is taken    */
+/*   from the *intended* send time, so a stalled server cannot hide its own   */
+/*   queueing delay (coordinated-omission correction).                        */
+/*   Replay: requests captured by the server (capture_requests) are sent at  */
+/*   their recorded spacing, optionally sped up, and their status compared   */
+/*   with the one the server gave them then.                                  */
+/*                                                                            */
+/* ************************************************************************** */
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <stdint.h>
+#include <time.h>
+#include <cctype>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <algorithm>
+
+namespace {
+
+uint64_t nowNs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+std::string jsonEscape(const std::string& str) {
+    std::string out;
+    for (size_t i = 0; i < str.length(); ++i) {
+        char c = str[i];
+        if (c == '"' || c == '\\') {
+            out += '\\';
+            out += c;
+        } else if ((unsigned char)c < 0x20) {
+            char buf[8];
+            std::snprintf(buf, sizeof(buf), "\\u%04x", (unsigned char)c);
+            out += buf;
+        } else {
+            out += c;
+        }
+    }
+    return out;
+}
+
+struct Options {
+    std::string host;
+    int port;
+    size_t connections;
+    double duration;
+    double warmup;
+    bool open_loop;
+    double rate;
+    bool keepalive;
+    size_t pipeline;
+    std::string mix_file;
+    std::string path;
+    std::string method;
+    size_t body_size;
+    std::string scenario;
+    std::string out_file;
+    double expected_interval_us;
+    unsigned seed;
+    std::vector<std::string> headers;
+    std::string replay_file;
+    double speed;
+
+    Options() : host("127.0.0.1"), port(8080), connections(8), duration(10.0),
+                warmup(1.0), open_loop(false), rate(1000.0), keepalive(false),
+                pipeline(1), path("/"), method("GET"), body_size(0),
+                scenario("default"), expected_interval_us(0.0), seed(42), speed(1.0) {}
+};
+
+struct RequestSpec {
+    unsigned weight;
+    std::string method;
+    std::string path;
+    size_t body_size;
+    std::string raw;
+    // Replayed requests only
+    std::vector<std::pair<std::string, std::string> > headers;
+    uint64_t at_us;      // captured arrival time
+    int expected_status; // what the server answered when it was captured
+
+    RequestSpec() : weight(1), body_size(0), at_us(0), expected_status(0) {}
+};
+
+// Just enough JSON for capture lines: objects, strings, numbers, literals
+class JsonReader {
+private:
+    const std::string& _text;
+    size_t _pos;
+
+    void skipSpace() {
+        while (_pos < _text.size() && std::isspace((unsigned char)_text[_pos])) {
+            _pos++;
+        }
+    }
+
+public:
+    explicit JsonReader(const std::string& text) : _text(text), _pos(0) {}
+
+    bool consume(char c) {
+        skipSpace();
+        if (_pos < _text.size() && _text[_pos] == c) {
+            _pos++;
+            return true;
+        }
+        return false;
+    }
+
+    bool peek(char c) {
+        skipSpace();
+        return _pos < _text.size() && _text[_pos] == c;
+    }
+
+    bool readString(std::string& out) {
+        out.clear();
+        if (!consume('"')) {
+            return false;
+        }
+        while (_pos < _text.size() && _text[_pos] != '"') {
+            char c = _text[_pos++];
+            if (c != '\\') {
+                out += c;
+                continue;
+            }
+            if (_pos >= _text.size()) {
+                return false;
+            }
+            c = _text[_pos++];
+            if (c == 'u' && _pos + 4 <= _text.size()) {
+                out += (char)std::strtoul(_text.substr(_pos, 4).c_str(), NULL, 16); // escaped controls only
+                _pos += 4;
+            } else {
+                out += c == 'n' ? '\n' : c == 't' ? '\t' : c == 'r' ? '\r' : c;
+            }
+        }
+        return consume('"');
+    }
+
+    bool readNumber(double& out) {
+        skipSpace();
+        const char* start = _text.c_str() + _pos;
+        char* end = NULL;
+        out = std::strtod(start, &end);
+        if (end == start) {
+            return false;
+        }
+        _pos += end - start;
+        return true;
+    }
+
+    bool skipValue() {
+        skipSpace();
+        if (peek('"')) {
+            std::string ignored;
+            return readString(ignored);
+        }
+        if (consume('{') || consume('[')) {
+            char close = _text[_pos - 1] == '{' ? '}' : ']';
+            int depth = 1;
+            bool in_string = false;
+            for (; _pos < _text.size() && depth > 0; ++_pos) {
+                char c = _text[_pos];
+                if (in_string) {
+                    if (c == '\\') {
+                        _pos++;
+                    } else if (c == '"') {
+                        in_string = false;
+                    }
+                } else if (c == '"') {
+                    in_string = true;
+                } else if (c == '{' || c == '[') {
+                    depth++;
+                } else if (c == '}' || c == ']') {
+                    depth--;
+                }
+            }
+            return depth == 0 && _text[_pos - 1] == close;
+        }
+        while (_pos < _text.size() && (std::isalnum((unsigned char)_text[_pos]) || _text[_pos] == '-'
+                                       || _text[_pos] == '+' || _text[_pos] == '.')) {
+            _pos++;
+        }
+        return true;
+    }
+};
+
+struct Pending {
+    size_t spec;
+    uint64_t intended_ns;
+    uint64_t sent_ns;
+    size_t out_end;  // offset in Connection::out just past this request
+};
+
+enum ConnState {
+    CONN_CLOSED,
+    CONN_CONNECTING,
+    CONN_OPEN
+};
+
+enum ParseState {
+    PARSE_HEADERS,
+    PARSE_BODY_LENGTH,
+    PARSE_CHUNK_SIZE,
+    PARSE_CHUNK_DATA,
+    PARSE_CHUNK_CRLF,
+    PARSE_TRAILERS,
+    PARSE_BODY_UNTIL_CLOSE
+};
+
+struct Connection {
+    int fd;
+    ConnState state;
+    std::string out;
+    size_t out_offset;
+    std::string in;
+    std::deque<Pending> inflight;
+    ParseState parse;
+    size_t remaining;
+    int status;
+    bool close_after;
+
+    Connection() : fd(-1), state(CONN_CLOSED), out_offset(0),
+                   parse(PARSE_HEADERS), remaining(0), status(0), close_after(false) {}
+};
+
+struct Stats {
+    std::vector<uint64_t> latency;  // intended -> done (corrected)
+    std::vector<uint64_t> service;  // sent -> done
+    std::map<int, uint64_t> status_counts;
+    std::map<std::string, uint64_t> mismatches; // replay: "captured->now" status pairs
+    uint64_t completed;
+    uint64_t errors;
+    uint64_t connect_errors;
+    uint64_t connections_opened;
+    uint64_t bytes_read;
+    uint64_t dropped;
+
+    Stats() : completed(0), errors(0), connect_errors(0), connections_opened(0),
+              bytes_read(0), dropped(0) {}
+};
+
+class LoadGenerator {
+private:
+    Options _opts;
+    std::vector<RequestSpec> _specs;
+    std::vector<size_t> _sequence;
+    size_t _sequence_pos;
+    std::vector<Connection> _conns;
+    std::deque<Pending> _backlog;
+    Stats _stats;
+    struct sockaddr_in _addr;
+    uint64_t _measure_start;
+    uint64_t _end;
+    size_t _replay_next; // next captured request to schedule
+
+    std::string buildRawRequest(const RequestSpec& spec) const;
+    std::string buildReplayRequest(const RequestSpec& spec) const;
+    bool parseCaptureLine(const std::string& line, RequestSpec& spec) const;
+    void buildSequence();
+    size_t nextSpec();
+    bool replayDone() const;
+
+    bool openConnection(Connection& conn);
+    void closeConnection(Connection& conn, bool requeue);
+    void enqueue(Connection& conn, const Pending& pending);
+    bool flushOutput(Connection& conn);
+    bool readInput(Connection& conn, uint64_t now);
+    bool parseResponses(Connection& conn, uint64_t now);
+    bool parseHeaders(Connection& conn, size_t header_end);
+    void completeResponse(Connection& conn, uint64_t now);
+    void record(const Pending& pending, uint64_t now, int status);
+    size_t capacity(const Connection& conn) const;
+
+public:
+    explicit LoadGenerator(const Options& opts);
+
+    bool loadMix();
+    bool loadReplay();
+    bool run();
+    void report(std::ostream& out) const;
+    uint64_t completed() const { return _stats.completed; }
+};
+
+LoadGenerator::LoadGenerator(const Options& opts)
+    : _opts(opts), _sequence_pos(0), _measure_start(0), _end(0), _replay_next(0) {
+    std::memset(&_addr, 0, sizeof(_addr));
+    _addr.sin_family = AF_INET;
+    _addr.sin_port = htons(opts.port);
+    _addr.sin_addr.s_addr = inet_addr(opts.host.c_str());
+    if (!_opts.keepalive) {
+        _opts.pipeline = 1;
+    }
+    if (_opts.pipeline == 0) {
+        _opts.pipeline = 1;
+    }
+}
+
+std::string LoadGenerator::buildRawRequest(const RequestSpec& spec) const {
+    std::ostringstream req;
+    req << spec.method << " " << spec.path << " HTTP/1.1\r\n";
+    req << "Host: " << _opts.host << ":" << _opts.port << "\r\n";
+    req << "User-Agent: webserv-loadgen/1.0\r\n";
+    req << "Connection: " << (_opts.keepalive ? "keep-alive" : "close") << "\r\n";
+    for (size_t i = 0; i < _opts.headers.size(); ++i) {
+        req << _opts.headers[i] << "\r\n";
+    }
+    if (spec.body_size > 0 || spec.method == "POST" || spec.method == "PUT") {
+        req << "Content-Type: application/octet-stream\r\n";
+        req << "Content-Length: " << spec.body_size << "\r\n";
+    }
+    req << "\r\n";
+    std::string raw = req.str();
+    for (size_t i = 0; i < spec.body_size; ++i) {
+        raw += (char)('a' + (i % 26));
+    }
+    return raw;
+}
+
+// Mix file format, one request per line:
+//   <weight> <METHOD> <path> [body_bytes]
+bool LoadGenerator::loadMix() {
+    if (_opts.mix_file.empty()) {
+        RequestSpec spec;
+        spec.weight = 1;
+        spec.method = _opts.method;
+        spec.path = _opts.path;
+        spec.body_size = _opts.body_size;
+        _specs.push_back(spec);
+    } else {
+        std::ifstream file(_opts.mix_file.c_str());
+        if (!file.is_open()) {
+            std::cerr << "loadgen: cannot open mix file " << _opts.mix_file << std::endl;
+            return false;
+        }
+        std::string line;
+        int line_number = 0;
+        while (std::getline(file, line)) {
+            line_number++;
+            size_t hash = line.find('#');
+            if (hash != std::string::npos) {
+                line.erase(hash);
+            }
+            std::istringstream iss(line);
+            RequestSpec spec;
+            spec.body_size = 0;
+            if (!(iss >> spec.weight)) {
+                continue;
+            }
+            if (!(iss >> spec.method >> spec.path) || spec.weight == 0) {
+                std::cerr << "loadgen: " << _opts.mix_file << ":" << line_number
+                          << ": expected '<weight> <METHOD> <path> [body_bytes]'" << std::endl;
+                return false;
+            }
+            iss >> spec.body_size;
+            _specs.push_back(spec);
+        }
+        if (_specs.empty()) {
+            std::cerr << "loadgen: mix file " << _opts.mix_file << " has no requests" << std::endl;
+            return false;
+        }
+    }
+    for (size_t i = 0; i < _specs.size(); ++i) {
+        _specs[i].raw = buildRawRequest(_specs[i]);
+    }
+    buildSequence();
+    return true;
+}
+
+bool byArrival(const RequestSpec& a, const RequestSpec& b) {
+    return a.at_us < b.at_us;
+}
+
+// One capture_requests line; fields this tool does not use are skipped
+bool LoadGenerator::parseCaptureLine(const std::string& line, RequestSpec& spec) const {
+    JsonReader json(line);
+    if (!json.consume('{')) {
+        return false;
+    }
+    while (!json.consume('}')) {
+        std::string key;
+        if (!json.readString(key) || !json.consume(':')) {
+            return false;
+        }
+        double number = 0;
+        bool ok = true;
+        if (key == "t") {
+            ok = json.readNumber(number);
+            spec.at_us = (uint64_t)number;
+        } else if (key == "method") {
+            ok = json.readString(spec.method);
+        } else if (key == "uri") {
+            ok = json.readString(spec.path);
+        } else if (key == "body_bytes") {
+            ok = json.readNumber(number);
+            spec.body_size = (size_t)number;
+        } else if (key == "status") {
+            ok = json.readNumber(number);
+            spec.expected_status = (int)number;
+        } else if (key == "headers") {
+            ok = json.consume('{');
+            while (ok && !json.consume('}')) {
+                std::string name;
+                std::string value;
+                ok = json.readString(name) && json.consume(':') && json.readString(value);
+                spec.headers.push_back(std::make_pair(name, value));
+                json.consume(',');
+            }
+        } else {
+            ok = json.skipValue();
+        }
+        if (!ok) {
+            return false;
+        }
+        json.consume(',');
+    }
+    return !spec.method.empty() && !spec.path.empty();
+}
+
+// Entries are written as responses complete, so they are sorted by arrival
+// before being scheduled.
+bool LoadGenerator::loadReplay() {
+    std::ifstream file(_opts.replay_file.c_str());
+    if (!file.is_open()) {
+        std::cerr << "loadgen: cannot open capture " << _opts.replay_file << std::endl;
+        return false;
+    }
+    std::string line;
+    int line_number = 0;
+    while (std::getline(file, line)) {
+        line_number++;
+        if (line.find_first_not_of(" \t\r") == std::string::npos) {
+            continue;
+        }
+        RequestSpec spec;
+        if (!parseCaptureLine(line, spec)) {
+            std::cerr << "loadgen: " << _opts.replay_file << ":" << line_number
+                      << ": not a capture_requests entry" << std::endl;
+            return false;
+        }
+        spec.raw = buildReplayRequest(spec);
+        _specs.push_back(spec);
+    }
+    if (_specs.empty()) {
+        std::cerr << "loadgen: capture " << _opts.replay_file << " has no requests" << std::endl;
+        return false;
+    }
+    std::stable_sort(_specs.begin(), _specs.end(), byArrival);
+    return true;
+}
+
+// The captured headers as they were, with framing of our own. Bodies were
+// not captured: a filler of the same size is sent, wrapped in a file part
+// when the request was multipart so the server parses it the same way.
+std::string LoadGenerator::buildReplayRequest(const RequestSpec& spec) const {
+    std::string raw = spec.method + " " + spec.path + " HTTP/1.1\r\n";
+    std::string boundary;
+    bool has_host = false;
+    for (size_t i = 0; i < spec.headers.size(); ++i) {
+        std::string name = spec.headers[i].first;
+        for (size_t j = 0; j < name.size(); ++j) {
+            name[j] = std::tolower(name[j]);
+        }
+        has_host = has_host || name == "host";
+        if (name == "content-type" && spec.headers[i].second.find("multipart/") != std::string::npos) {
+            size_t pos = spec.headers[i].second.find("boundary=");
+            if (pos != std::string::npos) {
+                boundary = spec.headers[i].second.substr(pos + 9);
+                boundary = boundary.substr(0, boundary.find(';'));
+                if (boundary.size() >= 2 && boundary[0] == '"') {
+                    boundary = boundary.substr(1, boundary.size() - 2);
+                }
+            }
+        }
+        raw += spec.headers[i].first + ": " + spec.headers[i].second + "\r\n";
+    }
+    if (!has_host) {
+        std::ostringstream host;
+        host << "Host: " << _opts.host << ":" << _opts.port << "\r\n";
+        raw += host.str();
+    }
+    raw += std::string("Connection: ") + (_opts.keepalive ? "keep-alive" : "close") + "\r\n";
+
+    std::string body;
+    if (!boundary.empty()) {
+        std::string head = "--" + boundary + "\r\nContent-Disposition: form-data; name=\"file\"; "
+                           "filename=\"replay.bin\"\r\nContent-Type: application/octet-stream\r\n\r\n";
+        std::string tail = "\r\n--" + boundary + "--\r\n";
+        size_t data = spec.body_size > head.size() + tail.size() ? spec.body_size - head.size() - tail.size() : 0;
+        body = head + std::string(data, 'r') + tail;
+    } else {
+        for (size_t i = 0; i < spec.body_size; ++i) {
+            body += (char)('a' + (i % 26));
+        }
+    }
+    if (!body.empty() || spec.method == "POST" || spec.method == "PUT" || spec.method == "PATCH") {
+        std::ostringstream length;
+        length << "Content-Length: " << body.size() << "\r\n";
+        raw += length.str();
+    }
+    return raw + "\r\n" + body;
+}
+
+bool LoadGenerator::replayDone() const {
+    if (_replay_next < _specs.size() || !_backlog.empty()) {
+        return false;
+    }
+    for (size_t i = 0; i < _conns.size(); ++i) {
+        if (!_conns[i].inflight.empty()) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Weighted, shuffled but seeded sequence so every run issues the same mix in
+// the same order.
+void LoadGenerator::buildSequence() {
+    for (size_t i = 0; i < _specs.size(); ++i) {
+        for (unsigned w = 0; w < _specs[i].weight; ++w) {
+            _sequence.push_back(i);
+        }
+    }
+    uint32_t state = _opts.seed ? _opts.seed : 1;
+    for (size_t i = _sequence.size(); i > 1; --i) {
+        state = state * 1103515245u + 12345u;
+        size_t j = (state >> 8) % i;
+        std::swap(_sequence[i - 1], _sequence[j]);
+    }
+}
+
+size_t LoadGenerator::nextSpec() {
+    size_t spec = _sequence[_sequence_pos];
+    _sequence_pos = (_sequence_pos + 1) % _sequence.size();
+    return spec;
+}
+
+bool LoadGenerator::openConnection(Connection& conn) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd == -1) {
+        return false;
+    }
+    if (fcntl(fd, F_SETFL, O_NONBLOCK) == -1) {
+        close(fd);
+        return false;
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (connect(fd, (struct sockaddr*)&_addr, sizeof(_addr)) == -1 && errno != EINPROGRESS) {
+        close(fd);
+        _stats.connect_errors++;
+        return false;
+    }
+    conn.fd = fd;
+    conn.state = CONN_CONNECTING;
+    conn.out.clear();
+    conn.out_offset = 0;
+    conn.in.clear();
+    conn.parse = PARSE_HEADERS;
+    conn.remaining = 0;
+    conn.status = 0;
+    conn.close_after = false;
+    return true;
+}
+
+// Requests that were never answered on a closed connection go back to the
+// backlog so the mix stays intact. Open-loop keeps their intended time;
+// closed-loop restamps them when they are reissued.
+void LoadGenerator::closeConnection(Connection& conn, bool requeue) {
+    if (conn.fd != -1) {
+        close(conn.fd);
+    }
+    conn.fd = -1;
+    conn.state = CONN_CLOSED;
+    if (requeue) {
+        for (std::deque<Pending>::reverse_iterator it = conn.inflight.rbegin();
+             it != conn.inflight.rend(); ++it) {
+            _backlog.push_front(*it);
+        }
+    }
+    conn.inflight.clear();
+    conn.out.clear();
+    conn.out_offset = 0;
+    conn.in.clear();
+}
+
+size_t LoadGenerator::capacity(const Connection& conn) const {
+    if (conn.state == CONN_CLOSED || conn.close_after) {
+        return 0;
+    }
+    if (conn.inflight.size() >= _opts.pipeline) {
+        return 0;
+    }
+    return _opts.pipeline - conn.inflight.size();
+}
+
+void LoadGenerator::enqueue(Connection& conn, const Pending& pending) {
+    if (conn.out_offset > 0 && conn.out_offset == conn.out.size()) {
+        conn.out.clear();
+        conn.out_offset = 0;
+    }
+    conn.out += _specs[pending.spec].raw;
+    conn.inflight.push_back(pending);
+    conn.inflight.back().sent_ns = 0;
+    conn.inflight.back().out_end = conn.out.size();
+}
+
+bool LoadGenerator::flushOutput(Connection& conn) {
+    uint64_t now = nowNs();
+    while (conn.out_offset < conn.out.size()) {
+        ssize_t sent = send(conn.fd, conn.out.data() + conn.out_offset,
+                            conn.out.size() - conn.out_offset, MSG_NOSIGNAL);
+        if (sent == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            return false;
+        }
+        conn.out_offset += sent;
+    }
+    // Stamp the send time of every request whose last byte left the socket.
+    for (size_t i = 0; i < conn.inflight.size(); ++i) {
+        Pending& pending = conn.inflight[i];
+        if (pending.sent_ns == 0 && pending.out_end <= conn.out_offset) {
+            pending.sent_ns = now;
+        }
+    }
+    if (conn.out_offset == conn.out.size()) {
+        conn.out.clear();
+        conn.out_offset = 0;
+    }
+    return true;
+}
+
+bool LoadGenerator::readInput(Connection& conn, uint64_t now) {
+    char buffer[65536];
+    while (true) {
+        ssize_t n = recv(conn.fd, buffer, sizeof(buffer), 0);
+        if (n > 0) {
+            _stats.bytes_read += n;
+            conn.in.append(buffer, n);
+            if (!parseResponses(conn, now)) {
+                return false;
+            }
+            if (conn.state == CONN_CLOSED) {
+                return true;
+            }
+            continue;
+        }
+        if (n == 0) {
+            if (conn.parse == PARSE_BODY_UNTIL_CLOSE && !conn.inflight.empty()) {
+                conn.close_after = true;
+                completeResponse(conn, now);
+                return true;
+            }
+            if (!conn.inflight.empty()) {
+                return false;
+            }
+            closeConnection(conn, false);
+            return true;
+        }
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return true;
+        }
+        return false;
+    }
+}
+
+bool LoadGenerator::parseHeaders(Connection& conn, size_t header_end) {
+    std::string head = conn.in.substr(0, header_end);
+    conn.in.erase(0, header_end + 4);
+
+    std::istringstream stream(head);
+    std::string line;
+    std::getline(stream, line);
+    std::istringstream status_line(line);
+    std::string version;
+    if (!(status_line >> version >> conn.status) || version.compare(0, 5, "HTTP/") != 0) {
+        return false;
+    }
+
+    bool has_length = false;
+    bool chunked = false;
+    conn.close_after = !_opts.keepalive || version == "HTTP/1.0";
+    while (std::getline(stream, line)) {
+        if (!line.empty() && line[line.length() - 1] == '\r') {
+            line.erase(line.length() - 1);
+        }
+        size_t colon = line.find(':');
+        if (colon == std::string::npos) {
+            continue;
+        }
+        std::string key = line.substr(0, colon);
+        std::string value = line.substr(colon + 1);
+        for (size_t i = 0; i < key.length(); ++i) {
+            key[i] = std::tolower(key[i]);
+        }
+        size_t start = value.find_first_not_of(" \t");
+        value = (start == std::string::npos) ? "" : value.substr(start);
+        for (size_t i = 0; i < value.length(); ++i) {
+            value[i] = std::tolower(value[i]);
+        }
+        if (key == "content-length") {
+            conn.remaining = std::strtoul(value.c_str(), NULL, 10);
+            has_length = true;
+        } else if (key == "transfer-encoding" && value.find("chunked") != std::string::npos) {
+            chunked = true;
+        } else if (key == "connection") {
+            if (value.find("close") != std::string::npos) {
+                conn.close_after = true;
+            } else if (value.find("keep-alive") != std::string::npos && _opts.keepalive) {
+                conn.close_after = false;
+            }
+        }
+    }
+
+    const RequestSpec& spec = _specs[conn.inflight.front().spec];
+    if (spec.method == "HEAD" || conn.status == 204 || conn.status == 304
+        || (conn.status >= 100 && conn.status < 200)) {
+        conn.remaining = 0;
+        conn.parse = PARSE_BODY_LENGTH;
+    } else if (chunked) {
+        conn.parse = PARSE_CHUNK_SIZE;
+    } else if (has_length) {
+        conn.parse = PARSE_BODY_LENGTH;
+    } else {
+        conn.parse = PARSE_BODY_UNTIL_CLOSE;
+        conn.close_after = true;
+    }
+    return true;
+}
+
+bool LoadGenerator::parseResponses(Connection& conn, uint64_t now) {
+    while (conn.state != CONN_CLOSED) {
+        if (conn.inflight.empty()) {
+            if (!conn.in.empty()) {
+                return false;  // bytes nobody asked for
+            }
+            return true;
+        }
+        switch (conn.parse) {
+            case PARSE_HEADERS: {
+                size_t header_end = conn.in.find("\r\n\r\n");
+                if (header_end == std::string::npos) {
+                    return true;
+                }
+                if (!parseHeaders(conn, header_end)) {
+                    return false;
+                }
+                break;
+            }
+            case PARSE_BODY_LENGTH: {
+                size_t take = std::min(conn.remaining, conn.in.size());
+                conn.in.erase(0, take);
+                conn.remaining -= take;
+                if (conn.remaining > 0) {
+                    return true;
+                }
+                completeResponse(conn, now);
+                break;
+            }
+            case PARSE_CHUNK_SIZE: {
+                size_t eol = conn.in.find("\r\n");
+                if (eol == std::string::npos) {
+                    return true;
+                }
+                conn.remaining = std::strtoul(conn.in.substr(0, eol).c_str(), NULL, 16);
+                conn.in.erase(0, eol + 2);
+                conn.parse = conn.remaining ? PARSE_CHUNK_DATA : PARSE_TRAILERS;
+                break;
+            }
+            case PARSE_CHUNK_DATA: {
+                size_t take = std::min(conn.remaining, conn.in.size());
+                conn.in.erase(0, take);
+                conn.remaining -= take;
+                if (conn.remaining > 0) {
+                    return true;
+                }
+                conn.parse = PARSE_CHUNK_CRLF;
+                break;
+            }
+            case PARSE_CHUNK_CRLF: {
+                if (conn.in.size() < 2) {
+                    return true;
+                }
+                conn.in.erase(0, 2);
+                conn.parse = PARSE_CHUNK_SIZE;
+                break;
+            }
+            case PARSE_TRAILERS: {
+                size_t eol = conn.in.find("\r\n");
+                if (eol == std::string::npos) {
+                    return true;
+                }
+                conn.in.erase(0, eol + 2);
+                if (eol == 0) {
+                    completeResponse(conn, now);
+                }
+                break;
+            }
+            case PARSE_BODY_UNTIL_CLOSE:
+                conn.in.clear();
+                return true;
+        }
+    }
+    return true;
+}
+
+void LoadGenerator::completeResponse(Connection& conn, uint64_t now) {
+    Pending done = conn.inflight.front();
+    conn.inflight.pop_front();
+    if (done.sent_ns == 0) {
+        done.sent_ns = now;
+    }
+    record(done, now, conn.status);
+    conn.parse = PARSE_HEADERS;
+    conn.remaining = 0;
+    if (conn.close_after) {
+        bool requeue = !conn.inflight.empty();
+        closeConnection(conn, requeue);
+    }
+}
+
+void LoadGenerator::record(const Pending& pending, uint64_t now, int status) {
+    if (pending.intended_ns < _measure_start || now > _end) {
+        return;
+    }
+    _stats.completed++;
+    _stats.status_counts[status]++;
+    int expected = _specs[pending.spec].expected_status;
+    if (expected && expected != status) {
+        std::ostringstream pair;
+        pair << expected << "->" << status;
+        _stats.mismatches[pair.str()]++;
+    }
+    if (status >= 500 || status == 0) {
+        _stats.errors++;
+    }
+    uint64_t latency = now - pending.intended_ns;
+    _stats.latency.push_back(latency);
+    _stats.service.push_back(now - pending.sent_ns);
+
+    // Closed-loop equivalent of HdrHistogram's recordValueWithExpectedInterval:
+    // back-fill the samples that a stalled connection would have produced.
+    if (!_opts.open_loop && _opts.expected_interval_us > 0) {
+        uint64_t interval = (uint64_t)(_opts.expected_interval_us * 1000.0);
+        for (uint64_t missing = latency > interval ? latency - interval : 0;
+             missing >= interval; missing -= interval) {
+            _stats.latency.push_back(missing);
+        }
+    }
+}
+
+bool LoadGenerator::run() {
+    _conns.resize(_opts.connections);
+    uint64_t start = nowNs();
+    bool replay = !_opts.replay_file.empty();
+    _measure_start = start + (uint64_t)(_opts.warmup * 1e9);
+    _end = _measure_start + (uint64_t)(_opts.duration * 1e9);
+    uint64_t first_us = replay ? _specs.front().at_us : 0;
+    if (replay) {
+        // The captured span at the chosen speed, plus time for stragglers
+        _measure_start = start;
+        _end = start + (uint64_t)((double)(_specs.back().at_us - first_us) * 1000.0 / _opts.speed)
+               + (uint64_t)(_opts.duration * 1e9);
+    }
+    uint64_t interval_ns = _opts.open_loop ? (uint64_t)(1e9 / _opts.rate) : 0;
+    if (_opts.open_loop && interval_ns == 0) {
+        interval_ns = 1;
+    }
+    uint64_t next_intended = start;
+
+    std::vector<struct pollfd> pfds;
+    std::vector<size_t> pfd_owner;
+    while (true) {
+        uint64_t now = nowNs();
+        if (now >= _end || (replay && replayDone())) {
+            break;
+        }
+
+        if (replay) {
+            next_intended = now + 10000000; // only responses left to wait for
+            while (_replay_next < _specs.size()) {
+                uint64_t intended = start + (uint64_t)((double)(_specs[_replay_next].at_us - first_us)
+                                                       * 1000.0 / _opts.speed);
+                if (intended > now) {
+                    next_intended = intended;
+                    break;
+                }
+                Pending pending;
+                pending.spec = _replay_next++;
+                pending.intended_ns = intended;
+                _backlog.push_back(pending);
+            }
+        } else if (_opts.open_loop) {
+            while (next_intended <= now) {
+                Pending pending;
+                pending.spec = nextSpec();
+                pending.intended_ns = next_intended;
+                _backlog.push_back(pending);
+                next_intended += interval_ns;
+            }
+        }
+
+        for (size_t i = 0; i < _conns.size(); ++i) {
+            Connection& conn = _conns[i];
+            if (conn.state == CONN_CLOSED) {
+                if (_opts.open_loop && _backlog.empty()) {
+                    continue;
+                }
+                if (!openConnection(conn)) {
+                    continue;
+                }
+                _stats.connections_opened++;
+            }
+            size_t room = capacity(conn);
+            while (room > 0) {
+                if (_opts.open_loop) {
+                    if (_backlog.empty()) {
+                        break;
+                    }
+                    enqueue(conn, _backlog.front());
+                    _backlog.pop_front();
+                } else {
+                    Pending pending;
+                    if (_backlog.empty()) {
+                        pending.spec = nextSpec();
+                    } else {
+                        pending.spec = _backlog.front().spec;
+                        _backlog.pop_front();
+                    }
+                    pending.intended_ns = now;
+                    enqueue(conn, pending);
+                }
+                room--;
+            }
+        }
+        // An unbounded backlog only measures our own memory; beyond a few
+        // seconds of queue the server has clearly fallen over.
+        if (_opts.open_loop && !replay && _backlog.size() > (size_t)(_opts.rate * 5) + 1) {
+            _stats.dropped += _backlog.size();
+            _backlog.clear();
+        }
+
+        pfds.clear();
+        pfd_owner.clear();
+        for (size_t i = 0; i < _conns.size(); ++i) {
+            Connection& conn = _conns[i];
+            if (conn.state == CONN_CLOSED) {
+                continue;
+            }
+            struct pollfd pfd;
+            pfd.fd = conn.fd;
+            pfd.events = 0;
+            pfd.revents = 0;
+            if (conn.state == CONN_CONNECTING || conn.out_offset < conn.out.size()) {
+                pfd.events |= POLLOUT;
+            }
+            if (conn.state == CONN_OPEN) {
+                pfd.events |= POLLIN;
+            }
+            pfds.push_back(pfd);
+            pfd_owner.push_back(i);
+        }
+
+        int timeout_ms = 10;
+        if (_opts.open_loop) {
+            uint64_t wait = next_intended > now ? next_intended - now : 0;
+            timeout_ms = (int)(wait / 1000000);
+        }
+        if (pfds.empty()) {
+            if (timeout_ms > 0) {
+                usleep(timeout_ms * 1000);
+            }
+            continue;
+        }
+        int ready = poll(&pfds[0], pfds.size(), timeout_ms);
+        if (ready == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            std::cerr << "loadgen: poll: " << std::strerror(errno) << std::endl;
+            return false;
+        }
+        now = nowNs();
+        for (size_t p = 0; p < pfds.size(); ++p) {
+            if (pfds[p].revents == 0) {
+                continue;
+            }
+            Connection& conn = _conns[pfd_owner[p]];
+            bool ok = true;
+            if (conn.state == CONN_CLOSED) {
+                continue;
+            }
+            if (conn.state == CONN_CONNECTING && (pfds[p].revents & (POLLOUT | POLLERR | POLLHUP))) {
+                int err = 0;
+                socklen_t len = sizeof(err);
+                getsockopt(conn.fd, SOL_SOCKET, SO_ERROR, &err, &len);
+                if (err != 0) {
+                    _stats.connect_errors++;
+                    closeConnection(conn, true);
+                    continue;
+                }
+                conn.state = CONN_OPEN;
+            }
+            if (conn.out_offset < conn.out.size()) {
+                ok = flushOutput(conn);
+            }
+            if (ok && (pfds[p].revents & (POLLIN | POLLHUP | POLLERR)) && conn.state == CONN_OPEN) {
+                ok = readInput(conn, now);
+            }
+            if (!ok) {
+                if (now >= _measure_start) {
+                    _stats.errors += conn.inflight.empty() ? 0 : 1;
+                }
+                // The in-flight head is lost; the rest is reissued.
+                if (!conn.inflight.empty()) {
+                    conn.inflight.pop_front();
+                }
+                closeConnection(conn, true);
+            }
+        }
+    }
+    if (replay) {
+        // Whatever was not answered in time counts as dropped
+        for (size_t i = 0; i < _conns.size(); ++i) {
+            _stats.dropped += _conns[i].inflight.size();
+        }
+        _stats.dropped += _backlog.size() + (_specs.size() - _replay_next);
+        _opts.duration = (double)(nowNs() - start) / 1e9;
+    }
+    return true;
+}
+
+uint64_t percentile(const std::vector<uint64_t>& sorted, double p) {
+    if (sorted.empty()) {
+        return 0;
+    }
+    size_t idx = (size_t)(p / 100.0 * (double)(sorted.size() - 1) + 0.5);
+    if (idx >= sorted.size()) {
+        idx = sorted.size() - 1;
+    }
+    return sorted[idx];
+}
+
+void writeDistribution(std::ostream& out, const char* name, std::vector<uint64_t> samples) {
+    std::sort(samples.begin(), samples.end());
+    double mean = 0.0;
+    for (size_t i = 0; i < samples.size(); ++i) {
+        mean += (double)samples[i];
+    }
+    if (!samples.empty()) {
+        mean /= (double)samples.size();
+    }
+    char buf[512];
+    std::snprintf(buf, sizeof(buf),
+                  "\"%s\":{\"samples\":%lu,\"mean\":%.1f,\"p50\":%.1f,\"p90\":%.1f,"
+                  "\"p99\":%.1f,\"p999\":%.1f,\"max\":%.1f}",
+                  name, (unsigned long)samples.size(), mean / 1000.0,
+                  percentile(samples, 50.0) / 1000.0, percentile(samples, 90.0) / 1000.0,
+                  percentile(samples, 99.0) / 1000.0, percentile(samples, 99.9) / 1000.0,
+                  (samples.empty() ? 0 : samples.back()) / 1000.0);
+    out << buf;
+}
+
+void LoadGenerator::report(std::ostream& out) const {
+    char buf[256];
+    out << "{\"scenario\":\"" << jsonEscape(_opts.scenario) << "\"";
+    out << ",\"mode\":\"" << (_opts.open_loop ? "open" : "closed") << "\"";
+    out << ",\"connections\":" << _opts.connections;
+    out << ",\"keepalive\":" << (_opts.keepalive ? "true" : "false");
+    out << ",\"pipeline\":" << _opts.pipeline;
+    if (!_opts.replay_file.empty()) {
+        std::snprintf(buf, sizeof(buf), ",\"speed\":%.2f", _opts.speed);
+        out << ",\"replay\":\"" << jsonEscape(_opts.replay_file) << "\",\"entries\":" << _specs.size() << buf;
+    } else if (_opts.open_loop) {
+        std::snprintf(buf, sizeof(buf), ",\"target_rps\":%.1f", _opts.rate);
+        out << buf;
+    }
+    std::snprintf(buf, sizeof(buf), ",\"duration_s\":%.3f", _opts.duration);
+    out << buf;
+    out << ",\"requests\":" << _stats.completed;
+    out << ",\"errors\":" << _stats.errors;
+    out << ",\"connect_errors\":" << _stats.connect_errors;
+    out << ",\"dropped\":" << _stats.dropped;
+    out << ",\"connections_opened\":" << _stats.connections_opened;
+    std::snprintf(buf, sizeof(buf), ",\"throughput_rps\":%.1f,\"read_mbps\":%.2f",
+                  (double)_stats.completed / _opts.duration,
+                  (double)_stats.bytes_read / _opts.duration / (1024.0 * 1024.0));
+    out << buf;
+    out << ",\"status\":{";
+    for (std::map<int, uint64_t>::const_iterator it = _stats.status_counts.begin();
+         it != _stats.status_counts.end(); ++it) {
+        if (it != _stats.status_counts.begin()) {
+            out << ",";
+        }
+        out << "\"" << it->first << "\":" << it->second;
+    }
+    out << "},";
+    if (!_opts.replay_file.empty()) {
+        uint64_t total = 0;
+        std::ostringstream pairs;
+        for (std::map<std::string, uint64_t>::const_iterator it = _stats.mismatches.begin();
+             it != _stats.mismatches.end(); ++it) {
+            pairs << (it == _stats.mismatches.begin() ? "" : ",") << "\"" << it->first << "\":" << it->second;
+            total += it->second;
+        }
+        out << "\"mismatches\":" << total << ",\"mismatch_status\":{" << pairs.str() << "},";
+    }
+    writeDistribution(out, "latency_us", _stats.latency);
+    out << ",";
+    writeDistribution(out, "service_time_us", _stats.service);
+    out << "}" << std::endl;
+}
+
+void usage() {
+    std::cerr <<
+        "Usage: loadgen [options]\n"
+        "  --host ADDR            server address (127.0.0.1)\n"
+        "  --port N               server port (8080)\n"
+        "  -c, --connections N    concurrent connections (8)\n"
+        "  -d, --duration SEC     measured duration (10)\n"
+        "  --warmup SEC           unmeasured warmup (1)\n"
+        "  --mode closed|open     closed-loop or fixed-rate open-loop (closed)\n"
+        "  -r, --rate RPS         open-loop request rate (1000)\n"
+        "  -k, --keepalive        reuse connections (Connection: keep-alive)\n"
+        "  -p, --pipeline N       requests in flight per connection (1, needs -k)\n"
+        "  --mix FILE             request mix file: <weight> <METHOD> <path> [body_bytes]\n"
+        "  --path PATH            single request path when no mix is given (/)\n"
+        "  --method M             single request method (GET)\n"
+        "  --body-size N          single request body size (0)\n"
+        "  -H, --header 'K: V'    extra request header (repeatable)\n"
+        "  --replay FILE          re-issue a capture_requests file at its recorded pace;\n"
+        "                         -d is then the grace period for late responses\n"
+        "  --speed X              replay X times faster than captured (1)\n"
+        "  --expected-interval US closed-loop coordinated-omission correction\n"
+        "  --scenario NAME        label in the JSON report\n"
+        "  --seed N               mix shuffle seed (42)\n"
+        "  -o, --out FILE         append the JSON report to FILE instead of stdout\n";
+}
+
+bool parseArgs(int argc, char** argv, Options& opts) {
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        bool has_value = (i + 1 < argc);
+        std::string value = has_value ? argv[i + 1] : "";
+        if (arg == "-k" || arg == "--keepalive") {
+            opts.keepalive = true;
+            continue;
+        }
+        if (arg == "-h" || arg == "--help") {
+            return false;
+        }
+        if (!has_value) {
+            std::cerr << "loadgen: missing value for " << arg << std::endl;
+            return false;
+        }
+        ++i;
+        if (arg == "--host") opts.host = value;
+        else if (arg == "--port") opts.port = std::atoi(value.c_str());
+        else if (arg == "-c" || arg == "--connections") opts.connections = std::strtoul(value.c_str(), NULL, 10);
+        else if (arg == "-d" || arg == "--duration") opts.duration = std::atof(value.c_str());
+        else if (arg == "--warmup") opts.warmup = std::atof(value.c_str());
+        else if (arg == "--mode") opts.open_loop = (value == "open");
+        else if (arg == "-r" || arg == "--rate") opts.rate = std::atof(value.c_str());
+        else if (arg == "-p" || arg == "--pipeline") opts.pipeline = std::strtoul(value.c_str(), NULL, 10);
+        else if (arg == "--mix") opts.mix_file = value;
+        else if (arg == "--path") opts.path = value;
+        else if (arg == "--method") opts.method = value;
+        else if (arg == "--body-size") opts.body_size = std::strtoul(value.c_str(), NULL, 10);
+        else if (arg == "-H" || arg == "--header") opts.headers.push_back(value);
+        else if (arg == "--expected-interval") opts.expected_interval_us = std::atof(value.c_str());
+        else if (arg == "--scenario") opts.scenario = value;
+        else if (arg == "--seed") opts.seed = std::strtoul(value.c_str(), NULL, 10);
+        else if (arg == "-o" || arg == "--out") opts.out_file = value;
+        else if (arg == "--replay") opts.replay_file = value;
+        else if (arg == "--speed") opts.speed = std::atof(value.c_str());
+        else {
+            std::cerr << "loadgen: unknown option " << arg << std::endl;
+            return false;
+        }
+    }
+    if (opts.connections == 0 || opts.duration <= 0 || opts.rate <= 0 || opts.speed <= 0) {
+        std::cerr << "loadgen: connections, duration, rate and speed must be positive" << std::endl;
+        return false;
+    }
+    if (!opts.replay_file.empty()) {
+        opts.open_loop = true; // captured arrivals do not wait for responses
+    }
+    return true;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+    Options opts;
+    if (!parseArgs(argc, argv, opts)) {
+        usage();
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    LoadGenerator generator(opts);
+    if (!(opts.replay_file.empty() ? generator.loadMix() : generator.loadReplay())) {
+        return 1;
+    }
+    if (!generator.run()) {
+        return 1;
+    }
+    if (opts.out_file.empty()) {
+        generator.report(std::cout);
+    } else {
+        std::ofstream out(opts.out_file.c_str(), std::ios::app);
+        if (!out.is_open()) {
+            std::cerr << "loadgen: cannot write " << opts.out_file << std::endl;
+            return 1;
+        }
+        generator.report(out);
+    }
+    return generator.completed() > 0 ? 0 : 2;
+}
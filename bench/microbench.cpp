@@ -0,0 +1,581 @@
+/* ************************************************************************** */
+/*                                                                            */
+/*   microbench.cpp - in-process benchmarks for webserv hot paths             */
+/*                                                                            */
+/*   Links against the server objects (everything but main.o) and reports    */
+/*   ns/op, allocations/op and allocated bytes/op per benchmark. Global       */
+/*   operator new/delete are replaced here to count allocations.              */
+/*                                                                            */
+/* ************************************************************************** */
+
+#include "WebServer.hpp"
+#include "HttpRequest.hpp"
+#include "Config.hpp"
+#include "Scan.hpp"
+#include <cctype>
+#include <stdint.h>
+#include <time.h>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+
+namespace {
+
+uint64_t g_alloc_count = 0;
+uint64_t g_alloc_bytes = 0;
+
+}  // namespace
+
+void* operator new(std::size_t size) throw(std::bad_alloc) {
+    g_alloc_count++;
+    g_alloc_bytes += size;
+    void* ptr = std::malloc(size ? size : 1);
+    if (!ptr) {
+        throw std::bad_alloc();
+    }
+    return ptr;
+}
+
+void* operator new[](std::size_t size) throw(std::bad_alloc) {
+    return operator new(size);
+}
+
+void operator delete(void* ptr) throw() {
+    std::free(ptr);
+}
+
+void operator delete[](void* ptr) throw() {
+    std::free(ptr);
+}
+
+// Friend of WebServer so the private response helpers can be measured as
+// they are, without widening the server's interface.
+class MicroBench {
+public:
+    static size_t getContentLength(WebServer& server, const std::string& headers) {
+        return server.getContentLength(headers);
+    }
+    static std::string getContentType(WebServer& server, const std::string& path) {
+        return server.getContentType(path);
+    }
+    // Head plus the body queued behind it, which is dropped again
+    static size_t generateSuccessResponse(WebServer& server, const std::string& content,
+                                          const std::string& type) {
+        size_t length = server.generateSuccessResponse(content, type).size() + server._response_body.pendingBytes();
+        server._response_body.clear();
+        return length;
+    }
+    // A static file through serveFile (open file cache on) and through the
+    // location's bundle, the queued body dropped again
+    static void addBundle(WebServer& server, StaticBundle* bundle) {
+        server._bundles[bundle->path()] = bundle;
+        server._open_files.configure(1024, 60, false);
+    }
+    static size_t serveFile(WebServer& server, const HttpRequest& request, const std::string& path,
+                            const LocationConfig& location) {
+        size_t length = server.serveFile(request, path, &location).size() + server._response_body.pendingBytes();
+        server._response_body.clear();
+        return length;
+    }
+    static size_t serveBundled(WebServer& server, const HttpRequest& request, const LocationConfig& location) {
+        StaticBundle* bundle = NULL;
+        const BundleEntry* entry = server.findBundled(request.getPath(), &location, bundle);
+        size_t length = entry ? server.serveBundled(request, *bundle, *entry, &location).size() : 0;
+        length += server._response_body.pendingBytes();
+        server._response_body.clear();
+        return length;
+    }
+};
+
+namespace {
+
+uint64_t nowNs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+volatile size_t g_sink = 0;
+
+struct Result {
+    std::string name;
+    uint64_t iterations;
+    double ns_per_op;
+    double allocs_per_op;
+    double bytes_per_op;
+};
+
+// Each benchmark is a functor with `void operator()()` doing one operation.
+template <typename Bench>
+Result measure(const std::string& name, Bench& bench, double min_seconds) {
+    for (int i = 0; i < 3; ++i) {
+        bench();  // warm caches and lazily-initialised statics
+    }
+    uint64_t iterations = 1;
+    uint64_t elapsed = 0;
+    uint64_t allocs = 0;
+    uint64_t bytes = 0;
+    while (true) {
+        uint64_t allocs_before = g_alloc_count;
+        uint64_t bytes_before = g_alloc_bytes;
+        uint64_t start = nowNs();
+        for (uint64_t i = 0; i < iterations; ++i) {
+            bench();
+        }
+        elapsed = nowNs() - start;
+        allocs = g_alloc_count - allocs_before;
+        bytes = g_alloc_bytes - bytes_before;
+        if (elapsed >= (uint64_t)(min_seconds * 1e9) || iterations >= (1ULL << 30)) {
+            break;
+        }
+        uint64_t target = (uint64_t)(min_seconds * 1e9 * 1.2);
+        uint64_t next = elapsed ? iterations * target / elapsed : iterations * 100;
+        iterations = next > iterations * 100 ? iterations * 100 : next + 1;
+    }
+    Result result;
+    result.name = name;
+    result.iterations = iterations;
+    result.ns_per_op = (double)elapsed / (double)iterations;
+    result.allocs_per_op = (double)allocs / (double)iterations;
+    result.bytes_per_op = (double)bytes / (double)iterations;
+    return result;
+}
+
+std::string sampleGetRequest() {
+    return "GET /static/css/site.min.css?v=20250814 HTTP/1.1\r\n"
+           "Host: localhost:8080\r\n"
+           "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:128.0) Gecko/20100101 Firefox/128.0\r\n"
+           "Accept: text/css,*/*;q=0.1\r\n"
+           "Accept-Language: en-US,en;q=0.5\r\n"
+           "Accept-Encoding: gzip, deflate, br\r\n"
+           "Referer: http://localhost:8080/index.html\r\n"
+           "Connection: keep-alive\r\n"
+           "Sec-Fetch-Dest: style\r\n"
+           "Sec-Fetch-Mode: no-cors\r\n"
+           "Sec-Fetch-Site: same-origin\r\n"
+           "Cache-Control: max-age=0\r\n"
+           "\r\n";
+}
+
+std::string samplePostRequest(size_t body_size) {
+    std::string body(body_size, 'x');
+    for (size_t i = 63; i < body.size(); i += 64) {
+        body[i] = '\n';
+    }
+    return "POST /uploads HTTP/1.1\r\n"
+           "Host: localhost:8080\r\n"
+           "User-Agent: curl/8.5.0\r\n"
+           "Accept: */*\r\n"
+           "Content-Type: application/octet-stream\r\n"
+           "Content-Length: " + size_t_to_string(body_size) + "\r\n"
+           "\r\n" + body;
+}
+
+struct ParseRequestBench {
+    std::string raw;
+    void operator()() {
+        HttpRequest request;
+        request.parseRequest(raw);
+        g_sink += request.getHeaders().size();
+    }
+};
+
+struct ContentLengthBench {
+    WebServer* server;
+    std::string headers;
+    void operator()() {
+        g_sink += MicroBench::getContentLength(*server, headers);
+    }
+};
+
+// How the scanning kernels run against what they replace: the two
+// std::string::find calls over the whole buffer, the portable fallback,
+// and the vector kernel this CPU gets.
+enum ScanVariant { SCAN_STRING_FIND, SCAN_PORTABLE, SCAN_VECTOR };
+
+struct HeaderEndBench {
+    std::string buffer;
+    ScanVariant variant;
+    void operator()() {
+        size_t end;
+        if (variant == SCAN_STRING_FIND) {
+            end = buffer.find("\r\n\r\n");
+            if (end == std::string::npos) {
+                end = buffer.find("\n\n");
+            }
+        } else if (variant == SCAN_PORTABLE) {
+            end = Scan::headerEndPortable(buffer.data(), buffer.size());
+        } else {
+            end = Scan::headerEnd(buffer.data(), buffer.size());
+        }
+        g_sink += end;
+    }
+};
+
+// A head arriving `piece` bytes per read, searched after each one: from
+// the start as processClientBuffer used to, or resumed where the previous
+// search stopped
+struct TrickleBench {
+    std::string head;
+    std::string buffer;
+    size_t piece;
+    bool resumed;
+    void operator()() {
+        buffer.clear();
+        size_t scanned = 0;
+        size_t end = std::string::npos;
+        for (size_t offset = 0; offset < head.size() && end == std::string::npos; offset += piece) {
+            buffer.append(head, offset, piece);
+            if (resumed) {
+                end = Scan::headerEnd(buffer.data(), buffer.size(), scanned);
+                scanned = buffer.size();
+            } else {
+                end = buffer.find("\r\n\r\n");
+                if (end == std::string::npos) {
+                    end = buffer.find("\n\n");
+                }
+            }
+        }
+        g_sink += end;
+    }
+};
+
+struct TokenBench {
+    std::string name;
+    ScanVariant variant;
+    void operator()() {
+        g_sink += variant == SCAN_PORTABLE ? Scan::isTokenPortable(name.data(), name.size())
+                                           : Scan::isToken(name.data(), name.size());
+    }
+};
+
+struct IgnoreCaseBench {
+    std::string a;
+    std::string b;
+    ScanVariant variant;
+    void operator()() {
+        bool equal;
+        if (variant == SCAN_STRING_FIND) { // the std::tolower loop getHeader had
+            size_t i = 0;
+            while (i < a.length() && std::tolower(a[i]) == std::tolower(b[i])) {
+                ++i;
+            }
+            equal = i == a.length();
+        } else if (variant == SCAN_PORTABLE) {
+            equal = Scan::equalsIgnoreCasePortable(a.data(), b.data(), a.size());
+        } else {
+            equal = Scan::equalsIgnoreCase(a.data(), b.data(), a.size());
+        }
+        g_sink += equal;
+    }
+};
+
+// A browser-like head of about 8KB, most of it cookies
+std::string sampleLargeHead() {
+    std::string head = sampleGetRequest();
+    head.erase(head.size() - 2);
+    for (size_t i = 0; head.size() < 8000; ++i) {
+        head += "Cookie: session_" + size_t_to_string(i) + "=" + std::string(90, 'c') + "\r\n";
+    }
+    return head + "\r\n";
+}
+
+struct FindLocationBench {
+    const Config* config;
+    const ServerConfig* server;
+    std::string uri;
+    void operator()() {
+        g_sink += (size_t)config->findLocationConfig(*server, uri);
+    }
+};
+
+struct ContentTypeBench {
+    WebServer* server;
+    std::string path;
+    void operator()() {
+        g_sink += MicroBench::getContentType(*server, path).size();
+    }
+};
+
+struct SuccessResponseBench {
+    WebServer* server;
+    std::string content;
+    void operator()() {
+        g_sink += MicroBench::generateSuccessResponse(*server, content, "text/html");
+    }
+};
+
+struct StaticFileBench {
+    WebServer* server;
+    HttpRequest request;
+    std::string path;
+    LocationConfig location;
+    bool bundled;
+    void operator()() {
+        g_sink += bundled ? MicroBench::serveBundled(*server, request, location)
+                          : MicroBench::serveFile(*server, request, path, location);
+    }
+};
+
+struct ParseConfigBench {
+    std::string path;
+    void operator()() {
+        Config config;
+        config.parseConfigFile(path);
+        g_sink += config.getServers().size();
+    }
+};
+
+std::string generateConfig(size_t servers, size_t locations) {
+    std::ostringstream conf;
+    for (size_t s = 0; s < servers; ++s) {
+        conf << "server {\n";
+        conf << "    listen 127.0.0.1:" << (20000 + s) << ";\n";
+        conf << "    server_name host" << s << ".example.com;\n";
+        conf << "    root ./www;\n";
+        conf << "    index index.html;\n";
+        conf << "    client_max_body_size 1048576;\n";
+        conf << "    error_page 404 /error/404.html;\n";
+        conf << "    error_page 500 /error/500.html;\n\n";
+        for (size_t l = 0; l < locations; ++l) {
+            conf << "    # location " << l << "\n";
+            conf << "    location /app" << s << "/section" << l << " {\n";
+            conf << "        root ./www/section" << l << ";\n";
+            conf << "        allow_methods GET POST DELETE;\n";
+            conf << "        autoindex " << (l % 2 ? "on" : "off") << ";\n";
+            conf << "        index index.html;\n";
+            conf << "    }\n";
+        }
+        conf << "}\n\n";
+    }
+    return conf.str();
+}
+
+ServerConfig generateServer(size_t locations) {
+    ServerConfig server;
+    server.host = "127.0.0.1";
+    server.port = 8080;
+    server.root = "./www";
+    server.index = "index.html";
+    server.client_max_body_size = 1048576;
+    LocationConfig root;
+    root.path = "/";
+    root.root = "./www";
+    server.locations.push_back(root);
+    for (size_t i = 0; i < locations; ++i) {
+        LocationConfig loc;
+        loc.path = "/api/v1/service" + size_t_to_string(i);
+        loc.root = "./www/service" + size_t_to_string(i);
+        loc.allowed_methods.push_back("GET");
+        server.locations.push_back(loc);
+    }
+    return server;
+}
+
+void printResult(const Result& r, bool json, bool first) {
+    if (json) {
+        std::printf("%s\n  {\"name\":\"%s\",\"iterations\":%lu,\"ns_per_op\":%.1f,"
+                    "\"allocs_per_op\":%.2f,\"bytes_per_op\":%.1f}",
+                    first ? "" : ",", r.name.c_str(), (unsigned long)r.iterations,
+                    r.ns_per_op, r.allocs_per_op, r.bytes_per_op);
+    } else {
+        std::printf("%-42s %12lu %14.1f %12.2f %14.1f\n", r.name.c_str(),
+                    (unsigned long)r.iterations, r.ns_per_op, r.allocs_per_op, r.bytes_per_op);
+    }
+    std::fflush(stdout);
+}
+
+void usage() {
+    std::fprintf(stderr,
+                 "Usage: microbench [--json] [--time SEC] [--filter SUBSTRING]\n");
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+    bool json = false;
+    double min_seconds = 0.3;
+    std::string filter;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--json") {
+            json = true;
+        } else if (arg == "--time" && i + 1 < argc) {
+            min_seconds = std::atof(argv[++i]);
+        } else if (arg == "--filter" && i + 1 < argc) {
+            filter = argv[++i];
+        } else {
+            usage();
+            return 1;
+        }
+    }
+
+    WebServer server;
+
+    char config_path[] = "/tmp/webserv_microbench_XXXXXX";
+    int config_fd = mkstemp(config_path);
+    if (config_fd == -1) {
+        std::perror("mkstemp");
+        return 1;
+    }
+    std::string config_text = generateConfig(100, 20);
+    if (write(config_fd, config_text.data(), config_text.size()) != (ssize_t)config_text.size()) {
+        std::perror("write");
+        close(config_fd);
+        unlink(config_path);
+        return 1;
+    }
+    close(config_fd);
+
+    Config router;
+    ServerConfig routed = generateServer(64);
+
+    if (json) {
+        std::printf("[");
+    } else {
+        std::printf("%-42s %12s %14s %12s %14s\n", "benchmark", "iterations", "ns/op",
+                    "allocs/op", "bytes/op");
+    }
+
+    bool first = true;
+#define RUN(label, bench) \
+    if (filter.empty() || std::string(label).find(filter) != std::string::npos) { \
+        Result r = measure(label, bench, min_seconds); \
+        printResult(r, json, first); \
+        first = false; \
+    }
+
+    ParseRequestBench parse_get;
+    parse_get.raw = sampleGetRequest();
+    RUN("HttpRequest::parseRequest/get", parse_get);
+
+    ParseRequestBench parse_post;
+    parse_post.raw = samplePostRequest(16384);
+    RUN("HttpRequest::parseRequest/post_16k", parse_post);
+
+    ContentLengthBench content_length;
+    content_length.server = &server;
+    content_length.headers = samplePostRequest(0);
+    RUN("WebServer::getContentLength/post", content_length);
+
+    ContentLengthBench content_length_absent;
+    content_length_absent.server = &server;
+    content_length_absent.headers = sampleGetRequest();
+    RUN("WebServer::getContentLength/absent", content_length_absent);
+
+    // headerEnd dispatches to the widest kernel available, the others use SSE2
+    const char* variant_names[] = { "string_find", "portable", Scan::kernel() };
+    const char* short_variant_names[] = { "tolower_loop", "portable", "sse2" };
+    const char* head_names[] = { "get", "8k" };
+    std::string heads[] = { sampleGetRequest(), sampleLargeHead() };
+    for (int h = 0; h < 2; ++h) {
+        for (int v = SCAN_STRING_FIND; v <= SCAN_VECTOR; ++v) {
+            HeaderEndBench header_end;
+            header_end.buffer = heads[h];
+            header_end.variant = static_cast<ScanVariant>(v);
+            RUN(std::string("Scan::headerEnd/") + head_names[h] + "/" + variant_names[v], header_end);
+        }
+    }
+
+    for (int resumed = 0; resumed < 2; ++resumed) {
+        TrickleBench trickle;
+        trickle.head = sampleLargeHead();
+        trickle.buffer.reserve(trickle.head.size());
+        trickle.piece = 64;
+        trickle.resumed = resumed != 0;
+        RUN(std::string("Scan::headerEnd/8k_in_64b_reads/") + (resumed ? "resumed" : "string_find"), trickle);
+    }
+
+    const char* token_labels[] = { "short", "long" };
+    std::string tokens[] = { "Content-Type", "X-Forwarded-Client-Certificate-Chain-Fingerprint" };
+    for (int t = 0; t < 2; ++t) {
+        for (int v = SCAN_PORTABLE; v <= SCAN_VECTOR; ++v) {
+            TokenBench token;
+            token.name = tokens[t];
+            token.variant = static_cast<ScanVariant>(v);
+            RUN(std::string("Scan::isToken/") + token_labels[t] + "/" + short_variant_names[v], token);
+        }
+        for (int v = SCAN_STRING_FIND; v <= SCAN_VECTOR; ++v) {
+            IgnoreCaseBench ignore_case;
+            ignore_case.a = tokens[t];
+            ignore_case.b = tokens[t];
+            for (size_t i = 0; i < ignore_case.b.size(); ++i) {
+                ignore_case.b[i] = std::tolower(ignore_case.b[i]);
+            }
+            ignore_case.variant = static_cast<ScanVariant>(v);
+            RUN(std::string("Scan::equalsIgnoreCase/") + token_labels[t] + "/" + short_variant_names[v], ignore_case);
+        }
+    }
+
+    FindLocationBench find_deep;
+    find_deep.config = &router;
+    find_deep.server = &routed;
+    find_deep.uri = "/api/v1/service63/users/42/profile";
+    RUN("Config::findLocationConfig/64_locations", find_deep);
+
+    FindLocationBench find_root;
+    find_root.config = &router;
+    find_root.server = &routed;
+    find_root.uri = "/static/css/site.min.css";
+    RUN("Config::findLocationConfig/fallback_root", find_root);
+
+    ContentTypeBench content_type;
+    content_type.server = &server;
+    content_type.path = "./www/static/js/app.bundle.min.js";
+    RUN("WebServer::getContentType/js", content_type);
+
+    ContentTypeBench content_type_unknown;
+    content_type_unknown.server = &server;
+    content_type_unknown.path = "./www/downloads/archive.tar.zst";
+    RUN("WebServer::getContentType/unknown", content_type_unknown);
+
+    SuccessResponseBench success_small;
+    success_small.server = &server;
+    success_small.content = std::string(1024, 'a');
+    RUN("WebServer::generateSuccessResponse/1k", success_small);
+
+    SuccessResponseBench success_large;
+    success_large.server = &server;
+    success_large.content = std::string(65536, 'a');
+    RUN("WebServer::generateSuccessResponse/64k", success_large);
+
+    char bundle_path[] = "/tmp/webserv_microbench_bundle_XXXXXX";
+    int bundle_fd = mkstemp(bundle_path);
+    size_t bundled_files = 0;
+    std::string bundle_error;
+    StaticBundle* bundle = NULL;
+    if (bundle_fd != -1) {
+        close(bundle_fd);
+        if (StaticBundle::build("./www", bundle_path, true, std::vector<std::string>(), bundled_files, bundle_error)) {
+            bundle = StaticBundle::load(bundle_path, bundle_error);
+        }
+        unlink(bundle_path);
+    }
+    if (bundle) {
+        MicroBench::addBundle(server, bundle);
+        for (int bundled = 0; bundled < 2; ++bundled) {
+            StaticFileBench static_file;
+            static_file.server = &server;
+            static_file.request.parseRequest("GET /index.html HTTP/1.1\r\nHost: localhost\r\n"
+                                             "Accept-Encoding: gzip, deflate, br\r\n\r\n");
+            static_file.path = "./www/index.html";
+            static_file.location.path = "/";
+            static_file.location.root = "./www";
+            static_file.location.mmap = true;
+            static_file.location.bundle = bundle_path;
+            static_file.bundled = bundled != 0;
+            RUN(std::string("WebServer::serveFile/index_html/") + (bundled ? "bundle" : "file"), static_file);
+        }
+    }
+
+    ParseConfigBench parse_config;
+    parse_config.path = config_path;
+    RUN("Config::parseConfigFile/100x20", parse_config);
+#undef RUN
+
+    if (json) {
+        std::printf("\n]\n");
+    }
+    unlink(config_path);
+    return g_sink == 0xdeadbeef ? 2 : 0;
+}
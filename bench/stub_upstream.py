@@ -0,0 +1,79 @@
+#!/usr/bin/env python3
+"""Minimal HTTP/1.1 keep-alive backend for the proxy_pass benchmarks.
+
+    bench/stub_upstream.py PORT [--size BYTES] [--chunked]
+
+Answers every request with BYTES of body (1024 by default) and an
+X-Upstream header naming its port, so balancing can be observed.
+"""
+import socket
+import sys
+import threading
+
+
+def serve(conn, port, body, chunked):
+    buffer = b""
+    try:
+        while True:
+            while b"\r\n\r\n" not in buffer:
+                data = conn.recv(65536)
+                if not data:
+                    return
+                buffer += data
+            head, buffer = buffer.split(b"\r\n\r\n", 1)
+            lines = head.decode("latin-1").split("\r\n")
+            headers = dict((l.split(":", 1)[0].strip().lower(), l.split(":", 1)[1].strip())
+                           for l in lines[1:] if ":" in l)
+            length = int(headers.get("content-length", "0"))
+            while len(buffer) < length:
+                data = conn.recv(65536)
+                if not data:
+                    return
+                buffer += data
+            buffer = buffer[length:]
+            close = headers.get("connection", "").lower() == "close"
+            method = lines[0].split(" ")[0]
+
+            out = "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\nX-Upstream: %d\r\n" % port
+            if close:
+                out += "Connection: close\r\n"
+            payload = b"" if method == "HEAD" else body
+            if chunked:
+                out += "Transfer-Encoding: chunked\r\n\r\n"
+                data = out.encode()
+                for i in range(0, len(payload), 8192):
+                    piece = payload[i:i + 8192]
+                    data += b"%x\r\n" % len(piece) + piece + b"\r\n"
+                if method != "HEAD":
+                    data += b"0\r\n\r\n"
+            else:
+                out += "Content-Length: %d\r\n\r\n" % len(body)
+                data = out.encode() + payload
+            conn.sendall(data)
+            if close:
+                return
+    except OSError:
+        pass
+    finally:
+        conn.close()
+
+
+def main():
+    port = int(sys.argv[1])
+    size = 1024
+    if "--size" in sys.argv:
+        size = int(sys.argv[sys.argv.index("--size") + 1])
+    chunked = "--chunked" in sys.argv
+    body = (b"0123456789abcdef" * (size // 16 + 1))[:size]
+
+    listener = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+    listener.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+    listener.bind(("127.0.0.1", port))
+    listener.listen(128)
+    while True:
+        conn, _ = listener.accept()
+        threading.Thread(target=serve, args=(conn, port, body, chunked), daemon=True).start()
+
+
+if __name__ == "__main__":
+    main()
@@ -4,15 +4,66 @@
 #include <string>
 #include <vector>
 #include <map>
+#include <sys/types.h>
+#include <sys/resource.h>
+#include <stdint.h>
 #include "HttpRequest.hpp"
+#include "RequestTiming.hpp"
+
+// Caps on one script run (cgi_timeout, cgi_limit_*); 0 leaves one unset
+struct CgiLimits {
+    int timeout;        // seconds before the script's process group is killed
+    long cpu;           // RLIMIT_CPU, seconds
+    size_t memory;      // RLIMIT_AS, bytes
+    long files;         // RLIMIT_NOFILE
+
+    CgiLimits() : timeout(0), cpu(0), memory(0), files(0) {}
+};
+
+// How a script ended and what it used, as wait4() reported it
+struct CgiUsage {
+    int status;
+    bool timed_out;
+    struct rusage rusage;
+
+    CgiUsage();
+};
+
+// Totals over finished scripts, for the stats line logged at exit
+class CgiStats {
+public:
+    CgiStats();
+
+    void record(const CgiUsage& usage);
+    void queued() { ++_queued; }
+    void rejected() { ++_rejected; }
+    bool empty() const { return _runs == 0 && _rejected == 0; }
+    // "12 runs (1 failed, 1 timed out), 3 queued, 0 rejected, cpu ..."
+    std::string statsLine() const;
+    // "cpu=0.120s rss=10240KB" for one run
+    static std::string describe(const CgiUsage& usage);
+
+private:
+    size_t _runs;
+    size_t _failed;
+    size_t _timed_out;
+    size_t _queued;
+    size_t _rejected;
+    uint64_t _user_us;
+    uint64_t _system_us;
+    uint64_t _max_cpu_us;  // one script, user + system
+    long _max_rss_kb;
+};
 
 class CgiExecutor {
 private:
-    std::vector<std::string> setupEnvironment(const HttpRequest& request, const std::string& script_path) const;
+    std::vector<std::string> setupEnvironment(const HttpRequest& request, const std::string& script_path,
+                                              const std::string& request_id) const;
     std::string getInterpreter(const std::string& script_path, const std::map<std::string, std::string>& interpreters) const;
     std::string parseCgiOutput(const std::string& raw_output) const;
     std::string generateCgiResponse(const std::string& cgi_headers, const std::string& body) const;
-    std::string readFromPipe(int pipe_fd) const;
+    bool readOutput(int pipe_fd, time_t deadline, std::string& output) const;
+    void writeBody(int pipe_fd, const std::string& body, int timeout) const;
     std::string toString(size_t value) const;
     std::string generateErrorResponse(int status_code, const std::string& status_text) const;
 
@@ -20,9 +71,35 @@ public:
     CgiExecutor();
     ~CgiExecutor();
     
+    // Runs the script to completion, or until limits.timeout kills it
     std::string execute(const std::string& script_path, 
                        const HttpRequest& request,
-                       const std::map<std::string, std::string>& interpreters) const;
+                       const std::map<std::string, std::string>& interpreters,
+                       const CgiLimits& limits,
+                       CgiUsage& usage,
+                       RequestTiming* timing = NULL) const;
+    // Non-blocking half of execute(): forks the script in a process group
+    // of its own under the rlimits, feeds it the request body and returns
+    // its pid with the read end of its stdout in output_fd (-1 on failure).
+    // With input_fd, the body is left to the caller: the write end of the
+    // script's stdin comes back there, -1 when there is no body to write.
+    // finish() turns the collected output and wait status into a response.
+    pid_t start(const std::string& script_path,
+                const HttpRequest& request,
+                const std::map<std::string, std::string>& interpreters,
+                const CgiLimits& limits,
+                int& output_fd,
+                const std::string& request_id = "",
+                int* input_fd = NULL) const;
+    std::string finish(const std::string& output, const CgiUsage& usage) const;
+
+    // SIGKILL to the script and everything it started
+    static void killGroup(pid_t pid);
+    // wait4() the script; without `block`, false while it is still running
+    static bool reap(pid_t pid, bool block, CgiUsage& usage);
+    // A descriptor that polls readable once the script exits (pidfd), -1
+    // where the kernel has none
+    static int exitFd(pid_t pid);
 };
 
 #endif
\ No newline at end of file
@@ -4,7 +4,10 @@
 #include <string>
 #include <vector>
 #include <map>
+#include <sys/types.h>
 #include "HttpRequest.hpp"
+#include "RequestTiming.hpp"
+#include "CgiExecutor.hpp"
 
 class CgiHandler {
 private:
@@ -22,7 +25,17 @@ public:
     ~CgiHandler();
     
     bool isCgiRequest(const std::string& uri) const;
-    std::string handleCgiRequest(const HttpRequest& request) const;
+    // With a timing, the script gets its id as REQUEST_ID and the spawn
+    // and run times are charged to it; usage says how the run ended
+    std::string handleCgiRequest(const HttpRequest& request, const CgiLimits& limits, CgiUsage& usage,
+                                 RequestTiming* timing = NULL) const;
+    // Same request without waiting: the script's stdout comes back in
+    // output_fd and the caller collects it, reaps pid and calls finish.
+    // Returns "" once the script runs, the error response otherwise.
+    // input_fd as for CgiExecutor::start.
+    std::string startCgiRequest(const HttpRequest& request, const CgiLimits& limits, pid_t& pid, int& output_fd,
+                                const std::string& request_id = "", int* input_fd = NULL) const;
+    std::string finishCgiRequest(const std::string& output, const CgiUsage& usage) const;
     void setCgiBinPath(const std::string& path);
 };
 
@@ -0,0 +1,57 @@
+#ifndef COMPRESSION_HPP
+#define COMPRESSION_HPP
+
+#include <string>
+#include <vector>
+#include <map>
+#include <list>
+#include <sys/types.h>
+#include <ctime>
+
+// Accept-Encoding negotiation and gzip helpers for the static file path.
+namespace Compression {
+    // True if `coding` (e.g. "gzip", "br") has a non-zero q-value in the
+    // given Accept-Encoding header, either explicitly or through "*".
+    bool acceptsEncoding(const std::string& accept_encoding, const std::string& coding);
+    bool isCompressibleType(const std::string& content_type, const std::vector<std::string>& types);
+    bool gzip(const std::string& input, std::string& output, int level = 6);
+}
+
+// Bounded LRU cache of compressed file bodies, keyed by path + encoding and
+// validated against the file's mtime and size so stale entries are
+// recompressed instead of served. An empty body records that compressing
+// did not shrink that version of the file, so it is not tried again.
+class CompressedCache {
+private:
+    struct Entry {
+        std::string data;
+        time_t mtime;
+        off_t size;
+        std::list<std::string>::iterator lru_pos;
+    };
+
+    std::map<std::string, Entry> _entries;
+    std::list<std::string> _lru; // front = most recently used
+    size_t _max_bytes;
+    size_t _used_bytes;
+    size_t _hits;
+    size_t _misses;
+
+    static std::string makeKey(const std::string& path, const std::string& encoding);
+    static size_t cost(const std::string& key, const std::string& data);
+    void evict(const std::string& key);
+
+public:
+    CompressedCache(size_t max_bytes = 16 * 1024 * 1024);
+    ~CompressedCache();
+
+    const std::string* get(const std::string& path, const std::string& encoding, time_t mtime, off_t size);
+    void put(const std::string& path, const std::string& encoding, time_t mtime, off_t size, const std::string& data);
+    void setMaxBytes(size_t max_bytes);
+
+    size_t usedBytes() const { return _used_bytes; }
+    size_t hits() const { return _hits; }
+    size_t misses() const { return _misses; }
+};
+
+#endif
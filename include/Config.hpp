@@ -16,13 +16,92 @@ struct LocationConfig {
     std::vector<std::string> allowed_methods;
     std::string index;
     bool autoindex;
+    bool autoindex_json;       // default listing format when the client does not ask
+    size_t autoindex_page_size; // max entries per listing page, 0 = unlimited
     std::string cgi_extension;
     std::string cgi_path;
     std::string upload_path;
+    bool upload_resumable;          // uploads created by POST, appended by PUT/PATCH
+    long upload_resumable_timeout;  // seconds an unfinished upload is kept idle
     std::map<int, std::string> error_pages;
     std::string redirect; // For redirections
+    bool gzip;              // compress compressible types on the fly
+    bool gzip_static;       // serve file.br / file.gz siblings when accepted
+    size_t gzip_min_length;
+    std::vector<std::string> gzip_types; // empty = built-in text types
+    long expires;           // seconds from now, or one of the sentinels below
+    std::string cache_control;
+    bool mmap;              // serve mid-size files from cached mappings
+    size_t mmap_max_size;   // larger files go through sendfile()
+    std::string bundle;     // mkbundle archive of the root, looked up first
+    std::string proxy_pass; // "http://<upstream name or host:port>[/path]"
+    int proxy_connect_timeout; // seconds
+    int proxy_read_timeout;    // seconds without upstream bytes
+    bool cgi_cache;            // micro-cache CGI GET responses
+    long cgi_cache_valid;      // seconds, when the response sets no lifetime
+    long cgi_cache_stale;      // seconds served stale while one refresh runs
+    std::vector<std::string> cgi_cache_vary; // request headers added to the key
+    bool cgi_cache_purge;      // requests here purge cached paths by prefix
+    size_t cgi_max_concurrent; // scripts running at once here, 0 = unlimited
+    size_t cgi_queue;          // requests waiting for one of them before 503
+    int cgi_timeout;           // seconds before a script's process group is killed
+    long cgi_limit_cpu;        // RLIMIT_CPU seconds, 0 = unlimited
+    size_t cgi_limit_memory;   // RLIMIT_AS bytes
+    long cgi_limit_files;      // RLIMIT_NOFILE
+    std::string limit_req;     // limit_req_zone applied to requests here
+    size_t limit_req_burst;    // excess requests queued before rejecting
+    size_t limit_req_delay;    // excess requests served without delay
+    int limit_req_status;
+    std::string limit_conn;    // limit_conn_zone applied to requests here
+    size_t limit_conn_max;     // concurrent requests per client address
+    int limit_conn_status;
+
+    enum { EXPIRES_OFF = -1, EXPIRES_EPOCH = -2, EXPIRES_MAX = -3 };
     
-    LocationConfig() : autoindex(false) {}
+    LocationConfig() : autoindex(false), autoindex_json(false), autoindex_page_size(1000),
+                       upload_resumable(false), upload_resumable_timeout(86400), gzip(false), gzip_static(false), gzip_min_length(1024),
+                       expires(EXPIRES_OFF), mmap(false), mmap_max_size(4194304),
+                       proxy_connect_timeout(5), proxy_read_timeout(60),
+                       cgi_cache(false), cgi_cache_valid(1), cgi_cache_stale(30), cgi_cache_purge(false),
+                       cgi_max_concurrent(0), cgi_queue(0), cgi_timeout(60),
+                       cgi_limit_cpu(0), cgi_limit_memory(0), cgi_limit_files(0),
+                       limit_req_burst(0), limit_req_delay(0), limit_req_status(429),
+                       limit_conn_max(0), limit_conn_status(503) {}
+};
+
+struct UpstreamServerConfig {
+    std::string host;
+    int port;
+    int weight;
+    int max_fails;      // failures within fail_timeout that mark it down
+    int fail_timeout;   // seconds; also how long it stays down
+
+    UpstreamServerConfig() : port(80), weight(1), max_fails(1), fail_timeout(10) {}
+};
+
+// upstream <name> { server host:port [weight=] [max_fails=] [fail_timeout=];
+//                   least_conn; | hash <key>; keepalive <n>; }
+struct UpstreamConfig {
+    enum Balance { ROUND_ROBIN, LEAST_CONN, HASH };
+
+    std::string name;
+    Balance balance;
+    std::string hash_key;   // may use $request_uri, $uri, $args, $remote_addr, $host
+    size_t keepalive;       // idle connections kept per server
+    std::vector<UpstreamServerConfig> servers;
+
+    UpstreamConfig() : balance(ROUND_ROBIN), keepalive(16) {}
+};
+
+// limit_req_zone <name> rate=<n>r/s|r/m [size=<clients>];
+// limit_conn_zone <name> [size=<clients>];
+struct LimitZoneConfig {
+    std::string name;
+    bool requests;      // limit_req_zone; otherwise limit_conn_zone
+    size_t rate;        // limit_req_zone: requests per 1000 seconds
+    size_t size;        // client addresses tracked, LRU beyond that
+
+    LimitZoneConfig() : requests(false), rate(0), size(4096) {}
 };
 
 struct ServerConfig {
@@ -32,6 +111,22 @@ struct ServerConfig {
     std::string root;
     std::string index;
     size_t client_max_body_size;
+    size_t header_buffers;        // large_client_header_buffers <number> <size>:
+    size_t header_buffer_size;    // the request line fits one buffer, the head all of them
+    size_t gzip_cache_size;
+    size_t mmap_cache_size;
+    size_t cgi_cache_size;
+    size_t open_file_cache;       // max cached paths, 0 = off
+    long open_file_cache_valid;   // seconds an entry is trusted
+    bool open_file_cache_errors;  // also cache failed lookups (404 storms)
+    bool ssl;                     // listen ... ssl
+    std::string ssl_certificate;
+    std::string ssl_certificate_key;
+    size_t ssl_session_cache;     // server-side session cache entries, 0 = off
+    long ssl_session_timeout;     // seconds a session stays resumable
+    bool ssl_session_tickets;
+    bool ssl_ktls;                // let the kernel encrypt records when it can
+    bool http2;                   // h2 via ALPN, h2c via prior knowledge or Upgrade
     std::map<int, std::string> error_pages;
     std::vector<LocationConfig> locations;
 };
@@ -39,6 +134,14 @@ struct ServerConfig {
 class Config {
 private:
     std::vector<ServerConfig> _servers;
+    std::map<std::string, UpstreamConfig> _upstreams;
+    std::map<std::string, LimitZoneConfig> _limit_zones;
+    std::string _event_backend; // "poll" or "io_uring"
+    long _shutdown_timeout;     // seconds a draining process waits for its clients
+    std::string _access_log;    // one line per request with its timings, "" = off
+    std::string _capture_path;  // capture_requests: sampled requests as JSONL, "" = off
+    double _capture_sample;     // fraction of requests captured
+    size_t _memory_budget;      // bytes buffered for all connections before reads pause, 0 = off
     void parseSimpleDirective(const std::string& line, ServerConfig& server);
     ServerConfig getDefaultServerConfig();
     bool finalizeConfig(bool in_server_block);
@@ -47,6 +150,7 @@ private:
     bool parseLocationBlock(std::ifstream& file, ServerConfig& server, const std::string& location_path, int& line_number);
     void parseErrorPage(const std::string& line, std::map<int, std::string>& error_pages);
     void parseAllowedMethods(const std::string& line, std::vector<std::string>& methods);
+    long parseExpires(const std::string& value);
     
 
     //conf utility
@@ -58,6 +162,13 @@ private:
     bool handleDirective(bool in_server_block, const std::string& line, ServerConfig& current_server, int line_number, std::ifstream& file);
     std::string trim(const std::string& str);
 
+    bool isUpstreamStart(const std::string& line);
+    bool parseUpstreamBlock(std::ifstream& file, const std::string& line, int& line_number);
+    bool parseUpstreamServer(const std::vector<std::string>& tokens, UpstreamServerConfig& server);
+    bool parseLimitZone(const std::vector<std::string>& tokens, int line_number);
+    void parseLimitReq(const std::vector<std::string>& tokens, LocationConfig& location);
+    void parseCgiMaxConcurrent(const std::vector<std::string>& tokens, LocationConfig& location);
+
     bool isLocationStart(const std::string& line);
     bool isLocationEnd(const std::string& line);
     std::string extractLocationPath(const std::string& line);
@@ -71,6 +182,15 @@ public:
     void setDefaultConfig();
     
     const std::vector<ServerConfig>& getServers() const { return _servers; }
+    const std::map<std::string, UpstreamConfig>& getUpstreams() const { return _upstreams; }
+    const std::map<std::string, LimitZoneConfig>& getLimitZones() const { return _limit_zones; }
+    const std::string& getEventBackend() const { return _event_backend; }
+    long getShutdownTimeout() const { return _shutdown_timeout; }
+    const std::string& getAccessLog() const { return _access_log; }
+    const std::string& getCapturePath() const { return _capture_path; }
+    double getCaptureSample() const { return _capture_sample; }
+    size_t getMemoryBudget() const { return _memory_budget; }
+    static bool parseHostPort(const std::string& value, std::string& host, int& port);
 
     const ServerConfig* findServerConfig(const std::string& host, int port, const std::string& server_name = "") const;
     const LocationConfig* findLocationConfig(const ServerConfig& server, const std::string& uri) const;
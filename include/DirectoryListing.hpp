@@ -0,0 +1,85 @@
+#ifndef DIRECTORYLISTING_HPP
+#define DIRECTORYLISTING_HPP
+
+#include <string>
+#include <vector>
+#include <map>
+#include <list>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <ctime>
+
+class OutputQueue;
+
+struct DirEntry {
+    std::string name;
+    bool is_dir;
+    off_t size;
+    time_t mtime;
+};
+
+// One page of an autoindex listing, from ?sort=&order=&offset=&limit=&format=
+struct ListingView {
+    enum SortKey { SORT_NAME, SORT_SIZE, SORT_MTIME };
+
+    SortKey sort;
+    bool descending;
+    size_t offset;
+    size_t limit;  // 0 = everything from offset on
+    bool json;
+
+    ListingView() : sort(SORT_NAME), descending(false), offset(0), limit(0), json(false) {}
+    std::string key() const;
+    std::string queryString(size_t page_offset) const; // same view, other page
+};
+
+// Directory entries read once per directory version (inode + mtime with
+// nanoseconds) and kept sorted, plus the rendered pages clients asked for.
+// Bounded by directory count and an approximate byte budget (LRU).
+class DirectoryListingCache {
+private:
+    struct Listing {
+        dev_t dev;
+        ino_t ino;
+        struct timespec mtime;
+        std::vector<DirEntry> entries;             // directories first, then by name
+        std::map<int, std::vector<size_t> > orders; // lazily built orders for size/mtime
+        std::map<std::string, std::vector<std::string> > pages; // rendered views, in chunks
+        size_t bytes;
+        std::list<std::string>::iterator lru_pos;
+    };
+
+    std::map<std::string, Listing> _listings;
+    std::list<std::string> _lru; // front = most recently used
+    size_t _max_listings;
+    size_t _max_bytes;
+    size_t _used_bytes;
+    size_t _hits;
+    size_t _misses;
+
+    Listing* lookup(const std::string& dir_path, const struct stat& dir_st);
+    bool readEntries(const std::string& dir_path, std::vector<DirEntry>& entries);
+    const std::vector<size_t>& order(Listing& listing, ListingView::SortKey sort);
+    void renderPage(Listing& listing, const std::string& uri, const ListingView& view,
+                    std::vector<std::string>& chunks);
+    void evict(const std::string& dir_path);
+    void trim();
+
+    DirectoryListingCache(const DirectoryListingCache&);
+    DirectoryListingCache& operator=(const DirectoryListingCache&);
+
+public:
+    DirectoryListingCache(size_t max_listings = 64, size_t max_bytes = 64 * 1024 * 1024);
+    ~DirectoryListingCache();
+
+    // Queues the requested page of dir_path onto `out` as a series of chunk
+    // segments and sets `length` to the body size. False if the directory
+    // cannot be read.
+    bool render(const std::string& dir_path, const struct stat& dir_st, const std::string& uri,
+                const ListingView& view, OutputQueue& out, size_t& length);
+
+    size_t hits() const { return _hits; }
+    size_t misses() const { return _misses; }
+};
+
+#endif
@@ -0,0 +1,119 @@
+#ifndef EVENTBACKEND_HPP
+#define EVENTBACKEND_HPP
+
+#include <string>
+#include <vector>
+#include <poll.h>
+#include <stdint.h>
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+// Readiness notification for the main loop. A backend fills the revents of
+// the loop's pollfd set with poll() semantics (level-triggered, POLLERR and
+// POLLHUP always reported, same return value and errno), so the loop does
+// not know which one is running. Only readiness: the handlers still do
+// their own accept, recv, send and file I/O.
+class EventBackend {
+public:
+    virtual ~EventBackend() {}
+
+    virtual int wait(std::vector<struct pollfd>& fds, int timeout_ms) = 0;
+    // `fd` joined the set at index `slot`, or its events there changed.
+    // Entries only move down the set, as the ones before them are erased.
+    virtual void watch(int fd, short events, size_t slot) = 0;
+    // `fd` left the set (it may be closed and its number reused right away)
+    virtual void remove(int fd) = 0;
+    virtual const char* name() const = 0;
+    virtual std::string statsLine() const = 0;
+
+    // "io_uring" when the kernel provides it, poll() otherwise
+    static EventBackend* create(const std::string& name);
+};
+
+class PollBackend : public EventBackend {
+private:
+    size_t _waits;
+    size_t _scanned; // pollfds handed to the kernel
+
+public:
+    PollBackend();
+
+    int wait(std::vector<struct pollfd>& fds, int timeout_ms);
+    void watch(int, short, size_t) {}
+    void remove(int) {}
+    const char* name() const { return "poll"; }
+    std::string statsLine() const;
+};
+
+// poll() readiness through io_uring, using the raw syscalls. Every fd
+// keeps a one-shot IORING_OP_POLL_ADD armed in the kernel for its current
+// events. A wait only looks at the fds watch() and remove() reported and
+// the ones that fired, and queues their changes to go in with it in a
+// single io_uring_enter(), instead of handing the whole set to poll()
+// every time. Fds that fired are re-armed on the next wait, which checks
+// readiness again on arming, so behaviour stays level-triggered like poll().
+class UringBackend : public EventBackend {
+private:
+    struct Armed {
+        int armed;           // events of the POLL_ADD in the kernel, -1 after remove()
+        short events;        // wanted by the set
+        bool watched;        // in the set
+        bool pending;        // a POLL_ADD is in the kernel
+        bool dirty;          // in _dirty
+        uint32_t generation; // tells completions of an older arming apart
+        size_t slot;         // its index in the set when last seen
+    };
+
+    int _ring_fd;
+    void* _sq_ring;
+    size_t _sq_ring_size;
+    void* _cq_ring;
+    size_t _cq_ring_size;
+    struct io_uring_sqe* _sqes;
+    size_t _sqes_size;
+    unsigned* _sq_head;
+    unsigned* _sq_tail;
+    unsigned _sq_mask;
+    unsigned* _sq_array;
+    unsigned* _cq_head;
+    unsigned* _cq_tail;
+    unsigned _cq_mask;
+    struct io_uring_cqe* _cqes;
+    unsigned _queued;    // SQEs not handed to the kernel yet
+
+    std::vector<Armed> _fds;    // by fd number
+    std::vector<int> _dirty;    // to arm, re-arm or cancel on the next wait
+    std::vector<int> _reported; // given revents by the last wait
+    uint32_t _generation;
+    size_t _enters;
+    size_t _submitted;
+
+    UringBackend();
+    bool setup(unsigned entries);
+    struct io_uring_sqe* nextSqe();
+    Armed& slotFor(int fd);
+    void markDirty(int fd);
+    size_t locate(const std::vector<struct pollfd>& fds, int fd);
+    void arm(int fd);
+    void cancel(int fd);
+    int enter(unsigned min_complete, int timeout_ms);
+    int reap(std::vector<struct pollfd>& fds);
+
+    UringBackend(const UringBackend&);
+    UringBackend& operator=(const UringBackend&);
+
+public:
+    ~UringBackend();
+
+    // NULL (errno set) when io_uring is missing, disabled or too old
+    static UringBackend* create(unsigned entries);
+
+    int wait(std::vector<struct pollfd>& fds, int timeout_ms);
+    void watch(int fd, short events, size_t slot);
+    void remove(int fd);
+    const char* name() const { return "io_uring"; }
+    std::string statsLine() const;
+};
+
+#endif
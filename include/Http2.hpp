@@ -0,0 +1,180 @@
+#ifndef HTTP2_HPP
+#define HTTP2_HPP
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <utility>
+#include <stdint.h>
+#include "OutputQueue.hpp"
+
+typedef std::vector<std::pair<std::string, std::string> > HeaderList;
+
+// HPACK (RFC 7541) for one direction of a connection: the static table, a
+// dynamic table bounded by the negotiated size, and Huffman strings. The
+// decoder side accepts every representation; the encoder indexes fields
+// that repeat across responses and Huffman-codes strings when shorter.
+class Hpack {
+private:
+    std::deque<std::pair<std::string, std::string> > _table; // front = newest
+    size_t _size;
+    size_t _max_size;
+    size_t _capacity;    // largest size the peer may switch to
+    size_t _size_update; // pending encoder table size update, or NO_UPDATE
+
+    static const size_t NO_UPDATE = (size_t)-1;
+
+    bool entry(size_t index, std::string& name, std::string& value) const;
+    size_t find(const std::string& name, const std::string& value, size_t& name_index) const;
+    void insert(const std::string& name, const std::string& value);
+    void evict(size_t limit);
+
+public:
+    Hpack(size_t max_size = 4096);
+
+    // False on a malformed block (COMPRESSION_ERROR).
+    bool decode(const std::string& block, HeaderList& headers);
+    std::string encode(const HeaderList& headers);
+    // Encoder: the peer's SETTINGS_HEADER_TABLE_SIZE (capped at 4096)
+    void setMaxSize(size_t max_size);
+
+    static bool huffmanDecode(const std::string& in, std::string& out);
+    static std::string huffmanEncode(const std::string& in);
+    static size_t huffmanLength(const std::string& in);
+};
+
+// A request whose headers (and body, if any) have arrived on a stream
+struct Http2Request {
+    uint32_t stream_id;
+    HeaderList headers;
+    std::string body;
+    bool oversized;  // body exceeded the limit and was dropped: answer 413
+
+    Http2Request() : stream_id(0), oversized(false) {}
+};
+
+// Server side of one HTTP/2 connection (RFC 9113), independent of the
+// socket: bytes go in through receive(), complete requests come out of
+// nextRequest(), responses go back in through respond(), and frames for
+// the socket collect in output(). Response bodies are framed lazily by
+// fill() within the flow-control windows, most urgent stream first
+// (RFC 9218 urgency from the `priority` header or PRIORITY_UPDATE).
+class Http2Session {
+public:
+    enum {
+        MAX_FRAME_SIZE = 16384,
+        MAX_STREAMS = 128,
+        STREAM_WINDOW = 1024 * 1024,
+        CONNECTION_WINDOW = 16 * 1024 * 1024,
+        MAX_HEADER_BLOCK = 256 * 1024
+    };
+
+private:
+    struct Stream {
+        uint32_t id;
+        HeaderList headers;
+        std::string body;
+        bool headers_done;
+        bool request_done;   // END_STREAM received (or body dropped)
+        bool remote_closed;
+        bool responded;
+        bool oversized;
+        int64_t send_window;
+        int64_t recv_window;
+        size_t recv_unacked;
+        int urgency;         // 0 (most urgent) .. 7
+        bool incremental;
+        OutputQueue pending; // response body not framed yet
+
+        Stream(uint32_t stream_id, int64_t window);
+    };
+
+    std::map<uint32_t, Stream*> _streams;
+    std::deque<uint32_t> _ready;
+    std::string _input;
+    OutputQueue _output;
+    Hpack _decoder;
+    Hpack _encoder;
+    size_t _max_body;
+    bool _preface_received;
+    bool _closing;           // GOAWAY sent
+    bool _going_away;        // graceful GOAWAY sent, finishing open streams
+    bool _goaway_received;
+    uint32_t _last_stream_id;
+    uint32_t _header_stream; // header block being assembled, 0 when none
+    bool _header_end_stream;
+    std::string _header_block;
+    int64_t _send_window;
+    int64_t _recv_window;
+    size_t _recv_unacked;
+    int64_t _peer_initial_window;
+    size_t _peer_max_frame;
+    uint32_t _last_scheduled;
+
+    bool handleFrame(uint8_t type, uint8_t flags, uint32_t stream_id, const std::string& payload);
+    bool onHeaders(uint8_t flags, uint32_t stream_id, const std::string& payload);
+    bool finishHeaders();
+    bool onData(uint8_t flags, uint32_t stream_id, const std::string& payload);
+    bool onSettings(uint8_t flags, uint32_t stream_id, const std::string& payload, bool acknowledge);
+    bool onWindowUpdate(uint32_t stream_id, const std::string& payload);
+    void onPriorityUpdate(const std::string& payload);
+    void requestComplete(Stream* stream);
+    void finishStream(Stream* stream);
+    void resetStream(uint32_t stream_id, uint32_t error);
+    bool fail(uint32_t error);
+    Stream* find(uint32_t stream_id);
+    Stream* nextScheduled();
+    void queueFrame(uint8_t type, uint8_t flags, uint32_t stream_id, const std::string& payload);
+    static void parsePriority(const std::string& value, int& urgency, bool& incremental);
+
+    Http2Session(const Http2Session&);
+    Http2Session& operator=(const Http2Session&);
+
+public:
+    explicit Http2Session(size_t max_body);
+    ~Http2Session();
+
+    // Queues the server preface (SETTINGS and the connection window)
+    void start();
+    // h2c upgrade: the HTTP/1.1 request becomes stream 1, already complete;
+    // `settings` is the HTTP2-Settings header (base64url SETTINGS payload).
+    bool upgrade(const std::string& settings);
+    // Consumes received bytes; false on a connection error (GOAWAY queued,
+    // close once the output is flushed).
+    bool receive(const char* data, size_t length);
+    bool nextRequest(Http2Request& request);
+    // Response for a stream: `headers` start with :status; `body` is moved
+    // out (segments are framed later by fill()).
+    void respond(uint32_t stream_id, const HeaderList& headers, OutputQueue& body);
+    // Frames pending response bodies into output() until it holds about
+    // `budget` bytes or the windows are exhausted.
+    void fill(size_t budget);
+
+    OutputQueue& output() { return _output; }
+    // Graceful shutdown: streams opened after this are not served (the
+    // client retries them on a new connection); the open ones finish
+    void goAway();
+    // Nothing more will happen on the connection: it can be closed once
+    // the output is flushed.
+    bool finished() const;
+    size_t streamCount() const { return _streams.size(); }
+    // Buffered input, request bodies and queued responses, for memory_budget
+    size_t memoryBytes() const;
+};
+
+namespace Http2 {
+    extern const char PREFACE[];
+    const size_t PREFACE_LENGTH = 24;
+
+    // HTTP/1.1 request text for the handlers; false if the header list is
+    // malformed (missing or misplaced pseudo-headers, uppercase names,
+    // connection-specific fields).
+    bool toHttp1(const HeaderList& headers, const std::string& body, std::string& request);
+    // Header list (":status" first, hop-by-hop fields dropped) of an
+    // HTTP/1.1 response; `body_start` is where its body begins.
+    bool fromHttp1(const std::string& response, HeaderList& headers, size_t& body_start);
+    std::string headerValue(const HeaderList& headers, const std::string& name);
+}
+
+#endif
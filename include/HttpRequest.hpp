@@ -10,6 +10,8 @@ enum HttpMethod {
     POST,
     DELETE,
     HEAD,
+    PUT,
+    PATCH,
     UNKNOWN
 };
 
@@ -37,6 +39,9 @@ public:
     bool isComplete() const { return _is_complete; }
     
     std::string getHeader(const std::string& key) const;
+    std::string getPath() const;  // URI without the query string
+    std::string getQuery() const; // text after '?', empty if none
+    std::string getQueryParam(const std::string& name) const;
     std::string methodToString() const;
 };
 
@@ -0,0 +1,70 @@
+#ifndef MAPPEDFILECACHE_HPP
+#define MAPPEDFILECACHE_HPP
+
+#include <string>
+#include <map>
+#include <list>
+#include <utility>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+// A read-only mapping of a whole file. Reference counted: the cache holds
+// one reference while the entry is live and every queued response segment
+// holds another, so eviction never unmaps bytes still being sent.
+struct MappedFile {
+    const char* addr;
+    size_t length;
+    time_t mtime;
+    off_t size;
+    int refs;
+
+    void retain() { ++refs; }
+    void release();
+};
+
+// Long-lived mappings keyed by (device, inode) and validated against mtime
+// and size, bounded by entry count and total mapped bytes (LRU).
+class MappedFileCache {
+private:
+    typedef std::pair<dev_t, ino_t> Key;
+
+    struct Entry {
+        MappedFile* file;
+        std::list<Key>::iterator lru_pos;
+    };
+
+    std::map<Key, Entry> _entries;
+    std::list<Key> _lru; // front = most recently used
+    size_t _max_entries;
+    size_t _max_bytes;
+    size_t _mapped_bytes;
+    size_t _hits;
+    size_t _misses;
+    size_t _evictions;
+
+    MappedFile* mapFile(const std::string& path, const struct stat& st);
+    void evict(const Key& key);
+    void countLookup(bool hit);
+
+    MappedFileCache(const MappedFileCache&);
+    MappedFileCache& operator=(const MappedFileCache&);
+
+public:
+    MappedFileCache(size_t max_entries = 1024, size_t max_bytes = 256 * 1024 * 1024);
+    ~MappedFileCache();
+
+    // Returns a retained mapping (caller must release()) or NULL.
+    MappedFile* acquire(const std::string& path, const struct stat& st);
+    void setLimits(size_t max_entries, size_t max_bytes);
+    void clear();
+
+    size_t hits() const { return _hits; }
+    size_t misses() const { return _misses; }
+    size_t evictions() const { return _evictions; }
+    size_t mappedBytes() const { return _mapped_bytes; }
+    size_t size() const { return _entries.size(); }
+    double hitRate() const;
+    std::string statsLine() const;
+};
+
+#endif
@@ -0,0 +1,42 @@
+#ifndef MEMORYBUDGET_HPP
+#define MEMORYBUDGET_HPP
+
+#include <map>
+#include <string>
+#include <stddef.h>
+
+// Bytes held for connections: request bytes not handled yet, responses
+// queued in memory (file ranges are not counted, they stay in the page
+// cache), HTTP/2 session state and proxied requests kept for retries.
+// Each connection's usage is set after its events are handled. Above the
+// budget (memory_budget) the server stops admitting new requests until
+// usage falls under three quarters of it.
+class MemoryBudget {
+public:
+    MemoryBudget();
+
+    void setLimit(size_t bytes); // 0 = no limit
+    size_t limit() const { return _limit; }
+    void charge(int fd, size_t bytes);
+    void release(int fd);
+    size_t used() const { return _used; }
+
+    // Whether new reads are held back; update() applies the hysteresis
+    // and returns true when the state changed
+    bool paused() const { return _paused; }
+    bool update();
+
+    // "used 0, peak 1048576 (one connection 65536), budget 268435456, paused 2 times"
+    std::string statsLine() const;
+
+private:
+    std::map<int, size_t> _connections;
+    size_t _limit;
+    size_t _used;
+    size_t _peak;
+    size_t _peak_connection;
+    bool _paused;
+    size_t _pauses;
+};
+
+#endif
@@ -0,0 +1,109 @@
+#ifndef MULTIPART_HPP
+#define MULTIPART_HPP
+
+#include <string>
+#include <vector>
+#include <map>
+
+// Incremental multipart/form-data parser (RFC 7578, RFC 2046 section 5.1).
+// Body bytes are fed in whatever chunks they arrive in; part contents are
+// passed on as soon as they cannot be the start of a boundary, so only a
+// boundary's length worth of data (or one part's headers) is ever held.
+class MultipartParser {
+public:
+    class Handler {
+    public:
+        virtual ~Handler() {}
+        // Header names are lowercase. Returning false stops the parser.
+        virtual bool partBegin(const std::map<std::string, std::string>& headers) = 0;
+        virtual bool partData(const char* data, size_t length) = 0;
+        virtual bool partEnd() = 0;
+    };
+
+    static const size_t MAX_HEADER_SIZE = 16 * 1024; // per part
+
+    MultipartParser(const std::string& boundary, Handler& handler);
+
+    // False once the body is malformed or the handler gave up
+    bool feed(const char* data, size_t length);
+    // The closing boundary was seen; anything after it is ignored
+    bool done() const { return _state == DONE; }
+    const std::string& error() const { return _error; }
+
+    // The boundary parameter of a multipart Content-Type, "" if none
+    static std::string boundaryOf(const std::string& content_type);
+    // A parameter of a header value such as Content-Disposition
+    static std::string parameter(const std::string& value, const std::string& name);
+
+private:
+    enum State { PREAMBLE, DELIMITER, HEADERS, BODY, DONE, FAILED };
+
+    std::string _delimiter; // CRLF "--" boundary
+    std::string _pending;   // bytes that may still turn out to be a delimiter
+    State _state;
+    Handler& _handler;
+    std::string _error;
+
+    bool fail(const std::string& reason);
+    bool parseHeaders(const std::string& block);
+
+    MultipartParser(const MultipartParser&);
+    MultipartParser& operator=(const MultipartParser&);
+};
+
+struct UploadedPart {
+    std::string field;    // form field name
+    std::string filename; // as sent by the client, "" for plain fields
+    std::string saved_as; // name in the upload directory, "" if not stored
+    size_t size;
+
+    UploadedPart() : size(0) {}
+};
+
+// Stores a request body in an upload directory while it arrives: every file
+// part of a multipart/form-data body goes straight to its own file, a body
+// of any other type to a single upload_<time>_<usec>.txt. Names are
+// sanitized and never replace an existing file. Until finish() succeeds the
+// upload is incomplete, and destroying it removes the files it created.
+class UploadWriter : private MultipartParser::Handler {
+private:
+    std::string _dir;
+    MultipartParser* _parser; // NULL for a raw body
+    int _fd;                  // file being written
+    std::vector<UploadedPart> _parts;
+    std::vector<std::string> _created;
+    bool _finished;
+    int _status;              // HTTP status of the failure, 0 while fine
+    std::string _error;
+
+    bool partBegin(const std::map<std::string, std::string>& headers);
+    bool partData(const char* data, size_t length);
+    bool partEnd();
+    bool createFile(const std::string& name, UploadedPart& part);
+    bool fail(int status, const std::string& reason);
+
+    UploadWriter(const UploadWriter&);
+    UploadWriter& operator=(const UploadWriter&);
+
+public:
+    UploadWriter(const std::string& dir, const std::string& content_type);
+    ~UploadWriter();
+
+    bool write(const char* data, size_t length);
+    // The body is complete: true when it was well-formed and fully stored
+    bool finish();
+
+    const std::vector<UploadedPart>& parts() const { return _parts; }
+    size_t filesSaved() const;
+    int errorStatus() const { return _status; }
+    const std::string& error() const { return _error; }
+    // The per-part results as an HTML page or a JSON document
+    std::string report(bool json) const;
+
+    // A client-supplied name reduced to a safe basename
+    static std::string sanitizeFilename(const std::string& name);
+    // `name`, then name-1.ext, name-2.ext, ... for later attempts
+    static std::string numberedName(const std::string& name, int attempt);
+};
+
+#endif
@@ -0,0 +1,77 @@
+#ifndef OPENFILECACHE_HPP
+#define OPENFILECACHE_HPP
+
+#include <string>
+#include <map>
+#include <vector>
+#include <list>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <ctime>
+
+// Result of one cached filesystem lookup. `error` is 0 when the path
+// exists, otherwise the errno of the failed stat (ENOENT, EACCES, ...).
+struct FileInfo {
+    int error;
+    struct stat st;
+    bool readable;
+
+    FileInfo() : error(0), readable(false) {}
+    bool exists() const { return error == 0; }
+    bool isDirectory() const { return error == 0 && S_ISDIR(st.st_mode); }
+};
+
+// open_file_cache: stat results, access checks, open descriptors, index
+// resolution and nonexistence, remembered per path for `valid` seconds and
+// bounded by entry count (LRU). With max_entries == 0 every call goes to
+// the kernel, so callers can use it unconditionally.
+class OpenFileCache {
+private:
+    struct Entry {
+        FileInfo info;
+        int fd;                 // kept open for regular files, -1 otherwise
+        std::string index_key;  // index candidates the resolution below is for
+        std::string index_path; // resolved index file, empty if none
+        bool index_resolved;
+        time_t expires;
+        std::list<std::string>::iterator lru_pos;
+    };
+
+    std::map<std::string, Entry> _entries;
+    std::list<std::string> _lru; // front = most recently used
+    size_t _max_entries;
+    time_t _valid;
+    bool _cache_errors;
+    size_t _open_fds;
+    size_t _hits;
+    size_t _misses;
+    Entry _scratch; // result holder when caching is disabled
+
+    Entry& entry(const std::string& path);
+    void fill(const std::string& path, Entry& entry);
+    void evict(const std::string& path);
+    void closeFd(Entry& entry);
+
+    OpenFileCache(const OpenFileCache&);
+    OpenFileCache& operator=(const OpenFileCache&);
+
+public:
+    OpenFileCache();
+    ~OpenFileCache();
+
+    void configure(size_t max_entries, time_t valid, bool cache_errors);
+
+    const FileInfo& lookup(const std::string& path);
+    // Returns a descriptor the caller owns (a dup of the cached one), or -1.
+    int open(const std::string& path);
+    // First readable, non-directory candidate inside dir_path, or "".
+    std::string resolveIndex(const std::string& dir_path, const std::vector<std::string>& candidates);
+    void invalidate(const std::string& path);
+    void clear();
+
+    size_t hits() const { return _hits; }
+    size_t misses() const { return _misses; }
+    size_t size() const { return _entries.size(); }
+};
+
+#endif
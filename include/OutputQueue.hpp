@@ -0,0 +1,75 @@
+#ifndef OUTPUTQUEUE_HPP
+#define OUTPUTQUEUE_HPP
+
+#include <string>
+#include <deque>
+#include <vector>
+#include <sys/types.h>
+
+struct MappedFile;
+class TlsConnection;
+
+// Pending bytes for one client socket: in-memory buffers, file ranges sent
+// with sendfile() straight from the page cache, and slices of mmap'ed files
+// written directly from the mapping. Consecutive buffers and slices go out
+// in one sendmsg(), flagged MSG_MORE when a file range follows so the head
+// and the start of the body share packets. On TLS connections without
+// kernel TLS the bytes go through SSL_write() instead, file ranges via a
+// bounce buffer.
+struct OutputSegment {
+    std::string data;   // used when fd == -1 and mapping == NULL
+    int fd;
+    MappedFile* mapping; // holds a reference until the segment is sent
+    off_t offset;
+    off_t length;
+
+    OutputSegment() : fd(-1), mapping(NULL), offset(0), length(0) {}
+};
+
+class OutputQueue {
+private:
+    std::deque<OutputSegment> _segments;
+    std::vector<int> _owned_fds;
+    size_t _data_offset; // progress inside the front data segment
+
+    enum { GATHER_MAX = 64 }; // iovecs per sendmsg()
+
+    void popFront();
+    bool references(int fd) const;
+    ssize_t sendBytes(int socket_fd, TlsConnection* tls, const char* data, size_t length);
+    ssize_t sendGathered(int socket_fd, size_t& attempted);
+    void consume(size_t bytes);
+    bool dataAfterFile() const;
+
+    OutputQueue(const OutputQueue&);
+    OutputQueue& operator=(const OutputQueue&);
+
+public:
+    enum FlushResult {
+        FLUSH_DONE,
+        FLUSH_AGAIN,
+        FLUSH_ERROR
+    };
+
+    OutputQueue();
+    ~OutputQueue();
+
+    void push(const std::string& data);
+    void pushOwned(std::string& data); // takes the bytes of `data`, leaving it empty
+    void pushFile(int fd, off_t offset, off_t length);
+    void pushMapping(MappedFile* mapping, off_t offset, off_t length); // takes over one reference
+    void adoptFd(int fd); // closed once no queued segment reads from it
+    void splice(OutputQueue& other); // moves other's segments and fds to the back
+    // Moves up to `max` bytes from the front to the back of `dest`,
+    // splitting a segment if needed; returns the number moved.
+    size_t take(OutputQueue& dest, size_t max);
+
+    FlushResult flush(int socket_fd, TlsConnection* tls = NULL);
+    bool empty() const { return _segments.empty(); }
+    size_t pendingBytes() const;
+    // What the queue holds in RAM: data segments, not file ranges or mappings
+    size_t memoryBytes() const;
+    void clear();
+};
+
+#endif
@@ -0,0 +1,128 @@
+#ifndef PROXY_HPP
+#define PROXY_HPP
+
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include <ctime>
+#include <stdint.h>
+#include "Config.hpp"
+
+// Runtime state of one upstream server: balancing weights, passive health
+// and the pool of idle keep-alive connections to it.
+struct UpstreamPeer {
+    UpstreamServerConfig config;
+    int current_weight;     // smooth weighted round-robin
+    size_t active;          // requests in flight
+    int fails;
+    time_t fail_window_start;
+    time_t down_until;
+    std::vector<int> idle;  // keep-alive sockets, not in the poll set
+
+    UpstreamPeer() : current_weight(0), active(0), fails(0), fail_window_start(0), down_until(0) {}
+    std::string address() const;
+};
+
+struct UpstreamGroup {
+    UpstreamConfig config;
+    std::vector<UpstreamPeer> peers;
+    std::vector<std::pair<uint32_t, size_t> > ring; // consistent-hash points -> peer
+};
+
+// Upstream groups from the config plus implicit single-server groups for
+// "proxy_pass http://host:port". Survives config reloads: groups whose
+// server list did not change keep their health state and idle pools.
+class UpstreamManager {
+private:
+    std::map<std::string, UpstreamGroup> _groups;
+
+    static void buildRing(UpstreamGroup& group);
+    static void closeIdle(UpstreamGroup& group);
+    static bool sameServers(const UpstreamConfig& a, const UpstreamConfig& b);
+    UpstreamPeer* find(const std::string& group_name, size_t peer, const std::string& address);
+
+    UpstreamManager(const UpstreamManager&);
+    UpstreamManager& operator=(const UpstreamManager&);
+
+public:
+    UpstreamManager();
+    ~UpstreamManager();
+
+    void configure(const std::map<std::string, UpstreamConfig>& upstreams);
+    // Group for the host part of a proxy_pass target, or NULL.
+    UpstreamGroup* group(const std::string& name);
+
+    // Picks a live peer not in `tried`; -1 when none is left. `hash_value`
+    // is the expanded hash key for consistent-hash groups.
+    int select(UpstreamGroup& group, const std::string& hash_value, const std::set<size_t>& tried);
+    // Socket to the peer: an idle keep-alive one if available (reused=true)
+    // or a fresh non-blocking connect in progress. -1 on immediate failure.
+    int connect(UpstreamGroup& group, size_t peer, bool& reused);
+    // The calls below name the peer by group, index and address so a session
+    // that outlived a reload cannot touch whichever server took its slot.
+    // Ends a request on the peer; the socket is pooled when reusable.
+    void release(const std::string& group_name, size_t peer, const std::string& address, int fd, bool reusable);
+    void reportFailure(const std::string& group_name, size_t peer, const std::string& address);
+    void reportSuccess(const std::string& group_name, size_t peer, const std::string& address);
+    void clear();
+};
+
+// One proxied request: client socket, upstream socket and the response
+// framing needed to know when the upstream connection can be reused.
+struct ProxySession {
+    enum State { CONNECTING, SENDING, READING_HEADERS, STREAMING, FINISHED };
+    enum Framing { FRAME_NONE, FRAME_LENGTH, FRAME_CHUNKED, FRAME_CLOSE };
+    enum ChunkState { CHUNK_SIZE, CHUNK_DATA, CHUNK_DATA_CRLF, CHUNK_TRAILER };
+
+    int client_fd;
+    int upstream_fd;
+    std::string group;
+    size_t peer;
+    std::string peer_address;
+    std::set<size_t> tried;
+    std::string hash_value;
+    bool idempotent;
+    bool head;
+
+    std::string request;
+    size_t request_sent;
+    bool reused;            // upstream socket came from the idle pool
+
+    State state;
+    std::string header_buffer;
+    int status;
+    Framing framing;
+    long long remaining;    // FRAME_LENGTH bytes left, or current chunk bytes left
+    ChunkState chunk_state;
+    std::string chunk_line;
+    bool upstream_keepalive;
+    bool forwarded;         // response bytes already handed to the client
+    bool paused;            // upstream reads stopped for client backpressure
+
+    int connect_timeout;
+    int read_timeout;
+    time_t deadline;
+
+    ProxySession();
+    // Consumes body bytes for framing; true once the response is complete.
+    bool consumeBody(const char* data, size_t length);
+};
+
+namespace Proxy {
+    // Rewrites the upstream response head for the client: drops hop-by-hop
+    // headers and fills status/framing fields of the session. False if the
+    // head is malformed.
+    bool parseResponseHead(const std::string& head, ProxySession& session, std::string& client_head);
+    // Builds the upstream request from the client's raw head and body; a
+    // request id replaces the client's X-Request-Id.
+    std::string buildRequest(const std::string& raw_head, const std::string& body, const std::string& uri,
+                             const std::string& client_addr, const std::string& scheme, bool keepalive,
+                             const std::string& request_id = "");
+    // "$request_uri" etc. expanded against the request.
+    std::string expandKey(const std::string& key, const std::string& uri, const std::string& host,
+                          const std::string& client_addr);
+    uint32_t hash(const std::string& value);
+}
+
+#endif
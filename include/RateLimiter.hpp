@@ -0,0 +1,68 @@
+#ifndef RATELIMITER_HPP
+#define RATELIMITER_HPP
+
+#include <vector>
+#include <stdint.h>
+#include "Config.hpp"
+
+// State of one limit_req_zone / limit_conn_zone: a fixed-size hash table
+// of client IPv4 addresses with LRU eviction, allocated once so a flood of
+// distinct addresses costs no memory, only the oldest entries.
+class LimitZone {
+public:
+    enum Verdict { PASS, DELAY, REJECT };
+
+private:
+    static const size_t NONE = (size_t)-1;
+
+    struct Node {
+        uint32_t key;
+        size_t next;            // hash chain, or free list
+        size_t lru_prev;
+        size_t lru_next;
+        uint64_t last_ms;       // time of the last accounted request
+        uint64_t excess;        // tokens owed beyond the rate, x1000
+        size_t connections;     // limit_conn: requests in progress
+    };
+
+    LimitZoneConfig _config;
+    std::vector<Node> _nodes;
+    std::vector<size_t> _buckets;
+    size_t _lru_head;           // most recently used
+    size_t _lru_tail;
+    size_t _free;
+    size_t _evictions;
+
+    size_t bucketOf(uint32_t key) const;
+    size_t find(uint32_t key) const;
+    size_t acquire(uint32_t key);
+    void release(size_t index);
+    void touch(size_t index);
+    void unlinkLru(size_t index);
+
+    LimitZone(const LimitZone&);
+    LimitZone& operator=(const LimitZone&);
+
+public:
+    explicit LimitZone(const LimitZoneConfig& config);
+    ~LimitZone();
+
+    const LimitZoneConfig& config() const { return _config; }
+
+    // limit_req: a token bucket refilled at the zone rate that holds
+    // `burst` requests. Requests beyond `delay` queued ones are slowed down
+    // to the rate (delay_ms set), beyond `burst` rejected.
+    Verdict request(uint32_t key, uint64_t now_ms, size_t burst, size_t delay, uint64_t& delay_ms);
+    // limit_conn: false when the client already has `max` requests going
+    // (or the table is full of clients that do).
+    bool openConnection(uint32_t key, size_t max);
+    void closeConnection(uint32_t key);
+
+    size_t evictions() const { return _evictions; }
+};
+
+namespace RateLimit {
+    uint64_t nowMs(); // monotonic
+}
+
+#endif
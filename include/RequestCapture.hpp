@@ -0,0 +1,46 @@
+#ifndef REQUESTCAPTURE_HPP
+#define REQUESTCAPTURE_HPP
+
+#include <string>
+#include <stdint.h>
+
+class HttpRequest;
+class RequestTiming;
+
+// Samples served requests into a JSONL file (capture_requests) that
+// `loadgen --replay` re-issues. One object per line:
+//   {"t":<arrival, epoch us>,"id":..,"method":..,"uri":..,"headers":{..},
+//    "body_bytes":N,"body_fnv1a":"<hex>","status":N,"bytes":N,"ms":X}
+// Lines are written when the response is done, so they are ordered by
+// completion, not arrival. Credentials (Authorization, Cookie) are left
+// out, and bodies are only described by their size and hash.
+class RequestCapture {
+public:
+    RequestCapture();
+    ~RequestCapture();
+
+    // Closes the current file; an empty path leaves capture off
+    bool open(const std::string& path, double sample);
+    void close();
+    bool enabled() const { return _fd != -1; }
+
+    // Whether the next request is captured: every 1/sample-th one
+    bool sample();
+    // The request half of an entry; body_bytes is the announced length
+    // for uploads streamed to disk, whose body is never held
+    std::string describe(const HttpRequest& request, const std::string& id, uint64_t arrival_us,
+                         size_t body_bytes) const;
+    // Completes `entry` with the response of `timing` and appends it
+    void write(const std::string& entry, const RequestTiming& timing);
+
+private:
+    int _fd;
+    double _sample;       // fraction of requests kept
+    double _credit;       // accumulated fraction, a request is kept at 1
+    int64_t _wall_offset; // epoch us minus monotonic us
+
+    RequestCapture(const RequestCapture&);
+    RequestCapture& operator=(const RequestCapture&);
+};
+
+#endif
@@ -0,0 +1,74 @@
+#ifndef REQUESTTIMING_HPP
+#define REQUESTTIMING_HPP
+
+#include <string>
+#include <stdint.h>
+
+// Where the time of one request went. Each boundary charges the time since
+// the previous one to a phase, so the phases add up to the total; CGI
+// spawn and run are carved out of the handler, upstream wait out of send.
+// Timestamps come from the monotonic clock, in microseconds.
+class RequestTiming {
+public:
+    enum Phase { HEADERS, DELAY, BODY, ROUTE, CGI_SPAWN, CGI_RUN, HANDLER, UPSTREAM, SEND, PHASE_COUNT };
+
+    std::string id;      // X-Request-Id, REQUEST_ID for CGI
+    std::string request; // "METHOD URI" for the access log
+    int status;          // 0 until a response exists
+    size_t bytes;        // response size as queued
+    std::string capture; // request half of a capture_requests entry, "" if not sampled
+
+    RequestTiming();
+
+    void begin(const std::string& request_id);
+    bool started() const { return _start != 0; }
+    uint64_t startUs() const { return _start; }
+    // Charges the time since the last boundary to `phase`
+    void mark(Phase phase);
+    // The first call ends HEADERS, later ones do nothing
+    void headersComplete();
+    uint64_t phase(Phase phase) const { return _phases[phase]; }
+    uint64_t total() const { return _last - _start; }
+    // "total=1.204 headers=0.031 ..." in milliseconds
+    std::string breakdown() const;
+
+    static uint64_t nowUs();
+    static const char* phaseName(Phase phase);
+    // 16 hex digits, unique within the process
+    static std::string newId();
+    // A client's X-Request-Id is kept when it is short and plain
+    static bool validId(const std::string& id);
+    // `response` with an X-Request-Id header after its status line
+    static std::string addHeader(const std::string& response, const std::string& id);
+    // The status code of an HTTP/1.1 response, 0 if it has none
+    static int statusOf(const std::string& response);
+
+private:
+    uint64_t _start;
+    uint64_t _last;
+    uint64_t _phases[PHASE_COUNT];
+    bool _headers_done;
+};
+
+// Per-phase totals, maxima and a log2 histogram over all finished
+// requests, for the stats line logged at exit.
+class TimingStats {
+public:
+    TimingStats();
+
+    void record(const RequestTiming& timing);
+    size_t requests() const { return _requests; }
+    std::string statsLine() const;
+
+private:
+    enum { BUCKETS = 32 }; // bucket i: under 2^i us
+
+    size_t _requests;
+    uint64_t _sum[RequestTiming::PHASE_COUNT + 1]; // the last one is the total
+    uint64_t _max[RequestTiming::PHASE_COUNT + 1];
+    size_t _histogram[RequestTiming::PHASE_COUNT + 1][BUCKETS];
+
+    uint64_t percentile(size_t column, double fraction) const;
+};
+
+#endif
@@ -0,0 +1,76 @@
+#ifndef RESPONSECACHE_HPP
+#define RESPONSECACHE_HPP
+
+#include <string>
+#include <map>
+#include <list>
+#include <ctime>
+
+// Micro-cache for complete dynamic (CGI) responses. Entries are fresh for
+// the lifetime the response itself declares (Cache-Control / Expires) or
+// the configured default, then may be served stale for a while longer so
+// one background refresh can replace them without clients waiting on a
+// fork. Bounded by total bytes (LRU).
+class ResponseCache {
+public:
+    enum Status { MISS, HIT, STALE };
+
+private:
+    struct Entry {
+        std::string response;
+        std::string uri;        // request path, for purge by prefix
+        time_t stored;
+        time_t expires;         // fresh until
+        time_t stale_until;     // may be served while refreshing until
+        bool refreshing;
+        std::list<std::string>::iterator lru_pos;
+    };
+
+    std::map<std::string, Entry> _entries;
+    std::list<std::string> _lru; // front = most recently used
+    size_t _max_bytes;
+    size_t _used_bytes;
+    size_t _hits;
+    size_t _stale_hits;
+    size_t _misses;
+
+    void evict(const std::string& key);
+    void trim();
+
+    ResponseCache(const ResponseCache&);
+    ResponseCache& operator=(const ResponseCache&);
+
+public:
+    ResponseCache(size_t max_bytes = 32 * 1024 * 1024);
+    ~ResponseCache();
+
+    // On HIT or STALE `response` is the stored response and `age` its age
+    // in seconds. A STALE entry stays usable; see beginRefresh().
+    Status lookup(const std::string& key, std::string& response, time_t& age);
+    // True for the one caller that should refresh a stale entry; false
+    // while another refresh of it is running.
+    bool beginRefresh(const std::string& key);
+    void endRefresh(const std::string& key);
+    // Stores a fresh response (ends any refresh of the key). Responses that
+    // forbid caching remove the entry; 5xx responses leave the previous one
+    // in place so it keeps being served stale. False if nothing was stored.
+    bool store(const std::string& key, const std::string& uri, const std::string& response,
+               long default_ttl, long default_stale);
+    // Drops entries whose request path starts with `prefix`.
+    size_t purge(const std::string& prefix);
+    void setMaxBytes(size_t max_bytes);
+    void clear();
+
+    // Lifetime and stale window the response allows; false if it must
+    // not be cached at all (status, Set-Cookie, no-store, private, ...).
+    static bool freshness(const std::string& response, long default_ttl, long default_stale,
+                          long& ttl, long& stale);
+    // Adds X-Cache-Status (and Age for cached copies) to the response head.
+    static std::string annotate(const std::string& response, const std::string& status, time_t age);
+
+    size_t usedBytes() const { return _used_bytes; }
+    size_t size() const { return _entries.size(); }
+    std::string statsLine() const;
+};
+
+#endif
@@ -0,0 +1,60 @@
+#ifndef RESUMABLEUPLOAD_HPP
+#define RESUMABLEUPLOAD_HPP
+
+#include <string>
+#include <sys/types.h>
+#include <ctime>
+
+// A file uploaded in any number of requests (upload_resumable), each one
+// appending at the offset the server has. The bytes received so far live
+// in <upload_path>/.partial/<id>, next to <id>.info with the announced
+// length and file name, so an upload outlives dropped connections and
+// server restarts until it has been idle for the configured timeout.
+// The data file is flock()ed while a request appends to it.
+class ResumableUpload {
+public:
+    enum OpenResult { OPEN_OK, OPEN_MISSING, OPEN_BUSY, OPEN_ERROR };
+
+    ~ResumableUpload();
+
+    // A new, empty upload of `length` bytes; NULL (error set) on failure
+    static ResumableUpload* create(const std::string& dir, const std::string& filename, off_t length,
+                                   std::string& error);
+    // An existing upload; uploads idle for longer than `timeout` seconds
+    // are removed and reported missing
+    static ResumableUpload* open(const std::string& dir, const std::string& id, long timeout, OpenResult& result);
+    // Removes the uploads of `dir` idle for longer than `timeout` seconds
+    static size_t expire(const std::string& dir, long timeout);
+
+    const std::string& id() const { return _id; }
+    off_t offset() const { return _offset; }
+    off_t length() const { return _length; }
+    time_t expires(long timeout) const { return _modified + timeout; }
+    bool complete() const { return _offset == _length; }
+    int writeError() const { return _write_error; } // errno of a failed append
+
+    bool append(const char* data, size_t length);
+    // Moves the complete file into the upload directory under a name no
+    // other file has (rename(2), so it appears whole or not at all)
+    bool finish(std::string& saved_as);
+    bool cancel();
+
+private:
+    std::string _dir;      // upload_path
+    std::string _id;
+    int _fd;               // data file, opened O_APPEND and locked
+    off_t _offset;
+    off_t _length;
+    std::string _filename; // already sanitized
+    time_t _modified;
+    int _write_error;
+
+    ResumableUpload(const std::string& dir, const std::string& id, int fd);
+    std::string dataPath() const;
+    std::string infoPath() const;
+
+    ResumableUpload(const ResumableUpload&);
+    ResumableUpload& operator=(const ResumableUpload&);
+};
+
+#endif
@@ -0,0 +1,29 @@
+#ifndef SCAN_HPP
+#define SCAN_HPP
+
+#include <cstddef>
+
+// Byte-scanning kernels for request framing. On x86-64 they run 16 bytes
+// at a time with SSE2 (32 with AVX2 where the CPU has it, picked at
+// startup); elsewhere portable loops do the same work.
+namespace Scan {
+    const size_t npos = static_cast<size_t>(-1);
+
+    // Offset just past the first blank line ("\r\n\r\n" or "\n\n"), npos
+    // if there is none yet. Scanning starts at `from`, typically the length
+    // already scanned: a terminator straddling it is still found.
+    size_t headerEnd(const char* data, size_t length, size_t from = 0);
+    // Non-empty and only RFC 9110 tchar: methods, header names
+    bool isToken(const char* data, size_t length);
+    // ASCII case-insensitive comparison of `length` bytes
+    bool equalsIgnoreCase(const char* a, const char* b, size_t length);
+    // Kernel headerEnd() runs with: "avx2", "sse2" or "portable"
+    const char* kernel();
+
+    // The fallbacks, also measured against the vector kernels by microbench
+    size_t headerEndPortable(const char* data, size_t length, size_t from = 0);
+    bool isTokenPortable(const char* data, size_t length);
+    bool equalsIgnoreCasePortable(const char* a, const char* b, size_t length);
+}
+
+#endif
@@ -0,0 +1,105 @@
+#ifndef STATICBUNDLE_HPP
+#define STATICBUNDLE_HPP
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include "MappedFileCache.hpp"
+
+// On-disk layout of a bundle (mkbundle), native byte order, every offset
+// from the start of the file:
+//
+//   BundleHeader
+//   uint32_t buckets[bucket_count]   entry index + 1, 0 = empty slot
+//   BundleEntry entries[entry_count]
+//   paths, content types, header blocks and bodies
+//
+// Buckets are an open-addressing table (linear probing) over the FNV-1a
+// hash of the path, at most half full.
+struct BundleHeader {
+    char magic[8];          // BUNDLE_MAGIC
+    uint32_t entry_count;
+    uint32_t bucket_count;  // power of two
+    uint64_t size;          // whole archive, checked against the file
+};
+
+// One representation of a file. The header block holds the lines a 200
+// carries for it, "Content-Type" and "Content-Length" first and the
+// validators (Vary, Content-Encoding, Last-Modified, ETag, Accept-Ranges)
+// from validators_offset on, which is what a 304 repeats.
+struct BundleVariant {
+    uint64_t body_offset;
+    uint64_t body_length;
+    uint64_t head_offset;
+    uint64_t etag_offset;
+    uint32_t head_length;
+    uint32_t validators_offset; // within the header block
+    uint32_t etag_length;
+    uint32_t reserved;
+};
+
+struct BundleEntry {
+    uint64_t hash;
+    uint64_t path_offset;   // "/css/site.css", relative to the packed root
+    uint64_t type_offset;
+    int64_t mtime;
+    uint32_t path_length;
+    uint32_t type_length;
+    BundleVariant identity;
+    BundleVariant gzip;     // body_length 0: no gzip variant
+};
+
+#define BUNDLE_MAGIC "WSBNDL01"
+
+// A bundle mapped once and served from: lookups touch only the mapping,
+// and responses hold a reference to it through the MappedFile, so a
+// bundle replaced on reload stays mapped until its last byte is sent.
+class StaticBundle {
+private:
+    std::string _path;
+    std::string _signature;
+    MappedFile* _file;
+    const BundleHeader* _header;
+    const uint32_t* _buckets;
+    const BundleEntry* _entries;
+    size_t _hits;
+    size_t _misses;
+
+    StaticBundle();
+    bool validate(std::string& error);
+
+    StaticBundle(const StaticBundle&);
+    StaticBundle& operator=(const StaticBundle&);
+
+public:
+    ~StaticBundle();
+
+    // Maps `path` and checks its layout; NULL with `error` set otherwise.
+    static StaticBundle* load(const std::string& path, std::string& error);
+    // Device, inode, size and mtime of `path`: an unchanged archive is
+    // kept mapped across reloads. Empty if it cannot be stat'ed.
+    static std::string signature(const std::string& path);
+    // Packs the regular files under `root` into `output` (written aside and
+    // renamed over it). Compressible types also get a gzip variant when
+    // that is smaller; `gzip_types` empty means the built-in list.
+    static bool build(const std::string& root, const std::string& output, bool gzip,
+                      const std::vector<std::string>& gzip_types, size_t& files, std::string& error);
+    static uint64_t hash(const char* data, size_t length);
+
+    const BundleEntry* find(const std::string& path);
+    const char* data(uint64_t offset) const { return _file->addr + offset; }
+    std::string slice(uint64_t offset, size_t length) const {
+        return std::string(_file->addr + offset, length);
+    }
+    // The archive's mapping, retained for an OutputQueue segment.
+    MappedFile* acquire() { _file->retain(); return _file; }
+
+    const std::string& path() const { return _path; }
+    const std::string& signature() const { return _signature; }
+    size_t entryCount() const { return _header->entry_count; }
+    size_t hits() const { return _hits; }
+    size_t misses() const { return _misses; }
+    std::string statsLine() const;
+};
+
+#endif
@@ -0,0 +1,89 @@
+#ifndef TLS_HPP
+#define TLS_HPP
+
+#include <string>
+#include <sys/types.h>
+#include <openssl/ssl.h>
+#include "Config.hpp"
+
+// Certificate, key and resumption state of one `listen ... ssl` address.
+// Kept across reloads while its settings do not change, so session-cache
+// entries and ticket keys stay valid; SSL objects hold their own reference
+// to the SSL_CTX, so connections outlive a context that was replaced.
+class TlsContext {
+private:
+    SSL_CTX* _ctx;
+    std::string _signature;
+
+    static int selectProtocol(SSL* ssl, const unsigned char** out, unsigned char* out_length,
+                              const unsigned char* in, unsigned int in_length, void* arg);
+
+    TlsContext(const TlsContext&);
+    TlsContext& operator=(const TlsContext&);
+
+public:
+    TlsContext();
+    ~TlsContext();
+
+    // Loads the certificate chain and key and applies the session and
+    // kTLS settings of `server`; false (with the reason logged) on error.
+    bool configure(const ServerConfig& server);
+    // New server-side session on an accepted socket, or NULL.
+    SSL* accept(int fd);
+
+    // The settings the context was built from
+    static std::string signature(const ServerConfig& server);
+    const std::string& signature() const { return _signature; }
+};
+
+// One TLS client connection. read() and write() behave like recv() and
+// send() on a non-blocking socket: -1 with errno EAGAIN when OpenSSL needs
+// the socket to become readable/writable first.
+class TlsConnection {
+private:
+    SSL* _ssl;
+    bool _established;
+    bool _failed;       // fatal error: no close_notify may follow
+    bool _wants_write;  // last call is waiting for POLLOUT, not POLLIN
+    bool _kernel_send;  // kTLS encrypts on the socket: plain send()/sendfile() work
+
+    ssize_t result(int ret);
+
+    TlsConnection(const TlsConnection&);
+    TlsConnection& operator=(const TlsConnection&);
+
+public:
+    explicit TlsConnection(SSL* ssl);
+    ~TlsConnection();
+
+    // One step of the server handshake: 1 done, 0 in progress (see
+    // wantsWrite()), -1 failed.
+    int handshake();
+    ssize_t read(char* buffer, size_t length);
+    ssize_t write(const char* data, size_t length);
+    // Decrypted bytes OpenSSL holds that poll() cannot report
+    size_t pending() const;
+    // Sends close_notify if the socket takes it right away
+    void shutdown();
+
+    bool established() const { return _established; }
+    bool wantsWrite() const { return _wants_write; }
+    bool kernelSend() const { return _kernel_send; }
+    bool resumed() const;
+    std::string protocol() const; // ALPN result, "" if none was negotiated
+    std::string description() const; // protocol and cipher
+    static std::string lastError();
+};
+
+// Handshake counters, logged at shutdown
+struct TlsStats {
+    size_t handshakes;
+    size_t resumed;
+    size_t kernel_send;
+    size_t failed;
+
+    TlsStats() : handshakes(0), resumed(0), kernel_send(0), failed(0) {}
+    std::string statsLine() const;
+};
+
+#endif
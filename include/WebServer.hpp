@@ -24,48 +24,305 @@ struct ServerConfig;
 #include "Config.hpp"
 #include "utils.hpp"
 #include "CgiHandler.hpp"
+#include "Compression.hpp"
+#include "OutputQueue.hpp"
+#include "MappedFileCache.hpp"
+#include "StaticBundle.hpp"
+#include "DirectoryListing.hpp"
+#include "OpenFileCache.hpp"
+#include "Proxy.hpp"
+#include "ResponseCache.hpp"
+#include "RateLimiter.hpp"
+#include "Tls.hpp"
+#include "Http2.hpp"
+#include "EventBackend.hpp"
+#include "Multipart.hpp"
+#include "ResumableUpload.hpp"
+#include "RequestTiming.hpp"
+#include "RequestCapture.hpp"
+#include "MemoryBudget.hpp"
+#include "Scan.hpp"
+#include <set>
+#include <deque>
 
 class Config;
 class HttpRequest;
 class CgiHandler;
 
 class WebServer {
+	friend class MicroBench;
+
 	private:
     std::vector<struct pollfd> _poll_fds;
+    EventBackend* _events;    // fills _poll_fds revents (event_backend)
     std::vector<int> _server_sockets;
     std::map<int, std::string> _client_buffers;
-    Config* _config;
+    std::map<int, OutputQueue*> _client_outputs;
+    OutputQueue _response_body; // body segments queued by the current handler, behind its head
+    bool _head_only;            // HEAD: handlers may skip producing the body
+    Config* _config;          // current snapshot, used by new connections
+    Config* _request_config;  // snapshot of the request being handled
+    std::string _config_file;
+    std::map<int, Config*> _client_configs;  // snapshot each connection started on
+    std::map<Config*, size_t> _config_users; // live connections per snapshot
+    std::map<std::string, int> _listen_fds;  // "host:port" -> listening socket
     CgiHandler* _cgi_handler;
+    CompressedCache _gzip_cache;
+    MappedFileCache _mapped_files;
+    std::map<std::string, StaticBundle*> _bundles; // archive path -> mapping (bundle)
+    DirectoryListingCache _listings;
+    OpenFileCache _open_files;
+    UpstreamManager _upstreams;
+    std::map<int, ProxySession*> _proxy_clients;   // client fd -> session
+    std::map<int, ProxySession*> _proxy_upstreams; // upstream fd -> session
+    std::map<int, std::string> _client_addrs;
+    const LocationConfig* _proxy_location; // set by generateResponse for proxy_pass
+    ResponseCache _cgi_cache;
+
+    // A script running through the poll loop: answering an HTTP/1.1
+    // client or an HTTP/2 stream, or the background refresh of a stale
+    // cgi_cache entry
+    struct CgiJob {
+        int client_fd;       // -1 for a refresh
+        uint32_t stream_id;  // HTTP/2 stream of client_fd's session, 0 for HTTP/1.1
+        RequestTiming timing; // the stream's, logged once it is answered
+        int input_fd;        // script stdin while the request body is written, or -1
+        std::string input;
+        size_t input_sent;
+        int output_fd;       // script stdout, -1 once it reached EOF
+        std::string output;
+        int exit_fd;         // pidfd polled after EOF until the script exits, or -1
+        std::string slot;    // location path counted by cgi_max_concurrent
+        uint64_t deadline;   // RateLimit::nowMs() past cgi_timeout, 0 = none
+        bool head;
+        std::string key;     // cgi_cache entry to store the response in, or ""
+        std::string uri;
+        long valid;
+        long stale;
+    };
+    std::map<pid_t, CgiJob> _cgi_jobs;
+    std::map<int, pid_t> _cgi_inputs;   // script stdin -> job
+    std::map<int, pid_t> _cgi_outputs;  // script stdout -> job
+    std::map<int, pid_t> _cgi_exits;    // pidfd -> job
+    std::map<int, pid_t> _cgi_clients;  // client -> its job, 0 while queued for a slot
+    std::map<std::pair<int, uint32_t>, pid_t> _cgi_streams; // HTTP/2 session and stream -> its job
+    struct CgiQueue {
+        size_t max_running;      // cgi_max_concurrent when the last client was queued
+        std::deque<int> clients; // oldest first
+    };
+    std::map<std::string, size_t> _cgi_running;   // slot -> scripts running
+    std::map<std::string, CgiQueue> _cgi_waiting; // slot -> clients waiting for it
+    int _cgi_client;    // client whose request is generated
+    uint32_t _cgi_stream; // its HTTP/2 stream, 0 for HTTP/1.1
+    bool _cgi_started;  // the handler left the request to a CGI job (or its queue)
+    CgiStats _cgi_stats;
+
+    // limit_req / limit_conn
+    std::map<std::string, LimitZone*> _limit_zones;
+    std::map<int, uint32_t> _client_ips;       // IPv4, network order
+    std::set<int> _limits_checked;             // request already admitted
+    std::map<int, uint64_t> _delayed_clients;  // limit_req delay: resume time (ms)
+    std::map<int, std::string> _conn_limits;   // limit_conn zone holding a slot
+
+    // TLS termination (listen ... ssl)
+    std::map<std::string, TlsContext*> _tls_contexts; // "host:port" -> context
+    std::map<int, TlsContext*> _tls_listeners;        // listening socket -> context
+    std::map<int, TlsConnection*> _tls_clients;
+    TlsStats _tls_stats;
+
+    // HTTP/2 connections (prior knowledge, h2c upgrade or ALPN h2); their
+    // frames are written from the session, not from _client_outputs
+    std::map<int, Http2Session*> _h2_sessions;
+
+    // Uploads written to disk while their body arrives
+    struct PendingUpload {
+        UploadWriter* writer;       // POST /upload...
+        ResumableUpload* resumable; // or PUT/PATCH appending to an upload
+        const LocationConfig* location;
+        size_t remaining; // body bytes still to come
+        bool json;        // the client asked for a JSON report
+    };
+    std::map<int, PendingUpload> _uploads;
+    std::map<int, size_t> _header_scans; // bytes of an incomplete head already searched
+
+    // Binary upgrade (SIGUSR2) and graceful shutdown (SIGQUIT)
+    std::string _executable;                   // argv[0], run again on upgrade
+    std::map<std::string, int> _inherited_fds; // listeners handed over by the old binary
+    int _upgrade_fd;           // ready pipe of a new binary still starting, -1 = none
+    pid_t _upgrade_pid;
+    uint64_t _upgrade_deadline; // RateLimit::nowMs() by which it must be ready
+    bool _draining;            // not accepting, exits once the clients are done
+    time_t _drain_deadline;    // shutdown_timeout
+    time_t _drain_idle_close;  // connections still without a request go then
+    time_t _next_upload_sweep; // expiry of idle resumable uploads, 0 = none configured
+
+    // Request ids and phase timings (access_log, stats at exit)
+    std::map<int, RequestTiming> _timings; // HTTP/1.1 request of each connection
+    RequestTiming* _timing;                // request being generated, for CGI
+    TimingStats _timing_stats;
+    int _access_log_fd;                    // -1 = off
+    RequestCapture _capture;               // capture_requests
+
+    // Buffer accounting (memory_budget): connections whose reads are held
+    // back while the budget is exceeded
+    MemoryBudget _memory;
+    std::set<int> _paused_reads;
     
     int createServerSocket(const std::string& host, int port);
+    bool syncListeners(const std::vector<ServerConfig>& servers);
+    bool loadTlsContexts(const std::vector<ServerConfig>& servers, std::map<std::string, TlsContext*>& contexts);
+    void installTlsContexts(std::map<std::string, TlsContext*>& contexts);
+    void discardTlsContexts(std::map<std::string, TlsContext*>& contexts);
+    bool loadBundles(const std::vector<ServerConfig>& servers, std::map<std::string, StaticBundle*>& bundles);
+    void installBundles(std::map<std::string, StaticBundle*>& bundles);
+    void discardBundles(std::map<std::string, StaticBundle*>& bundles);
+    void applyCacheSettings();
+    void applyEventBackend();
+    void openRequestLogs();
+    void identifyRequest(RequestTiming& timing, const HttpRequest& request, size_t body_bytes);
+    void logRequest(const RequestTiming& timing, int client_fd);
+    void reloadConfig();
+    void adoptInheritedListeners();
+    void notifyUpgradeParent();
+    void upgradeBinary();
+    void finishUpgrade(bool started);
+    void checkUpgrade();
+    void startDraining(const std::string& reason);
+    bool drainFinished();
+    void releaseClientConfig(int client_fd);
     void handleNewConnection(int server_fd);
     void handleClientData(int client_fd, int poll_index);
-    void sendResponse(int client_fd, const std::string& response);
+    bool continueHandshake(int client_fd, int poll_index);
+    ssize_t readClient(int client_fd);
+    void processClientBuffer(int client_fd, int poll_index);
+    size_t findHeaderEnd(int client_fd, const std::string& buffer);
+    int headerSizeStatus(int client_fd, const std::string& buffer, size_t header_end_pos);
+    void trackMemory(int client_fd);
+    bool betweenRequests(int client_fd);
+    void applyBackpressure();
+    int pollTimeout();
+    void applyLimitZones();
+    enum LimitResult { LIMIT_PASS, LIMIT_DELAY, LIMIT_REJECT };
+    LimitResult checkLimits(int client_fd, const std::string& request_line, int& status_code, uint64_t& delay_ms);
+    void resumeDelayedClients();
+    void releaseConnLimit(int client_fd);
+    void sendResponse(int client_fd, size_t poll_index, const std::string& response);
+    enum UploadKind { UPLOAD_NONE, UPLOAD_FORM, UPLOAD_APPEND };
+    UploadKind uploadKind(const HttpRequest& request, const LocationConfig*& location);
+    bool startUpload(int client_fd, int poll_index, size_t header_end_pos, size_t content_length);
+    void continueUpload(int client_fd, int poll_index, PendingUpload& upload);
+
+    // HTTP/2: streams are answered by the same handlers through an
+    // HTTP/1.1 rendering of each request
+    bool http2Enabled(int client_fd);
+    Http2Session* startHttp2(int client_fd);
+    bool upgradeHttp2(int client_fd, const HttpRequest& request);
+    void handleHttp2(int client_fd, size_t poll_index, short revents);
+    void receiveHttp2(int client_fd, Http2Session* session);
+    bool serveHttp2Stream(int client_fd, Http2Session* session, uint32_t stream_id, const HttpRequest& request,
+                          RequestTiming& timing);
+    void respondHttp2(Http2Session* session, uint32_t stream_id, std::string response, bool head,
+                      RequestTiming& timing);
+    void flushHttp2(int client_fd, size_t poll_index);
+    void handleClientWrite(int client_fd, size_t poll_index);
+    void closeClient(int client_fd, size_t poll_index);
     std::string generateResponse(const HttpRequest& request);
+
+    // Reverse proxy (proxy_pass), driven by the same poll loop
+    void startProxy(int client_fd, const HttpRequest& request, const std::string& raw_head, const std::string& body);
+    bool connectUpstream(ProxySession* session);
+    void handleUpstreamEvent(int upstream_fd, short revents);
+    void readUpstream(ProxySession* session);
+    void deliverUpstream(ProxySession* session, const char* data, size_t length);
+    void detachUpstream(ProxySession* session, bool reusable);
+    void upstreamFailed(ProxySession* session, bool timed_out);
+    void finishProxy(ProxySession* session, bool reusable);
+    void respondProxyError(ProxySession* session, int status_code, const std::string& status_text);
+    void flushProxyClient(ProxySession* session);
+    void checkProxyTimeouts();
+    // The poll set only changes through these, which tell the event backend
+    size_t pollIndex(int fd) const;
+    void setPollEvents(int fd, short events);
+    void setPollEventsAt(size_t poll_index, short events);
+    void addPollFd(int fd, short events);
+    void removePollFd(int fd);
     std::string generateErrorResponse(int statusCode, const std::string& statusMessage); // new
     std::string intToString(int value); // new
     std::string getStatusMessage(int code);
     std::string toString(size_t value);
     size_t getContentLength(const std::string& headers);
 
+    // CGI micro-cache
+    std::string serveCgi(const HttpRequest& request, const LocationConfig* location);
+    std::string cgiCacheKey(const HttpRequest& request, const LocationConfig* location);
+    std::string runCgi(const HttpRequest& request, const LocationConfig* location, const std::string& cache_key);
+    CgiLimits cgiLimits(const LocationConfig& location) const;
+    CgiJob& addCgiJob(pid_t pid, int output_fd, const std::string& slot, const CgiLimits& limits);
+    void startCgiRefresh(const std::string& key, const HttpRequest& request, const LocationConfig* location);
+    void handleCgiInput(int input_fd);
+    void handleCgiOutput(int output_fd);
+    void handleCgiExit(int exit_fd);
+    void checkCgiJobs();
+    void finishCgiJob(pid_t pid, CgiUsage& usage);
+    void admitQueuedCgi();
+    void releaseCgiClient(int client_fd);
+    void releaseCgiStreams(int client_fd);
+
     // File operations
     std::string getContentType(const std::string& file_path);
     std::string getFilePath(const std::string& uri, const LocationConfig* location = NULL);
     bool fileExists(const std::string& path);
     bool isDirectory(const std::string& path);
     std::string readFile(const std::string& file_path);
+    std::string serveFile(const HttpRequest& request, const std::string& file_path, const LocationConfig* location);
+    const BundleEntry* findBundled(const std::string& uri, const LocationConfig* location, StaticBundle*& bundle);
+    std::string serveBundled(const HttpRequest& request, StaticBundle& bundle, const BundleEntry& entry,
+                             const LocationConfig* location);
+
+    // Conditional GET / caching
+    std::string makeETag(const struct stat& st, const std::string& encoding);
+    bool isNotModified(const HttpRequest& request, const std::string& etag, time_t mtime);
+    std::string getCacheHeaders(const LocationConfig* location);
+    std::string generateNotModifiedResponse(const std::string& headers);
+
+    // Byte ranges (206 / multipart/byteranges / 416)
+    typedef std::pair<off_t, off_t> ByteRange; // inclusive first, last
+    enum RangeResult { RANGE_NONE, RANGE_OK, RANGE_UNSATISFIABLE };
+    enum { MAX_RANGES = 16 };
+    RangeResult parseRangeHeader(const std::string& header, off_t size, std::vector<ByteRange>& ranges);
+    bool ifRangeMatches(const HttpRequest& request, const std::string& etag, time_t mtime);
+    std::string serveRanges(int fd, const std::vector<ByteRange>& ranges, off_t size,
+                            const std::string& content_type, const std::string& headers,
+                            MappedFile* mapping = NULL, off_t mapping_offset = 0);
+    void pushRange(int fd, MappedFile* mapping, off_t offset, off_t length);
+    std::string generateHeaders(int status_code, const std::string& status_text, const std::string& content_type,
+                                off_t content_length, const std::string& extra_headers = "");
 
     // HTTP method handlers
     std::string handleGetRequest(const HttpRequest& request, const LocationConfig* location = NULL);
     std::string handleHeadRequest(const HttpRequest& request, const LocationConfig* location = NULL);
     std::string handlePostRequest(const HttpRequest& request, const LocationConfig* location = NULL);
     std::string handleDeleteRequest(const HttpRequest& request, const LocationConfig* location = NULL);
-    std::string handleDirectoryRequest(const std::string& dir_path, const std::string& uri, const LocationConfig* location = NULL);
-    std::string generateDirectoryListing(const std::string& dir_path, const std::string& uri);
-    std::string generateSuccessResponse(const std::string& content, const std::string& content_type);
+    std::string handleDirectoryRequest(const HttpRequest& request, const std::string& dir_path, const std::string& uri, const LocationConfig* location = NULL);
+    std::string generateDirectoryListing(const HttpRequest& request, const std::string& dir_path, const std::string& uri, const LocationConfig* location);
+    std::string generateSuccessResponse(const std::string& content, const std::string& content_type, const std::string& extra_headers = "");
 
     // POST request handlers
-    std::string handleFileUpload(const HttpRequest& request);
+    std::string handleFileUpload(const HttpRequest& request, const LocationConfig* location);
+    std::string finishUpload(UploadWriter& upload, const LocationConfig* location, bool json);
+    std::string uploadDir(const LocationConfig* location);
+    std::string uploadUrl(const LocationConfig* location, const std::string& saved_as);
+
+    // Resumable uploads (upload_resumable)
+    std::string resumableBase(const LocationConfig* location);
+    std::string resumableId(const HttpRequest& request, const LocationConfig* location);
+    bool isResumableRequest(const HttpRequest& request, const LocationConfig* location);
+    std::string handleResumableUpload(const HttpRequest& request, const LocationConfig* location);
+    ResumableUpload* openResumableAppend(const HttpRequest& request, const LocationConfig* location,
+                                         size_t content_length, std::string& response);
+    std::string finishResumableAppend(ResumableUpload& upload, const LocationConfig* location);
+    std::string resumableHeaders(const ResumableUpload& upload, const LocationConfig* location);
+    void expireResumableUploads();
     std::string handleFormSubmission(const HttpRequest& request);
     std::string handlePostEcho(const HttpRequest& request);
 
@@ -74,6 +331,8 @@ public:
     WebServer();
     ~WebServer();
     
+    // The program SIGUSR2 starts on the listening sockets (argv[0])
+    void setExecutable(const std::string& path);
     bool initialize(const std::string& config_file);
     void run();
     void cleanup();
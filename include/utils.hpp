@@ -43,3 +43,10 @@ void log_error(const std::string &message);
 // string utils
 std::string int_to_string(int value);
 std::string size_t_to_string(size_t value);
+
+// HTTP dates (IMF-fixdate, always GMT)
+std::string http_date(time_t t);
+bool parse_http_date(const std::string &str, time_t &out);
+
+// Content-Type for a file name, by extension
+std::string mime_type(const std::string &path);
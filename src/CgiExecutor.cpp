@@ -1,11 +1,111 @@
 #include "../include/CgiExecutor.hpp"
 #include <unistd.h>
 #include <sys/wait.h>
+#include <sys/syscall.h>
+#include <poll.h>
+#include <signal.h>
 #include <iostream>
 #include <sstream>
+#include <iomanip>
 #include <fcntl.h>
+#include <cerrno>
+#include <cstring>
+#include <ctime>
 #include <cstdlib>  // Add this for exit()
 
+CgiUsage::CgiUsage() : status(-1), timed_out(false) {
+    std::memset(&rusage, 0, sizeof(rusage));
+}
+
+namespace {
+
+uint64_t microseconds(const struct timeval& tv) {
+    return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+std::string seconds(uint64_t us) {
+    std::ostringstream oss;
+    oss << std::fixed << std::setprecision(3) << us / 1000000.0 << "s";
+    return oss.str();
+}
+
+// Milliseconds left until `deadline` for poll(), -1 without one
+int remainingMs(time_t deadline) {
+    if (!deadline) {
+        return -1;
+    }
+    time_t now = time(NULL);
+    return now >= deadline ? 0 : (int)(deadline - now) * 1000;
+}
+
+// In the child, before exec: the caps apply to the script and whatever it
+// runs. The CPU hard limit sits a second above the soft one, so SIGXCPU
+// comes first and SIGKILL only if the script ignores it.
+void applyLimits(const CgiLimits& limits) {
+    struct rlimit limit;
+    if (limits.cpu > 0) {
+        limit.rlim_cur = limits.cpu;
+        limit.rlim_max = limits.cpu + 1;
+        setrlimit(RLIMIT_CPU, &limit);
+    }
+    if (limits.memory > 0) {
+        limit.rlim_cur = limit.rlim_max = limits.memory;
+        setrlimit(RLIMIT_AS, &limit);
+    }
+    if (limits.files > 0) {
+        limit.rlim_cur = limit.rlim_max = limits.files;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+}
+
+}
+
+CgiStats::CgiStats() : _runs(0), _failed(0), _timed_out(0), _queued(0), _rejected(0),
+                       _user_us(0), _system_us(0), _max_cpu_us(0), _max_rss_kb(0) {
+}
+
+void CgiStats::record(const CgiUsage& usage) {
+    ++_runs;
+    if (usage.timed_out) {
+        ++_timed_out;
+    } else if (!WIFEXITED(usage.status) || WEXITSTATUS(usage.status) != 0) {
+        ++_failed;
+    }
+    uint64_t user = microseconds(usage.rusage.ru_utime);
+    uint64_t system = microseconds(usage.rusage.ru_stime);
+    _user_us += user;
+    _system_us += system;
+    if (user + system > _max_cpu_us) {
+        _max_cpu_us = user + system;
+    }
+    if (usage.rusage.ru_maxrss > _max_rss_kb) {
+        _max_rss_kb = usage.rusage.ru_maxrss;
+    }
+}
+
+std::string CgiStats::statsLine() const {
+    std::ostringstream oss;
+    oss << _runs << " runs (" << _failed << " failed, " << _timed_out << " timed out), "
+        << _queued << " queued, " << _rejected << " rejected, cpu " << seconds(_user_us) << " user "
+        << seconds(_system_us) << " system, one script at most " << seconds(_max_cpu_us)
+        << " cpu and " << _max_rss_kb << "KB rss";
+    return oss.str();
+}
+
+std::string CgiStats::describe(const CgiUsage& usage) {
+    std::ostringstream oss;
+    oss << "cpu=" << seconds(microseconds(usage.rusage.ru_utime) + microseconds(usage.rusage.ru_stime))
+        << " rss=" << usage.rusage.ru_maxrss << "KB";
+    if (usage.timed_out) {
+        oss << " timed out";
+    } else if (WIFSIGNALED(usage.status)) {
+        oss << " signal=" << WTERMSIG(usage.status);
+    } else if (WIFEXITED(usage.status)) {
+        oss << " exit=" << WEXITSTATUS(usage.status);
+    }
+    return oss.str();
+}
+
 CgiExecutor::CgiExecutor() {
 }
 
@@ -38,19 +138,87 @@ std::string CgiExecutor::generateErrorResponse(int status_code, const std::strin
 
 std::string CgiExecutor::execute(const std::string& script_path, 
                                 const HttpRequest& request,
-                                const std::map<std::string, std::string>& interpreters) const {
+                                const std::map<std::string, std::string>& interpreters,
+                                const CgiLimits& limits,
+                                CgiUsage& usage,
+                                RequestTiming* timing) const {
+    int output_fd;
+    pid_t pid = start(script_path, request, interpreters, limits, output_fd, timing ? timing->id : "");
+    if (timing) {
+        timing->mark(RequestTiming::CGI_SPAWN);
+    }
+    if (pid == -1) {
+        return generateErrorResponse(500, "Internal Server Error - CGI Start Failed");
+    }
+    
+    // Read script output until it closes it or runs out of time
+    std::string output;
+    time_t deadline = limits.timeout > 0 ? time(NULL) + limits.timeout : 0;
+    bool complete = readOutput(output_fd, deadline, output);
+    close(output_fd);
+    if (!complete) {
+        killGroup(pid);
+    }
+    
+    // Wait for child process
+    reap(pid, true, usage);
+    usage.timed_out = !complete;
+    if (timing) {
+        timing->mark(RequestTiming::CGI_RUN);
+    }
+    
+    return finish(output, usage);
+}
+
+void CgiExecutor::killGroup(pid_t pid) {
+    if (kill(-pid, SIGKILL) == -1) {
+        kill(pid, SIGKILL);
+    }
+}
+
+bool CgiExecutor::reap(pid_t pid, bool block, CgiUsage& usage) {
+    pid_t result;
+    do {
+        result = wait4(pid, &usage.status, block ? 0 : WNOHANG, &usage.rusage);
+    } while (result == -1 && errno == EINTR);
+    if (result == -1) {
+        usage.status = -1; // not ours to wait for: counts as a failure
+    }
+    return result != 0;
+}
+
+int CgiExecutor::exitFd(pid_t pid) {
+#ifdef SYS_pidfd_open
+    int fd = syscall(SYS_pidfd_open, pid, 0);
+    if (fd != -1) {
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+    }
+    return fd;
+#else
+    (void)pid;
+    return -1;
+#endif
+}
+
+pid_t CgiExecutor::start(const std::string& script_path, 
+                         const HttpRequest& request,
+                         const std::map<std::string, std::string>& interpreters,
+                         const CgiLimits& limits,
+                         int& output_fd,
+                         const std::string& request_id,
+                         int* input_fd) const {
     
     int pipe_stdout[2];
     int pipe_stdin[2];
     
     if (pipe(pipe_stdout) == -1) {
-        return generateErrorResponse(500, "Internal Server Error - Pipe Creation Failed");
+        return -1;
     }
     
     if (pipe(pipe_stdin) == -1) {
         close(pipe_stdout[0]);
         close(pipe_stdout[1]);
-        return generateErrorResponse(500, "Internal Server Error - Stdin Pipe Creation Failed");
+        return -1;
     }
     
     pid_t pid = fork();
@@ -59,11 +227,13 @@ std::string CgiExecutor::execute(const std::string& script_path,
         close(pipe_stdout[1]);
         close(pipe_stdin[0]);
         close(pipe_stdin[1]);
-        return generateErrorResponse(500, "Internal Server Error - Fork Failed");
+        return -1;
     }
     
     if (pid == 0) {
-        // Child process
+        // Child process, leading a process group a timeout can kill whole
+        setpgid(0, 0);
+        applyLimits(limits);
         close(pipe_stdout[0]); // Close read end of stdout pipe
         close(pipe_stdin[1]);  // Close write end of stdin pipe
         
@@ -76,7 +246,7 @@ std::string CgiExecutor::execute(const std::string& script_path,
         close(pipe_stdin[0]);
         
         // Setup environment variables
-        std::vector<std::string> env_vars = setupEnvironment(request, script_path);
+        std::vector<std::string> env_vars = setupEnvironment(request, script_path, request_id);
         
         // Convert to char* array
         std::vector<char*> env_ptrs;
@@ -97,26 +267,33 @@ std::string CgiExecutor::execute(const std::string& script_path,
         exit(1);
     }
     
-    // Parent process (moved outside the if/else to fix control flow)
+    // Parent process; also sets the group, so it exists whichever runs first
+    setpgid(pid, pid);
     close(pipe_stdout[1]); // Close write end of stdout pipe
     close(pipe_stdin[0]);  // Close read end of stdin pipe
     
     // Write POST data to script's stdin if needed
-    if (request.getMethod() == POST && !request.getBody().empty()) {
-        const std::string& body = request.getBody();
-        write(pipe_stdin[1], body.c_str(), body.length());
+    bool has_body = request.getMethod() == POST && !request.getBody().empty();
+    if (input_fd) {
+        *input_fd = has_body ? pipe_stdin[1] : -1;
+        if (has_body) {
+            output_fd = pipe_stdout[0];
+            return pid;
+        }
+    } else if (has_body) {
+        writeBody(pipe_stdin[1], request.getBody(), limits.timeout);
     }
     close(pipe_stdin[1]); // Close stdin pipe
     
-    // Read script output
-    std::string output = readFromPipe(pipe_stdout[0]);
-    close(pipe_stdout[0]);
-    
-    // Wait for child process
-    int status;
-    waitpid(pid, &status, 0);
-    
-    if (WEXITSTATUS(status) != 0) {
+    output_fd = pipe_stdout[0];
+    return pid;
+}
+
+std::string CgiExecutor::finish(const std::string& output, const CgiUsage& usage) const {
+    if (usage.timed_out) {
+        return generateErrorResponse(504, "Gateway Timeout");
+    }
+    if (!WIFEXITED(usage.status) || WEXITSTATUS(usage.status) != 0) {
         return generateErrorResponse(500, "CGI Script Execution Error");
     }
     
@@ -124,7 +301,8 @@ std::string CgiExecutor::execute(const std::string& script_path,
     return parseCgiOutput(output);
 }
 
-std::vector<std::string> CgiExecutor::setupEnvironment(const HttpRequest& request, const std::string& script_path) const {
+std::vector<std::string> CgiExecutor::setupEnvironment(const HttpRequest& request, const std::string& script_path,
+                                                       const std::string& request_id) const {
     std::vector<std::string> env_vars;
     
     env_vars.push_back("REQUEST_METHOD=" + request.methodToString());
@@ -135,6 +313,9 @@ std::vector<std::string> CgiExecutor::setupEnvironment(const HttpRequest& reques
     env_vars.push_back("SERVER_SOFTWARE=Webserv/1.0");
     env_vars.push_back("GATEWAY_INTERFACE=CGI/1.1");
     env_vars.push_back("REDIRECT_STATUS=200");
+    if (!request_id.empty()) {
+        env_vars.push_back("REQUEST_ID=" + request_id);
+    }
     
     if (request.getMethod() == POST) {
         env_vars.push_back("CONTENT_LENGTH=" + toString(request.getBody().length()));
@@ -168,17 +349,56 @@ std::string CgiExecutor::getInterpreter(const std::string& script_path, const st
     return "";
 }
 
-std::string CgiExecutor::readFromPipe(int pipe_fd) const {
-    std::string output;
-    char buffer[1024];
-    ssize_t bytes_read;
+// Collects the script's stdout until EOF; false if the deadline passes first
+bool CgiExecutor::readOutput(int pipe_fd, time_t deadline, std::string& output) const {
+    char buffer[8192];
+    struct pollfd pfd;
+    pfd.fd = pipe_fd;
+    pfd.events = POLLIN;
     
-    while ((bytes_read = read(pipe_fd, buffer, sizeof(buffer) - 1)) > 0) {
-        buffer[bytes_read] = '\0';
-        output += buffer;
+    while (true) {
+        int ready = poll(&pfd, 1, remainingMs(deadline));
+        if (ready == -1 && errno == EINTR) {
+            continue;
+        }
+        if (ready == 0) {
+            return false;
+        }
+        ssize_t bytes_read = read(pipe_fd, buffer, sizeof(buffer));
+        if (bytes_read == -1 && errno == EINTR) {
+            continue;
+        }
+        if (bytes_read <= 0) {
+            return true;
+        }
+        output.append(buffer, bytes_read);
     }
+}
+
+// A script that stops reading its stdin would block a plain write() for
+// good once the pipe fills; this gives up after `timeout` seconds instead,
+// and the same timeout then kills the script.
+void CgiExecutor::writeBody(int pipe_fd, const std::string& body, int timeout) const {
+    fcntl(pipe_fd, F_SETFL, O_NONBLOCK);
+    time_t deadline = timeout > 0 ? time(NULL) + timeout : 0;
+    struct pollfd pfd;
+    pfd.fd = pipe_fd;
+    pfd.events = POLLOUT;
     
-    return output;
+    size_t written = 0;
+    while (written < body.length()) {
+        ssize_t n = write(pipe_fd, body.data() + written, body.length() - written);
+        if (n > 0) {
+            written += n;
+            continue;
+        }
+        if (n == -1 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            return; // the script closed its stdin
+        }
+        if (n == -1 && errno != EINTR && poll(&pfd, 1, remainingMs(deadline)) == 0) {
+            return;
+        }
+    }
 }
 
 std::string CgiExecutor::parseCgiOutput(const std::string& raw_output) const {
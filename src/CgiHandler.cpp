@@ -71,7 +71,8 @@ std::string CgiHandler::generateErrorResponse(int status_code, const std::string
     return response.str();
 }
 
-std::string CgiHandler::handleCgiRequest(const HttpRequest& request) const {
+std::string CgiHandler::handleCgiRequest(const HttpRequest& request, const CgiLimits& limits, CgiUsage& usage,
+                                         RequestTiming* timing) const {
     std::string uri = request.getUri();
     std::string script_path = getScriptPath(uri);
     
@@ -90,7 +91,32 @@ std::string CgiHandler::handleCgiRequest(const HttpRequest& request) const {
     
     // Execute the CGI script
     CgiExecutor executor;
-    return executor.execute(script_path, request, _interpreters);
+    return executor.execute(script_path, request, _interpreters, limits, usage, timing);
+}
+
+std::string CgiHandler::startCgiRequest(const HttpRequest& request, const CgiLimits& limits, pid_t& pid,
+                                        int& output_fd, const std::string& request_id, int* input_fd) const {
+    std::string script_path = getScriptPath(request.getUri());
+    
+    struct stat buffer;
+    if (stat(script_path.c_str(), &buffer) != 0) {
+        return generateErrorResponse(404, "CGI Script Not Found");
+    }
+    if (!isExecutable(script_path)) {
+        return generateErrorResponse(403, "CGI Script Not Executable");
+    }
+    
+    CgiExecutor executor;
+    pid = executor.start(script_path, request, _interpreters, limits, output_fd, request_id, input_fd);
+    if (pid == -1) {
+        return generateErrorResponse(500, "Internal Server Error - CGI Start Failed");
+    }
+    return "";
+}
+
+std::string CgiHandler::finishCgiRequest(const std::string& output, const CgiUsage& usage) const {
+    CgiExecutor executor;
+    return executor.finish(output, usage);
 }
 
 void CgiHandler::setCgiBinPath(const std::string& path) {
@@ -0,0 +1,175 @@
+#include "Compression.hpp"
+#include <zlib.h>
+#include <cstdlib>
+#include <cctype>
+
+namespace {
+
+std::string toLower(const std::string& str) {
+    std::string result = str;
+    for (size_t i = 0; i < result.length(); ++i) {
+        result[i] = std::tolower(result[i]);
+    }
+    return result;
+}
+
+std::string trimSpaces(const std::string& str) {
+    size_t start = str.find_first_not_of(" \t");
+    if (start == std::string::npos) return "";
+    size_t end = str.find_last_not_of(" \t");
+    return str.substr(start, end - start + 1);
+}
+
+}
+
+bool Compression::acceptsEncoding(const std::string& accept_encoding, const std::string& coding) {
+    double coding_q = -1.0;
+    double wildcard_q = -1.0;
+
+    size_t pos = 0;
+    while (pos <= accept_encoding.length()) {
+        size_t comma = accept_encoding.find(',', pos);
+        if (comma == std::string::npos) {
+            comma = accept_encoding.length();
+        }
+        std::string item = accept_encoding.substr(pos, comma - pos);
+        pos = comma + 1;
+
+        double q = 1.0;
+        size_t semi = item.find(';');
+        std::string name = toLower(trimSpaces(item.substr(0, semi)));
+        if (semi != std::string::npos) {
+            std::string params = toLower(item.substr(semi + 1));
+            size_t q_pos = params.find("q=");
+            if (q_pos != std::string::npos) {
+                q = std::atof(params.c_str() + q_pos + 2);
+            }
+        }
+        if (name == coding) {
+            coding_q = q;
+        } else if (name == "*") {
+            wildcard_q = q;
+        }
+    }
+
+    if (coding_q >= 0.0) {
+        return coding_q > 0.0;
+    }
+    return wildcard_q > 0.0;
+}
+
+bool Compression::isCompressibleType(const std::string& content_type, const std::vector<std::string>& types) {
+    std::string type = content_type.substr(0, content_type.find(';'));
+    if (!types.empty()) {
+        for (size_t i = 0; i < types.size(); ++i) {
+            if (types[i] == type || types[i] == "*") {
+                return true;
+            }
+        }
+        return false;
+    }
+    return type.compare(0, 5, "text/") == 0
+        || type == "application/javascript"
+        || type == "application/json"
+        || type == "application/xml"
+        || type == "image/svg+xml";
+}
+
+bool Compression::gzip(const std::string& input, std::string& output, int level) {
+    z_stream stream;
+    stream.zalloc = Z_NULL;
+    stream.zfree = Z_NULL;
+    stream.opaque = Z_NULL;
+
+    // windowBits 15 + 16 selects the gzip wrapper instead of raw zlib
+    if (deflateInit2(&stream, level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return false;
+    }
+
+    output.resize(deflateBound(&stream, input.length()));
+    stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(input.data()));
+    stream.avail_in = input.length();
+    stream.next_out = reinterpret_cast<Bytef*>(&output[0]);
+    stream.avail_out = output.length();
+
+    int ret = deflate(&stream, Z_FINISH);
+    size_t produced = stream.total_out;
+    deflateEnd(&stream);
+
+    if (ret != Z_STREAM_END) {
+        output.clear();
+        return false;
+    }
+    output.resize(produced);
+    return true;
+}
+
+CompressedCache::CompressedCache(size_t max_bytes)
+    : _max_bytes(max_bytes), _used_bytes(0), _hits(0), _misses(0) {
+}
+
+CompressedCache::~CompressedCache() {
+}
+
+std::string CompressedCache::makeKey(const std::string& path, const std::string& encoding) {
+    return encoding + ":" + path;
+}
+
+// Negative entries are charged their key, so they too are bounded
+size_t CompressedCache::cost(const std::string& key, const std::string& data) {
+    return data.empty() ? key.length() : data.length();
+}
+
+void CompressedCache::evict(const std::string& key) {
+    std::map<std::string, Entry>::iterator it = _entries.find(key);
+    if (it == _entries.end()) {
+        return;
+    }
+    _used_bytes -= cost(key, it->second.data);
+    _lru.erase(it->second.lru_pos);
+    _entries.erase(it);
+}
+
+const std::string* CompressedCache::get(const std::string& path, const std::string& encoding, time_t mtime, off_t size) {
+    std::string key = makeKey(path, encoding);
+    std::map<std::string, Entry>::iterator it = _entries.find(key);
+    if (it == _entries.end()) {
+        _misses++;
+        return NULL;
+    }
+    if (it->second.mtime != mtime || it->second.size != size) {
+        evict(key);
+        _misses++;
+        return NULL;
+    }
+    _lru.splice(_lru.begin(), _lru, it->second.lru_pos);
+    _hits++;
+    return &it->second.data;
+}
+
+void CompressedCache::put(const std::string& path, const std::string& encoding, time_t mtime, off_t size, const std::string& data) {
+    if (data.length() > _max_bytes) {
+        return;
+    }
+    std::string key = makeKey(path, encoding);
+    evict(key);
+
+    while (_used_bytes + cost(key, data) > _max_bytes && !_lru.empty()) {
+        evict(_lru.back());
+    }
+
+    _lru.push_front(key);
+    Entry& entry = _entries[key];
+    entry.data = data;
+    entry.mtime = mtime;
+    entry.size = size;
+    entry.lru_pos = _lru.begin();
+    _used_bytes += cost(key, data);
+}
+
+void CompressedCache::setMaxBytes(size_t max_bytes) {
+    _max_bytes = max_bytes;
+    while (_used_bytes > _max_bytes && !_lru.empty()) {
+        evict(_lru.back());
+    }
+}
@@ -2,10 +2,11 @@
 #include "utils.hpp"
 #include <fstream>
 #include <iostream>
+#include <cstdlib>
 
 #include "Config.hpp"
 
-Config::Config() {}
+Config::Config() : _event_backend("poll"), _shutdown_timeout(30), _capture_sample(1.0), _memory_budget(268435456) {}
 
 Config::~Config() {}
 
@@ -88,6 +89,20 @@ ServerConfig Config::getDefaultServerConfig() {
     server.root = "./www";
     server.index = "index.html";
     server.client_max_body_size = 1048576; // 1MB
+    server.header_buffers = 4;
+    server.header_buffer_size = 8192; // 8KB
+    server.gzip_cache_size = 16777216; // 16MB
+    server.mmap_cache_size = 268435456; // 256MB
+    server.cgi_cache_size = 33554432; // 32MB
+    server.open_file_cache = 0;
+    server.open_file_cache_valid = 60;
+    server.open_file_cache_errors = true;
+    server.ssl = false;
+    server.ssl_session_cache = 20480;
+    server.ssl_session_timeout = 300;
+    server.ssl_session_tickets = true;
+    server.ssl_ktls = true;
+    server.http2 = true;
     server.error_pages[404] = "/error/404.html";
     server.error_pages[500] = "/error/500.html";
     return server;
@@ -105,6 +120,159 @@ bool Config::isServerEnd(const std::string& line) {
     return line == "}";
 }
 
+bool Config::isUpstreamStart(const std::string& line) {
+    return line.compare(0, 9, "upstream ") == 0 && line.find("{") != std::string::npos;
+}
+
+bool Config::parseHostPort(const std::string& value, std::string& host, int& port) {
+    size_t colon = value.rfind(':');
+    host = value.substr(0, colon);
+    port = 80;
+    if (colon != std::string::npos) {
+        std::string port_str = value.substr(colon + 1);
+        if (port_str.empty() || port_str.find_first_not_of("0123456789") != std::string::npos) {
+            return false;
+        }
+        port = std::atoi(port_str.c_str());
+    }
+    if (host == "localhost") {
+        host = "127.0.0.1";
+    }
+    return !host.empty() && port > 0 && port <= 65535;
+}
+
+bool Config::parseUpstreamServer(const std::vector<std::string>& tokens, UpstreamServerConfig& server) {
+    if (tokens.size() < 2 || !parseHostPort(tokens[1], server.host, server.port)) {
+        return false;
+    }
+    for (size_t i = 2; i < tokens.size(); ++i) {
+        size_t eq = tokens[i].find('=');
+        std::string key = tokens[i].substr(0, eq);
+        int value = (eq == std::string::npos) ? 0 : std::atoi(tokens[i].c_str() + eq + 1);
+        if (key == "weight" && value > 0) {
+            server.weight = value;
+        } else if (key == "max_fails" && value >= 0) {
+            server.max_fails = value;
+        } else if (key == "fail_timeout" && value >= 0) {
+            server.fail_timeout = value;
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool Config::parseLimitZone(const std::vector<std::string>& tokens, int line_number) {
+    LimitZoneConfig zone;
+    zone.requests = (tokens[0] == "limit_req_zone");
+    if (tokens.size() < 2 || _limit_zones.count(tokens[1])) {
+        std::cerr << "Error line " << line_number << ": missing or duplicate zone name" << std::endl;
+        return false;
+    }
+    zone.name = tokens[1];
+    for (size_t i = 2; i < tokens.size(); ++i) {
+        if (tokens[i].compare(0, 5, "rate=") == 0 && zone.requests) {
+            char* unit;
+            double rate = std::strtod(tokens[i].c_str() + 5, &unit);
+            if (std::string(unit) == "r/s") {
+                zone.rate = (size_t)(rate * 1000);
+            } else if (std::string(unit) == "r/m") {
+                zone.rate = (size_t)(rate * 1000 / 60);
+            }
+        } else if (tokens[i].compare(0, 5, "size=") == 0) {
+            zone.size = std::atoi(tokens[i].c_str() + 5);
+        } else {
+            std::cerr << "Error line " << line_number << ": unknown " << tokens[0] << " parameter " << tokens[i] << std::endl;
+            return false;
+        }
+    }
+    if ((zone.requests && zone.rate == 0) || zone.size == 0) {
+        std::cerr << "Error line " << line_number << ": " << tokens[0] << " " << zone.name
+                  << " needs a rate (e.g. rate=10r/s) and a non-zero size" << std::endl;
+        return false;
+    }
+    _limit_zones[zone.name] = zone;
+    return true;
+}
+
+// limit_req zone=<name> [burst=<n>] [nodelay | delay=<n>]
+void Config::parseLimitReq(const std::vector<std::string>& tokens, LocationConfig& location) {
+    bool nodelay = false;
+    for (size_t i = 1; i < tokens.size(); ++i) {
+        if (tokens[i].compare(0, 5, "zone=") == 0) {
+            location.limit_req = tokens[i].substr(5);
+        } else if (tokens[i].compare(0, 6, "burst=") == 0) {
+            location.limit_req_burst = std::atoi(tokens[i].c_str() + 6);
+        } else if (tokens[i].compare(0, 6, "delay=") == 0) {
+            location.limit_req_delay = std::atoi(tokens[i].c_str() + 6);
+        } else if (tokens[i] == "nodelay") {
+            nodelay = true;
+        }
+    }
+    if (nodelay) {
+        location.limit_req_delay = location.limit_req_burst;
+    }
+}
+
+// cgi_max_concurrent <n> [queue=<n>]
+void Config::parseCgiMaxConcurrent(const std::vector<std::string>& tokens, LocationConfig& location) {
+    location.cgi_max_concurrent = std::atoi(tokens[1].c_str());
+    for (size_t i = 2; i < tokens.size(); ++i) {
+        if (tokens[i].compare(0, 6, "queue=") == 0) {
+            location.cgi_queue = std::atoi(tokens[i].c_str() + 6);
+        }
+    }
+}
+
+bool Config::parseUpstreamBlock(std::ifstream& file, const std::string& header, int& line_number) {
+    UpstreamConfig upstream;
+    upstream.name = trim(header.substr(9, header.find('{') - 9));
+    if (upstream.name.empty() || _upstreams.count(upstream.name)) {
+        std::cerr << "Error line " << line_number << ": missing or duplicate upstream name" << std::endl;
+        return false;
+    }
+
+    std::string line;
+    while (std::getline(file, line)) {
+        line_number++;
+        line = trim(line);
+        if (shouldSkipLine(line)) continue;
+
+        if (line == "}") {
+            if (upstream.servers.empty()) {
+                std::cerr << "Error: upstream " << upstream.name << " has no servers" << std::endl;
+                return false;
+            }
+            _upstreams[upstream.name] = upstream;
+            return true;
+        }
+
+        std::vector<std::string> tokens = splitLine(line);
+        if (tokens.empty()) continue;
+        if (tokens[0] == "server") {
+            UpstreamServerConfig server;
+            if (!parseUpstreamServer(tokens, server)) {
+                std::cerr << "Error line " << line_number << ": invalid upstream server: " << line << std::endl;
+                return false;
+            }
+            upstream.servers.push_back(server);
+        } else if (tokens[0] == "least_conn") {
+            upstream.balance = UpstreamConfig::LEAST_CONN;
+        } else if (tokens[0] == "hash" && tokens.size() >= 2) {
+            upstream.balance = UpstreamConfig::HASH;
+            upstream.hash_key = tokens[1];
+        } else if (tokens[0] == "keepalive" && tokens.size() >= 2) {
+            upstream.keepalive = std::atoi(tokens[1].c_str());
+        } else {
+            std::cerr << "Error line " << line_number << ": unknown upstream directive: " << line << std::endl;
+            return false;
+        }
+    }
+
+    std::cerr << "Error: Unclosed upstream block " << upstream.name << std::endl;
+    return false;
+}
+
 bool Config::isLocationStart(const std::string& line) {
     return line.find("location") == 0 && line.find("{") != std::string::npos;
 }
@@ -149,6 +317,61 @@ bool Config::handleServerEnd(bool& in_server_block, ServerConfig& current_server
 }
 
 bool Config::handleDirective(bool in_server_block, const std::string& line, ServerConfig& current_server, int line_number, std::ifstream& file) {
+    if (!in_server_block && isUpstreamStart(line)) {
+        return parseUpstreamBlock(file, line, line_number);
+    }
+    if (!in_server_block && (line.compare(0, 15, "limit_req_zone ") == 0
+                             || line.compare(0, 16, "limit_conn_zone ") == 0)) {
+        return parseLimitZone(splitLine(line), line_number);
+    }
+    if (!in_server_block && line.compare(0, 14, "event_backend ") == 0) {
+        std::vector<std::string> tokens = splitLine(line);
+        if (tokens.size() != 2 || (tokens[1] != "poll" && tokens[1] != "io_uring")) {
+            std::cerr << "Error line " << line_number << ": event_backend must be poll or io_uring" << std::endl;
+            return false;
+        }
+        _event_backend = tokens[1];
+        return true;
+    }
+    if (!in_server_block && line.compare(0, 17, "shutdown_timeout ") == 0) {
+        std::vector<std::string> tokens = splitLine(line);
+        if (tokens.size() != 2 || std::atol(tokens[1].c_str()) < 0) {
+            std::cerr << "Error line " << line_number << ": shutdown_timeout takes seconds" << std::endl;
+            return false;
+        }
+        _shutdown_timeout = std::atol(tokens[1].c_str());
+        return true;
+    }
+    if (!in_server_block && line.compare(0, 11, "access_log ") == 0) {
+        std::vector<std::string> tokens = splitLine(line);
+        if (tokens.size() != 2) {
+            std::cerr << "Error line " << line_number << ": access_log takes a path or off" << std::endl;
+            return false;
+        }
+        _access_log = tokens[1] == "off" ? "" : tokens[1];
+        return true;
+    }
+    if (!in_server_block && line.compare(0, 17, "capture_requests ") == 0) {
+        std::vector<std::string> tokens = splitLine(line);
+        double sample = tokens.size() == 3 ? std::atof(tokens[2].c_str()) : 1.0;
+        if (tokens.size() < 2 || tokens.size() > 3 || sample <= 0.0 || sample > 1.0) {
+            std::cerr << "Error line " << line_number << ": capture_requests takes a path (or off) and a sample rate in (0, 1]" << std::endl;
+            return false;
+        }
+        _capture_path = tokens[1] == "off" ? "" : tokens[1];
+        _capture_sample = sample;
+        return true;
+    }
+    if (!in_server_block && line.compare(0, 14, "memory_budget ") == 0) {
+        std::vector<std::string> tokens = splitLine(line);
+        if (tokens.size() != 2 || (tokens[1] != "off" && std::atol(tokens[1].c_str()) <= 0)) {
+            std::cerr << "Error line " << line_number << ": memory_budget takes bytes or off" << std::endl;
+            return false;
+        }
+        _memory_budget = tokens[1] == "off" ? 0 : std::atol(tokens[1].c_str());
+        return true;
+    }
+
     if (isLocationStart(line)) {
         if (!in_server_block) {
             std::cerr << "Error line " << line_number << ": location directive outside server block" << std::endl;
@@ -209,6 +432,7 @@ void Config::parseSimpleDirective(const std::string& line, ServerConfig& server)
         } else {
             server.port = std::atoi(listen_value.c_str());
         }
+        server.ssl = tokens.size() >= 3 && tokens[2] == "ssl";
     } else if (directive == "server_name" && tokens.size() >= 2) {
         server.server_name = tokens[1];
     } else if (directive == "root" && tokens.size() >= 2) {
@@ -217,6 +441,35 @@ void Config::parseSimpleDirective(const std::string& line, ServerConfig& server)
         server.index = tokens[1];
     } else if (directive == "client_max_body_size" && tokens.size() >= 2) {
         server.client_max_body_size = std::atoi(tokens[1].c_str());
+    } else if (directive == "large_client_header_buffers" && tokens.size() >= 3) {
+        server.header_buffers = std::atoi(tokens[1].c_str());
+        server.header_buffer_size = std::atoi(tokens[2].c_str());
+    } else if (directive == "gzip_cache_size" && tokens.size() >= 2) {
+        server.gzip_cache_size = std::atoi(tokens[1].c_str());
+    } else if (directive == "mmap_cache_size" && tokens.size() >= 2) {
+        server.mmap_cache_size = std::atoi(tokens[1].c_str());
+    } else if (directive == "cgi_cache_size" && tokens.size() >= 2) {
+        server.cgi_cache_size = std::atoi(tokens[1].c_str());
+    } else if (directive == "open_file_cache" && tokens.size() >= 2) {
+        server.open_file_cache = (tokens[1] == "off") ? 0 : std::atoi(tokens[1].c_str());
+    } else if (directive == "open_file_cache_valid" && tokens.size() >= 2) {
+        server.open_file_cache_valid = std::atoi(tokens[1].c_str());
+    } else if (directive == "open_file_cache_errors" && tokens.size() >= 2) {
+        server.open_file_cache_errors = (tokens[1] == "on");
+    } else if (directive == "ssl_certificate" && tokens.size() >= 2) {
+        server.ssl_certificate = tokens[1];
+    } else if (directive == "ssl_certificate_key" && tokens.size() >= 2) {
+        server.ssl_certificate_key = tokens[1];
+    } else if (directive == "ssl_session_cache" && tokens.size() >= 2) {
+        server.ssl_session_cache = (tokens[1] == "off") ? 0 : std::atoi(tokens[1].c_str());
+    } else if (directive == "ssl_session_timeout" && tokens.size() >= 2) {
+        server.ssl_session_timeout = std::atoi(tokens[1].c_str());
+    } else if (directive == "ssl_session_tickets" && tokens.size() >= 2) {
+        server.ssl_session_tickets = (tokens[1] == "on");
+    } else if (directive == "ssl_ktls" && tokens.size() >= 2) {
+        server.ssl_ktls = (tokens[1] == "on");
+    } else if (directive == "http2" && tokens.size() >= 2) {
+        server.http2 = (tokens[1] == "on");
     } else if (directive == "error_page") {
         parseErrorPage(line, server.error_pages);
     }
@@ -234,6 +487,10 @@ void Config::parseSimpleDirective(const std::string& line, LocationConfig& locat
         location.index = tokens[1];
     } else if (directive == "autoindex" && tokens.size() >= 2) {
         location.autoindex = (tokens[1] == "on");
+    } else if (directive == "autoindex_format" && tokens.size() >= 2) {
+        location.autoindex_json = (tokens[1] == "json");
+    } else if (directive == "autoindex_page_size" && tokens.size() >= 2) {
+        location.autoindex_page_size = std::atoi(tokens[1].c_str());
     } else if (directive == "allow_methods" || directive == "methods") {
         parseAllowedMethods(line, location.allowed_methods);
     } else if (directive == "cgi_extension" && tokens.size() >= 2) {
@@ -242,10 +499,71 @@ void Config::parseSimpleDirective(const std::string& line, LocationConfig& locat
         location.cgi_path = tokens[1];
     } else if (directive == "upload_path" && tokens.size() >= 2) {
         location.upload_path = tokens[1];
+    } else if (directive == "upload_resumable" && tokens.size() >= 2) {
+        location.upload_resumable = (tokens[1] == "on");
+    } else if (directive == "upload_resumable_timeout" && tokens.size() >= 2) {
+        location.upload_resumable_timeout = std::atol(tokens[1].c_str());
     } else if (directive == "error_page") {
         parseErrorPage(line, location.error_pages);
     } else if (directive == "return" && tokens.size() >= 2) {
         location.redirect = tokens[1];
+    } else if (directive == "gzip" && tokens.size() >= 2) {
+        location.gzip = (tokens[1] == "on");
+    } else if (directive == "gzip_static" && tokens.size() >= 2) {
+        location.gzip_static = (tokens[1] == "on");
+    } else if (directive == "gzip_min_length" && tokens.size() >= 2) {
+        location.gzip_min_length = std::atoi(tokens[1].c_str());
+    } else if (directive == "mmap" && tokens.size() >= 2) {
+        location.mmap = (tokens[1] == "on");
+    } else if (directive == "mmap_max_size" && tokens.size() >= 2) {
+        location.mmap_max_size = std::atoi(tokens[1].c_str());
+    } else if (directive == "bundle" && tokens.size() >= 2) {
+        location.bundle = tokens[1];
+    } else if (directive == "proxy_pass" && tokens.size() >= 2) {
+        location.proxy_pass = tokens[1];
+    } else if (directive == "proxy_connect_timeout" && tokens.size() >= 2) {
+        location.proxy_connect_timeout = std::atoi(tokens[1].c_str());
+    } else if (directive == "proxy_read_timeout" && tokens.size() >= 2) {
+        location.proxy_read_timeout = std::atoi(tokens[1].c_str());
+    } else if (directive == "cgi_cache" && tokens.size() >= 2) {
+        location.cgi_cache = (tokens[1] == "on");
+    } else if (directive == "cgi_cache_valid" && tokens.size() >= 2) {
+        location.cgi_cache_valid = std::atoi(tokens[1].c_str());
+    } else if (directive == "cgi_cache_stale" && tokens.size() >= 2) {
+        location.cgi_cache_stale = std::atoi(tokens[1].c_str());
+    } else if (directive == "cgi_cache_vary") {
+        location.cgi_cache_vary.assign(tokens.begin() + 1, tokens.end());
+    } else if (directive == "cgi_cache_purge" && tokens.size() >= 2) {
+        location.cgi_cache_purge = (tokens[1] == "on");
+    } else if (directive == "cgi_max_concurrent" && tokens.size() >= 2) {
+        parseCgiMaxConcurrent(tokens, location);
+    } else if (directive == "cgi_timeout" && tokens.size() >= 2) {
+        location.cgi_timeout = std::atoi(tokens[1].c_str());
+    } else if (directive == "cgi_limit_cpu" && tokens.size() >= 2) {
+        location.cgi_limit_cpu = std::atol(tokens[1].c_str());
+    } else if (directive == "cgi_limit_memory" && tokens.size() >= 2) {
+        location.cgi_limit_memory = std::strtoul(tokens[1].c_str(), NULL, 10);
+    } else if (directive == "cgi_limit_files" && tokens.size() >= 2) {
+        location.cgi_limit_files = std::atol(tokens[1].c_str());
+    } else if (directive == "limit_req") {
+        parseLimitReq(tokens, location);
+    } else if (directive == "limit_req_status" && tokens.size() >= 2) {
+        location.limit_req_status = std::atoi(tokens[1].c_str());
+    } else if (directive == "limit_conn" && tokens.size() >= 3) {
+        location.limit_conn = tokens[1];
+        location.limit_conn_max = std::atoi(tokens[2].c_str());
+    } else if (directive == "limit_conn_status" && tokens.size() >= 2) {
+        location.limit_conn_status = std::atoi(tokens[1].c_str());
+    } else if (directive == "gzip_types") {
+        location.gzip_types.assign(tokens.begin() + 1, tokens.end());
+    } else if (directive == "expires" && tokens.size() >= 2) {
+        location.expires = parseExpires(tokens[1]);
+    } else if (directive == "cache_control" && tokens.size() >= 2) {
+        location.cache_control.clear();
+        for (size_t i = 1; i < tokens.size(); ++i) {
+            if (i > 1) location.cache_control += " ";
+            location.cache_control += tokens[i];
+        }
     }
 }
 
@@ -265,7 +583,8 @@ void Config::parseAllowedMethods(const std::string& line, std::vector<std::strin
     
     for (size_t i = 1; i < tokens.size(); ++i) {
         std::string method = tokens[i];
-        if (method == "GET" || method == "POST" || method == "DELETE" || method == "HEAD") {
+        if (method == "GET" || method == "POST" || method == "DELETE" || method == "HEAD"
+            || method == "PUT" || method == "PATCH") {
             methods.push_back(method);
         }
     }
@@ -275,6 +594,25 @@ void Config::parseAllowedMethods(const std::string& line, std::vector<std::strin
     }
 }
 
+// expires off | epoch | max | <n>[s|m|h|d|w]
+long Config::parseExpires(const std::string& value) {
+    if (value == "off") return LocationConfig::EXPIRES_OFF;
+    if (value == "epoch") return LocationConfig::EXPIRES_EPOCH;
+    if (value == "max") return LocationConfig::EXPIRES_MAX;
+    
+    long amount = std::atol(value.c_str());
+    if (amount < 0) return LocationConfig::EXPIRES_EPOCH;
+    
+    char unit = value.empty() ? 's' : value[value.length() - 1];
+    switch (unit) {
+        case 'm': return amount * 60;
+        case 'h': return amount * 3600;
+        case 'd': return amount * 86400;
+        case 'w': return amount * 604800;
+        default: return amount;
+    }
+}
+
 std::vector<std::string> Config::splitLine(const std::string& line) {
     std::vector<std::string> tokens;
     std::istringstream iss(line);
@@ -376,21 +714,80 @@ bool Config::validateConfig() const {
             std::cerr << "Error: Invalid client_max_body_size" << std::endl;
             return false;
         }
+
+        if (it->header_buffers == 0 || it->header_buffer_size < 1024) {
+            std::cerr << "Error: large_client_header_buffers needs a count and a size of at least 1024" << std::endl;
+            return false;
+        }
+
+        if (it->ssl && (it->ssl_certificate.empty() || it->ssl_certificate_key.empty())) {
+            std::cerr << "Error: listen " << it->host << ":" << it->port
+                      << " ssl needs ssl_certificate and ssl_certificate_key" << std::endl;
+            return false;
+        }
+        for (std::vector<ServerConfig>::const_iterator other = _servers.begin(); other != it; ++other) {
+            if (other->host == it->host && other->port == it->port && other->ssl != it->ssl) {
+                std::cerr << "Error: " << it->host << ":" << it->port << " is both plain and ssl" << std::endl;
+                return false;
+            }
+        }
+
+        for (size_t i = 0; i < it->locations.size(); ++i) {
+            const std::string& target = it->locations[i].proxy_pass;
+            if (target.empty()) {
+                continue;
+            }
+            std::string name = target.compare(0, 7, "http://") == 0 ? target.substr(7) : "";
+            name = name.substr(0, name.find('/'));
+            std::string host;
+            int port;
+            if (name.empty() || (!_upstreams.count(name) && !parseHostPort(name, host, port))) {
+                std::cerr << "Error: Invalid proxy_pass target " << target << std::endl;
+                return false;
+            }
+        }
+
+        for (size_t i = 0; i < it->locations.size(); ++i) {
+            const LocationConfig& location = it->locations[i];
+            std::map<std::string, LimitZoneConfig>::const_iterator zone;
+            if (!location.limit_req.empty()) {
+                zone = _limit_zones.find(location.limit_req);
+                if (zone == _limit_zones.end() || !zone->second.requests) {
+                    std::cerr << "Error: limit_req zone " << location.limit_req << " is not a limit_req_zone" << std::endl;
+                    return false;
+                }
+            }
+            if (!location.limit_conn.empty()) {
+                zone = _limit_zones.find(location.limit_conn);
+                if (zone == _limit_zones.end() || zone->second.requests || location.limit_conn_max == 0) {
+                    std::cerr << "Error: limit_conn needs a limit_conn_zone and a non-zero count" << std::endl;
+                    return false;
+                }
+            }
+        }
     }
     
     return true;
 }
 
 void Config::printConfig() const {
+    std::cout << "Event backend: " << _event_backend << std::endl;
+    std::cout << "Shutdown timeout: " << _shutdown_timeout << "s" << std::endl;
+    std::cout << "Access log: " << (_access_log.empty() ? "off" : _access_log) << std::endl;
+    std::cout << "Memory budget: " << (_memory_budget ? size_t_to_string(_memory_budget) + " bytes" : "off") << std::endl;
+    if (!_capture_path.empty()) {
+        std::cout << "Capturing requests: " << _capture_path << " (sample " << _capture_sample << ")" << std::endl;
+    }
     for (size_t i = 0; i < _servers.size(); ++i) {
         const ServerConfig& server = _servers[i];
         std::cout << "Server " << i << ":" << std::endl;
         std::cout << "  Host: " << server.host << std::endl;
-        std::cout << "  Port: " << server.port << std::endl;
+        std::cout << "  Port: " << server.port << (server.ssl ? " (ssl)" : "") << std::endl;
         std::cout << "  Server Name: " << server.server_name << std::endl;
         std::cout << "  Root: " << server.root << std::endl;
         std::cout << "  Index: " << server.index << std::endl;
         std::cout << "  Max Body Size: " << server.client_max_body_size << std::endl;
+        std::cout << "  Header Buffers: " << server.header_buffers << " x " << server.header_buffer_size << std::endl;
         
         for (size_t j = 0; j < server.locations.size(); ++j) {
             const LocationConfig& loc = server.locations[j];
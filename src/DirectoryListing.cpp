@@ -0,0 +1,344 @@
+#include "DirectoryListing.hpp"
+#include "OutputQueue.hpp"
+#include "utils.hpp"
+#include <algorithm>
+#include <dirent.h>
+#include <fcntl.h>
+#include <cstring>
+#include <cstdio>
+#include <cctype>
+#include <cerrno>
+
+// Rendered pages are split into segments of about this size so a large
+// listing never has to exist as one contiguous buffer.
+static const size_t CHUNK_SIZE = 32 * 1024;
+static const size_t MAX_PAGES_PER_LISTING = 16;
+
+namespace {
+
+struct DirsFirstByName {
+    bool operator()(const DirEntry& a, const DirEntry& b) const {
+        if (a.is_dir != b.is_dir) {
+            return a.is_dir;
+        }
+        return a.name < b.name;
+    }
+};
+
+struct BySize {
+    const std::vector<DirEntry>* entries;
+    explicit BySize(const std::vector<DirEntry>* e) : entries(e) {}
+    bool operator()(size_t a, size_t b) const {
+        return (*entries)[a].size < (*entries)[b].size;
+    }
+};
+
+struct ByMtime {
+    const std::vector<DirEntry>* entries;
+    explicit ByMtime(const std::vector<DirEntry>* e) : entries(e) {}
+    bool operator()(size_t a, size_t b) const {
+        return (*entries)[a].mtime < (*entries)[b].mtime;
+    }
+};
+
+std::string htmlEscape(const std::string& str) {
+    std::string result;
+    result.reserve(str.length());
+    for (size_t i = 0; i < str.length(); ++i) {
+        switch (str[i]) {
+            case '&': result += "&amp;"; break;
+            case '<': result += "&lt;"; break;
+            case '>': result += "&gt;"; break;
+            case '"': result += "&quot;"; break;
+            default: result += str[i];
+        }
+    }
+    return result;
+}
+
+std::string urlEncode(const std::string& str) {
+    static const char hex[] = "0123456789ABCDEF";
+    std::string result;
+    for (size_t i = 0; i < str.length(); ++i) {
+        unsigned char c = str[i];
+        if (std::isalnum(c) || c == '-' || c == '.' || c == '_' || c == '~') {
+            result += c;
+        } else {
+            result += '%';
+            result += hex[c >> 4];
+            result += hex[c & 15];
+        }
+    }
+    return result;
+}
+
+std::string jsonEscape(const std::string& str) {
+    std::string result;
+    for (size_t i = 0; i < str.length(); ++i) {
+        unsigned char c = str[i];
+        if (c == '"' || c == '\\') {
+            result += '\\';
+            result += c;
+        } else if (c < 0x20) {
+            char buffer[8];
+            std::snprintf(buffer, sizeof(buffer), "\\u%04x", c);
+            result += buffer;
+        } else {
+            result += c;
+        }
+    }
+    return result;
+}
+
+std::string formatTime(time_t t) {
+    char buffer[32];
+    struct tm tm_time;
+    gmtime_r(&t, &tm_time);
+    strftime(buffer, sizeof(buffer), "%d-%b-%Y %H:%M", &tm_time);
+    return buffer;
+}
+
+}
+
+std::string ListingView::key() const {
+    char buffer[96];
+    std::snprintf(buffer, sizeof(buffer), "%c%d%c:%lu:%lu", json ? 'j' : 'h', (int)sort,
+                  descending ? 'd' : 'a', (unsigned long)offset, (unsigned long)limit);
+    return buffer;
+}
+
+std::string ListingView::queryString(size_t page_offset) const {
+    static const char* const sort_names[] = { "name", "size", "mtime" };
+    std::string query = "?sort=";
+    query += sort_names[sort];
+    query += descending ? "&order=desc" : "&order=asc";
+    query += "&offset=" + size_t_to_string(page_offset);
+    query += "&limit=" + size_t_to_string(limit);
+    if (json) {
+        query += "&format=json";
+    }
+    return query;
+}
+
+DirectoryListingCache::DirectoryListingCache(size_t max_listings, size_t max_bytes)
+    : _max_listings(max_listings), _max_bytes(max_bytes), _used_bytes(0), _hits(0), _misses(0) {
+}
+
+DirectoryListingCache::~DirectoryListingCache() {
+}
+
+bool DirectoryListingCache::readEntries(const std::string& dir_path, std::vector<DirEntry>& entries) {
+    DIR* dir = opendir(dir_path.c_str());
+    if (!dir) {
+        LOG_ERROR("Cannot open directory: " + dir_path + ": " + std::string(strerror(errno)));
+        return false;
+    }
+    int dir_fd = dirfd(dir);
+    struct dirent* ent;
+    while ((ent = readdir(dir)) != NULL) {
+        if (ent->d_name[0] == '.' && (ent->d_name[1] == '\0'
+            || (ent->d_name[1] == '.' && ent->d_name[2] == '\0'))) {
+            continue;
+        }
+        DirEntry entry;
+        entry.name = ent->d_name;
+        entry.is_dir = (ent->d_type == DT_DIR);
+        entry.size = 0;
+        entry.mtime = 0;
+        struct stat st;
+        if (fstatat(dir_fd, ent->d_name, &st, 0) == 0) {
+            entry.is_dir = S_ISDIR(st.st_mode);
+            entry.size = st.st_size;
+            entry.mtime = st.st_mtime;
+        }
+        entries.push_back(entry);
+    }
+    closedir(dir);
+    std::sort(entries.begin(), entries.end(), DirsFirstByName());
+    return true;
+}
+
+DirectoryListingCache::Listing* DirectoryListingCache::lookup(const std::string& dir_path, const struct stat& dir_st) {
+    std::map<std::string, Listing>::iterator it = _listings.find(dir_path);
+    if (it != _listings.end()) {
+        Listing& listing = it->second;
+        if (listing.dev == dir_st.st_dev && listing.ino == dir_st.st_ino
+            && listing.mtime.tv_sec == dir_st.st_mtim.tv_sec
+            && listing.mtime.tv_nsec == dir_st.st_mtim.tv_nsec) {
+            _hits++;
+            _lru.splice(_lru.begin(), _lru, listing.lru_pos);
+            return &listing;
+        }
+        evict(dir_path); // directory changed since it was read
+    }
+    _misses++;
+
+    std::vector<DirEntry> entries;
+    if (!readEntries(dir_path, entries)) {
+        return NULL;
+    }
+
+    _lru.push_front(dir_path);
+    Listing& listing = _listings[dir_path];
+    listing.dev = dir_st.st_dev;
+    listing.ino = dir_st.st_ino;
+    listing.mtime = dir_st.st_mtim;
+    listing.entries.swap(entries);
+    listing.bytes = 0;
+    for (size_t i = 0; i < listing.entries.size(); ++i) {
+        listing.bytes += sizeof(DirEntry) + listing.entries[i].name.length();
+    }
+    listing.lru_pos = _lru.begin();
+    _used_bytes += listing.bytes;
+    LOG_DEBUG("Read " + size_t_to_string(listing.entries.size()) + " entries from " + dir_path);
+    return &listing;
+}
+
+const std::vector<size_t>& DirectoryListingCache::order(Listing& listing, ListingView::SortKey sort) {
+    std::map<int, std::vector<size_t> >::iterator it = listing.orders.find(sort);
+    if (it != listing.orders.end()) {
+        return it->second;
+    }
+    std::vector<size_t>& indices = listing.orders[sort];
+    indices.resize(listing.entries.size());
+    for (size_t i = 0; i < indices.size(); ++i) {
+        indices[i] = i;
+    }
+    if (sort == ListingView::SORT_SIZE) {
+        std::stable_sort(indices.begin(), indices.end(), BySize(&listing.entries));
+    } else if (sort == ListingView::SORT_MTIME) {
+        std::stable_sort(indices.begin(), indices.end(), ByMtime(&listing.entries));
+    }
+    listing.bytes += indices.size() * sizeof(size_t);
+    _used_bytes += indices.size() * sizeof(size_t);
+    return indices;
+}
+
+void DirectoryListingCache::renderPage(Listing& listing, const std::string& uri, const ListingView& view,
+                                       std::vector<std::string>& chunks) {
+    const std::vector<size_t>& indices = order(listing, view.sort);
+    size_t total = indices.size();
+    size_t first = std::min(view.offset, total);
+    size_t last = view.limit ? std::min(first + view.limit, total) : total;
+
+    std::string base = uri;
+    if (base.empty() || base[base.length() - 1] != '/') {
+        base += "/";
+    }
+
+    std::string chunk;
+    if (view.json) {
+        chunk = "{\"path\":\"" + jsonEscape(base) + "\",\"total\":" + size_t_to_string(total)
+            + ",\"offset\":" + size_t_to_string(first) + ",\"limit\":" + size_t_to_string(view.limit)
+            + ",\"entries\":[";
+    } else {
+        chunk = "<html><head><title>Index of " + htmlEscape(base) + "</title></head><body>";
+        chunk += "<h1>Index of " + htmlEscape(base) + "</h1><hr><pre>";
+        if (base != "/") {
+            chunk += "<a href=\"../\">../</a>\n";
+        }
+    }
+
+    for (size_t i = first; i < last; ++i) {
+        size_t index = view.descending ? indices[total - 1 - i] : indices[i];
+        const DirEntry& entry = listing.entries[index];
+        std::string name = entry.is_dir ? entry.name + "/" : entry.name;
+
+        if (view.json) {
+            if (i != first) {
+                chunk += ",";
+            }
+            chunk += "{\"name\":\"" + jsonEscape(entry.name) + "\",\"type\":\"";
+            chunk += entry.is_dir ? "directory" : "file";
+            chunk += "\",\"size\":" + size_t_to_string(entry.size)
+                + ",\"mtime\":" + size_t_to_string(entry.mtime) + "}";
+        } else {
+            std::string href = urlEncode(entry.name);
+            if (entry.is_dir) {
+                href += "/";
+            }
+            chunk += "<a href=\"" + htmlEscape(base) + href + "\">" + htmlEscape(name) + "</a>";
+            chunk.append(name.length() < 50 ? 51 - name.length() : 1, ' ');
+            chunk += formatTime(entry.mtime);
+            std::string size = entry.is_dir ? "-" : size_t_to_string(entry.size);
+            chunk.append(size.length() < 20 ? 20 - size.length() : 1, ' ');
+            chunk += size + "\n";
+        }
+
+        if (chunk.length() >= CHUNK_SIZE) {
+            chunks.push_back(chunk);
+            chunk.clear();
+        }
+    }
+
+    if (view.json) {
+        chunk += "]}";
+    } else {
+        chunk += "</pre><hr>";
+        if (view.limit && (first > 0 || last < total)) {
+            if (first > 0) {
+                size_t prev = first > view.limit ? first - view.limit : 0;
+                chunk += "<a href=\"" + htmlEscape(base + view.queryString(prev)) + "\">&laquo; previous</a> ";
+            }
+            if (last < total) {
+                chunk += "<a href=\"" + htmlEscape(base + view.queryString(last)) + "\">next &raquo;</a> ";
+            }
+            chunk += "(" + size_t_to_string(first + (last > first ? 1 : 0)) + "-" + size_t_to_string(last)
+                + " of " + size_t_to_string(total) + ")";
+        }
+        chunk += "</body></html>";
+    }
+    chunks.push_back(chunk);
+}
+
+bool DirectoryListingCache::render(const std::string& dir_path, const struct stat& dir_st, const std::string& uri,
+                                   const ListingView& view, OutputQueue& out, size_t& length) {
+    Listing* listing = lookup(dir_path, dir_st);
+    if (!listing) {
+        return false;
+    }
+
+    std::string key = view.key() + uri;
+    std::map<std::string, std::vector<std::string> >::iterator page = listing->pages.find(key);
+    if (page == listing->pages.end()) {
+        if (listing->pages.size() >= MAX_PAGES_PER_LISTING) {
+            for (page = listing->pages.begin(); page != listing->pages.end(); ++page) {
+                for (size_t i = 0; i < page->second.size(); ++i) {
+                    listing->bytes -= page->second[i].length();
+                    _used_bytes -= page->second[i].length();
+                }
+            }
+            listing->pages.clear();
+        }
+        page = listing->pages.insert(std::make_pair(key, std::vector<std::string>())).first;
+        renderPage(*listing, uri, view, page->second);
+        for (size_t i = 0; i < page->second.size(); ++i) {
+            listing->bytes += page->second[i].length();
+            _used_bytes += page->second[i].length();
+        }
+    }
+
+    length = 0;
+    for (size_t i = 0; i < page->second.size(); ++i) {
+        out.push(page->second[i]);
+        length += page->second[i].length();
+    }
+    trim();
+    return true;
+}
+
+void DirectoryListingCache::evict(const std::string& dir_path) {
+    std::map<std::string, Listing>::iterator it = _listings.find(dir_path);
+    if (it == _listings.end()) {
+        return;
+    }
+    _used_bytes -= it->second.bytes;
+    _lru.erase(it->second.lru_pos);
+    _listings.erase(it);
+}
+
+void DirectoryListingCache::trim() {
+    while (!_lru.empty() && (_listings.size() > _max_listings || _used_bytes > _max_bytes)) {
+        evict(_lru.back());
+    }
+}
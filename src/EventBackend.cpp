@@ -0,0 +1,372 @@
+#include "EventBackend.hpp"
+#include "utils.hpp"
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <endian.h>
+#include <cerrno>
+#include <cstring>
+#include <cstdio>
+#include <algorithm>
+
+// Armed polls are not bounded by the ring size, only the changes queued
+// between two waits are; a full queue is submitted early.
+static const unsigned RING_ENTRIES = 1024;
+static const uint64_t CANCEL_TAG = ~(uint64_t)0;
+
+EventBackend* EventBackend::create(const std::string& name) {
+    if (name == "io_uring") {
+        UringBackend* uring = UringBackend::create(RING_ENTRIES);
+        if (uring) {
+            LOG_INFO("events: using io_uring");
+            return uring;
+        }
+        LOG_ERROR("events: io_uring unavailable (" + std::string(strerror(errno)) + "), falling back to poll");
+    }
+    return new PollBackend();
+}
+
+PollBackend::PollBackend() : _waits(0), _scanned(0) {
+}
+
+int PollBackend::wait(std::vector<struct pollfd>& fds, int timeout_ms) {
+    _waits++;
+    _scanned += fds.size();
+    return poll(fds.empty() ? NULL : &fds[0], fds.size(), timeout_ms);
+}
+
+std::string PollBackend::statsLine() const {
+    char buffer[128];
+    std::snprintf(buffer, sizeof(buffer), "%lu poll calls, %.1f fds per call", (unsigned long)_waits,
+                  _waits ? (double)_scanned / (double)_waits : 0.0);
+    return std::string(buffer);
+}
+
+UringBackend::UringBackend()
+    : _ring_fd(-1), _sq_ring(NULL), _sq_ring_size(0), _cq_ring(NULL), _cq_ring_size(0),
+      _sqes(NULL), _sqes_size(0), _sq_head(NULL), _sq_tail(NULL), _sq_mask(0), _sq_array(NULL),
+      _cq_head(NULL), _cq_tail(NULL), _cq_mask(0), _cqes(NULL), _queued(0),
+      _generation(0), _enters(0), _submitted(0) {
+}
+
+UringBackend::~UringBackend() {
+    if (_sqes) {
+        munmap(_sqes, _sqes_size);
+    }
+    if (_cq_ring && _cq_ring != _sq_ring) {
+        munmap(_cq_ring, _cq_ring_size);
+    }
+    if (_sq_ring) {
+        munmap(_sq_ring, _sq_ring_size);
+    }
+    if (_ring_fd != -1) {
+        close(_ring_fd); // cancels whatever is still armed
+    }
+}
+
+UringBackend* UringBackend::create(unsigned entries) {
+    UringBackend* backend = new UringBackend();
+    if (!backend->setup(entries)) {
+        int saved_errno = errno;
+        delete backend;
+        errno = saved_errno;
+        return NULL;
+    }
+    return backend;
+}
+
+bool UringBackend::setup(unsigned entries) {
+    // Completions are only needed inside our own io_uring_enter(), so the
+    // kernel need not interrupt the loop to post them. Older kernels reject
+    // these flags; try the next set.
+    static const unsigned flag_sets[] = {
+#if defined(IORING_SETUP_SINGLE_ISSUER) && defined(IORING_SETUP_DEFER_TASKRUN)
+        IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN,
+#endif
+#ifdef IORING_SETUP_COOP_TASKRUN
+        IORING_SETUP_COOP_TASKRUN,
+#endif
+        0
+    };
+    struct io_uring_params params;
+    for (size_t i = 0; i < sizeof(flag_sets) / sizeof(flag_sets[0]); ++i) {
+        std::memset(&params, 0, sizeof(params));
+        params.flags = flag_sets[i];
+        _ring_fd = syscall(__NR_io_uring_setup, entries, &params);
+        if (_ring_fd != -1 || errno != EINVAL) {
+            break;
+        }
+    }
+    if (_ring_fd == -1) {
+        return false;
+    }
+    // The timeout goes with the wait (5.11), and completions beyond the
+    // CQ size must be kept rather than dropped
+    if (!(params.features & IORING_FEAT_EXT_ARG) || !(params.features & IORING_FEAT_NODROP)) {
+        errno = ENOSYS;
+        return false;
+    }
+
+    _sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    _cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        _sq_ring_size = _cq_ring_size = std::max(_sq_ring_size, _cq_ring_size);
+    }
+    void* ring = mmap(NULL, _sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      _ring_fd, IORING_OFF_SQ_RING);
+    if (ring == MAP_FAILED) {
+        return false;
+    }
+    _sq_ring = ring;
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        _cq_ring = _sq_ring;
+    } else {
+        ring = mmap(NULL, _cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                    _ring_fd, IORING_OFF_CQ_RING);
+        if (ring == MAP_FAILED) {
+            return false;
+        }
+        _cq_ring = ring;
+    }
+    _sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring = mmap(NULL, _sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                _ring_fd, IORING_OFF_SQES);
+    if (ring == MAP_FAILED) {
+        return false;
+    }
+    _sqes = static_cast<struct io_uring_sqe*>(ring);
+
+    char* sq = static_cast<char*>(_sq_ring);
+    _sq_head = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+    _sq_tail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+    _sq_mask = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+    _sq_array = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+    char* cq = static_cast<char*>(_cq_ring);
+    _cq_head = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+    _cq_tail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+    _cq_mask = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+    _cqes = reinterpret_cast<struct io_uring_cqe*>(cq + params.cq_off.cqes);
+    return true;
+}
+
+struct io_uring_sqe* UringBackend::nextSqe() {
+    unsigned tail = *_sq_tail;
+    if (tail - __atomic_load_n(_sq_head, __ATOMIC_ACQUIRE) > _sq_mask) {
+        enter(0, 0);
+        if (tail - __atomic_load_n(_sq_head, __ATOMIC_ACQUIRE) > _sq_mask) {
+            return NULL;
+        }
+    }
+    unsigned index = tail & _sq_mask;
+    struct io_uring_sqe* sqe = &_sqes[index];
+    std::memset(sqe, 0, sizeof(*sqe));
+    _sq_array[index] = index;
+    __atomic_store_n(_sq_tail, tail + 1, __ATOMIC_RELEASE);
+    _queued++;
+    return sqe;
+}
+
+UringBackend::Armed& UringBackend::slotFor(int fd) {
+    if ((size_t)fd >= _fds.size()) {
+        Armed unused = { 0, 0, false, false, false, 0, 0 };
+        _fds.resize(fd + 1, unused);
+    }
+    return _fds[fd];
+}
+
+void UringBackend::markDirty(int fd) {
+    Armed& armed = _fds[fd];
+    if (!armed.dirty) {
+        armed.dirty = true;
+        _dirty.push_back(fd);
+    }
+}
+
+// Index of `fd` in the set, searched down from where it was last seen;
+// fds.size() if it is not there
+size_t UringBackend::locate(const std::vector<struct pollfd>& fds, int fd) {
+    Armed& armed = _fds[fd];
+    size_t i = std::min(armed.slot + 1, fds.size());
+    while (i > 0) {
+        if (fds[--i].fd == fd) {
+            armed.slot = i;
+            return i;
+        }
+    }
+    return fds.size();
+}
+
+void UringBackend::arm(int fd) {
+    struct io_uring_sqe* sqe = nextSqe();
+    if (!sqe) {
+        return; // stays dirty, retried on the next wait
+    }
+    Armed& armed = _fds[fd];
+    armed.armed = armed.events;
+    armed.pending = true;
+    armed.generation = ++_generation;
+    uint32_t mask = (unsigned short)armed.events;
+#if __BYTE_ORDER == __BIG_ENDIAN
+    mask = (mask << 16) | (mask >> 16);
+#endif
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = mask;
+    sqe->user_data = ((uint64_t)armed.generation << 32) | (uint32_t)fd;
+}
+
+void UringBackend::cancel(int fd) {
+    Armed& armed = _fds[fd];
+    struct io_uring_sqe* sqe = nextSqe();
+    if (!sqe) {
+        return;
+    }
+    armed.pending = false;
+    sqe->opcode = IORING_OP_POLL_REMOVE;
+    sqe->fd = -1;
+    sqe->addr = ((uint64_t)armed.generation << 32) | (uint32_t)fd;
+    sqe->user_data = CANCEL_TAG;
+}
+
+void UringBackend::watch(int fd, short events, size_t slot) {
+    if (fd < 0) {
+        return;
+    }
+    Armed& armed = slotFor(fd);
+    armed.events = events;
+    armed.watched = true;
+    armed.slot = slot;
+    markDirty(fd);
+}
+
+void UringBackend::remove(int fd) {
+    if (fd < 0 || (size_t)fd >= _fds.size()) {
+        return;
+    }
+    Armed& armed = _fds[fd];
+    armed.watched = false;
+    armed.armed = -1; // whatever is armed is for the old file, even if the number comes back
+    if (armed.pending) {
+        cancel(fd);
+    }
+    if (armed.pending) {
+        markDirty(fd); // the ring was full: cancelled on the next wait
+    }
+}
+
+// Submits what is queued and waits for at least `min_complete` completions
+// or the timeout (-1: none). Same results as io_uring_enter().
+int UringBackend::enter(unsigned min_complete, int timeout_ms) {
+    struct __kernel_timespec ts;
+    struct io_uring_getevents_arg arg;
+    std::memset(&arg, 0, sizeof(arg));
+    if (timeout_ms >= 0) {
+        ts.tv_sec = timeout_ms / 1000;
+        ts.tv_nsec = (long long)(timeout_ms % 1000) * 1000000;
+        arg.ts = (uint64_t)(uintptr_t)&ts;
+    }
+    _enters++;
+    int ret = syscall(__NR_io_uring_enter, _ring_fd, _queued, min_complete,
+                      IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+    if (ret > 0) {
+        _submitted += ret;
+        _queued -= std::min((unsigned)ret, _queued);
+    }
+    return ret;
+}
+
+// Turns completions into revents for fds still in the set and marks them
+// to be re-armed; returns how many entries of `fds` got some.
+int UringBackend::reap(std::vector<struct pollfd>& fds) {
+    int ready = 0;
+    unsigned head = *_cq_head;
+    unsigned tail = __atomic_load_n(_cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; ++head) {
+        const struct io_uring_cqe& cqe = _cqes[head & _cq_mask];
+        if (cqe.user_data == CANCEL_TAG) {
+            continue;
+        }
+        int fd = (int)(uint32_t)cqe.user_data;
+        uint32_t generation = (uint32_t)(cqe.user_data >> 32);
+        if ((size_t)fd >= _fds.size()) {
+            continue;
+        }
+        Armed& armed = _fds[fd];
+        if (!armed.pending || armed.generation != generation) {
+            continue; // cancelled or re-armed since
+        }
+        armed.pending = false;
+        if (!armed.watched) {
+            continue;
+        }
+        markDirty(fd);
+        if (cqe.res == -ECANCELED) {
+            continue;
+        }
+        short revents = cqe.res < 0 ? POLLNVAL
+                                    : (short)(cqe.res & (armed.events | POLLERR | POLLHUP | POLLNVAL));
+        size_t slot = revents ? locate(fds, fd) : fds.size();
+        if (slot == fds.size()) {
+            continue;
+        }
+        struct pollfd& pfd = fds[slot];
+        if (!pfd.revents) {
+            ready++;
+            _reported.push_back(fd);
+        }
+        pfd.revents |= revents;
+    }
+    __atomic_store_n(_cq_head, head, __ATOMIC_RELEASE);
+    return ready;
+}
+
+int UringBackend::wait(std::vector<struct pollfd>& fds, int timeout_ms) {
+    for (size_t i = 0; i < _reported.size(); ++i) {
+        if (_fds[_reported[i]].watched) {
+            size_t slot = locate(fds, _reported[i]);
+            if (slot < fds.size()) {
+                fds[slot].revents = 0;
+            }
+        }
+    }
+    _reported.clear();
+
+    std::vector<int> dirty;
+    dirty.swap(_dirty);
+    for (size_t i = 0; i < dirty.size(); ++i) {
+        int fd = dirty[i];
+        Armed& armed = _fds[fd];
+        armed.dirty = false;
+        if (armed.pending && (!armed.watched || armed.armed != armed.events)) {
+            cancel(fd);
+        }
+        if (armed.watched && !armed.pending) {
+            arm(fd);
+        }
+        if (armed.pending ? (!armed.watched || armed.armed != armed.events) : armed.watched) {
+            markDirty(fd); // the ring was full
+        }
+    }
+
+    int ret = enter(timeout_ms == 0 ? 0 : 1, timeout_ms);
+    int saved_errno = errno;
+    int ready = reap(fds);
+    if (ret == -1 && ready == 0) {
+        // Timed out, or completions the CQ could not hold yet (the next
+        // enter flushes them): nothing to report either way
+        if (saved_errno == ETIME || saved_errno == EBUSY || saved_errno == EAGAIN) {
+            return 0;
+        }
+        errno = saved_errno;
+        return -1;
+    }
+    return ready;
+}
+
+std::string UringBackend::statsLine() const {
+    char buffer[128];
+    std::snprintf(buffer, sizeof(buffer), "%lu io_uring_enter calls, %.1f submissions per call",
+                  (unsigned long)_enters, _enters ? (double)_submitted / (double)_enters : 0.0);
+    return std::string(buffer);
+}
@@ -0,0 +1,1169 @@
+#include "Http2.hpp"
+#include "utils.hpp"
+#include <cctype>
+#include <cstdlib>
+#include <algorithm>
+
+const char Http2::PREFACE[] = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+
+namespace {
+
+enum FrameType {
+    FRAME_DATA = 0x0,
+    FRAME_HEADERS = 0x1,
+    FRAME_PRIORITY = 0x2,
+    FRAME_RST_STREAM = 0x3,
+    FRAME_SETTINGS = 0x4,
+    FRAME_PUSH_PROMISE = 0x5,
+    FRAME_PING = 0x6,
+    FRAME_GOAWAY = 0x7,
+    FRAME_WINDOW_UPDATE = 0x8,
+    FRAME_CONTINUATION = 0x9,
+    FRAME_PRIORITY_UPDATE = 0x10
+};
+
+enum FrameFlag {
+    FLAG_END_STREAM = 0x1,
+    FLAG_ACK = 0x1,
+    FLAG_END_HEADERS = 0x4,
+    FLAG_PADDED = 0x8,
+    FLAG_PRIORITY = 0x20
+};
+
+enum ErrorCode {
+    NO_ERROR = 0x0,
+    PROTOCOL_ERROR = 0x1,
+    FLOW_CONTROL_ERROR = 0x3,
+    STREAM_CLOSED = 0x5,
+    FRAME_SIZE_ERROR = 0x6,
+    REFUSED_STREAM = 0x7,
+    COMPRESSION_ERROR = 0x9,
+    ENHANCE_YOUR_CALM = 0xb
+};
+
+const int64_t MAX_WINDOW = 0x7fffffff;
+const int64_t DEFAULT_WINDOW = 65535;
+
+struct HuffmanCode {
+    uint32_t code;
+    uint8_t bits;
+};
+
+// RFC 7541 Appendix B, indexed by symbol (256 = EOS)
+const HuffmanCode HUFFMAN[257] = {
+    {0x1ff8, 13}, {0x7fffd8, 23}, {0xfffffe2, 28}, {0xfffffe3, 28}, {0xfffffe4, 28}, {0xfffffe5, 28},
+    {0xfffffe6, 28}, {0xfffffe7, 28}, {0xfffffe8, 28}, {0xffffea, 24}, {0x3ffffffc, 30}, {0xfffffe9, 28},
+    {0xfffffea, 28}, {0x3ffffffd, 30}, {0xfffffeb, 28}, {0xfffffec, 28}, {0xfffffed, 28}, {0xfffffee, 28},
+    {0xfffffef, 28}, {0xffffff0, 28}, {0xffffff1, 28}, {0xffffff2, 28}, {0x3ffffffe, 30}, {0xffffff3, 28},
+    {0xffffff4, 28}, {0xffffff5, 28}, {0xffffff6, 28}, {0xffffff7, 28}, {0xffffff8, 28}, {0xffffff9, 28},
+    {0xffffffa, 28}, {0xffffffb, 28}, {0x14, 6}, {0x3f8, 10}, {0x3f9, 10}, {0xffa, 12},
+    {0x1ff9, 13}, {0x15, 6}, {0xf8, 8}, {0x7fa, 11}, {0x3fa, 10}, {0x3fb, 10},
+    {0xf9, 8}, {0x7fb, 11}, {0xfa, 8}, {0x16, 6}, {0x17, 6}, {0x18, 6},
+    {0x0, 5}, {0x1, 5}, {0x2, 5}, {0x19, 6}, {0x1a, 6}, {0x1b, 6},
+    {0x1c, 6}, {0x1d, 6}, {0x1e, 6}, {0x1f, 6}, {0x5c, 7}, {0xfb, 8},
+    {0x7ffc, 15}, {0x20, 6}, {0xffb, 12}, {0x3fc, 10}, {0x1ffa, 13}, {0x21, 6},
+    {0x5d, 7}, {0x5e, 7}, {0x5f, 7}, {0x60, 7}, {0x61, 7}, {0x62, 7},
+    {0x63, 7}, {0x64, 7}, {0x65, 7}, {0x66, 7}, {0x67, 7}, {0x68, 7},
+    {0x69, 7}, {0x6a, 7}, {0x6b, 7}, {0x6c, 7}, {0x6d, 7}, {0x6e, 7},
+    {0x6f, 7}, {0x70, 7}, {0x71, 7}, {0x72, 7}, {0xfc, 8}, {0x73, 7},
+    {0xfd, 8}, {0x1ffb, 13}, {0x7fff0, 19}, {0x1ffc, 13}, {0x3ffc, 14}, {0x22, 6},
+    {0x7ffd, 15}, {0x3, 5}, {0x23, 6}, {0x4, 5}, {0x24, 6}, {0x5, 5},
+    {0x25, 6}, {0x26, 6}, {0x27, 6}, {0x6, 5}, {0x74, 7}, {0x75, 7},
+    {0x28, 6}, {0x29, 6}, {0x2a, 6}, {0x7, 5}, {0x2b, 6}, {0x76, 7},
+    {0x2c, 6}, {0x8, 5}, {0x9, 5}, {0x2d, 6}, {0x77, 7}, {0x78, 7},
+    {0x79, 7}, {0x7a, 7}, {0x7b, 7}, {0x7ffe, 15}, {0x7fc, 11}, {0x3ffd, 14},
+    {0x1ffd, 13}, {0xffffffc, 28}, {0xfffe6, 20}, {0x3fffd2, 22}, {0xfffe7, 20}, {0xfffe8, 20},
+    {0x3fffd3, 22}, {0x3fffd4, 22}, {0x3fffd5, 22}, {0x7fffd9, 23}, {0x3fffd6, 22}, {0x7fffda, 23},
+    {0x7fffdb, 23}, {0x7fffdc, 23}, {0x7fffdd, 23}, {0x7fffde, 23}, {0xffffeb, 24}, {0x7fffdf, 23},
+    {0xffffec, 24}, {0xffffed, 24}, {0x3fffd7, 22}, {0x7fffe0, 23}, {0xffffee, 24}, {0x7fffe1, 23},
+    {0x7fffe2, 23}, {0x7fffe3, 23}, {0x7fffe4, 23}, {0x1fffdc, 21}, {0x3fffd8, 22}, {0x7fffe5, 23},
+    {0x3fffd9, 22}, {0x7fffe6, 23}, {0x7fffe7, 23}, {0xffffef, 24}, {0x3fffda, 22}, {0x1fffdd, 21},
+    {0xfffe9, 20}, {0x3fffdb, 22}, {0x3fffdc, 22}, {0x7fffe8, 23}, {0x7fffe9, 23}, {0x1fffde, 21},
+    {0x7fffea, 23}, {0x3fffdd, 22}, {0x3fffde, 22}, {0xfffff0, 24}, {0x1fffdf, 21}, {0x3fffdf, 22},
+    {0x7fffeb, 23}, {0x7fffec, 23}, {0x1fffe0, 21}, {0x1fffe1, 21}, {0x3fffe0, 22}, {0x1fffe2, 21},
+    {0x7fffed, 23}, {0x3fffe1, 22}, {0x7fffee, 23}, {0x7fffef, 23}, {0xfffea, 20}, {0x3fffe2, 22},
+    {0x3fffe3, 22}, {0x3fffe4, 22}, {0x7ffff0, 23}, {0x3fffe5, 22}, {0x3fffe6, 22}, {0x7ffff1, 23},
+    {0x3ffffe0, 26}, {0x3ffffe1, 26}, {0xfffeb, 20}, {0x7fff1, 19}, {0x3fffe7, 22}, {0x7ffff2, 23},
+    {0x3fffe8, 22}, {0x1ffffec, 25}, {0x3ffffe2, 26}, {0x3ffffe3, 26}, {0x3ffffe4, 26}, {0x7ffffde, 27},
+    {0x7ffffdf, 27}, {0x3ffffe5, 26}, {0xfffff1, 24}, {0x1ffffed, 25}, {0x7fff2, 19}, {0x1fffe3, 21},
+    {0x3ffffe6, 26}, {0x7ffffe0, 27}, {0x7ffffe1, 27}, {0x3ffffe7, 26}, {0x7ffffe2, 27}, {0xfffff2, 24},
+    {0x1fffe4, 21}, {0x1fffe5, 21}, {0x3ffffe8, 26}, {0x3ffffe9, 26}, {0xffffffd, 28}, {0x7ffffe3, 27},
+    {0x7ffffe4, 27}, {0x7ffffe5, 27}, {0xfffec, 20}, {0xfffff3, 24}, {0xfffed, 20}, {0x1fffe6, 21},
+    {0x3fffe9, 22}, {0x1fffe7, 21}, {0x1fffe8, 21}, {0x7ffff3, 23}, {0x3fffea, 22}, {0x3fffeb, 22},
+    {0x1ffffee, 25}, {0x1ffffef, 25}, {0xfffff4, 24}, {0xfffff5, 24}, {0x3ffffea, 26}, {0x7ffff4, 23},
+    {0x3ffffeb, 26}, {0x7ffffe6, 27}, {0x3ffffec, 26}, {0x3ffffed, 26}, {0x7ffffe7, 27}, {0x7ffffe8, 27},
+    {0x7ffffe9, 27}, {0x7ffffea, 27}, {0x7ffffeb, 27}, {0xffffffe, 28}, {0x7ffffec, 27}, {0x7ffffed, 27},
+    {0x7ffffee, 27}, {0x7ffffef, 27}, {0x7fffff0, 27}, {0x3ffffee, 26}, {0x3fffffff, 30}
+};
+
+struct HuffmanNode {
+    int child[2];
+    int symbol;
+};
+
+// Decoding tree built from the code table on first use
+const std::vector<HuffmanNode>& huffmanTree() {
+    static std::vector<HuffmanNode> tree;
+    if (tree.empty()) {
+        HuffmanNode empty = {{-1, -1}, -1};
+        tree.push_back(empty);
+        for (int symbol = 0; symbol < 257; ++symbol) {
+            int node = 0;
+            for (int bit = HUFFMAN[symbol].bits - 1; bit >= 0; --bit) {
+                int branch = (HUFFMAN[symbol].code >> bit) & 1;
+                if (tree[node].child[branch] == -1) {
+                    tree[node].child[branch] = tree.size();
+                    tree.push_back(empty);
+                }
+                node = tree[node].child[branch];
+            }
+            tree[node].symbol = symbol;
+        }
+    }
+    return tree;
+}
+
+// RFC 7541 Appendix A
+const char* const STATIC_TABLE[61][2] = {
+    {":authority", ""}, {":method", "GET"}, {":method", "POST"}, {":path", "/"},
+    {":path", "/index.html"}, {":scheme", "http"}, {":scheme", "https"}, {":status", "200"},
+    {":status", "204"}, {":status", "206"}, {":status", "304"}, {":status", "400"},
+    {":status", "404"}, {":status", "500"}, {"accept-charset", ""}, {"accept-encoding", "gzip, deflate"},
+    {"accept-language", ""}, {"accept-ranges", ""}, {"accept", ""}, {"access-control-allow-origin", ""},
+    {"age", ""}, {"allow", ""}, {"authorization", ""}, {"cache-control", ""},
+    {"content-disposition", ""}, {"content-encoding", ""}, {"content-language", ""}, {"content-length", ""},
+    {"content-location", ""}, {"content-range", ""}, {"content-type", ""}, {"cookie", ""},
+    {"date", ""}, {"etag", ""}, {"expect", ""}, {"expires", ""},
+    {"from", ""}, {"host", ""}, {"if-match", ""}, {"if-modified-since", ""},
+    {"if-none-match", ""}, {"if-range", ""}, {"if-unmodified-since", ""}, {"last-modified", ""},
+    {"link", ""}, {"location", ""}, {"max-forwards", ""}, {"proxy-authenticate", ""},
+    {"proxy-authorization", ""}, {"range", ""}, {"referer", ""}, {"refresh", ""},
+    {"retry-after", ""}, {"server", ""}, {"set-cookie", ""}, {"strict-transport-security", ""},
+    {"transfer-encoding", ""}, {"user-agent", ""}, {"vary", ""}, {"via", ""},
+    {"www-authenticate", ""}
+};
+const size_t STATIC_TABLE_SIZE = 61;
+
+void encodeInteger(std::string& out, uint8_t first, int prefix, size_t value) {
+    size_t max = (1u << prefix) - 1;
+    if (value < max) {
+        out += (char)(first | value);
+        return;
+    }
+    out += (char)(first | max);
+    value -= max;
+    while (value >= 128) {
+        out += (char)((value & 0x7f) | 0x80);
+        value >>= 7;
+    }
+    out += (char)value;
+}
+
+bool decodeInteger(const std::string& in, size_t& pos, int prefix, size_t& value) {
+    if (pos >= in.size()) {
+        return false;
+    }
+    size_t max = (1u << prefix) - 1;
+    value = (unsigned char)in[pos++] & max;
+    if (value < max) {
+        return true;
+    }
+    for (int shift = 0; pos < in.size() && shift <= 28; shift += 7) {
+        unsigned char byte = in[pos++];
+        value += (size_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool decodeString(const std::string& in, size_t& pos, std::string& out) {
+    if (pos >= in.size()) {
+        return false;
+    }
+    bool huffman = in[pos] & 0x80;
+    size_t length;
+    if (!decodeInteger(in, pos, 7, length) || length > in.size() - pos) {
+        return false;
+    }
+    if (huffman) {
+        if (!Hpack::huffmanDecode(in.substr(pos, length), out)) {
+            return false;
+        }
+    } else {
+        out = in.substr(pos, length);
+    }
+    pos += length;
+    return true;
+}
+
+void encodeString(std::string& out, const std::string& value) {
+    size_t huffman_length = Hpack::huffmanLength(value);
+    if (huffman_length < value.size()) {
+        encodeInteger(out, 0x80, 7, huffman_length);
+        out += Hpack::huffmanEncode(value);
+    } else {
+        encodeInteger(out, 0x00, 7, value.size());
+        out += value;
+    }
+}
+
+// Fields whose value differs on nearly every response: indexing them
+// would only churn the dynamic table.
+bool indexable(const std::string& name) {
+    return name != "content-length" && name != "date" && name != "etag" && name != "last-modified"
+        && name != "age" && name != "content-range" && name != "expires" && name != "set-cookie";
+}
+
+std::string frameHeader(size_t length, uint8_t type, uint8_t flags, uint32_t stream_id) {
+    char header[9];
+    header[0] = (char)(length >> 16);
+    header[1] = (char)(length >> 8);
+    header[2] = (char)length;
+    header[3] = (char)type;
+    header[4] = (char)flags;
+    header[5] = (char)((stream_id >> 24) & 0x7f);
+    header[6] = (char)(stream_id >> 16);
+    header[7] = (char)(stream_id >> 8);
+    header[8] = (char)stream_id;
+    return std::string(header, sizeof(header));
+}
+
+uint32_t readUint32(const std::string& data, size_t pos) {
+    return ((uint32_t)(unsigned char)data[pos] << 24) | ((uint32_t)(unsigned char)data[pos + 1] << 16)
+        | ((uint32_t)(unsigned char)data[pos + 2] << 8) | (uint32_t)(unsigned char)data[pos + 3];
+}
+
+std::string uint32String(uint32_t value) {
+    char bytes[4];
+    bytes[0] = (char)(value >> 24);
+    bytes[1] = (char)(value >> 16);
+    bytes[2] = (char)(value >> 8);
+    bytes[3] = (char)value;
+    return std::string(bytes, sizeof(bytes));
+}
+
+std::string setting(uint16_t id, uint32_t value) {
+    char bytes[2];
+    bytes[0] = (char)(id >> 8);
+    bytes[1] = (char)id;
+    return std::string(bytes, sizeof(bytes)) + uint32String(value);
+}
+
+bool stripPadding(uint8_t flags, const std::string& payload, std::string& data) {
+    if (!(flags & FLAG_PADDED)) {
+        data = payload;
+        return true;
+    }
+    if (payload.empty() || (unsigned char)payload[0] >= payload.size()) {
+        return false;
+    }
+    data = payload.substr(1, payload.size() - 1 - (unsigned char)payload[0]);
+    return true;
+}
+
+// HTTP2-Settings is base64url without padding
+bool base64UrlDecode(const std::string& in, std::string& out) {
+    unsigned int buffer = 0;
+    int bits = 0;
+    for (size_t i = 0; i < in.size(); ++i) {
+        char c = in[i];
+        int value;
+        if (c >= 'A' && c <= 'Z') value = c - 'A';
+        else if (c >= 'a' && c <= 'z') value = c - 'a' + 26;
+        else if (c >= '0' && c <= '9') value = c - '0' + 52;
+        else if (c == '-' || c == '+') value = 62;
+        else if (c == '_' || c == '/') value = 63;
+        else if (c == '=') break;
+        else return false;
+        buffer = (buffer << 6) | value;
+        bits += 6;
+        if (bits >= 8) {
+            bits -= 8;
+            out += (char)((buffer >> bits) & 0xff);
+        }
+    }
+    return true;
+}
+
+std::string trimSpaces(const std::string& str) {
+    size_t start = str.find_first_not_of(" \t");
+    if (start == std::string::npos) return "";
+    size_t end = str.find_last_not_of(" \t\r");
+    return str.substr(start, end - start + 1);
+}
+
+std::string toLower(const std::string& str) {
+    std::string result = str;
+    for (size_t i = 0; i < result.length(); ++i) {
+        result[i] = std::tolower(result[i]);
+    }
+    return result;
+}
+
+bool isConnectionSpecific(const std::string& name) {
+    return name == "connection" || name == "keep-alive" || name == "proxy-connection"
+        || name == "transfer-encoding" || name == "upgrade";
+}
+
+}
+
+Hpack::Hpack(size_t max_size)
+    : _size(0), _max_size(max_size), _capacity(max_size), _size_update(NO_UPDATE) {
+}
+
+bool Hpack::entry(size_t index, std::string& name, std::string& value) const {
+    if (index == 0) {
+        return false;
+    }
+    if (index <= STATIC_TABLE_SIZE) {
+        name = STATIC_TABLE[index - 1][0];
+        value = STATIC_TABLE[index - 1][1];
+        return true;
+    }
+    index -= STATIC_TABLE_SIZE + 1;
+    if (index >= _table.size()) {
+        return false;
+    }
+    name = _table[index].first;
+    value = _table[index].second;
+    return true;
+}
+
+// Index of an exact match, or 0 with `name_index` set to the first entry
+// that has the name (0 if none).
+size_t Hpack::find(const std::string& name, const std::string& value, size_t& name_index) const {
+    name_index = 0;
+    for (size_t i = 0; i < STATIC_TABLE_SIZE; ++i) {
+        if (name == STATIC_TABLE[i][0]) {
+            if (value == STATIC_TABLE[i][1]) {
+                return i + 1;
+            }
+            if (!name_index) {
+                name_index = i + 1;
+            }
+        }
+    }
+    for (size_t i = 0; i < _table.size(); ++i) {
+        if (_table[i].first == name) {
+            if (_table[i].second == value) {
+                return STATIC_TABLE_SIZE + 1 + i;
+            }
+            if (!name_index) {
+                name_index = STATIC_TABLE_SIZE + 1 + i;
+            }
+        }
+    }
+    return 0;
+}
+
+void Hpack::insert(const std::string& name, const std::string& value) {
+    size_t size = name.size() + value.size() + 32;
+    if (size > _max_size) {
+        evict(0); // an entry larger than the table empties it
+        return;
+    }
+    evict(_max_size - size);
+    _table.push_front(std::make_pair(name, value));
+    _size += size;
+}
+
+void Hpack::evict(size_t limit) {
+    while (_size > limit && !_table.empty()) {
+        _size -= _table.back().first.size() + _table.back().second.size() + 32;
+        _table.pop_back();
+    }
+}
+
+void Hpack::setMaxSize(size_t max_size) {
+    max_size = std::min(max_size, _capacity);
+    if (max_size == _max_size) {
+        return;
+    }
+    _max_size = max_size;
+    evict(max_size);
+    _size_update = max_size;
+}
+
+bool Hpack::decode(const std::string& block, HeaderList& headers) {
+    size_t pos = 0;
+    bool fields_seen = false;
+    while (pos < block.size()) {
+        unsigned char first = block[pos];
+        std::string name;
+        std::string value;
+        if (first & 0x80) {
+            size_t index;
+            if (!decodeInteger(block, pos, 7, index) || !entry(index, name, value)) {
+                return false;
+            }
+        } else if ((first & 0xe0) == 0x20) {
+            // Dynamic table size update, only before the first field
+            size_t size;
+            if (fields_seen || !decodeInteger(block, pos, 5, size) || size > _capacity) {
+                return false;
+            }
+            _max_size = size;
+            evict(size);
+            continue;
+        } else {
+            bool indexing = first & 0x40;
+            size_t index;
+            if (!decodeInteger(block, pos, indexing ? 6 : 4, index)) {
+                return false;
+            }
+            if (index) {
+                std::string ignored;
+                if (!entry(index, name, ignored)) {
+                    return false;
+                }
+            } else if (!decodeString(block, pos, name)) {
+                return false;
+            }
+            if (!decodeString(block, pos, value)) {
+                return false;
+            }
+            if (indexing) {
+                insert(name, value);
+            }
+        }
+        headers.push_back(std::make_pair(name, value));
+        fields_seen = true;
+    }
+    return true;
+}
+
+std::string Hpack::encode(const HeaderList& headers) {
+    std::string out;
+    if (_size_update != NO_UPDATE) {
+        encodeInteger(out, 0x20, 5, _size_update);
+        _size_update = NO_UPDATE;
+    }
+    for (HeaderList::const_iterator it = headers.begin(); it != headers.end(); ++it) {
+        size_t name_index;
+        size_t index = find(it->first, it->second, name_index);
+        if (index) {
+            encodeInteger(out, 0x80, 7, index);
+            continue;
+        }
+        bool indexing = indexable(it->first);
+        encodeInteger(out, indexing ? 0x40 : 0x00, indexing ? 6 : 4, name_index);
+        if (!name_index) {
+            encodeString(out, it->first);
+        }
+        encodeString(out, it->second);
+        if (indexing) {
+            insert(it->first, it->second);
+        }
+    }
+    return out;
+}
+
+bool Hpack::huffmanDecode(const std::string& in, std::string& out) {
+    const std::vector<HuffmanNode>& tree = huffmanTree();
+    out.clear();
+    int node = 0;
+    int depth = 0;
+    bool all_ones = true;
+    for (size_t i = 0; i < in.size(); ++i) {
+        unsigned char byte = in[i];
+        for (int bit = 7; bit >= 0; --bit) {
+            int branch = (byte >> bit) & 1;
+            node = tree[node].child[branch];
+            if (node == -1) {
+                return false;
+            }
+            depth++;
+            all_ones = all_ones && branch;
+            if (tree[node].symbol != -1) {
+                if (tree[node].symbol == 256) {
+                    return false; // EOS must not appear in a string
+                }
+                out += (char)tree[node].symbol;
+                node = 0;
+                depth = 0;
+                all_ones = true;
+            }
+        }
+    }
+    // Padding is a prefix of EOS: at most 7 one bits
+    return depth < 8 && all_ones;
+}
+
+std::string Hpack::huffmanEncode(const std::string& in) {
+    std::string out;
+    uint64_t bits = 0;
+    int count = 0;
+    for (size_t i = 0; i < in.size(); ++i) {
+        const HuffmanCode& code = HUFFMAN[(unsigned char)in[i]];
+        bits = (bits << code.bits) | code.code;
+        count += code.bits;
+        while (count >= 8) {
+            count -= 8;
+            out += (char)(bits >> count);
+        }
+        bits &= ((uint64_t)1 << count) - 1;
+    }
+    if (count > 0) {
+        out += (char)((bits << (8 - count)) | (0xff >> count));
+    }
+    return out;
+}
+
+size_t Hpack::huffmanLength(const std::string& in) {
+    size_t bits = 0;
+    for (size_t i = 0; i < in.size(); ++i) {
+        bits += HUFFMAN[(unsigned char)in[i]].bits;
+    }
+    return (bits + 7) / 8;
+}
+
+Http2Session::Stream::Stream(uint32_t stream_id, int64_t window)
+    : id(stream_id), headers_done(false), request_done(false), remote_closed(false), responded(false),
+      oversized(false), send_window(window), recv_window(STREAM_WINDOW), recv_unacked(0), urgency(3),
+      incremental(false) {
+}
+
+Http2Session::Http2Session(size_t max_body)
+    : _max_body(max_body), _preface_received(false), _closing(false), _going_away(false), _goaway_received(false),
+      _last_stream_id(0), _header_stream(0), _header_end_stream(false), _send_window(DEFAULT_WINDOW),
+      _recv_window(DEFAULT_WINDOW), _recv_unacked(0), _peer_initial_window(DEFAULT_WINDOW),
+      _peer_max_frame(MAX_FRAME_SIZE), _last_scheduled(0) {
+}
+
+Http2Session::~Http2Session() {
+    for (std::map<uint32_t, Stream*>::iterator it = _streams.begin(); it != _streams.end(); ++it) {
+        delete it->second;
+    }
+}
+
+void Http2Session::start() {
+    queueFrame(FRAME_SETTINGS, 0, 0, setting(0x3, MAX_STREAMS) + setting(0x4, STREAM_WINDOW));
+    queueFrame(FRAME_WINDOW_UPDATE, 0, 0, uint32String(CONNECTION_WINDOW - DEFAULT_WINDOW));
+    _recv_window = CONNECTION_WINDOW;
+}
+
+bool Http2Session::upgrade(const std::string& settings) {
+    std::string payload;
+    if (!base64UrlDecode(settings, payload) || !onSettings(0, 0, payload, false)) {
+        return false;
+    }
+    Stream* stream = new Stream(1, _peer_initial_window);
+    stream->headers_done = true;
+    stream->request_done = true;
+    stream->remote_closed = true;
+    _streams[1] = stream;
+    _last_stream_id = 1;
+    return true;
+}
+
+bool Http2Session::receive(const char* data, size_t length) {
+    if (_closing) {
+        return false;
+    }
+    _input.append(data, length);
+    size_t pos = 0;
+    if (!_preface_received) {
+        size_t compared = std::min(_input.size(), Http2::PREFACE_LENGTH);
+        if (_input.compare(0, compared, Http2::PREFACE, compared) != 0) {
+            return fail(PROTOCOL_ERROR);
+        }
+        if (compared < Http2::PREFACE_LENGTH) {
+            return true;
+        }
+        _preface_received = true;
+        pos = Http2::PREFACE_LENGTH;
+    }
+    while (_input.size() - pos >= 9) {
+        const unsigned char* header = (const unsigned char*)_input.data() + pos;
+        size_t frame_length = ((size_t)header[0] << 16) | ((size_t)header[1] << 8) | header[2];
+        uint8_t type = header[3];
+        uint8_t flags = header[4];
+        uint32_t stream_id = readUint32(_input, pos + 5) & 0x7fffffff;
+        if (frame_length > MAX_FRAME_SIZE) {
+            return fail(FRAME_SIZE_ERROR);
+        }
+        if (_input.size() - pos - 9 < frame_length) {
+            break;
+        }
+        std::string payload = _input.substr(pos + 9, frame_length);
+        pos += 9 + frame_length;
+        if (!handleFrame(type, flags, stream_id, payload)) {
+            return false;
+        }
+    }
+    _input.erase(0, pos);
+    return true;
+}
+
+bool Http2Session::handleFrame(uint8_t type, uint8_t flags, uint32_t stream_id, const std::string& payload) {
+    // A header block is one unit: nothing may interleave with its CONTINUATIONs
+    if (_header_stream) {
+        if (type != FRAME_CONTINUATION || stream_id != _header_stream) {
+            return fail(PROTOCOL_ERROR);
+        }
+        _header_block += payload;
+        if (_header_block.size() > MAX_HEADER_BLOCK) {
+            return fail(ENHANCE_YOUR_CALM);
+        }
+        return (flags & FLAG_END_HEADERS) ? finishHeaders() : true;
+    }
+
+    switch (type) {
+        case FRAME_DATA:
+            return onData(flags, stream_id, payload);
+        case FRAME_HEADERS:
+            return onHeaders(flags, stream_id, payload);
+        case FRAME_PRIORITY:
+            // RFC 9113 deprecates the dependency tree; urgency comes from
+            // the priority header instead
+            if (stream_id == 0) {
+                return fail(PROTOCOL_ERROR);
+            }
+            if (payload.size() != 5) {
+                resetStream(stream_id, FRAME_SIZE_ERROR);
+            }
+            return true;
+        case FRAME_RST_STREAM: {
+            if (stream_id == 0 || stream_id > _last_stream_id) {
+                return fail(PROTOCOL_ERROR);
+            }
+            if (payload.size() != 4) {
+                return fail(FRAME_SIZE_ERROR);
+            }
+            std::map<uint32_t, Stream*>::iterator it = _streams.find(stream_id);
+            if (it != _streams.end()) {
+                delete it->second;
+                _streams.erase(it);
+            }
+            return true;
+        }
+        case FRAME_SETTINGS:
+            return onSettings(flags, stream_id, payload, true);
+        case FRAME_PUSH_PROMISE:
+            return fail(PROTOCOL_ERROR); // clients never push
+        case FRAME_PING:
+            if (stream_id != 0) {
+                return fail(PROTOCOL_ERROR);
+            }
+            if (payload.size() != 8) {
+                return fail(FRAME_SIZE_ERROR);
+            }
+            if (!(flags & FLAG_ACK)) {
+                queueFrame(FRAME_PING, FLAG_ACK, 0, payload);
+            }
+            return true;
+        case FRAME_GOAWAY:
+            _goaway_received = true;
+            return true;
+        case FRAME_WINDOW_UPDATE:
+            return onWindowUpdate(stream_id, payload);
+        case FRAME_CONTINUATION:
+            return fail(PROTOCOL_ERROR); // no header block is open
+        case FRAME_PRIORITY_UPDATE:
+            onPriorityUpdate(payload);
+            return true;
+        default:
+            return true; // unknown frame types are ignored
+    }
+}
+
+bool Http2Session::onHeaders(uint8_t flags, uint32_t stream_id, const std::string& payload) {
+    if (stream_id == 0 || !(stream_id & 1)) {
+        return fail(PROTOCOL_ERROR);
+    }
+    std::string block;
+    if (!stripPadding(flags, payload, block)) {
+        return fail(PROTOCOL_ERROR);
+    }
+    if (flags & FLAG_PRIORITY) {
+        if (block.size() < 5) {
+            return fail(FRAME_SIZE_ERROR);
+        }
+        block.erase(0, 5);
+    }
+    if (stream_id > _last_stream_id) {
+        _last_stream_id = stream_id;
+        if (!_goaway_received && !_going_away) {
+            _streams[stream_id] = new Stream(stream_id, _peer_initial_window);
+        }
+    }
+    _header_stream = stream_id;
+    _header_end_stream = flags & FLAG_END_STREAM;
+    _header_block = block;
+    return (flags & FLAG_END_HEADERS) ? finishHeaders() : true;
+}
+
+bool Http2Session::finishHeaders() {
+    uint32_t stream_id = _header_stream;
+    _header_stream = 0;
+    HeaderList headers;
+    bool decoded = _decoder.decode(_header_block, headers);
+    _header_block.clear();
+    if (!decoded) {
+        return fail(COMPRESSION_ERROR);
+    }
+
+    // Blocks for streams that are gone were decoded only to keep the
+    // dynamic table in step with the client
+    Stream* stream = find(stream_id);
+    if (!stream) {
+        return true;
+    }
+    if (stream->remote_closed) {
+        resetStream(stream_id, STREAM_CLOSED);
+        return true;
+    }
+    if (stream->headers_done) {
+        // Trailers: nothing uses them, but they must end the stream
+        if (!_header_end_stream) {
+            resetStream(stream_id, PROTOCOL_ERROR);
+            return true;
+        }
+        stream->remote_closed = true;
+        requestComplete(stream);
+        return true;
+    }
+    if (_streams.size() > MAX_STREAMS) {
+        resetStream(stream_id, REFUSED_STREAM);
+        return true;
+    }
+    stream->headers_done = true;
+    stream->headers.swap(headers);
+    parsePriority(Http2::headerValue(stream->headers, "priority"), stream->urgency, stream->incremental);
+    if (_header_end_stream) {
+        stream->remote_closed = true;
+        requestComplete(stream);
+    }
+    return true;
+}
+
+bool Http2Session::onData(uint8_t flags, uint32_t stream_id, const std::string& payload) {
+    if (stream_id == 0) {
+        return fail(PROTOCOL_ERROR);
+    }
+    // Padding counts against the windows too
+    if ((int64_t)payload.size() > _recv_window) {
+        return fail(FLOW_CONTROL_ERROR);
+    }
+    _recv_window -= payload.size();
+    _recv_unacked += payload.size();
+    if (_recv_unacked >= CONNECTION_WINDOW / 2) {
+        queueFrame(FRAME_WINDOW_UPDATE, 0, 0, uint32String(_recv_unacked));
+        _recv_window += _recv_unacked;
+        _recv_unacked = 0;
+    }
+
+    std::string data;
+    if (!stripPadding(flags, payload, data)) {
+        return fail(PROTOCOL_ERROR);
+    }
+    Stream* stream = find(stream_id);
+    if (!stream) {
+        return stream_id > _last_stream_id ? fail(PROTOCOL_ERROR) : true;
+    }
+    if (!stream->headers_done || stream->remote_closed) {
+        resetStream(stream_id, STREAM_CLOSED);
+        return true;
+    }
+    if ((int64_t)payload.size() > stream->recv_window) {
+        resetStream(stream_id, FLOW_CONTROL_ERROR);
+        return true;
+    }
+    stream->recv_window -= payload.size();
+
+    if (!stream->oversized) {
+        if (stream->body.size() + data.size() > _max_body) {
+            // Answered with 413 right away; the rest of the body is dropped
+            stream->oversized = true;
+            std::string().swap(stream->body);
+            requestComplete(stream);
+        } else {
+            stream->body.append(data);
+        }
+    }
+    if (flags & FLAG_END_STREAM) {
+        stream->remote_closed = true;
+        requestComplete(stream);
+        return true;
+    }
+    stream->recv_unacked += payload.size();
+    if (stream->recv_unacked >= STREAM_WINDOW / 2) {
+        queueFrame(FRAME_WINDOW_UPDATE, 0, stream_id, uint32String(stream->recv_unacked));
+        stream->recv_window += stream->recv_unacked;
+        stream->recv_unacked = 0;
+    }
+    return true;
+}
+
+bool Http2Session::onSettings(uint8_t flags, uint32_t stream_id, const std::string& payload, bool acknowledge) {
+    if (stream_id != 0) {
+        return fail(PROTOCOL_ERROR);
+    }
+    if (flags & FLAG_ACK) {
+        return payload.empty() ? true : fail(FRAME_SIZE_ERROR);
+    }
+    if (payload.size() % 6) {
+        return fail(FRAME_SIZE_ERROR);
+    }
+    for (size_t pos = 0; pos < payload.size(); pos += 6) {
+        uint16_t id = ((uint16_t)(unsigned char)payload[pos] << 8) | (unsigned char)payload[pos + 1];
+        uint32_t value = readUint32(payload, pos + 2);
+        if (id == 0x1) {          // HEADER_TABLE_SIZE
+            _encoder.setMaxSize(value);
+        } else if (id == 0x2) {   // ENABLE_PUSH: we never push anyway
+            if (value > 1) {
+                return fail(PROTOCOL_ERROR);
+            }
+        } else if (id == 0x4) {   // INITIAL_WINDOW_SIZE applies to open streams too
+            if (value > MAX_WINDOW) {
+                return fail(FLOW_CONTROL_ERROR);
+            }
+            for (std::map<uint32_t, Stream*>::iterator it = _streams.begin(); it != _streams.end(); ++it) {
+                it->second->send_window += (int64_t)value - _peer_initial_window;
+            }
+            _peer_initial_window = value;
+        } else if (id == 0x5) {   // MAX_FRAME_SIZE
+            if (value < MAX_FRAME_SIZE || value > 16777215) {
+                return fail(PROTOCOL_ERROR);
+            }
+            _peer_max_frame = value;
+        }
+    }
+    if (acknowledge) {
+        queueFrame(FRAME_SETTINGS, FLAG_ACK, 0, "");
+    }
+    return true;
+}
+
+bool Http2Session::onWindowUpdate(uint32_t stream_id, const std::string& payload) {
+    if (payload.size() != 4) {
+        return fail(FRAME_SIZE_ERROR);
+    }
+    uint32_t increment = readUint32(payload, 0) & 0x7fffffff;
+    if (stream_id == 0) {
+        if (increment == 0) {
+            return fail(PROTOCOL_ERROR);
+        }
+        _send_window += increment;
+        return _send_window > MAX_WINDOW ? fail(FLOW_CONTROL_ERROR) : true;
+    }
+    Stream* stream = find(stream_id);
+    if (!stream) {
+        return true;
+    }
+    if (increment == 0) {
+        resetStream(stream_id, PROTOCOL_ERROR);
+        return true;
+    }
+    stream->send_window += increment;
+    if (stream->send_window > MAX_WINDOW) {
+        resetStream(stream_id, FLOW_CONTROL_ERROR);
+    }
+    return true;
+}
+
+void Http2Session::onPriorityUpdate(const std::string& payload) {
+    if (payload.size() < 4) {
+        return;
+    }
+    Stream* stream = find(readUint32(payload, 0) & 0x7fffffff);
+    if (stream) {
+        parsePriority(payload.substr(4), stream->urgency, stream->incremental);
+    }
+}
+
+// RFC 9218 structured field: "u=<0-7>" and "i" (incremental)
+void Http2Session::parsePriority(const std::string& value, int& urgency, bool& incremental) {
+    size_t pos = 0;
+    while (pos < value.size()) {
+        size_t end = value.find(',', pos);
+        if (end == std::string::npos) {
+            end = value.size();
+        }
+        std::string item = trimSpaces(value.substr(pos, end - pos));
+        pos = end + 1;
+        if (item.size() == 3 && item.compare(0, 2, "u=") == 0 && item[2] >= '0' && item[2] <= '7') {
+            urgency = item[2] - '0';
+        } else if (item == "i" || item == "i=?1") {
+            incremental = true;
+        } else if (item == "i=?0") {
+            incremental = false;
+        }
+    }
+}
+
+void Http2Session::requestComplete(Stream* stream) {
+    if (!stream->request_done) {
+        stream->request_done = true;
+        _ready.push_back(stream->id);
+    }
+}
+
+// All of the response is framed: the stream is done on our side. A client
+// still sending (a dropped oversized body) is told to stop.
+void Http2Session::finishStream(Stream* stream) {
+    if (!stream->remote_closed) {
+        queueFrame(FRAME_RST_STREAM, 0, stream->id, uint32String(NO_ERROR));
+    }
+    _streams.erase(stream->id);
+    delete stream;
+}
+
+void Http2Session::resetStream(uint32_t stream_id, uint32_t error) {
+    queueFrame(FRAME_RST_STREAM, 0, stream_id, uint32String(error));
+    std::map<uint32_t, Stream*>::iterator it = _streams.find(stream_id);
+    if (it != _streams.end()) {
+        delete it->second;
+        _streams.erase(it);
+    }
+}
+
+bool Http2Session::fail(uint32_t error) {
+    if (!_closing) {
+        LOG_DEBUG("http2: connection error " + size_t_to_string(error));
+        queueFrame(FRAME_GOAWAY, 0, 0, uint32String(_last_stream_id) + uint32String(error));
+        _closing = true;
+    }
+    _input.clear();
+    return false;
+}
+
+Http2Session::Stream* Http2Session::find(uint32_t stream_id) {
+    std::map<uint32_t, Stream*>::iterator it = _streams.find(stream_id);
+    return it == _streams.end() ? NULL : it->second;
+}
+
+void Http2Session::queueFrame(uint8_t type, uint8_t flags, uint32_t stream_id, const std::string& payload) {
+    _output.push(frameHeader(payload.size(), type, flags, stream_id) + payload);
+}
+
+bool Http2Session::nextRequest(Http2Request& request) {
+    while (!_ready.empty()) {
+        uint32_t stream_id = _ready.front();
+        _ready.pop_front();
+        Stream* stream = find(stream_id);
+        if (!stream || stream->responded) {
+            continue; // reset by the client meanwhile
+        }
+        request.stream_id = stream_id;
+        request.headers.swap(stream->headers);
+        request.body.swap(stream->body);
+        request.oversized = stream->oversized;
+        return true;
+    }
+    return false;
+}
+
+void Http2Session::respond(uint32_t stream_id, const HeaderList& headers, OutputQueue& body) {
+    Stream* stream = find(stream_id);
+    if (!stream || stream->responded) {
+        body.clear();
+        return;
+    }
+    stream->responded = true;
+    std::string block = _encoder.encode(headers);
+    bool end_stream = body.empty();
+    size_t pos = 0;
+    do {
+        size_t length = std::min(block.size() - pos, _peer_max_frame);
+        uint8_t flags = (pos + length == block.size()) ? FLAG_END_HEADERS : 0;
+        if (pos == 0 && end_stream) {
+            flags |= FLAG_END_STREAM;
+        }
+        queueFrame(pos == 0 ? FRAME_HEADERS : FRAME_CONTINUATION, flags, stream_id, block.substr(pos, length));
+        pos += length;
+    } while (pos < block.size());
+
+    stream->pending.splice(body);
+    if (end_stream) {
+        finishStream(stream);
+    }
+}
+
+// RFC 9218 scheduling: the lowest urgency wins; within it, non-incremental
+// responses go one at a time in stream order, incremental ones take turns.
+Http2Session::Stream* Http2Session::nextScheduled() {
+    int urgency = 8;
+    bool sequential = false;
+    for (std::map<uint32_t, Stream*>::iterator it = _streams.begin(); it != _streams.end(); ++it) {
+        Stream* stream = it->second;
+        if (!stream->responded || stream->pending.empty() || stream->send_window <= 0) {
+            continue;
+        }
+        if (stream->urgency < urgency) {
+            urgency = stream->urgency;
+            sequential = !stream->incremental;
+        } else if (stream->urgency == urgency && !stream->incremental) {
+            sequential = true;
+        }
+    }
+    if (urgency == 8) {
+        return NULL;
+    }
+
+    Stream* first = NULL;
+    for (std::map<uint32_t, Stream*>::iterator it = _streams.begin(); it != _streams.end(); ++it) {
+        Stream* stream = it->second;
+        if (!stream->responded || stream->pending.empty() || stream->send_window <= 0
+            || stream->urgency != urgency || stream->incremental == sequential) {
+            continue;
+        }
+        if (sequential || stream->id > _last_scheduled) {
+            _last_scheduled = stream->id;
+            return stream;
+        }
+        if (!first) {
+            first = stream;
+        }
+    }
+    _last_scheduled = first->id;
+    return first;
+}
+
+void Http2Session::fill(size_t budget) {
+    while (_output.pendingBytes() < budget && _send_window > 0) {
+        Stream* stream = nextScheduled();
+        if (!stream) {
+            return;
+        }
+        size_t pending = stream->pending.pendingBytes();
+        size_t length = std::min(pending, _peer_max_frame);
+        length = std::min(length, (size_t)std::min(stream->send_window, _send_window));
+        bool end_stream = (length == pending);
+        _output.push(frameHeader(length, FRAME_DATA, end_stream ? FLAG_END_STREAM : 0, stream->id));
+        stream->pending.take(_output, length);
+        stream->send_window -= length;
+        _send_window -= length;
+        if (end_stream) {
+            finishStream(stream);
+        }
+    }
+}
+
+void Http2Session::goAway() {
+    if (_closing || _going_away) {
+        return;
+    }
+    queueFrame(FRAME_GOAWAY, 0, 0, uint32String(_last_stream_id) + uint32String(NO_ERROR));
+    _going_away = true;
+}
+
+bool Http2Session::finished() const {
+    return _closing || ((_goaway_received || _going_away) && _streams.empty());
+}
+
+size_t Http2Session::memoryBytes() const {
+    size_t total = _input.capacity() + _header_block.capacity() + _output.memoryBytes();
+    for (std::map<uint32_t, Stream*>::const_iterator it = _streams.begin(); it != _streams.end(); ++it) {
+        total += it->second->body.capacity() + it->second->pending.memoryBytes();
+    }
+    return total;
+}
+
+bool Http2::toHttp1(const HeaderList& headers, const std::string& body, std::string& request) {
+    std::string method;
+    std::string path;
+    std::string scheme;
+    std::string authority;
+    std::string fields;
+    std::string cookie;
+    bool has_host = false;
+    bool has_length = false;
+    bool regular_seen = false;
+
+    for (HeaderList::const_iterator it = headers.begin(); it != headers.end(); ++it) {
+        const std::string& name = it->first;
+        const std::string& value = it->second;
+        if (name.empty() || value.find_first_of("\r\n", 0) != std::string::npos
+            || value.find('\0') != std::string::npos) {
+            return false;
+        }
+        for (size_t i = 0; i < name.size(); ++i) {
+            if (std::isupper((unsigned char)name[i])) {
+                return false;
+            }
+        }
+        if (name[0] == ':') {
+            if (regular_seen) {
+                return false; // pseudo-headers come first
+            }
+            std::string* target = NULL;
+            if (name == ":method") target = &method;
+            else if (name == ":path") target = &path;
+            else if (name == ":scheme") target = &scheme;
+            else if (name == ":authority") target = &authority;
+            if (!target || !target->empty()) {
+                return false;
+            }
+            *target = value;
+            continue;
+        }
+        regular_seen = true;
+        if (isConnectionSpecific(name) || (name == "te" && value != "trailers")) {
+            return false;
+        }
+        if (name == "cookie") {
+            // Cookie crumbs are rejoined for HTTP/1.1 (RFC 9113 8.2.3)
+            cookie += (cookie.empty() ? "" : "; ") + value;
+            continue;
+        }
+        has_host = has_host || name == "host";
+        has_length = has_length || name == "content-length";
+        fields += name + ": " + value + "\r\n";
+    }
+    if (method.empty() || path.empty() || scheme.empty() || method == "CONNECT") {
+        return false;
+    }
+
+    request = method + " " + path + " HTTP/1.1\r\n";
+    if (!has_host && !authority.empty()) {
+        request += "host: " + authority + "\r\n";
+    }
+    request += fields;
+    if (!cookie.empty()) {
+        request += "cookie: " + cookie + "\r\n";
+    }
+    if (!body.empty() && !has_length) {
+        request += "content-length: " + size_t_to_string(body.size()) + "\r\n";
+    }
+    request += "\r\n";
+    request += body;
+    return true;
+}
+
+bool Http2::fromHttp1(const std::string& response, HeaderList& headers, size_t& body_start) {
+    size_t head_end = response.find("\r\n\r\n");
+    size_t space = response.find(' ');
+    if (head_end == std::string::npos || response.compare(0, 5, "HTTP/") != 0 || space > head_end) {
+        return false;
+    }
+    headers.push_back(std::make_pair(std::string(":status"), response.substr(space + 1, 3)));
+    size_t pos = response.find("\r\n") + 2;
+    while (pos < head_end) {
+        size_t end = response.find("\r\n", pos);
+        std::string line = response.substr(pos, end - pos);
+        pos = end + 2;
+        size_t colon = line.find(':');
+        if (colon == std::string::npos) {
+            continue;
+        }
+        std::string name = toLower(trimSpaces(line.substr(0, colon)));
+        if (isConnectionSpecific(name)) {
+            continue;
+        }
+        headers.push_back(std::make_pair(name, trimSpaces(line.substr(colon + 1))));
+    }
+    body_start = head_end + 4;
+    return true;
+}
+
+std::string Http2::headerValue(const HeaderList& headers, const std::string& name) {
+    for (HeaderList::const_iterator it = headers.begin(); it != headers.end(); ++it) {
+        if (it->first == name) {
+            return it->second;
+        }
+    }
+    return "";
+}
@@ -1,4 +1,5 @@
 #include "HttpRequest.hpp"
+#include "Scan.hpp"
 #include <sstream>
 #include <algorithm>
 
@@ -22,7 +23,7 @@ bool HttpRequest::parseRequest(const std::string& raw_request) {
     std::istringstream request_line(line);
     std::string method_str;
     
-    if (!(request_line >> method_str >> _uri >> _version)) {
+    if (!(request_line >> method_str >> _uri >> _version) || !Scan::isToken(method_str.data(), method_str.size())) {
         return false;
     }
     if (method_str == "GET") {
@@ -33,6 +34,10 @@ bool HttpRequest::parseRequest(const std::string& raw_request) {
         _method = HEAD;
     } else if (method_str == "DELETE") {
         _method = DELETE;
+    } else if (method_str == "PUT") {
+        _method = PUT;
+    } else if (method_str == "PATCH") {
+        _method = PATCH;
     } else {
         _method = UNKNOWN;
     }
@@ -43,6 +48,10 @@ bool HttpRequest::parseRequest(const std::string& raw_request) {
         
         size_t colon_pos = line.find(':');
         if (colon_pos != std::string::npos) {
+            // A field name is a token: no spaces before the colon (RFC 9112)
+            if (!Scan::isToken(line.data(), colon_pos)) {
+                return false;
+            }
             std::string key = line.substr(0, colon_pos);
             std::string value = line.substr(colon_pos + 1);
             while (!value.empty() && value[0] == ' ') {
@@ -52,9 +61,10 @@ bool HttpRequest::parseRequest(const std::string& raw_request) {
             _headers[key] = value;
         }
     }
-    std::string body_line;
-    while (std::getline(stream, body_line)) {
-        _body += body_line + "\n";
+    // The body is everything after the blank line, byte for byte
+    std::streampos body_start = stream.tellg();
+    if (body_start != std::streampos(-1)) {
+        _body = raw_request.substr(body_start);
     }
     
     _is_complete = true;
@@ -66,6 +76,40 @@ std::string HttpRequest::getHeader(const std::string& key) const {
     if (it != _headers.end()) {
         return it->second;
     }
+    // Header names are case-insensitive; fall back to a slower scan
+    for (it = _headers.begin(); it != _headers.end(); ++it) {
+        if (it->first.length() == key.length() && Scan::equalsIgnoreCase(it->first.data(), key.data(), key.length())) {
+            return it->second;
+        }
+    }
+    return "";
+}
+
+std::string HttpRequest::getPath() const {
+    return _uri.substr(0, _uri.find('?'));
+}
+
+std::string HttpRequest::getQuery() const {
+    size_t pos = _uri.find('?');
+    return pos == std::string::npos ? "" : _uri.substr(pos + 1);
+}
+
+std::string HttpRequest::getQueryParam(const std::string& name) const {
+    std::string query = getQuery();
+    size_t pos = 0;
+    while (pos < query.length()) {
+        size_t amp = query.find('&', pos);
+        if (amp == std::string::npos) {
+            amp = query.length();
+        }
+        std::string pair = query.substr(pos, amp - pos);
+        pos = amp + 1;
+
+        size_t eq = pair.find('=');
+        if (pair.substr(0, eq) == name) {
+            return eq == std::string::npos ? "" : pair.substr(eq + 1);
+        }
+    }
     return "";
 }
 
@@ -75,6 +119,8 @@ std::string HttpRequest::methodToString() const {
         case POST: return "POST";
         case DELETE: return "DELETE";
         case HEAD: return "HEAD";
+        case PUT: return "PUT";
+        case PATCH: return "PATCH";
         case UNKNOWN: return "UNKNOWN";
     }
     return "UNKNOWN";
@@ -0,0 +1,150 @@
+#include "MappedFileCache.hpp"
+#include "utils.hpp"
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#include <cstdio>
+
+// Mappings at least this large are read front to back by the socket, so
+// the kernel may drop pages behind us and read further ahead.
+static const size_t SEQUENTIAL_HINT_SIZE = 1024 * 1024;
+
+void MappedFile::release() {
+    if (--refs > 0) {
+        return;
+    }
+    munmap(const_cast<char*>(addr), length);
+    delete this;
+}
+
+MappedFileCache::MappedFileCache(size_t max_entries, size_t max_bytes)
+    : _max_entries(max_entries), _max_bytes(max_bytes), _mapped_bytes(0),
+      _hits(0), _misses(0), _evictions(0) {
+}
+
+MappedFileCache::~MappedFileCache() {
+    clear();
+}
+
+MappedFile* MappedFileCache::mapFile(const std::string& path, const struct stat& st) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd == -1) {
+        LOG_ERROR("Cannot open file for mmap: " + path + ": " + std::string(strerror(errno)));
+        return NULL;
+    }
+    void* addr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (addr == MAP_FAILED) {
+        LOG_ERROR("mmap failed for " + path + ": " + std::string(strerror(errno)));
+        close(fd);
+        return NULL;
+    }
+    // Start readahead now so the first send does not fault page by page
+    posix_fadvise(fd, 0, st.st_size, POSIX_FADV_WILLNEED);
+    close(fd);
+
+    madvise(addr, st.st_size, MADV_WILLNEED);
+    if ((size_t)st.st_size >= SEQUENTIAL_HINT_SIZE) {
+        madvise(addr, st.st_size, MADV_SEQUENTIAL);
+    }
+
+    MappedFile* file = new MappedFile();
+    file->addr = static_cast<const char*>(addr);
+    file->length = st.st_size;
+    file->mtime = st.st_mtime;
+    file->size = st.st_size;
+    file->refs = 1; // the cache's reference
+    return file;
+}
+
+void MappedFileCache::evict(const Key& key) {
+    std::map<Key, Entry>::iterator it = _entries.find(key);
+    if (it == _entries.end()) {
+        return;
+    }
+    _mapped_bytes -= it->second.file->length;
+    _lru.erase(it->second.lru_pos);
+    it->second.file->release();
+    _entries.erase(it);
+}
+
+MappedFile* MappedFileCache::acquire(const std::string& path, const struct stat& st) {
+    if (st.st_size <= 0 || (size_t)st.st_size > _max_bytes) {
+        return NULL;
+    }
+
+    Key key(st.st_dev, st.st_ino);
+    std::map<Key, Entry>::iterator it = _entries.find(key);
+    if (it != _entries.end()) {
+        MappedFile* file = it->second.file;
+        if (file->mtime == st.st_mtime && file->size == st.st_size) {
+            countLookup(true);
+            _lru.splice(_lru.begin(), _lru, it->second.lru_pos);
+            file->retain();
+            return file;
+        }
+        evict(key); // file changed on disk
+    }
+    countLookup(false);
+
+    MappedFile* file = mapFile(path, st);
+    if (!file) {
+        return NULL;
+    }
+
+    while (!_lru.empty() && (_entries.size() >= _max_entries || _mapped_bytes + file->length > _max_bytes)) {
+        evict(_lru.back());
+        _evictions++;
+    }
+
+    _lru.push_front(key);
+    Entry& entry = _entries[key];
+    entry.file = file;
+    entry.lru_pos = _lru.begin();
+    _mapped_bytes += file->length;
+
+    file->retain();
+    return file;
+}
+
+void MappedFileCache::setLimits(size_t max_entries, size_t max_bytes) {
+    _max_entries = max_entries ? max_entries : 1;
+    _max_bytes = max_bytes;
+    while (!_lru.empty() && (_entries.size() > _max_entries || _mapped_bytes > _max_bytes)) {
+        evict(_lru.back());
+        _evictions++;
+    }
+}
+
+void MappedFileCache::clear() {
+    while (!_lru.empty()) {
+        evict(_lru.back());
+    }
+}
+
+void MappedFileCache::countLookup(bool hit) {
+    if (hit) {
+        _hits++;
+    } else {
+        _misses++;
+    }
+    if ((_hits + _misses) % 1024 == 0) {
+        LOG_INFO("mmap cache: " + statsLine());
+    }
+}
+
+double MappedFileCache::hitRate() const {
+    size_t lookups = _hits + _misses;
+    return lookups ? (double)_hits / (double)lookups : 0.0;
+}
+
+std::string MappedFileCache::statsLine() const {
+    char buffer[256];
+    std::snprintf(buffer, sizeof(buffer),
+                  "%lu entries, %lu bytes mapped, %lu hits, %lu misses, %lu evictions, hit rate %.1f%%",
+                  (unsigned long)_entries.size(), (unsigned long)_mapped_bytes,
+                  (unsigned long)_hits, (unsigned long)_misses, (unsigned long)_evictions,
+                  hitRate() * 100.0);
+    return std::string(buffer);
+}
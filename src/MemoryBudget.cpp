@@ -0,0 +1,54 @@
+#include "MemoryBudget.hpp"
+#include <cstdio>
+
+MemoryBudget::MemoryBudget()
+    : _limit(0), _used(0), _peak(0), _peak_connection(0), _paused(false), _pauses(0) {
+}
+
+void MemoryBudget::setLimit(size_t bytes) {
+    _limit = bytes;
+}
+
+void MemoryBudget::charge(int fd, size_t bytes) {
+    if (bytes == 0) {
+        release(fd);
+        return;
+    }
+    size_t& current = _connections[fd];
+    _used = _used - current + bytes;
+    current = bytes;
+    if (_used > _peak) {
+        _peak = _used;
+    }
+    if (bytes > _peak_connection) {
+        _peak_connection = bytes;
+    }
+}
+
+void MemoryBudget::release(int fd) {
+    std::map<int, size_t>::iterator it = _connections.find(fd);
+    if (it != _connections.end()) {
+        _used -= it->second;
+        _connections.erase(it);
+    }
+}
+
+bool MemoryBudget::update() {
+    bool paused = _limit > 0 && (_paused ? _used > _limit / 4 * 3 : _used > _limit);
+    if (paused == _paused) {
+        return false;
+    }
+    _paused = paused;
+    if (paused) {
+        _pauses++;
+    }
+    return true;
+}
+
+std::string MemoryBudget::statsLine() const {
+    char buffer[160];
+    std::snprintf(buffer, sizeof(buffer), "used %lu, peak %lu (one connection %lu), budget %lu, paused %lu times",
+                  (unsigned long)_used, (unsigned long)_peak, (unsigned long)_peak_connection,
+                  (unsigned long)_limit, (unsigned long)_pauses);
+    return buffer;
+}
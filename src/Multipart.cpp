@@ -0,0 +1,463 @@
+#include "Multipart.hpp"
+#include "utils.hpp"
+#include <cerrno>
+#include <cctype>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+namespace {
+
+std::string toLower(const std::string& str) {
+    std::string result = str;
+    for (size_t i = 0; i < result.length(); ++i) {
+        result[i] = std::tolower(result[i]);
+    }
+    return result;
+}
+
+std::string trimSpaces(const std::string& str) {
+    size_t start = str.find_first_not_of(" \t");
+    if (start == std::string::npos) return "";
+    size_t end = str.find_last_not_of(" \t\r");
+    return str.substr(start, end - start + 1);
+}
+
+std::string htmlEscape(const std::string& str) {
+    std::string result;
+    for (size_t i = 0; i < str.length(); ++i) {
+        switch (str[i]) {
+            case '&': result += "&amp;"; break;
+            case '<': result += "&lt;"; break;
+            case '>': result += "&gt;"; break;
+            case '"': result += "&quot;"; break;
+            default: result += str[i];
+        }
+    }
+    return result;
+}
+
+std::string jsonEscape(const std::string& str) {
+    std::string result;
+    for (size_t i = 0; i < str.length(); ++i) {
+        unsigned char c = str[i];
+        if (c == '"' || c == '\\') {
+            result += '\\';
+            result += c;
+        } else if (c < 0x20) {
+            char buffer[8];
+            std::snprintf(buffer, sizeof(buffer), "\\u%04x", c);
+            result += buffer;
+        } else {
+            result += c;
+        }
+    }
+    return result;
+}
+
+} // namespace
+
+// MultipartParser
+
+MultipartParser::MultipartParser(const std::string& boundary, Handler& handler)
+    : _delimiter("\r\n--" + boundary), _pending("\r\n"), _state(PREAMBLE), _handler(handler) {
+    // The first boundary has no line break before it; pretending the body
+    // starts with one lets every delimiter be matched the same way
+}
+
+bool MultipartParser::fail(const std::string& reason) {
+    _state = FAILED;
+    _error = reason;
+    _pending.clear();
+    return false;
+}
+
+bool MultipartParser::feed(const char* data, size_t length) {
+    if (_state == DONE) {
+        return true; // epilogue
+    }
+    if (_state == FAILED) {
+        return false;
+    }
+    _pending.append(data, length);
+
+    size_t pos = 0;
+    bool more = true;
+    while (more) {
+        switch (_state) {
+            case PREAMBLE:
+            case BODY: {
+                const char* start = _pending.data() + pos;
+                const void* found = memmem(start, _pending.size() - pos, _delimiter.data(), _delimiter.size());
+                // Without a match only the tail can still be the start of
+                // a delimiter; everything before it is part data
+                size_t end;
+                if (found) {
+                    end = static_cast<const char*>(found) - _pending.data();
+                } else if (_pending.size() - pos >= _delimiter.size()) {
+                    end = _pending.size() - (_delimiter.size() - 1);
+                } else {
+                    end = pos;
+                }
+                if (_state == BODY && end > pos && !_handler.partData(_pending.data() + pos, end - pos)) {
+                    return fail("part rejected");
+                }
+                pos = end;
+                if (!found) {
+                    more = false;
+                    break;
+                }
+                pos += _delimiter.size();
+                if (_state == BODY && !_handler.partEnd()) {
+                    return fail("part rejected");
+                }
+                _state = DELIMITER;
+                break;
+            }
+            case DELIMITER: {
+                // "--" closes the body, otherwise optional padding and CRLF
+                if (_pending.size() - pos < 2) {
+                    more = false;
+                    break;
+                }
+                if (_pending.compare(pos, 2, "--") == 0) {
+                    _state = DONE;
+                    pos = _pending.size();
+                    more = false;
+                    break;
+                }
+                size_t eol = _pending.find("\r\n", pos);
+                if (eol == std::string::npos) {
+                    if (_pending.size() - pos > 256) {
+                        return fail("garbage after boundary");
+                    }
+                    more = false;
+                    break;
+                }
+                for (size_t i = pos; i < eol; ++i) {
+                    if (_pending[i] != ' ' && _pending[i] != '\t') {
+                        return fail("garbage after boundary");
+                    }
+                }
+                pos = eol + 2;
+                _state = HEADERS;
+                break;
+            }
+            case HEADERS: {
+                std::string block;
+                if (_pending.compare(pos, 2, "\r\n") == 0) {
+                    pos += 2; // a part without headers
+                } else {
+                    size_t end = _pending.find("\r\n\r\n", pos);
+                    if (end == std::string::npos) {
+                        if (_pending.size() - pos > MAX_HEADER_SIZE) {
+                            return fail("part headers too large");
+                        }
+                        more = false;
+                        break;
+                    }
+                    block = _pending.substr(pos, end + 2 - pos);
+                    pos = end + 4;
+                }
+                if (!parseHeaders(block)) {
+                    return false;
+                }
+                _state = BODY;
+                break;
+            }
+            case DONE:
+                pos = _pending.size();
+                more = false;
+                break;
+            case FAILED:
+                return false;
+        }
+    }
+    _pending.erase(0, pos);
+    return true;
+}
+
+bool MultipartParser::parseHeaders(const std::string& block) {
+    std::map<std::string, std::string> headers;
+    std::string last;
+    size_t start = 0;
+    while (start < block.size()) {
+        size_t end = block.find("\r\n", start);
+        std::string line = block.substr(start, end - start);
+        start = end + 2;
+        if (!line.empty() && (line[0] == ' ' || line[0] == '\t') && !last.empty()) {
+            headers[last] += " " + trimSpaces(line); // obsolete folding
+            continue;
+        }
+        size_t colon = line.find(':');
+        if (colon == std::string::npos || colon == 0) {
+            return fail("malformed part header");
+        }
+        last = toLower(trimSpaces(line.substr(0, colon)));
+        headers[last] = trimSpaces(line.substr(colon + 1));
+    }
+    if (!_handler.partBegin(headers)) {
+        return fail("part rejected");
+    }
+    return true;
+}
+
+std::string MultipartParser::boundaryOf(const std::string& content_type) {
+    if (toLower(content_type).compare(0, 10, "multipart/") != 0) {
+        return "";
+    }
+    std::string boundary = parameter(content_type, "boundary");
+    return boundary.size() <= 200 ? boundary : "";
+}
+
+std::string MultipartParser::parameter(const std::string& value, const std::string& name) {
+    size_t pos = value.find(';');
+    while (pos != std::string::npos && pos < value.size()) {
+        ++pos;
+        while (pos < value.size() && (value[pos] == ' ' || value[pos] == '\t')) {
+            ++pos;
+        }
+        size_t equals = value.find_first_of("=;", pos);
+        std::string key = toLower(trimSpaces(value.substr(pos, equals == std::string::npos ? std::string::npos : equals - pos)));
+        if (equals == std::string::npos || value[equals] == ';') {
+            pos = equals;
+            continue;
+        }
+        pos = equals + 1;
+        std::string result;
+        if (pos < value.size() && value[pos] == '"') {
+            for (++pos; pos < value.size() && value[pos] != '"'; ++pos) {
+                if (value[pos] == '\\' && pos + 1 < value.size()) {
+                    ++pos;
+                }
+                result += value[pos];
+            }
+            pos = value.find(';', pos);
+        } else {
+            size_t end = value.find(';', pos);
+            result = trimSpaces(value.substr(pos, end == std::string::npos ? std::string::npos : end - pos));
+            pos = end;
+        }
+        if (key == name) {
+            return result;
+        }
+    }
+    return "";
+}
+
+// UploadWriter
+
+UploadWriter::UploadWriter(const std::string& dir, const std::string& content_type)
+    : _dir(dir), _parser(NULL), _fd(-1), _finished(false), _status(0) {
+    if (toLower(content_type).compare(0, 19, "multipart/form-data") == 0) {
+        std::string boundary = MultipartParser::boundaryOf(content_type);
+        if (boundary.empty()) {
+            fail(400, "multipart body without a boundary");
+        } else {
+            _parser = new MultipartParser(boundary, *this);
+        }
+    }
+}
+
+UploadWriter::~UploadWriter() {
+    if (_fd != -1) {
+        close(_fd);
+    }
+    if (!_finished) {
+        for (size_t i = 0; i < _created.size(); ++i) {
+            unlink(_created[i].c_str());
+        }
+    }
+    delete _parser;
+}
+
+bool UploadWriter::fail(int status, const std::string& reason) {
+    if (_status == 0) {
+        _status = status;
+        _error = reason;
+    }
+    return false;
+}
+
+bool UploadWriter::write(const char* data, size_t length) {
+    if (_status != 0 || _finished) {
+        return false;
+    }
+    if (_parser) {
+        if (!_parser->feed(data, length)) {
+            return fail(400, "malformed multipart body: " + _parser->error());
+        }
+        return true;
+    }
+    if (_parts.empty()) {
+        _parts.push_back(UploadedPart());
+        // Microseconds keep names apart at any realistic upload rate, so
+        // createFile rarely has to probe for a free one
+        struct timeval now;
+        gettimeofday(&now, NULL);
+        char name[64];
+        std::snprintf(name, sizeof(name), "upload_%ld_%06ld.txt", static_cast<long>(now.tv_sec), static_cast<long>(now.tv_usec));
+        if (!createFile(name, _parts.back())) {
+            return false;
+        }
+    }
+    return partData(data, length);
+}
+
+bool UploadWriter::finish() {
+    if (_status != 0 || _finished) {
+        return _finished;
+    }
+    if (_parser && !_parser->done()) {
+        return fail(400, "multipart body ends before its closing boundary");
+    }
+    if (!_parser && _parts.empty() && !write("", 0)) {
+        return false; // an empty body still makes an (empty) file
+    }
+    if (_fd != -1) {
+        close(_fd);
+        _fd = -1;
+    }
+    _finished = true;
+    return true;
+}
+
+bool UploadWriter::partBegin(const std::map<std::string, std::string>& headers) {
+    UploadedPart part;
+    std::map<std::string, std::string>::const_iterator disposition = headers.find("content-disposition");
+    if (disposition != headers.end()) {
+        part.field = MultipartParser::parameter(disposition->second, "name");
+        part.filename = MultipartParser::parameter(disposition->second, "filename");
+    }
+    _parts.push_back(part);
+    // Plain form fields are counted, not stored; a file input left empty
+    // arrives with filename="" and no content
+    if (part.filename.empty()) {
+        return true;
+    }
+    return createFile(sanitizeFilename(part.filename), _parts.back());
+}
+
+bool UploadWriter::partData(const char* data, size_t length) {
+    _parts.back().size += length;
+    while (_fd != -1 && length > 0) {
+        ssize_t written = ::write(_fd, data, length);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            int saved = errno;
+            return fail(saved == ENOSPC || saved == EDQUOT ? 507 : 500,
+                        "cannot write " + _parts.back().saved_as + ": " + std::strerror(saved));
+        }
+        data += written;
+        length -= written;
+    }
+    return true;
+}
+
+bool UploadWriter::partEnd() {
+    if (_fd != -1) {
+        close(_fd);
+        _fd = -1;
+    }
+    return true;
+}
+
+std::string UploadWriter::numberedName(const std::string& name, int attempt) {
+    if (attempt == 0) {
+        return name;
+    }
+    size_t dot = name.rfind('.');
+    if (dot == 0 || dot == std::string::npos) {
+        dot = name.size();
+    }
+    return name.substr(0, dot) + "-" + int_to_string(attempt) + name.substr(dot);
+}
+
+// Creates `name` in the upload directory, or the next free numberedName();
+// O_EXCL makes the check and the creation one step.
+bool UploadWriter::createFile(const std::string& name, UploadedPart& part) {
+    mkdir(_dir.c_str(), 0755);
+    for (int attempt = 0; attempt < 10000; ++attempt) {
+        std::string candidate = numberedName(name, attempt);
+        std::string path = _dir + "/" + candidate;
+        int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+        if (fd != -1) {
+            _fd = fd;
+            _created.push_back(path);
+            part.saved_as = candidate;
+            return true;
+        }
+        if (errno != EEXIST) {
+            int saved = errno;
+            return fail(saved == ENOSPC || saved == EDQUOT ? 507 : 500,
+                        "cannot create " + path + ": " + std::strerror(saved));
+        }
+    }
+    return fail(500, "no free name for " + name + " in " + _dir);
+}
+
+size_t UploadWriter::filesSaved() const {
+    size_t count = 0;
+    for (size_t i = 0; i < _parts.size(); ++i) {
+        if (!_parts[i].saved_as.empty()) {
+            ++count;
+        }
+    }
+    return count;
+}
+
+std::string UploadWriter::report(bool json) const {
+    std::string body;
+    if (json) {
+        body = "{\"files\":" + size_t_to_string(filesSaved()) + ",\"parts\":[";
+        for (size_t i = 0; i < _parts.size(); ++i) {
+            const UploadedPart& part = _parts[i];
+            body += i ? ",{" : "{";
+            body += "\"field\":\"" + jsonEscape(part.field) + "\",\"filename\":\"" + jsonEscape(part.filename)
+                + "\",\"saved_as\":\"" + jsonEscape(part.saved_as) + "\",\"size\":" + size_t_to_string(part.size) + "}";
+        }
+        return body + "]}\n";
+    }
+    body = filesSaved() ? "<html><body><h1>File uploaded successfully</h1><ul>"
+                        : "<html><body><h1>No file uploaded</h1><ul>";
+    for (size_t i = 0; i < _parts.size(); ++i) {
+        const UploadedPart& part = _parts[i];
+        body += "<li>";
+        if (!part.field.empty()) {
+            body += htmlEscape(part.field) + ": ";
+        }
+        if (!part.saved_as.empty()) {
+            if (!part.filename.empty()) {
+                body += htmlEscape(part.filename) + " ";
+            }
+            body += "saved as " + htmlEscape(part.saved_as) + " ";
+        }
+        body += "(" + size_t_to_string(part.size) + " bytes)</li>";
+    }
+    return body + "</ul></body></html>";
+}
+
+std::string UploadWriter::sanitizeFilename(const std::string& name) {
+    // Browsers on Windows used to send the whole client-side path
+    size_t slash = name.find_last_of("/\\");
+    std::string base = slash == std::string::npos ? name : name.substr(slash + 1);
+    std::string result;
+    for (size_t i = 0; i < base.size(); ++i) {
+        unsigned char c = base[i];
+        result += (std::isalnum(c) || c == '.' || c == '-' || c == '_') ? static_cast<char>(c) : '_';
+    }
+    // No hidden files, and no "." or ".."
+    size_t start = result.find_first_not_of('.');
+    result = start == std::string::npos ? "" : result.substr(start);
+    if (result.size() > 100) {
+        size_t dot = result.rfind('.');
+        std::string extension = (dot != std::string::npos && result.size() - dot <= 16) ? result.substr(dot) : "";
+        result = result.substr(0, 100 - extension.size()) + extension;
+    }
+    return result.empty() ? "upload" : result;
+}
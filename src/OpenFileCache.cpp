@@ -0,0 +1,172 @@
+#include "OpenFileCache.hpp"
+#include "utils.hpp"
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+
+// Cached descriptors count against the process fd limit, so only this many
+// entries keep one open; the rest are reopened per request.
+static const size_t MAX_CACHED_FDS = 256;
+
+OpenFileCache::OpenFileCache()
+    : _max_entries(0), _valid(60), _cache_errors(true), _open_fds(0), _hits(0), _misses(0) {
+    _scratch.fd = -1;
+    _scratch.index_resolved = false;
+    _scratch.expires = 0;
+}
+
+OpenFileCache::~OpenFileCache() {
+    clear();
+}
+
+void OpenFileCache::configure(size_t max_entries, time_t valid, bool cache_errors) {
+    _max_entries = max_entries;
+    _valid = valid;
+    _cache_errors = cache_errors;
+    while (!_lru.empty() && _entries.size() > _max_entries) {
+        evict(_lru.back());
+    }
+}
+
+void OpenFileCache::fill(const std::string& path, Entry& entry) {
+    entry.fd = -1;
+    entry.index_key.clear();
+    entry.index_path.clear();
+    entry.index_resolved = false;
+    entry.info.readable = false;
+    if (stat(path.c_str(), &entry.info.st) != 0) {
+        entry.info.error = errno;
+        return;
+    }
+    entry.info.error = 0;
+    entry.info.readable = (access(path.c_str(), R_OK) == 0);
+}
+
+OpenFileCache::Entry& OpenFileCache::entry(const std::string& path) {
+    if (_max_entries == 0) {
+        _misses++;
+        fill(path, _scratch);
+        return _scratch;
+    }
+
+    time_t now = time(NULL);
+    std::map<std::string, Entry>::iterator it = _entries.find(path);
+    if (it != _entries.end()) {
+        if (now < it->second.expires) {
+            _hits++;
+            _lru.splice(_lru.begin(), _lru, it->second.lru_pos);
+            return it->second;
+        }
+        evict(path);
+    }
+    _misses++;
+
+    Entry fresh;
+    fill(path, fresh);
+    if (!fresh.info.exists() && !_cache_errors) {
+        _scratch = fresh;
+        return _scratch;
+    }
+
+    while (!_lru.empty() && _entries.size() >= _max_entries) {
+        evict(_lru.back());
+    }
+    _lru.push_front(path);
+    Entry& stored = _entries[path];
+    stored = fresh;
+    stored.expires = now + _valid;
+    stored.lru_pos = _lru.begin();
+    return stored;
+}
+
+const FileInfo& OpenFileCache::lookup(const std::string& path) {
+    return entry(path).info;
+}
+
+int OpenFileCache::open(const std::string& path) {
+    Entry& e = entry(path);
+    if (!e.info.exists() || !e.info.readable || S_ISDIR(e.info.st.st_mode)) {
+        errno = e.info.error ? e.info.error : EACCES;
+        return -1;
+    }
+    if (&e != &_scratch && e.fd == -1 && _open_fds < MAX_CACHED_FDS) {
+        e.fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (e.fd != -1) {
+            _open_fds++;
+        }
+    }
+    if (e.fd != -1) {
+        return fcntl(e.fd, F_DUPFD_CLOEXEC, 0);
+    }
+    return ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+}
+
+std::string OpenFileCache::resolveIndex(const std::string& dir_path, const std::vector<std::string>& candidates) {
+    std::string key;
+    for (size_t i = 0; i < candidates.size(); ++i) {
+        key += candidates[i] + "\n";
+    }
+
+    Entry& dir = entry(dir_path);
+    if (&dir != &_scratch && dir.index_resolved && dir.index_key == key) {
+        return dir.index_path;
+    }
+
+    std::string base = dir_path;
+    if (base.empty() || base[base.length() - 1] != '/') {
+        base += "/";
+    }
+    std::string result;
+    for (size_t i = 0; i < candidates.size() && result.empty(); ++i) {
+        const FileInfo& info = lookup(base + candidates[i]);
+        if (info.exists() && info.readable && !S_ISDIR(info.st.st_mode)) {
+            result = base + candidates[i];
+        }
+    }
+
+    // The lookups above may have evicted the directory entry
+    std::map<std::string, Entry>::iterator it = _entries.find(dir_path);
+    if (it != _entries.end()) {
+        it->second.index_key = key;
+        it->second.index_path = result;
+        it->second.index_resolved = true;
+    }
+    return result;
+}
+
+void OpenFileCache::closeFd(Entry& entry) {
+    if (entry.fd != -1) {
+        close(entry.fd);
+        entry.fd = -1;
+        _open_fds--;
+    }
+}
+
+void OpenFileCache::evict(const std::string& path) {
+    std::map<std::string, Entry>::iterator it = _entries.find(path);
+    if (it == _entries.end()) {
+        return;
+    }
+    closeFd(it->second);
+    _lru.erase(it->second.lru_pos);
+    _entries.erase(it);
+}
+
+// Both spellings of a directory: "./www/uploads" and "./www/uploads/" are
+// separate entries (a trailing slash stats differently for files).
+void OpenFileCache::invalidate(const std::string& path) {
+    evict(path);
+    if (!path.empty() && path[path.length() - 1] == '/') {
+        if (path.length() > 1) {
+            evict(path.substr(0, path.length() - 1));
+        }
+    } else {
+        evict(path + "/");
+    }
+}
+
+void OpenFileCache::clear() {
+    while (!_lru.empty()) {
+        evict(_lru.back());
+    }
+}
@@ -0,0 +1,366 @@
+#include "OutputQueue.hpp"
+#include "MappedFileCache.hpp"
+#include "Tls.hpp"
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+namespace {
+
+// TCP_CORK for the length of one flush: data queued behind a file range
+// (multipart/byteranges boundaries) joins the range's last packet
+// instead of leaving in one of its own
+class Cork {
+public:
+    Cork(int fd, bool enabled) : _fd(enabled ? fd : -1) {
+        set(1);
+    }
+    ~Cork() {
+        set(0);
+    }
+
+private:
+    int _fd;
+
+    void set(int value) {
+        if (_fd != -1) {
+            setsockopt(_fd, IPPROTO_TCP, TCP_CORK, &value, sizeof(value));
+        }
+    }
+};
+
+} // namespace
+
+OutputQueue::OutputQueue() : _data_offset(0) {
+}
+
+OutputQueue::~OutputQueue() {
+    clear();
+}
+
+void OutputQueue::push(const std::string& data) {
+    if (data.empty()) {
+        return;
+    }
+    _segments.push_back(OutputSegment());
+    _segments.back().data = data;
+}
+
+void OutputQueue::pushOwned(std::string& data) {
+    if (data.empty()) {
+        return;
+    }
+    _segments.push_back(OutputSegment());
+    _segments.back().data.swap(data);
+}
+
+void OutputQueue::pushFile(int fd, off_t offset, off_t length) {
+    if (length <= 0) {
+        return;
+    }
+    OutputSegment segment;
+    segment.fd = fd;
+    segment.offset = offset;
+    segment.length = length;
+    _segments.push_back(segment);
+}
+
+void OutputQueue::pushMapping(MappedFile* mapping, off_t offset, off_t length) {
+    if (length <= 0) {
+        mapping->release();
+        return;
+    }
+    OutputSegment segment;
+    segment.mapping = mapping;
+    segment.offset = offset;
+    segment.length = length;
+    _segments.push_back(segment);
+}
+
+void OutputQueue::adoptFd(int fd) {
+    _owned_fds.push_back(fd);
+}
+
+void OutputQueue::splice(OutputQueue& other) {
+    for (std::deque<OutputSegment>::iterator it = other._segments.begin(); it != other._segments.end(); ++it) {
+        _segments.push_back(OutputSegment());
+        OutputSegment& moved = _segments.back();
+        moved.data.swap(it->data); // the mapping reference moves along
+        moved.fd = it->fd;
+        moved.mapping = it->mapping;
+        moved.offset = it->offset;
+        moved.length = it->length;
+    }
+    if (!other._segments.empty() && other._data_offset > 0) {
+        std::deque<OutputSegment>::iterator first = _segments.end() - other._segments.size();
+        first->data.erase(0, other._data_offset);
+    }
+    _owned_fds.insert(_owned_fds.end(), other._owned_fds.begin(), other._owned_fds.end());
+    other._segments.clear();
+    other._owned_fds.clear();
+    other._data_offset = 0;
+}
+
+ssize_t OutputQueue::sendBytes(int socket_fd, TlsConnection* tls, const char* data, size_t length) {
+    if (tls) {
+        return tls->write(data, length);
+    }
+    return send(socket_fd, data, length, MSG_NOSIGNAL);
+}
+
+// One sendmsg() over the in-memory segments at the front; `attempted` is
+// how many bytes they hold
+ssize_t OutputQueue::sendGathered(int socket_fd, size_t& attempted) {
+    struct iovec iov[GATHER_MAX];
+    size_t count = 0;
+    attempted = 0;
+    std::deque<OutputSegment>::iterator it = _segments.begin();
+    for (; it != _segments.end() && it->fd == -1 && count < GATHER_MAX; ++it, ++count) {
+        if (it->mapping) {
+            iov[count].iov_base = const_cast<char*>(it->mapping->addr) + it->offset;
+            iov[count].iov_len = it->length;
+        } else {
+            size_t skip = count == 0 ? _data_offset : 0;
+            iov[count].iov_base = const_cast<char*>(it->data.data()) + skip;
+            iov[count].iov_len = it->data.length() - skip;
+        }
+        attempted += iov[count].iov_len;
+    }
+    struct msghdr message;
+    std::memset(&message, 0, sizeof(message));
+    message.msg_iov = iov;
+    message.msg_iovlen = count;
+    return sendmsg(socket_fd, &message, MSG_NOSIGNAL | (it != _segments.end() ? MSG_MORE : 0));
+}
+
+// Drops `bytes` sent from the in-memory segments at the front
+void OutputQueue::consume(size_t bytes) {
+    while (bytes > 0) {
+        OutputSegment& segment = _segments.front();
+        if (segment.mapping) {
+            size_t part = bytes < (size_t)segment.length ? bytes : (size_t)segment.length;
+            segment.offset += part;
+            segment.length -= part;
+            bytes -= part;
+            if (segment.length > 0) {
+                return;
+            }
+        } else {
+            size_t part = std::min(bytes, segment.data.length() - _data_offset);
+            _data_offset += part;
+            bytes -= part;
+            if (_data_offset < segment.data.length()) {
+                return;
+            }
+            _data_offset = 0;
+        }
+        popFront();
+    }
+}
+
+bool OutputQueue::dataAfterFile() const {
+    bool file_seen = false;
+    for (std::deque<OutputSegment>::const_iterator it = _segments.begin(); it != _segments.end(); ++it) {
+        if (file_seen) {
+            return true;
+        }
+        file_seen = it->fd != -1;
+    }
+    return false;
+}
+
+// With kTLS the kernel frames and encrypts whatever is written to the
+// socket, so send() and sendfile() stay zero-copy; only user-space TLS
+// needs the bytes handed to OpenSSL.
+OutputQueue::FlushResult OutputQueue::flush(int socket_fd, TlsConnection* tls) {
+    if (tls && tls->kernelSend()) {
+        tls = NULL;
+    }
+    Cork cork(socket_fd, !tls && dataAfterFile());
+    while (!_segments.empty()) {
+        OutputSegment& segment = _segments.front();
+
+        if (!tls && segment.fd == -1) {
+            size_t attempted;
+            ssize_t sent = sendGathered(socket_fd, attempted);
+            if (sent == -1) {
+                return (errno == EAGAIN || errno == EWOULDBLOCK) ? FLUSH_AGAIN : FLUSH_ERROR;
+            }
+            consume(sent); // pops what was sent in full
+            if ((size_t)sent < attempted) {
+                return FLUSH_AGAIN;
+            }
+            continue;
+        } else if (segment.mapping) {
+            ssize_t sent = sendBytes(socket_fd, tls, segment.mapping->addr + segment.offset, segment.length);
+            if (sent == -1) {
+                return (errno == EAGAIN || errno == EWOULDBLOCK) ? FLUSH_AGAIN : FLUSH_ERROR;
+            }
+            segment.offset += sent;
+            segment.length -= sent;
+            if (segment.length > 0) {
+                return FLUSH_AGAIN;
+            }
+        } else if (segment.fd == -1) {
+            ssize_t sent = sendBytes(socket_fd, tls, segment.data.data() + _data_offset,
+                                     segment.data.length() - _data_offset);
+            if (sent == -1) {
+                return (errno == EAGAIN || errno == EWOULDBLOCK) ? FLUSH_AGAIN : FLUSH_ERROR;
+            }
+            _data_offset += sent;
+            if (_data_offset < segment.data.length()) {
+                return FLUSH_AGAIN;
+            }
+            _data_offset = 0;
+        } else if (tls) {
+            // One TLS record at a time; a partial write re-reads the rest
+            char buffer[16384];
+            size_t chunk = segment.length < (off_t)sizeof(buffer) ? (size_t)segment.length : sizeof(buffer);
+            ssize_t got = pread(segment.fd, buffer, chunk, segment.offset);
+            if (got <= 0) {
+                return FLUSH_ERROR;
+            }
+            ssize_t sent = tls->write(buffer, got);
+            if (sent == -1) {
+                return errno == EAGAIN ? FLUSH_AGAIN : FLUSH_ERROR;
+            }
+            segment.offset += sent;
+            segment.length -= sent;
+            if (segment.length > 0) {
+                continue;
+            }
+        } else {
+            ssize_t sent = sendfile(socket_fd, segment.fd, &segment.offset, segment.length);
+            if (sent == -1) {
+                return (errno == EAGAIN || errno == EWOULDBLOCK) ? FLUSH_AGAIN : FLUSH_ERROR;
+            }
+            if (sent == 0) {
+                return FLUSH_ERROR; // file shrank underneath us
+            }
+            segment.length -= sent;
+            if (segment.length > 0) {
+                return FLUSH_AGAIN;
+            }
+        }
+        popFront();
+    }
+    return FLUSH_DONE;
+}
+
+size_t OutputQueue::take(OutputQueue& dest, size_t max) {
+    size_t moved = 0;
+    while (moved < max && !_segments.empty()) {
+        OutputSegment& segment = _segments.front();
+        size_t wanted = max - moved;
+        if (segment.fd == -1 && !segment.mapping) {
+            size_t available = segment.data.length() - _data_offset;
+            if (wanted < available) {
+                dest.push(segment.data.substr(_data_offset, wanted));
+                _data_offset += wanted;
+                return max;
+            }
+            if (_data_offset) {
+                dest.push(segment.data.substr(_data_offset));
+            } else {
+                dest.pushOwned(segment.data);
+            }
+            _data_offset = 0;
+            moved += available;
+            _segments.pop_front();
+        } else if ((off_t)wanted < segment.length) {
+            OutputSegment piece = segment;
+            piece.length = wanted;
+            if (piece.mapping) {
+                piece.mapping->retain();
+            }
+            dest._segments.push_back(piece);
+            segment.offset += wanted;
+            segment.length -= wanted;
+            return max;
+        } else {
+            dest._segments.push_back(segment); // the mapping reference moves along
+            moved += segment.length;
+            _segments.pop_front();
+        }
+    }
+
+    // An owned fd goes with the last range that reads from it
+    for (size_t i = 0; i < _owned_fds.size(); ) {
+        if (references(_owned_fds[i])) {
+            ++i;
+            continue;
+        }
+        if (dest.references(_owned_fds[i])) {
+            dest._owned_fds.push_back(_owned_fds[i]);
+        } else {
+            close(_owned_fds[i]);
+        }
+        _owned_fds.erase(_owned_fds.begin() + i);
+    }
+    return moved;
+}
+
+// Long-lived queues (HTTP/2 connections) release each file as soon as its
+// last range is sent instead of when the queue is cleared.
+void OutputQueue::popFront() {
+    OutputSegment& segment = _segments.front();
+    int fd = segment.fd;
+    if (segment.mapping) {
+        segment.mapping->release();
+    }
+    _segments.pop_front();
+    if (fd == -1 || references(fd)) {
+        return;
+    }
+    for (size_t i = 0; i < _owned_fds.size(); ++i) {
+        if (_owned_fds[i] == fd) {
+            close(fd);
+            _owned_fds.erase(_owned_fds.begin() + i);
+            break;
+        }
+    }
+}
+
+bool OutputQueue::references(int fd) const {
+    for (std::deque<OutputSegment>::const_iterator it = _segments.begin(); it != _segments.end(); ++it) {
+        if (it->fd == fd) {
+            return true;
+        }
+    }
+    return false;
+}
+
+size_t OutputQueue::pendingBytes() const {
+    size_t total = 0;
+    for (std::deque<OutputSegment>::const_iterator it = _segments.begin(); it != _segments.end(); ++it) {
+        total += (it->fd == -1 && !it->mapping) ? it->data.length() : (size_t)it->length;
+    }
+    return total - _data_offset;
+}
+
+size_t OutputQueue::memoryBytes() const {
+    size_t total = 0;
+    for (std::deque<OutputSegment>::const_iterator it = _segments.begin(); it != _segments.end(); ++it) {
+        if (it->fd == -1 && !it->mapping) {
+            total += it->data.capacity();
+        }
+    }
+    return total;
+}
+
+void OutputQueue::clear() {
+    while (!_segments.empty()) {
+        popFront();
+    }
+    _data_offset = 0;
+    for (size_t i = 0; i < _owned_fds.size(); ++i) {
+        close(_owned_fds[i]);
+    }
+    _owned_fds.clear();
+}
@@ -0,0 +1,510 @@
+#include "Proxy.hpp"
+#include "utils.hpp"
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <cstdlib>
+#include <cctype>
+
+// Virtual nodes per unit of weight on the consistent-hash ring.
+static const int RING_POINTS = 100;
+
+namespace {
+
+std::string toLower(const std::string& str) {
+    std::string result = str;
+    for (size_t i = 0; i < result.length(); ++i) {
+        result[i] = std::tolower(result[i]);
+    }
+    return result;
+}
+
+std::string trimSpaces(const std::string& str) {
+    size_t start = str.find_first_not_of(" \t");
+    if (start == std::string::npos) return "";
+    size_t end = str.find_last_not_of(" \t\r");
+    return str.substr(start, end - start + 1);
+}
+
+bool isHopByHop(const std::string& name) {
+    return name == "connection" || name == "keep-alive" || name == "proxy-connection"
+        || name == "te" || name == "upgrade" || name == "trailer";
+}
+
+std::string replaceAll(std::string str, const std::string& from, const std::string& to) {
+    size_t pos = 0;
+    while ((pos = str.find(from, pos)) != std::string::npos) {
+        str.replace(pos, from.length(), to);
+        pos += to.length();
+    }
+    return str;
+}
+
+}
+
+std::string UpstreamPeer::address() const {
+    return config.host + ":" + size_t_to_string(config.port);
+}
+
+UpstreamManager::UpstreamManager() {
+}
+
+UpstreamManager::~UpstreamManager() {
+    clear();
+}
+
+bool UpstreamManager::sameServers(const UpstreamConfig& a, const UpstreamConfig& b) {
+    if (a.servers.size() != b.servers.size()) {
+        return false;
+    }
+    for (size_t i = 0; i < a.servers.size(); ++i) {
+        if (a.servers[i].host != b.servers[i].host || a.servers[i].port != b.servers[i].port) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void UpstreamManager::buildRing(UpstreamGroup& group) {
+    group.ring.clear();
+    if (group.config.balance != UpstreamConfig::HASH) {
+        return;
+    }
+    for (size_t i = 0; i < group.peers.size(); ++i) {
+        std::string address = group.peers[i].address();
+        for (int j = 0; j < group.peers[i].config.weight * RING_POINTS; ++j) {
+            group.ring.push_back(std::make_pair(Proxy::hash(address + "#" + size_t_to_string(j)), i));
+        }
+    }
+    std::sort(group.ring.begin(), group.ring.end());
+}
+
+void UpstreamManager::closeIdle(UpstreamGroup& group) {
+    for (size_t i = 0; i < group.peers.size(); ++i) {
+        for (size_t j = 0; j < group.peers[i].idle.size(); ++j) {
+            close(group.peers[i].idle[j]);
+        }
+        group.peers[i].idle.clear();
+    }
+}
+
+void UpstreamManager::configure(const std::map<std::string, UpstreamConfig>& upstreams) {
+    std::map<std::string, UpstreamGroup> groups;
+
+    for (std::map<std::string, UpstreamConfig>::const_iterator it = upstreams.begin(); it != upstreams.end(); ++it) {
+        UpstreamGroup& group = groups[it->first];
+        std::map<std::string, UpstreamGroup>::iterator old = _groups.find(it->first);
+        if (old != _groups.end() && sameServers(old->second.config, it->second)) {
+            group.peers = old->second.peers; // keeps health state and idle sockets
+            old->second.peers.clear();
+            for (size_t i = 0; i < group.peers.size(); ++i) {
+                group.peers[i].config = it->second.servers[i];
+            }
+        } else {
+            for (size_t i = 0; i < it->second.servers.size(); ++i) {
+                UpstreamPeer peer;
+                peer.config = it->second.servers[i];
+                group.peers.push_back(peer);
+            }
+        }
+        group.config = it->second;
+        buildRing(group);
+    }
+
+    // Implicit host:port groups are not in the config; carry them over.
+    // Idle sockets of replaced or removed groups are closed.
+    for (std::map<std::string, UpstreamGroup>::iterator it = _groups.begin(); it != _groups.end(); ++it) {
+        if (!groups.count(it->first) && it->second.config.name.empty()) {
+            groups[it->first] = it->second;
+            it->second.peers.clear();
+        } else {
+            closeIdle(it->second);
+        }
+    }
+    _groups.swap(groups);
+}
+
+UpstreamGroup* UpstreamManager::group(const std::string& name) {
+    std::map<std::string, UpstreamGroup>::iterator it = _groups.find(name);
+    if (it != _groups.end()) {
+        return &it->second;
+    }
+    UpstreamServerConfig server;
+    if (!Config::parseHostPort(name, server.host, server.port)) {
+        return NULL;
+    }
+    UpstreamGroup& group = _groups[name];
+    group.config.servers.push_back(server); // name stays empty: implicit group
+    UpstreamPeer peer;
+    peer.config = server;
+    group.peers.push_back(peer);
+    return &group;
+}
+
+int UpstreamManager::select(UpstreamGroup& group, const std::string& hash_value, const std::set<size_t>& tried) {
+    time_t now = time(NULL);
+    std::vector<bool> usable(group.peers.size(), false);
+    bool any = false;
+    for (size_t i = 0; i < group.peers.size(); ++i) {
+        usable[i] = !tried.count(i) && group.peers[i].down_until <= now;
+        any = any || usable[i];
+    }
+    if (!any) {
+        // Everything is marked down: probe the untried ones anyway rather
+        // than failing every request until fail_timeout runs out.
+        for (size_t i = 0; i < group.peers.size(); ++i) {
+            usable[i] = !tried.count(i);
+            any = any || usable[i];
+        }
+        if (!any) {
+            return -1;
+        }
+    }
+
+    if (group.config.balance == UpstreamConfig::HASH && !group.ring.empty()) {
+        uint32_t point = Proxy::hash(hash_value);
+        size_t start = std::lower_bound(group.ring.begin(), group.ring.end(),
+                                        std::make_pair(point, (size_t)0)) - group.ring.begin();
+        for (size_t n = 0; n < group.ring.size(); ++n) {
+            size_t peer = group.ring[(start + n) % group.ring.size()].second;
+            if (usable[peer]) {
+                return peer;
+            }
+        }
+        return -1;
+    }
+
+    int best = -1;
+    if (group.config.balance == UpstreamConfig::LEAST_CONN) {
+        for (size_t i = 0; i < group.peers.size(); ++i) {
+            if (!usable[i]) continue;
+            if (best == -1 || group.peers[i].active * group.peers[best].config.weight
+                              < group.peers[best].active * group.peers[i].config.weight) {
+                best = i;
+            }
+        }
+        return best;
+    }
+
+    // Smooth weighted round-robin (as in nginx)
+    int total = 0;
+    for (size_t i = 0; i < group.peers.size(); ++i) {
+        if (!usable[i]) continue;
+        group.peers[i].current_weight += group.peers[i].config.weight;
+        total += group.peers[i].config.weight;
+        if (best == -1 || group.peers[i].current_weight > group.peers[best].current_weight) {
+            best = i;
+        }
+    }
+    group.peers[best].current_weight -= total;
+    return best;
+}
+
+int UpstreamManager::connect(UpstreamGroup& group, size_t index, bool& reused) {
+    UpstreamPeer& peer = group.peers[index];
+
+    while (!peer.idle.empty()) {
+        int fd = peer.idle.back();
+        peer.idle.pop_back();
+        // An idle socket that is readable was closed (or spoke out of turn)
+        char probe;
+        ssize_t n = recv(fd, &probe, 1, MSG_PEEK | MSG_DONTWAIT);
+        if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            reused = true;
+            peer.active++;
+            return fd;
+        }
+        close(fd);
+    }
+
+    reused = false;
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        LOG_ERROR("upstream socket() failed: " + std::string(strerror(errno)));
+        return -1;
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    struct sockaddr_in addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(peer.config.port);
+    if (inet_pton(AF_INET, peer.config.host.c_str(), &addr.sin_addr) != 1) {
+        LOG_ERROR("upstream address is not an IPv4 literal: " + peer.config.host);
+        close(fd);
+        return -1;
+    }
+    if (::connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == -1 && errno != EINPROGRESS) {
+        LOG_ERROR("connect to upstream " + peer.address() + " failed: " + std::string(strerror(errno)));
+        close(fd);
+        return -1;
+    }
+    peer.active++;
+    return fd;
+}
+
+UpstreamPeer* UpstreamManager::find(const std::string& group_name, size_t index, const std::string& address) {
+    std::map<std::string, UpstreamGroup>::iterator it = _groups.find(group_name);
+    if (it == _groups.end() || index >= it->second.peers.size()
+        || it->second.peers[index].address() != address) {
+        return NULL;
+    }
+    return &it->second.peers[index];
+}
+
+void UpstreamManager::release(const std::string& group_name, size_t index, const std::string& address, int fd, bool reusable) {
+    UpstreamPeer* peer = find(group_name, index, address);
+    if (peer && peer->active > 0) {
+        peer->active--;
+    }
+    if (fd == -1) {
+        return;
+    }
+    if (peer && reusable && peer->idle.size() < _groups[group_name].config.keepalive) {
+        peer->idle.push_back(fd);
+        return;
+    }
+    close(fd);
+}
+
+void UpstreamManager::reportFailure(const std::string& group_name, size_t index, const std::string& address) {
+    UpstreamPeer* peer = find(group_name, index, address);
+    if (!peer) {
+        return;
+    }
+    time_t now = time(NULL);
+    if (now - peer->fail_window_start > peer->config.fail_timeout) {
+        peer->fails = 0;
+        peer->fail_window_start = now;
+    }
+    peer->fails++;
+    if (peer->config.max_fails > 0 && peer->fails >= peer->config.max_fails) {
+        peer->down_until = now + peer->config.fail_timeout;
+        peer->fails = 0;
+        LOG_ERROR("upstream " + address + " marked down for " + size_t_to_string(peer->config.fail_timeout) + "s");
+    }
+}
+
+void UpstreamManager::reportSuccess(const std::string& group_name, size_t index, const std::string& address) {
+    UpstreamPeer* peer = find(group_name, index, address);
+    if (peer) {
+        peer->fails = 0;
+        peer->down_until = 0;
+    }
+}
+
+void UpstreamManager::clear() {
+    for (std::map<std::string, UpstreamGroup>::iterator it = _groups.begin(); it != _groups.end(); ++it) {
+        closeIdle(it->second);
+    }
+    _groups.clear();
+}
+
+ProxySession::ProxySession()
+    : client_fd(-1), upstream_fd(-1), peer(0), idempotent(true), head(false), request_sent(0),
+      reused(false), state(CONNECTING), status(0), framing(FRAME_NONE), remaining(0),
+      chunk_state(CHUNK_SIZE), upstream_keepalive(false), forwarded(false), paused(false),
+      connect_timeout(5), read_timeout(60), deadline(0) {
+}
+
+bool ProxySession::consumeBody(const char* data, size_t length) {
+    if (framing == FRAME_NONE) {
+        return true;
+    }
+    if (framing == FRAME_CLOSE) {
+        return false;
+    }
+    if (framing == FRAME_LENGTH) {
+        remaining -= length;
+        if (remaining < 0) {
+            upstream_keepalive = false; // sent more than it announced
+        }
+        return remaining <= 0;
+    }
+
+    size_t i = 0;
+    while (i < length) {
+        if (chunk_state == CHUNK_DATA) {
+            size_t take = std::min((size_t)remaining, length - i);
+            remaining -= take;
+            i += take;
+            if (remaining == 0) {
+                chunk_state = CHUNK_DATA_CRLF;
+            }
+            continue;
+        }
+        char c = data[i++];
+        if (c != '\n') {
+            if (chunk_state != CHUNK_DATA_CRLF) {
+                chunk_line += c;
+            }
+            continue;
+        }
+        if (chunk_state == CHUNK_DATA_CRLF) {
+            chunk_state = CHUNK_SIZE;
+        } else if (chunk_state == CHUNK_SIZE) {
+            remaining = std::strtoll(chunk_line.c_str(), NULL, 16);
+            chunk_line.clear();
+            chunk_state = remaining > 0 ? CHUNK_DATA : CHUNK_TRAILER;
+        } else {
+            bool last = trimSpaces(chunk_line).empty();
+            chunk_line.clear();
+            if (last) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+bool Proxy::parseResponseHead(const std::string& head, ProxySession& session, std::string& client_head) {
+    size_t line_end = head.find('\n');
+    std::string status_line = trimSpaces(head.substr(0, line_end));
+    if (status_line.compare(0, 5, "HTTP/") != 0 || status_line.length() < 12) {
+        return false;
+    }
+    bool http11 = status_line.compare(0, 8, "HTTP/1.1") == 0;
+    session.status = std::atoi(status_line.c_str() + 9);
+    if (session.status < 100 || session.status > 599) {
+        return false;
+    }
+
+    session.upstream_keepalive = http11;
+    bool chunked = false;
+    long long content_length = -1;
+    client_head = status_line + "\r\n";
+
+    size_t pos = line_end + 1;
+    while (pos < head.length()) {
+        size_t end = head.find('\n', pos);
+        if (end == std::string::npos) {
+            end = head.length();
+        }
+        std::string line = head.substr(pos, end - pos);
+        pos = end + 1;
+        if (!line.empty() && line[line.length() - 1] == '\r') {
+            line.erase(line.length() - 1);
+        }
+        if (line.empty()) {
+            break;
+        }
+        size_t colon = line.find(':');
+        if (colon == std::string::npos) {
+            continue;
+        }
+        std::string name = toLower(trimSpaces(line.substr(0, colon)));
+        std::string value = toLower(trimSpaces(line.substr(colon + 1)));
+
+        if (name == "connection") {
+            if (value.find("close") != std::string::npos) {
+                session.upstream_keepalive = false;
+            } else if (value.find("keep-alive") != std::string::npos) {
+                session.upstream_keepalive = true;
+            }
+        } else if (name == "transfer-encoding") {
+            chunked = value.find("chunked") != std::string::npos;
+        } else if (name == "content-length") {
+            content_length = std::strtoll(value.c_str(), NULL, 10);
+        }
+        if (isHopByHop(name)) {
+            continue;
+        }
+        client_head += line + "\r\n";
+    }
+    client_head += "Connection: close\r\n\r\n";
+
+    if (session.head || session.status < 200 || session.status == 204 || session.status == 304) {
+        session.framing = ProxySession::FRAME_NONE;
+    } else if (chunked) {
+        session.framing = ProxySession::FRAME_CHUNKED;
+    } else if (content_length >= 0) {
+        session.framing = content_length ? ProxySession::FRAME_LENGTH : ProxySession::FRAME_NONE;
+        session.remaining = content_length;
+    } else {
+        session.framing = ProxySession::FRAME_CLOSE;
+        session.upstream_keepalive = false;
+    }
+    return true;
+}
+
+std::string Proxy::buildRequest(const std::string& raw_head, const std::string& body, const std::string& uri,
+                                const std::string& client_addr, const std::string& scheme, bool keepalive,
+                                const std::string& request_id) {
+    size_t line_end = raw_head.find('\n');
+    std::string request_line = trimSpaces(raw_head.substr(0, line_end));
+    std::string method = request_line.substr(0, request_line.find(' '));
+
+    std::string request = method + " " + uri + " HTTP/1.1\r\n";
+    std::string forwarded_for;
+
+    size_t pos = line_end + 1;
+    while (pos < raw_head.length()) {
+        size_t end = raw_head.find('\n', pos);
+        if (end == std::string::npos) {
+            end = raw_head.length();
+        }
+        std::string line = raw_head.substr(pos, end - pos);
+        pos = end + 1;
+        if (!line.empty() && line[line.length() - 1] == '\r') {
+            line.erase(line.length() - 1);
+        }
+        if (line.empty()) {
+            break;
+        }
+        size_t colon = line.find(':');
+        if (colon == std::string::npos) {
+            continue;
+        }
+        std::string name = toLower(trimSpaces(line.substr(0, colon)));
+        if (isHopByHop(name) || name == "expect" || (name == "x-request-id" && !request_id.empty())) {
+            continue;
+        }
+        if (name == "x-forwarded-for") {
+            forwarded_for = trimSpaces(line.substr(colon + 1)) + ", ";
+            continue;
+        }
+        request += line + "\r\n";
+    }
+    request += "X-Forwarded-For: " + forwarded_for + client_addr + "\r\n";
+    request += "X-Forwarded-Proto: " + scheme + "\r\n";
+    if (!request_id.empty()) {
+        request += "X-Request-Id: " + request_id + "\r\n";
+    }
+    request += keepalive ? "Connection: keep-alive\r\n" : "Connection: close\r\n";
+    request += "\r\n";
+    request += body;
+    return request;
+}
+
+std::string Proxy::expandKey(const std::string& key, const std::string& uri, const std::string& host,
+                             const std::string& client_addr) {
+    size_t query = uri.find('?');
+    std::string result = key;
+    result = replaceAll(result, "$request_uri", uri);
+    result = replaceAll(result, "$uri", uri.substr(0, query));
+    result = replaceAll(result, "$args", query == std::string::npos ? "" : uri.substr(query + 1));
+    result = replaceAll(result, "$remote_addr", client_addr);
+    result = replaceAll(result, "$host", host);
+    return result;
+}
+
+uint32_t Proxy::hash(const std::string& value) {
+    // FNV-1a with a final avalanche so nearby keys spread over the ring
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < value.length(); ++i) {
+        h ^= (unsigned char)value[i];
+        h *= 16777619u;
+    }
+    h ^= h >> 16;
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35u;
+    h ^= h >> 16;
+    return h;
+}
@@ -0,0 +1,165 @@
+#include "RateLimiter.hpp"
+#include "utils.hpp"
+#include <ctime>
+
+const size_t LimitZone::NONE;
+
+LimitZone::LimitZone(const LimitZoneConfig& config)
+    : _config(config), _nodes(config.size), _buckets(config.size, NONE),
+      _lru_head(NONE), _lru_tail(NONE), _free(NONE), _evictions(0) {
+    for (size_t i = _nodes.size(); i-- > 0; ) {
+        _nodes[i].next = _free;
+        _free = i;
+    }
+}
+
+LimitZone::~LimitZone() {
+}
+
+size_t LimitZone::bucketOf(uint32_t key) const {
+    return (size_t)((key * 2654435761u) % _buckets.size());
+}
+
+size_t LimitZone::find(uint32_t key) const {
+    for (size_t i = _buckets[bucketOf(key)]; i != NONE; i = _nodes[i].next) {
+        if (_nodes[i].key == key) {
+            return i;
+        }
+    }
+    return NONE;
+}
+
+void LimitZone::unlinkLru(size_t index) {
+    Node& node = _nodes[index];
+    if (node.lru_prev != NONE) {
+        _nodes[node.lru_prev].lru_next = node.lru_next;
+    } else {
+        _lru_head = node.lru_next;
+    }
+    if (node.lru_next != NONE) {
+        _nodes[node.lru_next].lru_prev = node.lru_prev;
+    } else {
+        _lru_tail = node.lru_prev;
+    }
+}
+
+void LimitZone::touch(size_t index) {
+    if (_lru_head == index) {
+        return;
+    }
+    unlinkLru(index);
+    _nodes[index].lru_prev = NONE;
+    _nodes[index].lru_next = _lru_head;
+    if (_lru_head != NONE) {
+        _nodes[_lru_head].lru_prev = index;
+    }
+    _lru_head = index;
+    if (_lru_tail == NONE) {
+        _lru_tail = index;
+    }
+}
+
+void LimitZone::release(size_t index) {
+    size_t* link = &_buckets[bucketOf(_nodes[index].key)];
+    while (*link != index) {
+        link = &_nodes[*link].next;
+    }
+    *link = _nodes[index].next;
+    unlinkLru(index);
+    _nodes[index].next = _free;
+    _free = index;
+}
+
+// Existing node for `key`, or a new one taken from the free list or from
+// the least recently used client that holds no connection slot.
+size_t LimitZone::acquire(uint32_t key) {
+    size_t index = find(key);
+    if (index != NONE) {
+        touch(index);
+        return index;
+    }
+    if (_free == NONE) {
+        size_t victim = _lru_tail;
+        while (victim != NONE && _nodes[victim].connections > 0) {
+            victim = _nodes[victim].lru_prev;
+        }
+        if (victim == NONE) {
+            return NONE;
+        }
+        release(victim);
+        _evictions++;
+    }
+    index = _free;
+    _free = _nodes[index].next;
+
+    Node& node = _nodes[index];
+    node.key = key;
+    node.last_ms = 0;
+    node.excess = 0;
+    node.connections = 0;
+    size_t bucket = bucketOf(key);
+    node.next = _buckets[bucket];
+    _buckets[bucket] = index;
+    node.lru_prev = NONE;
+    node.lru_next = _lru_head;
+    if (_lru_head != NONE) {
+        _nodes[_lru_head].lru_prev = index;
+    }
+    _lru_head = index;
+    if (_lru_tail == NONE) {
+        _lru_tail = index;
+    }
+    return index;
+}
+
+LimitZone::Verdict LimitZone::request(uint32_t key, uint64_t now_ms, size_t burst, size_t delay,
+                                      uint64_t& delay_ms) {
+    size_t index = acquire(key);
+    if (index == NONE) {
+        return PASS; // request zones never pin entries; cannot happen
+    }
+    Node& node = _nodes[index];
+
+    // The debt drops by the tokens refilled since the last request and
+    // grows by the one this request takes. A client's first request is free.
+    uint64_t excess = 0;
+    if (node.last_ms) {
+        int64_t owed = (int64_t)node.excess - (int64_t)((now_ms - node.last_ms) * _config.rate / 1000) + 1000;
+        excess = owed > 0 ? (uint64_t)owed : 0;
+    }
+    if (excess > burst * 1000) {
+        return REJECT;
+    }
+    node.excess = excess;
+    node.last_ms = now_ms;
+    if (excess <= delay * 1000) {
+        return PASS;
+    }
+    delay_ms = (excess - delay * 1000) * 1000 / _config.rate;
+    return DELAY;
+}
+
+bool LimitZone::openConnection(uint32_t key, size_t max) {
+    size_t index = acquire(key);
+    if (index == NONE || _nodes[index].connections >= max) {
+        return false;
+    }
+    _nodes[index].connections++;
+    return true;
+}
+
+void LimitZone::closeConnection(uint32_t key) {
+    size_t index = find(key);
+    if (index == NONE || _nodes[index].connections == 0) {
+        return;
+    }
+    if (--_nodes[index].connections == 0) {
+        release(index);
+    }
+}
+
+uint64_t RateLimit::nowMs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
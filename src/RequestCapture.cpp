@@ -0,0 +1,137 @@
+#include "RequestCapture.hpp"
+#include "RequestTiming.hpp"
+#include "HttpRequest.hpp"
+#include "utils.hpp"
+#include <cctype>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+namespace {
+
+std::string jsonEscape(const std::string& str) {
+    std::string out;
+    for (size_t i = 0; i < str.length(); ++i) {
+        char c = str[i];
+        if (c == '"' || c == '\\') {
+            out += '\\';
+            out += c;
+        } else if ((unsigned char)c < 0x20) {
+            char buf[8];
+            std::snprintf(buf, sizeof(buf), "\\u%04x", (unsigned char)c);
+            out += buf;
+        } else {
+            out += c;
+        }
+    }
+    return out;
+}
+
+std::string lower(const std::string& str) {
+    std::string out = str;
+    for (size_t i = 0; i < out.size(); ++i) {
+        out[i] = std::tolower(static_cast<unsigned char>(out[i]));
+    }
+    return out;
+}
+
+// Replay sets its own framing and ids, and credentials stay out of the file
+bool captured(const std::string& name) {
+    std::string key = lower(name);
+    return key != "authorization" && key != "proxy-authorization" && key != "cookie"
+        && key != "content-length" && key != "connection" && key != "x-request-id";
+}
+
+uint64_t fnv1a(const std::string& data) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < data.size(); ++i) {
+        hash ^= (unsigned char)data[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+} // namespace
+
+RequestCapture::RequestCapture() : _fd(-1), _sample(1.0), _credit(0.0), _wall_offset(0) {
+}
+
+RequestCapture::~RequestCapture() {
+    close();
+}
+
+bool RequestCapture::open(const std::string& path, double sample) {
+    close();
+    if (path.empty()) {
+        return true;
+    }
+    _fd = ::open(path.c_str(), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+    if (_fd == -1) {
+        return false;
+    }
+    _sample = sample;
+    _credit = 0.0;
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    _wall_offset = (int64_t)now.tv_sec * 1000000 + now.tv_usec - (int64_t)RequestTiming::nowUs();
+    return true;
+}
+
+void RequestCapture::close() {
+    if (_fd != -1) {
+        ::close(_fd);
+        _fd = -1;
+    }
+}
+
+bool RequestCapture::sample() {
+    if (_fd == -1) {
+        return false;
+    }
+    _credit += _sample;
+    if (_credit < 1.0) {
+        return false;
+    }
+    _credit -= 1.0;
+    return true;
+}
+
+std::string RequestCapture::describe(const HttpRequest& request, const std::string& id, uint64_t arrival_us,
+                                     size_t body_bytes) const {
+    char number[64];
+    std::snprintf(number, sizeof(number), "%lld", (long long)((int64_t)arrival_us + _wall_offset));
+    std::string entry = std::string("{\"t\":") + number + ",\"id\":\"" + jsonEscape(id)
+        + "\",\"method\":\"" + request.methodToString() + "\",\"uri\":\"" + jsonEscape(request.getUri())
+        + "\",\"headers\":{";
+    const std::map<std::string, std::string>& headers = request.getHeaders();
+    bool first = true;
+    for (std::map<std::string, std::string>::const_iterator it = headers.begin(); it != headers.end(); ++it) {
+        if (!captured(it->first)) {
+            continue;
+        }
+        entry += (first ? "\"" : ",\"") + jsonEscape(it->first) + "\":\"" + jsonEscape(it->second) + "\"";
+        first = false;
+    }
+    entry += "},\"body_bytes\":" + size_t_to_string(body_bytes);
+    if (body_bytes > 0 && request.getBody().size() == body_bytes) {
+        std::snprintf(number, sizeof(number), "%016llx", (unsigned long long)fnv1a(request.getBody()));
+        entry += std::string(",\"body_fnv1a\":\"") + number + "\"";
+    }
+    return entry;
+}
+
+void RequestCapture::write(const std::string& entry, const RequestTiming& timing) {
+    if (_fd == -1) {
+        return;
+    }
+    char tail[128];
+    std::snprintf(tail, sizeof(tail), ",\"status\":%d,\"bytes\":%lu,\"ms\":%.3f}\n", timing.status,
+                  (unsigned long)timing.bytes, (double)timing.total() / 1000.0);
+    std::string line = entry + tail;
+    if (::write(_fd, line.data(), line.size()) == -1) {
+        LOG_ERROR("capture_requests: " + std::string(std::strerror(errno)));
+    }
+}
@@ -0,0 +1,188 @@
+#include "RequestTiming.hpp"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace {
+
+const char* const PHASE_NAMES[RequestTiming::PHASE_COUNT] = {
+    "headers", "delay", "body", "route", "cgi_spawn", "cgi_run", "handler", "upstream", "send"
+};
+
+// splitmix64: a bijection, so ids from one seed never repeat
+uint64_t mix(uint64_t value) {
+    value += 0x9e3779b97f4a7c15ULL;
+    value = (value ^ (value >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    value = (value ^ (value >> 27)) * 0x94d049bb133111ebULL;
+    return value ^ (value >> 31);
+}
+
+uint64_t idSeed() {
+    uint64_t seed = 0;
+    int fd = open("/dev/urandom", O_RDONLY | O_CLOEXEC);
+    if (fd == -1 || read(fd, &seed, sizeof(seed)) != (ssize_t)sizeof(seed)) {
+        seed = RequestTiming::nowUs() ^ ((uint64_t)getpid() << 32);
+    }
+    if (fd != -1) {
+        close(fd);
+    }
+    return seed;
+}
+
+std::string milliseconds(uint64_t us) {
+    char buffer[32];
+    std::snprintf(buffer, sizeof(buffer), "%.3f", (double)us / 1000.0);
+    return buffer;
+}
+
+} // namespace
+
+RequestTiming::RequestTiming() : status(0), bytes(0), _start(0), _last(0), _headers_done(false) {
+    std::memset(_phases, 0, sizeof(_phases));
+}
+
+void RequestTiming::begin(const std::string& request_id) {
+    id = request_id;
+    _start = _last = nowUs();
+}
+
+void RequestTiming::mark(Phase phase) {
+    uint64_t now = nowUs();
+    _phases[phase] += now - _last;
+    _last = now;
+}
+
+void RequestTiming::headersComplete() {
+    if (!_headers_done) {
+        _headers_done = true;
+        mark(HEADERS);
+    }
+}
+
+std::string RequestTiming::breakdown() const {
+    std::string line = "total=" + milliseconds(total());
+    for (int i = 0; i < PHASE_COUNT; ++i) {
+        line += std::string(" ") + PHASE_NAMES[i] + "=" + milliseconds(_phases[i]);
+    }
+    return line;
+}
+
+uint64_t RequestTiming::nowUs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+const char* RequestTiming::phaseName(Phase phase) {
+    return PHASE_NAMES[phase];
+}
+
+std::string RequestTiming::newId() {
+    static uint64_t seed = idSeed();
+    static uint64_t counter = 0;
+    char buffer[17];
+    std::snprintf(buffer, sizeof(buffer), "%016llx", (unsigned long long)mix(seed + counter++));
+    return buffer;
+}
+
+bool RequestTiming::validId(const std::string& id) {
+    if (id.empty() || id.size() > 64) {
+        return false;
+    }
+    for (size_t i = 0; i < id.size(); ++i) {
+        char c = id[i];
+        bool plain = (c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z')
+                     || c == '-' || c == '_' || c == '.' || c == ':';
+        if (!plain) {
+            return false;
+        }
+    }
+    return true;
+}
+
+std::string RequestTiming::addHeader(const std::string& response, const std::string& id) {
+    size_t line_end = response.find("\r\n");
+    if (id.empty() || line_end == std::string::npos) {
+        return response;
+    }
+    std::string result;
+    result.reserve(response.size() + id.size() + 16);
+    result.append(response, 0, line_end + 2);
+    result += "X-Request-Id: " + id + "\r\n";
+    result.append(response, line_end + 2, std::string::npos);
+    return result;
+}
+
+int RequestTiming::statusOf(const std::string& response) {
+    if (response.compare(0, 5, "HTTP/") != 0) {
+        return 0;
+    }
+    size_t space = response.find(' ');
+    if (space == std::string::npos || space + 4 > response.size()) {
+        return 0;
+    }
+    return std::atoi(response.c_str() + space + 1);
+}
+
+TimingStats::TimingStats() : _requests(0) {
+    std::memset(_sum, 0, sizeof(_sum));
+    std::memset(_max, 0, sizeof(_max));
+    std::memset(_histogram, 0, sizeof(_histogram));
+}
+
+void TimingStats::record(const RequestTiming& timing) {
+    _requests++;
+    for (int column = 0; column <= RequestTiming::PHASE_COUNT; ++column) {
+        uint64_t us = column == RequestTiming::PHASE_COUNT ? timing.total()
+                                                          : timing.phase(static_cast<RequestTiming::Phase>(column));
+        _sum[column] += us;
+        if (us > _max[column]) {
+            _max[column] = us;
+        }
+        size_t bucket = 0;
+        while (bucket < BUCKETS - 1 && (1ULL << bucket) <= us) {
+            bucket++;
+        }
+        _histogram[column][bucket]++;
+    }
+}
+
+// Upper bound of the bucket holding the percentile, capped by the maximum
+uint64_t TimingStats::percentile(size_t column, double fraction) const {
+    size_t wanted = (size_t)(fraction * (double)_requests + 0.999999);
+    size_t seen = 0;
+    for (size_t bucket = 0; bucket < BUCKETS; ++bucket) {
+        seen += _histogram[column][bucket];
+        if (seen >= wanted) {
+            uint64_t bound = 1ULL << bucket;
+            return bound < _max[column] ? bound : _max[column];
+        }
+    }
+    return _max[column];
+}
+
+// Phases no request spent time in are left out
+std::string TimingStats::statsLine() const {
+    char buffer[128];
+    std::snprintf(buffer, sizeof(buffer), "%lu requests, avg/p99/max ms:", (unsigned long)_requests);
+    std::string line = buffer;
+    if (_requests == 0) {
+        return line + " -";
+    }
+    for (int i = 0; i <= RequestTiming::PHASE_COUNT; ++i) {
+        int column = (i + RequestTiming::PHASE_COUNT) % (RequestTiming::PHASE_COUNT + 1); // total first
+        if (_max[column] == 0 && column != RequestTiming::PHASE_COUNT) {
+            continue;
+        }
+        const char* name = column == RequestTiming::PHASE_COUNT
+                           ? "total" : RequestTiming::phaseName(static_cast<RequestTiming::Phase>(column));
+        std::snprintf(buffer, sizeof(buffer), " %s %.3f/%.3f/%.3f", name,
+                      (double)_sum[column] / (double)_requests / 1000.0,
+                      (double)percentile(column, 0.99) / 1000.0, (double)_max[column] / 1000.0);
+        line += buffer;
+    }
+    return line;
+}
@@ -0,0 +1,256 @@
+#include "ResponseCache.hpp"
+#include "utils.hpp"
+#include <cstdio>
+#include <cstdlib>
+#include <cctype>
+
+namespace {
+
+std::string toLower(const std::string& str) {
+    std::string result = str;
+    for (size_t i = 0; i < result.length(); ++i) {
+        result[i] = std::tolower(result[i]);
+    }
+    return result;
+}
+
+std::string trimSpaces(const std::string& str) {
+    size_t start = str.find_first_not_of(" \t");
+    if (start == std::string::npos) return "";
+    size_t end = str.find_last_not_of(" \t\r");
+    return str.substr(start, end - start + 1);
+}
+
+// Value of "name=<seconds>" inside a Cache-Control header, or -1.
+long directiveSeconds(const std::string& cache_control, const std::string& name) {
+    size_t pos = 0;
+    while ((pos = cache_control.find(name + "=", pos)) != std::string::npos) {
+        if (pos == 0 || cache_control[pos - 1] == ' ' || cache_control[pos - 1] == ',') {
+            return std::strtol(cache_control.c_str() + pos + name.length() + 1, NULL, 10);
+        }
+        pos += name.length();
+    }
+    return -1;
+}
+
+bool hasDirective(const std::string& cache_control, const std::string& name) {
+    size_t pos = 0;
+    while ((pos = cache_control.find(name, pos)) != std::string::npos) {
+        size_t end = pos + name.length();
+        bool starts = pos == 0 || cache_control[pos - 1] == ' ' || cache_control[pos - 1] == ',';
+        bool ends = end == cache_control.length() || cache_control[end] == ',' || cache_control[end] == ' '
+            || cache_control[end] == '=';
+        if (starts && ends) {
+            return true;
+        }
+        pos = end;
+    }
+    return false;
+}
+
+}
+
+ResponseCache::ResponseCache(size_t max_bytes)
+    : _max_bytes(max_bytes), _used_bytes(0), _hits(0), _stale_hits(0), _misses(0) {
+}
+
+ResponseCache::~ResponseCache() {
+}
+
+ResponseCache::Status ResponseCache::lookup(const std::string& key, std::string& response, time_t& age) {
+    std::map<std::string, Entry>::iterator it = _entries.find(key);
+    if (it == _entries.end()) {
+        _misses++;
+        return MISS;
+    }
+    Entry& entry = it->second;
+    time_t now = time(NULL);
+    if (now > entry.stale_until) {
+        evict(key);
+        _misses++;
+        return MISS;
+    }
+    _lru.splice(_lru.begin(), _lru, entry.lru_pos);
+    response = entry.response;
+    age = now - entry.stored;
+    if (now <= entry.expires) {
+        _hits++;
+        return HIT;
+    }
+    _stale_hits++;
+    return STALE;
+}
+
+bool ResponseCache::beginRefresh(const std::string& key) {
+    std::map<std::string, Entry>::iterator it = _entries.find(key);
+    if (it == _entries.end() || it->second.refreshing) {
+        return false;
+    }
+    it->second.refreshing = true;
+    return true;
+}
+
+void ResponseCache::endRefresh(const std::string& key) {
+    std::map<std::string, Entry>::iterator it = _entries.find(key);
+    if (it != _entries.end()) {
+        it->second.refreshing = false;
+    }
+}
+
+bool ResponseCache::store(const std::string& key, const std::string& uri, const std::string& response,
+                          long default_ttl, long default_stale) {
+    int status = response.length() > 12 ? std::atoi(response.c_str() + 9) : 0;
+    if (status >= 500 || status == 0) {
+        endRefresh(key);
+        return false;
+    }
+    long ttl;
+    long stale;
+    if (!freshness(response, default_ttl, default_stale, ttl, stale) || ttl <= 0
+        || response.length() > _max_bytes / 4) {
+        evict(key);
+        return false;
+    }
+
+    evict(key);
+    time_t now = time(NULL);
+    _lru.push_front(key);
+    Entry& entry = _entries[key];
+    entry.response = response;
+    entry.uri = uri;
+    entry.stored = now;
+    entry.expires = now + ttl;
+    entry.stale_until = entry.expires + stale;
+    entry.refreshing = false;
+    entry.lru_pos = _lru.begin();
+    _used_bytes += key.length() + response.length();
+    trim();
+    return true;
+}
+
+size_t ResponseCache::purge(const std::string& prefix) {
+    size_t purged = 0;
+    std::map<std::string, Entry>::iterator it = _entries.begin();
+    while (it != _entries.end()) {
+        std::map<std::string, Entry>::iterator current = it++;
+        if (current->second.uri.compare(0, prefix.length(), prefix) == 0) {
+            evict(current->first);
+            purged++;
+        }
+    }
+    LOG_INFO("cgi cache: purged " + size_t_to_string(purged) + " entries under " + prefix);
+    return purged;
+}
+
+void ResponseCache::evict(const std::string& key) {
+    std::map<std::string, Entry>::iterator it = _entries.find(key);
+    if (it == _entries.end()) {
+        return;
+    }
+    _used_bytes -= key.length() + it->second.response.length();
+    _lru.erase(it->second.lru_pos);
+    _entries.erase(it);
+}
+
+void ResponseCache::trim() {
+    while (!_lru.empty() && _used_bytes > _max_bytes) {
+        evict(_lru.back());
+    }
+}
+
+void ResponseCache::setMaxBytes(size_t max_bytes) {
+    _max_bytes = max_bytes;
+    trim();
+}
+
+void ResponseCache::clear() {
+    _entries.clear();
+    _lru.clear();
+    _used_bytes = 0;
+}
+
+bool ResponseCache::freshness(const std::string& response, long default_ttl, long default_stale,
+                              long& ttl, long& stale) {
+    int status = response.length() > 12 ? std::atoi(response.c_str() + 9) : 0;
+    if (status != 200 && status != 203 && status != 301 && status != 404 && status != 410) {
+        return false;
+    }
+    ttl = default_ttl;
+    stale = default_stale;
+
+    size_t head_end = response.find("\r\n\r\n");
+    size_t pos = response.find('\n');
+    std::string expires;
+    std::string date;
+    bool max_age = false;
+    while (pos != std::string::npos && pos < head_end) {
+        size_t end = response.find('\n', pos + 1);
+        std::string line = response.substr(pos + 1, end == std::string::npos ? std::string::npos : end - pos - 1);
+        pos = end;
+        size_t colon = line.find(':');
+        if (colon == std::string::npos) {
+            continue;
+        }
+        std::string name = toLower(trimSpaces(line.substr(0, colon)));
+        std::string value = trimSpaces(line.substr(colon + 1));
+        if (name == "set-cookie") {
+            return false;
+        } else if (name == "cache-control") {
+            std::string directives = toLower(value);
+            if (hasDirective(directives, "no-store") || hasDirective(directives, "no-cache")
+                || hasDirective(directives, "private")) {
+                return false;
+            }
+            long seconds = directiveSeconds(directives, "s-maxage");
+            if (seconds < 0) {
+                seconds = directiveSeconds(directives, "max-age");
+            }
+            if (seconds >= 0) {
+                ttl = seconds;
+                max_age = true;
+            }
+            seconds = directiveSeconds(directives, "stale-while-revalidate");
+            if (seconds >= 0) {
+                stale = seconds;
+            }
+        } else if (name == "expires") {
+            expires = value;
+        } else if (name == "date") {
+            date = value;
+        }
+    }
+
+    if (!max_age && !expires.empty()) {
+        time_t expires_at;
+        time_t now = time(NULL);
+        if (!date.empty()) {
+            parse_http_date(date, now);
+        }
+        // An unparsable Expires means "already expired"
+        ttl = parse_http_date(expires, expires_at) && expires_at > now ? (long)(expires_at - now) : 0;
+    }
+    return true;
+}
+
+std::string ResponseCache::annotate(const std::string& response, const std::string& status, time_t age) {
+    size_t line_end = response.find("\r\n");
+    if (line_end == std::string::npos) {
+        return response;
+    }
+    std::string headers = "X-Cache-Status: " + status + "\r\n";
+    if (status != "MISS") {
+        headers += "Age: " + size_t_to_string(age) + "\r\n";
+    }
+    return response.substr(0, line_end + 2) + headers + response.substr(line_end + 2);
+}
+
+std::string ResponseCache::statsLine() const {
+    char buffer[256];
+    size_t lookups = _hits + _stale_hits + _misses;
+    std::snprintf(buffer, sizeof(buffer),
+                  "%lu entries, %lu bytes, %lu hits, %lu stale hits, %lu misses, hit rate %.1f%%",
+                  (unsigned long)_entries.size(), (unsigned long)_used_bytes, (unsigned long)_hits,
+                  (unsigned long)_stale_hits, (unsigned long)_misses,
+                  lookups ? (double)(_hits + _stale_hits) * 100.0 / (double)lookups : 0.0);
+    return std::string(buffer);
+}
@@ -0,0 +1,278 @@
+#include "ResumableUpload.hpp"
+#include "Multipart.hpp"
+#include <cerrno>
+#include <cctype>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+
+const char PARTIAL_DIR[] = "/.partial";
+const size_t ID_BYTES = 16;
+
+std::string randomId() {
+    unsigned char bytes[ID_BYTES];
+    int fd = open("/dev/urandom", O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return "";
+    }
+    ssize_t got = read(fd, bytes, sizeof(bytes));
+    close(fd);
+    if (got != static_cast<ssize_t>(sizeof(bytes))) {
+        return "";
+    }
+    static const char hex[] = "0123456789abcdef";
+    std::string id;
+    for (size_t i = 0; i < sizeof(bytes); ++i) {
+        id += hex[bytes[i] >> 4];
+        id += hex[bytes[i] & 15];
+    }
+    return id;
+}
+
+// Ids come from request paths; anything else could name another file
+bool validId(const std::string& id) {
+    if (id.size() != ID_BYTES * 2) {
+        return false;
+    }
+    for (size_t i = 0; i < id.size(); ++i) {
+        if (!std::isxdigit(static_cast<unsigned char>(id[i])) || std::isupper(static_cast<unsigned char>(id[i]))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool writeAll(int fd, const std::string& data) {
+    size_t done = 0;
+    while (done < data.size()) {
+        ssize_t written = write(fd, data.data() + done, data.size() - done);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        done += written;
+    }
+    return true;
+}
+
+} // namespace
+
+ResumableUpload::ResumableUpload(const std::string& dir, const std::string& id, int fd)
+    : _dir(dir), _id(id), _fd(fd), _offset(0), _length(0), _modified(0), _write_error(0) {
+}
+
+ResumableUpload::~ResumableUpload() {
+    if (_fd != -1) {
+        close(_fd); // drops the lock; what was appended stays
+    }
+}
+
+std::string ResumableUpload::dataPath() const {
+    return _dir + PARTIAL_DIR + "/" + _id;
+}
+
+std::string ResumableUpload::infoPath() const {
+    return dataPath() + ".info";
+}
+
+ResumableUpload* ResumableUpload::create(const std::string& dir, const std::string& filename, off_t length,
+                                         std::string& error) {
+    mkdir(dir.c_str(), 0755);
+    mkdir((dir + PARTIAL_DIR).c_str(), 0700);
+    std::string id = randomId();
+    if (id.empty()) {
+        error = "cannot read /dev/urandom";
+        return NULL;
+    }
+    std::string path = dir + PARTIAL_DIR + "/" + id;
+    int fd = ::open(path.c_str(), O_WRONLY | O_APPEND | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        error = "cannot create " + path + ": " + std::strerror(errno);
+        return NULL;
+    }
+    flock(fd, LOCK_EX | LOCK_NB);
+    ResumableUpload* upload = new ResumableUpload(dir, id, fd);
+    upload->_length = length;
+    upload->_filename = filename;
+    upload->_modified = time(NULL);
+
+    // Written aside and renamed so open() never reads half of it
+    char line[64];
+    std::snprintf(line, sizeof(line), "length %lld\n", static_cast<long long>(length));
+    std::string info = std::string(line) + "name " + filename + "\n";
+    std::string temp = upload->infoPath() + ".tmp";
+    int info_fd = ::open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    bool written = info_fd != -1 && writeAll(info_fd, info);
+    if (info_fd != -1) {
+        close(info_fd);
+    }
+    if (!written || rename(temp.c_str(), upload->infoPath().c_str()) != 0) {
+        error = "cannot write " + upload->infoPath() + ": " + std::strerror(errno);
+        unlink(temp.c_str());
+        unlink(path.c_str());
+        delete upload;
+        return NULL;
+    }
+    return upload;
+}
+
+ResumableUpload* ResumableUpload::open(const std::string& dir, const std::string& id, long timeout,
+                                       OpenResult& result) {
+    result = OPEN_MISSING;
+    if (!validId(id)) {
+        return NULL;
+    }
+    ResumableUpload probe(dir, id, -1);
+    std::ifstream info(probe.infoPath().c_str());
+    std::string key;
+    bool has_length = false;
+    while (info >> key) {
+        if (key == "length") {
+            long long length = -1;
+            info >> length;
+            probe._length = length;
+            has_length = length >= 0;
+        } else if (key == "name") {
+            info >> probe._filename;
+        }
+    }
+    if (!has_length || probe._filename.empty()) {
+        return NULL;
+    }
+
+    int fd = ::open(probe.dataPath().c_str(), O_WRONLY | O_APPEND | O_CLOEXEC);
+    if (fd == -1) {
+        result = errno == ENOENT ? OPEN_MISSING : OPEN_ERROR;
+        return NULL;
+    }
+    if (flock(fd, LOCK_EX | LOCK_NB) == -1) {
+        result = errno == EWOULDBLOCK ? OPEN_BUSY : OPEN_ERROR;
+        close(fd);
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1 || st.st_size > probe._length) {
+        result = OPEN_ERROR;
+        close(fd);
+        return NULL;
+    }
+    if (timeout > 0 && st.st_mtime + timeout < time(NULL)) {
+        unlink(probe.dataPath().c_str());
+        unlink(probe.infoPath().c_str());
+        close(fd);
+        return NULL;
+    }
+
+    ResumableUpload* upload = new ResumableUpload(dir, id, fd);
+    upload->_length = probe._length;
+    upload->_filename = probe._filename;
+    upload->_offset = st.st_size;
+    upload->_modified = st.st_mtime;
+    result = OPEN_OK;
+    return upload;
+}
+
+// An upload is as old as its last append, so the .info files go by the
+// mtime of their data file; uploads being appended to are skipped.
+size_t ResumableUpload::expire(const std::string& dir, long timeout) {
+    std::string partial = dir + PARTIAL_DIR;
+    DIR* listing = opendir(partial.c_str());
+    if (!listing || timeout <= 0) {
+        if (listing) {
+            closedir(listing);
+        }
+        return 0;
+    }
+    time_t cutoff = time(NULL) - timeout;
+    size_t removed = 0;
+    struct dirent* entry;
+    while ((entry = readdir(listing)) != NULL) {
+        std::string name = entry->d_name;
+        if (name == "." || name == "..") {
+            continue;
+        }
+        std::string path = partial + "/" + name;
+        size_t suffix = name.find('.');
+        std::string data = partial + "/" + name.substr(0, suffix);
+        struct stat st;
+        if (stat(data.c_str(), &st) == -1 && stat(path.c_str(), &st) == -1) {
+            continue;
+        }
+        if (st.st_mtime >= cutoff) {
+            continue;
+        }
+        int fd = ::open(data.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd != -1 && flock(fd, LOCK_EX | LOCK_NB) == -1) {
+            close(fd);
+            continue;
+        }
+        if (unlink(path.c_str()) == 0 && suffix == std::string::npos) {
+            removed++;
+        }
+        if (fd != -1) {
+            close(fd);
+        }
+    }
+    closedir(listing);
+    return removed;
+}
+
+bool ResumableUpload::append(const char* data, size_t length) {
+    while (length > 0) {
+        ssize_t written = write(_fd, data, length);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            _write_error = errno;
+            return false;
+        }
+        data += written;
+        length -= written;
+        _offset += written;
+    }
+    _modified = time(NULL);
+    return true;
+}
+
+bool ResumableUpload::finish(std::string& saved_as) {
+    std::string data = dataPath();
+    for (int attempt = 0; attempt < 10000; ++attempt) {
+        std::string candidate = UploadWriter::numberedName(_filename, attempt);
+        std::string path = _dir + "/" + candidate;
+        int result = renameat2(AT_FDCWD, data.c_str(), AT_FDCWD, path.c_str(), RENAME_NOREPLACE);
+        if (result == -1 && errno == EINVAL) {
+            // No RENAME_NOREPLACE on this filesystem: link() fails on an
+            // existing name just the same
+            result = link(data.c_str(), path.c_str());
+            if (result == 0) {
+                unlink(data.c_str());
+            }
+        }
+        if (result == 0) {
+            unlink(infoPath().c_str());
+            saved_as = candidate;
+            return true;
+        }
+        if (errno != EEXIST) {
+            return false;
+        }
+    }
+    errno = EEXIST;
+    return false;
+}
+
+bool ResumableUpload::cancel() {
+    unlink(infoPath().c_str());
+    return unlink(dataPath().c_str()) == 0;
+}
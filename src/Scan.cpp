@@ -0,0 +1,200 @@
+#include "Scan.hpp"
+#include <cstring>
+
+#if defined(__SSE2__) && defined(__GNUC__)
+#define SCAN_SSE2 1
+#include <immintrin.h>
+#endif
+
+namespace {
+
+// The offset past the terminator whose first '\n' is at `i`, npos if the
+// bytes around it do not form one (yet)
+inline size_t terminatorAt(const char* data, size_t length, size_t i) {
+    if (i + 1 < length && data[i + 1] == '\n') {
+        return i + 2;
+    }
+    if (i > 0 && i + 2 < length && data[i - 1] == '\r' && data[i + 1] == '\r' && data[i + 2] == '\n') {
+        return i + 3;
+    }
+    return Scan::npos;
+}
+
+// A terminator is at most four bytes: back up far enough to see one that
+// began before `from`
+inline size_t scanStart(size_t from) {
+    return from > 3 ? from - 3 : 0;
+}
+
+inline bool tokenChar(unsigned char c) {
+    unsigned char folded = c | 0x20;
+    if ((folded >= 'a' && folded <= 'z') || (c >= '0' && c <= '9')) {
+        return true;
+    }
+    return c > 0x20 && c < 0x7f && std::strchr("!#$%&'*+-.^_`|~", c) != NULL;
+}
+
+inline unsigned char lowerAscii(unsigned char c) {
+    return (c >= 'A' && c <= 'Z') ? c + 0x20 : c;
+}
+
+#ifdef SCAN_SSE2
+
+size_t headerEndSse2(const char* data, size_t length, size_t from) {
+    size_t i = scanStart(from);
+    const __m128i newline = _mm_set1_epi8('\n');
+    for (; i + 16 <= length; i += 16) {
+        __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+        unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(block, newline));
+        while (mask) {
+            size_t end = terminatorAt(data, length, i + __builtin_ctz(mask));
+            if (end != Scan::npos) {
+                return end;
+            }
+            mask &= mask - 1;
+        }
+    }
+    return Scan::headerEndPortable(data, length, i + 3);
+}
+
+__attribute__((target("avx2")))
+size_t headerEndAvx2(const char* data, size_t length, size_t from) {
+    size_t i = scanStart(from);
+    const __m256i newline = _mm256_set1_epi8('\n');
+    for (; i + 32 <= length; i += 32) {
+        __m256i block = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i));
+        unsigned mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(block, newline));
+        while (mask) {
+            size_t end = terminatorAt(data, length, i + __builtin_ctz(mask));
+            if (end != Scan::npos) {
+                return end;
+            }
+            mask &= mask - 1;
+        }
+    }
+    return headerEndSse2(data, length, i + 3);
+}
+
+inline __m128i inRange(__m128i bytes, char low, char high) {
+    return _mm_and_si128(_mm_cmpgt_epi8(bytes, _mm_set1_epi8(low - 1)),
+                         _mm_cmplt_epi8(bytes, _mm_set1_epi8(high + 1)));
+}
+
+inline __m128i lower16(__m128i bytes) {
+    return _mm_add_epi8(bytes, _mm_and_si128(inRange(bytes, 'A', 'Z'), _mm_set1_epi8(0x20)));
+}
+
+typedef size_t (*HeaderEndKernel)(const char*, size_t, size_t);
+
+HeaderEndKernel pickHeaderEnd(const char*& name) {
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        name = "avx2";
+        return headerEndAvx2;
+    }
+    name = "sse2";
+    return headerEndSse2;
+}
+
+const char* g_kernel_name = "sse2";
+const HeaderEndKernel g_header_end = pickHeaderEnd(g_kernel_name);
+
+#endif
+
+} // namespace
+
+size_t Scan::headerEndPortable(const char* data, size_t length, size_t from) {
+    size_t i = scanStart(from);
+    while (i < length) {
+        const void* hit = std::memchr(data + i, '\n', length - i);
+        if (!hit) {
+            return npos;
+        }
+        i = static_cast<const char*>(hit) - data;
+        size_t end = terminatorAt(data, length, i);
+        if (end != npos) {
+            return end;
+        }
+        ++i;
+    }
+    return npos;
+}
+
+bool Scan::isTokenPortable(const char* data, size_t length) {
+    for (size_t i = 0; i < length; ++i) {
+        if (!tokenChar(static_cast<unsigned char>(data[i]))) {
+            return false;
+        }
+    }
+    return length > 0;
+}
+
+bool Scan::equalsIgnoreCasePortable(const char* a, const char* b, size_t length) {
+    for (size_t i = 0; i < length; ++i) {
+        if (lowerAscii(static_cast<unsigned char>(a[i])) != lowerAscii(static_cast<unsigned char>(b[i]))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+#ifdef SCAN_SSE2
+
+size_t Scan::headerEnd(const char* data, size_t length, size_t from) {
+    return g_header_end(data, length, from);
+}
+
+// Letters, digits and '-' are checked sixteen at a time; a block holding
+// anything else (or the tail) goes through the full tchar test
+bool Scan::isToken(const char* data, size_t length) {
+    if (length == 0) {
+        return false;
+    }
+    size_t i = 0;
+    for (; i + 16 <= length; i += 16) {
+        __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+        __m128i common = _mm_or_si128(inRange(_mm_or_si128(block, _mm_set1_epi8(0x20)), 'a', 'z'),
+                                      _mm_or_si128(inRange(block, '0', '9'),
+                                                   _mm_cmpeq_epi8(block, _mm_set1_epi8('-'))));
+        if (_mm_movemask_epi8(common) != 0xFFFF && !isTokenPortable(data + i, 16)) {
+            return false;
+        }
+    }
+    return i == length || isTokenPortable(data + i, length - i);
+}
+
+bool Scan::equalsIgnoreCase(const char* a, const char* b, size_t length) {
+    size_t i = 0;
+    for (; i + 16 <= length; i += 16) {
+        __m128i left = lower16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i)));
+        __m128i right = lower16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i)));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(left, right)) != 0xFFFF) {
+            return false;
+        }
+    }
+    return equalsIgnoreCasePortable(a + i, b + i, length - i);
+}
+
+const char* Scan::kernel() {
+    return g_kernel_name;
+}
+
+#else
+
+size_t Scan::headerEnd(const char* data, size_t length, size_t from) {
+    return headerEndPortable(data, length, from);
+}
+
+bool Scan::isToken(const char* data, size_t length) {
+    return isTokenPortable(data, length);
+}
+
+bool Scan::equalsIgnoreCase(const char* a, const char* b, size_t length) {
+    return equalsIgnoreCasePortable(a, b, length);
+}
+
+const char* Scan::kernel() {
+    return "portable";
+}
+
+#endif
@@ -0,0 +1,348 @@
+#include "StaticBundle.hpp"
+#include "Compression.hpp"
+#include "utils.hpp"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <cerrno>
+#include <cstring>
+#include <cstdio>
+
+namespace {
+
+struct PackedFile {
+    std::string path;   // relative, "/css/site.css"
+    std::string source;
+    struct stat st;
+
+    bool operator<(const PackedFile& other) const { return path < other.path; }
+};
+
+std::string makeSignature(const struct stat& st) {
+    std::ostringstream signature;
+    signature << st.st_dev << ":" << st.st_ino << ":" << st.st_size << ":" << st.st_mtime;
+    return signature.str();
+}
+
+// Regular files below `dir`; symlinks to files are followed, symlinks to
+// directories are not, so a link cycle cannot recurse forever.
+bool collect(const std::string& dir, const std::string& relative, std::vector<PackedFile>& files,
+             std::string& error) {
+    DIR* handle = opendir(dir.c_str());
+    if (!handle) {
+        error = "cannot open " + dir + ": " + strerror(errno);
+        return false;
+    }
+    bool ok = true;
+    struct dirent* entry;
+    while (ok && (entry = readdir(handle)) != NULL) {
+        std::string name = entry->d_name;
+        if (name == "." || name == "..") {
+            continue;
+        }
+        PackedFile file;
+        file.path = relative + "/" + name;
+        file.source = dir + "/" + name;
+        if (lstat(file.source.c_str(), &file.st) == -1) {
+            continue;
+        }
+        if (S_ISDIR(file.st.st_mode)) {
+            ok = collect(file.source, file.path, files, error);
+            continue;
+        }
+        if (S_ISLNK(file.st.st_mode) && stat(file.source.c_str(), &file.st) == -1) {
+            continue;
+        }
+        if (S_ISREG(file.st.st_mode)) {
+            files.push_back(file);
+        }
+    }
+    closedir(handle);
+    return ok;
+}
+
+bool readWhole(const std::string& path, std::string& content) {
+    std::ifstream file(path.c_str(), std::ios::binary);
+    if (!file) {
+        return false;
+    }
+    std::ostringstream buffer;
+    buffer << file.rdbuf();
+    content = buffer.str();
+    return !file.bad();
+}
+
+// Same tag serveFile gives the file, so switching a location between its
+// root and a bundle of it does not invalidate what clients have cached.
+std::string makeETag(const struct stat& st, const std::string& encoding) {
+    std::ostringstream etag;
+    etag << std::hex << "\"" << st.st_ino << "-" << st.st_size << "-" << st.st_mtime;
+    if (!encoding.empty()) {
+        etag << "-" << encoding;
+    }
+    etag << "\"";
+    return etag.str();
+}
+
+// Appends `value` to the data area, whose first byte is at `base` in the
+// archive, and returns its archive offset.
+uint64_t append(std::string& data, uint64_t base, const std::string& value) {
+    uint64_t offset = base + data.size();
+    data += value;
+    return offset;
+}
+
+void addVariant(std::string& data, uint64_t base, BundleVariant& variant, const std::string& type,
+                const std::string& body, const std::string& validators, const std::string& etag) {
+    std::memset(&variant, 0, sizeof(variant));
+    std::string head = "Content-Type: " + type + "\r\n"
+        + "Content-Length: " + size_t_to_string(body.length()) + "\r\n";
+    variant.validators_offset = head.length();
+    head += validators;
+    variant.head_offset = append(data, base, head);
+    variant.head_length = head.length();
+    variant.etag_offset = variant.head_offset + head.find("ETag: ") + 6;
+    variant.etag_length = etag.length();
+    variant.body_offset = append(data, base, body);
+    variant.body_length = body.length();
+}
+
+}  // namespace
+
+StaticBundle::StaticBundle()
+    : _file(NULL), _header(NULL), _buckets(NULL), _entries(NULL), _hits(0), _misses(0) {
+}
+
+StaticBundle::~StaticBundle() {
+    if (_file) {
+        _file->release();
+    }
+}
+
+// FNV-1a, 64 bit
+uint64_t StaticBundle::hash(const char* data, size_t length) {
+    uint64_t h = 14695981039346656037ULL;
+    for (size_t i = 0; i < length; ++i) {
+        h ^= (unsigned char)data[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+std::string StaticBundle::signature(const std::string& path) {
+    struct stat st;
+    if (stat(path.c_str(), &st) == -1) {
+        return "";
+    }
+    return makeSignature(st);
+}
+
+StaticBundle* StaticBundle::load(const std::string& path, std::string& error) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd == -1) {
+        error = "cannot open " + path + ": " + strerror(errno);
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) || (size_t)st.st_size < sizeof(BundleHeader)) {
+        error = path + " is not a bundle";
+        close(fd);
+        return NULL;
+    }
+    void* addr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) {
+        error = "mmap failed for " + path + ": " + strerror(errno);
+        return NULL;
+    }
+    madvise(addr, st.st_size, MADV_WILLNEED);
+
+    StaticBundle* bundle = new StaticBundle();
+    bundle->_path = path;
+    bundle->_signature = makeSignature(st);
+    bundle->_file = new MappedFile();
+    bundle->_file->addr = static_cast<const char*>(addr);
+    bundle->_file->length = st.st_size;
+    bundle->_file->mtime = st.st_mtime;
+    bundle->_file->size = st.st_size;
+    bundle->_file->refs = 1; // the bundle's reference
+    bundle->_header = static_cast<const BundleHeader*>(addr);
+    if (!bundle->validate(error)) {
+        error = path + ": " + error;
+        delete bundle;
+        return NULL;
+    }
+    return bundle;
+}
+
+// Every offset is checked once here so that serving can trust them.
+bool StaticBundle::validate(std::string& error) {
+    uint64_t size = _file->length;
+    if (std::memcmp(_header->magic, BUNDLE_MAGIC, sizeof(_header->magic)) != 0) {
+        error = "not a bundle (bad magic)";
+        return false;
+    }
+    if (_header->size != size) {
+        error = "truncated (header says " + size_t_to_string(_header->size) + " bytes)";
+        return false;
+    }
+    uint64_t buckets = _header->bucket_count;
+    uint64_t entries = _header->entry_count;
+    if (buckets == 0 || (buckets & (buckets - 1)) != 0 || entries >= buckets
+        || sizeof(BundleHeader) + buckets * sizeof(uint32_t) + entries * sizeof(BundleEntry) > size) {
+        error = "bad index";
+        return false;
+    }
+    const uint32_t* slots = reinterpret_cast<const uint32_t*>(_file->addr + sizeof(BundleHeader));
+    for (uint64_t i = 0; i < buckets; ++i) {
+        if (slots[i] > entries) {
+            error = "bad index";
+            return false;
+        }
+    }
+    const BundleEntry* table = reinterpret_cast<const BundleEntry*>(slots + buckets);
+    for (uint64_t i = 0; i < entries; ++i) {
+        const BundleEntry& entry = table[i];
+        const BundleVariant* variants[] = { &entry.identity, &entry.gzip };
+        bool ok = entry.path_offset <= size && entry.path_length <= size - entry.path_offset
+            && entry.type_offset <= size && entry.type_length <= size - entry.type_offset;
+        for (size_t j = 0; j < 2 && ok; ++j) {
+            const BundleVariant& v = *variants[j];
+            if (j == 1 && v.body_length == 0) {
+                break;
+            }
+            ok = v.body_offset <= size && v.body_length <= size - v.body_offset
+                && v.head_offset <= size && v.head_length <= size - v.head_offset
+                && v.validators_offset <= v.head_length
+                && v.etag_offset <= size && v.etag_length <= size - v.etag_offset;
+        }
+        if (!ok) {
+            error = "entry " + size_t_to_string(i) + " points outside the file";
+            return false;
+        }
+    }
+    _buckets = slots;
+    _entries = table;
+    return true;
+}
+
+const BundleEntry* StaticBundle::find(const std::string& path) {
+    uint64_t h = hash(path.data(), path.length());
+    uint32_t mask = _header->bucket_count - 1;
+    for (uint32_t i = h & mask, probes = 0; probes <= mask; i = (i + 1) & mask, ++probes) {
+        uint32_t slot = _buckets[i];
+        if (slot == 0) {
+            break;
+        }
+        const BundleEntry& entry = _entries[slot - 1];
+        if (entry.hash == h && entry.path_length == path.length()
+            && std::memcmp(_file->addr + entry.path_offset, path.data(), path.length()) == 0) {
+            _hits++;
+            return &entry;
+        }
+    }
+    _misses++;
+    return NULL;
+}
+
+bool StaticBundle::build(const std::string& root, const std::string& output, bool gzip,
+                         const std::vector<std::string>& gzip_types, size_t& files, std::string& error) {
+    std::vector<PackedFile> packed;
+    if (!collect(root, "", packed, error)) {
+        return false;
+    }
+    std::sort(packed.begin(), packed.end()); // same tree, same archive
+
+    uint32_t bucket_count = 16;
+    while (bucket_count < packed.size() * 2) {
+        bucket_count *= 2;
+    }
+    std::vector<uint32_t> buckets(bucket_count, 0);
+    std::vector<BundleEntry> entries(packed.size());
+    uint64_t base = sizeof(BundleHeader) + bucket_count * sizeof(uint32_t)
+        + packed.size() * sizeof(BundleEntry);
+    std::string data;
+
+    for (size_t i = 0; i < packed.size(); ++i) {
+        const PackedFile& file = packed[i];
+        std::string body;
+        if (!readWhole(file.source, body)) {
+            error = "cannot read " + file.source + ": " + strerror(errno);
+            return false;
+        }
+        std::string type = mime_type(file.path);
+        std::string compressed;
+        bool variant = gzip && !body.empty() && Compression::isCompressibleType(type, gzip_types)
+            && Compression::gzip(body, compressed, 9) && compressed.length() < body.length();
+
+        BundleEntry& entry = entries[i];
+        std::memset(&entry, 0, sizeof(entry));
+        entry.hash = hash(file.path.data(), file.path.length());
+        entry.mtime = file.st.st_mtime;
+        entry.path_offset = append(data, base, file.path);
+        entry.path_length = file.path.length();
+        entry.type_offset = append(data, base, type);
+        entry.type_length = type.length();
+
+        std::string last_modified = "Last-Modified: " + http_date(file.st.st_mtime) + "\r\n";
+        std::string etag = makeETag(file.st, "");
+        addVariant(data, base, entry.identity, type, body,
+                   (variant ? "Vary: Accept-Encoding\r\n" : "") + last_modified
+                   + "ETag: " + etag + "\r\n" + "Accept-Ranges: bytes\r\n", etag);
+        if (variant) {
+            std::string gzip_etag = makeETag(file.st, "gzip");
+            addVariant(data, base, entry.gzip, type, compressed,
+                       "Vary: Accept-Encoding\r\nContent-Encoding: gzip\r\n" + last_modified
+                       + "ETag: " + gzip_etag + "\r\n", gzip_etag);
+        }
+
+        uint32_t slot = entry.hash & (bucket_count - 1);
+        while (buckets[slot] != 0) {
+            slot = (slot + 1) & (bucket_count - 1);
+        }
+        buckets[slot] = i + 1;
+    }
+
+    BundleHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, BUNDLE_MAGIC, sizeof(header.magic));
+    header.entry_count = packed.size();
+    header.bucket_count = bucket_count;
+    header.size = base + data.size();
+
+    // Written aside and renamed, so a server reloading meanwhile maps
+    // either the old archive or the new one, never half of one.
+    std::string temporary = output + ".tmp";
+    std::ofstream out(temporary.c_str(), std::ios::binary | std::ios::trunc);
+    if (!out) {
+        error = "cannot create " + temporary + ": " + strerror(errno);
+        return false;
+    }
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    out.write(reinterpret_cast<const char*>(&buckets[0]), buckets.size() * sizeof(uint32_t));
+    if (!entries.empty()) {
+        out.write(reinterpret_cast<const char*>(&entries[0]), entries.size() * sizeof(BundleEntry));
+    }
+    out.write(data.data(), data.size());
+    out.close();
+    if (out.fail() || rename(temporary.c_str(), output.c_str()) == -1) {
+        error = "cannot write " + output + ": " + strerror(errno);
+        unlink(temporary.c_str());
+        return false;
+    }
+    files = packed.size();
+    return true;
+}
+
+std::string StaticBundle::statsLine() const {
+    char buffer[512];
+    std::snprintf(buffer, sizeof(buffer), "%s: %lu files, %lu bytes mapped, %lu hits, %lu misses",
+                  _path.c_str(), (unsigned long)_header->entry_count, (unsigned long)_file->length,
+                  (unsigned long)_hits, (unsigned long)_misses);
+    return std::string(buffer);
+}
@@ -0,0 +1,235 @@
+#include "Tls.hpp"
+#include "utils.hpp"
+#include <openssl/err.h>
+#include <sys/stat.h>
+#include <climits>
+#include <cerrno>
+#include <cstdio>
+
+namespace {
+
+// ALPN lists in server preference order
+const unsigned char PROTOCOLS_H2[] = "\x02h2\x08http/1.1";
+const unsigned char PROTOCOLS_HTTP11[] = "\x08http/1.1";
+
+std::string fileVersion(const std::string& path) {
+    struct stat st;
+    if (stat(path.c_str(), &st) == -1) {
+        return "-";
+    }
+    return size_t_to_string(st.st_mtime) + "." + size_t_to_string(st.st_size);
+}
+
+}
+
+TlsContext::TlsContext() : _ctx(NULL) {
+}
+
+TlsContext::~TlsContext() {
+    if (_ctx) {
+        SSL_CTX_free(_ctx);
+    }
+}
+
+bool TlsContext::configure(const ServerConfig& server) {
+    std::string address = server.host + ":" + size_t_to_string(server.port);
+    _signature = signature(server);
+    _ctx = SSL_CTX_new(TLS_server_method());
+    if (!_ctx) {
+        LOG_ERROR("ssl: cannot create context for " + address + ": " + TlsConnection::lastError());
+        return false;
+    }
+    SSL_CTX_set_min_proto_version(_ctx, TLS1_2_VERSION);
+
+    // A peer closing without close_notify is an ordinary EOF for HTTP/1.x,
+    // where every message carries its own length
+    long options = SSL_OP_IGNORE_UNEXPECTED_EOF | SSL_OP_NO_RENEGOTIATION | SSL_OP_CIPHER_SERVER_PREFERENCE;
+    if (!server.ssl_session_tickets) {
+        options |= SSL_OP_NO_TICKET;
+    }
+#ifdef SSL_OP_ENABLE_KTLS
+    if (server.ssl_ktls) {
+        options |= SSL_OP_ENABLE_KTLS;
+    }
+#endif
+    SSL_CTX_set_options(_ctx, options);
+    // Partial writes let the output queue advance like it does with send();
+    // idle connections give their record buffers back
+    SSL_CTX_set_mode(_ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER
+                     | SSL_MODE_RELEASE_BUFFERS);
+
+    if (SSL_CTX_use_certificate_chain_file(_ctx, server.ssl_certificate.c_str()) != 1
+        || SSL_CTX_use_PrivateKey_file(_ctx, server.ssl_certificate_key.c_str(), SSL_FILETYPE_PEM) != 1
+        || SSL_CTX_check_private_key(_ctx) != 1) {
+        LOG_ERROR("ssl: cannot load " + server.ssl_certificate + " / " + server.ssl_certificate_key
+                  + " for " + address + ": " + TlsConnection::lastError());
+        return false;
+    }
+
+    static const unsigned char id_context[] = "webserv";
+    SSL_CTX_set_session_id_context(_ctx, id_context, sizeof(id_context) - 1);
+    if (server.ssl_session_cache > 0) {
+        SSL_CTX_set_session_cache_mode(_ctx, SSL_SESS_CACHE_SERVER);
+        SSL_CTX_sess_set_cache_size(_ctx, server.ssl_session_cache);
+    } else {
+        SSL_CTX_set_session_cache_mode(_ctx, SSL_SESS_CACHE_OFF);
+    }
+    SSL_CTX_set_timeout(_ctx, server.ssl_session_timeout);
+    // The list is static: the SSL_CTX can outlive this object after a reload
+    SSL_CTX_set_alpn_select_cb(_ctx, selectProtocol,
+                               (void*)(server.http2 ? PROTOCOLS_H2 : PROTOCOLS_HTTP11));
+    LOG_INFO("ssl: loaded " + server.ssl_certificate + " for " + address);
+    return true;
+}
+
+// ALPN: the first protocol of our list the client offers (h2 only when
+// http2 is on). A client offering none of them still gets HTTP/1.1
+// rather than an alert.
+int TlsContext::selectProtocol(SSL*, const unsigned char** out, unsigned char* out_length,
+                               const unsigned char* in, unsigned int in_length, void* arg) {
+    const unsigned char* protocols = static_cast<const unsigned char*>(arg);
+    unsigned int length = (protocols == PROTOCOLS_H2) ? sizeof(PROTOCOLS_H2) - 1 : sizeof(PROTOCOLS_HTTP11) - 1;
+    unsigned char* selected;
+    if (SSL_select_next_proto(&selected, out_length, protocols, length, in, in_length) != OPENSSL_NPN_NEGOTIATED) {
+        return SSL_TLSEXT_ERR_NOACK;
+    }
+    *out = selected;
+    return SSL_TLSEXT_ERR_OK;
+}
+
+SSL* TlsContext::accept(int fd) {
+    SSL* ssl = SSL_new(_ctx);
+    if (!ssl) {
+        return NULL;
+    }
+    if (SSL_set_fd(ssl, fd) != 1) {
+        SSL_free(ssl);
+        return NULL;
+    }
+    SSL_set_accept_state(ssl);
+    return ssl;
+}
+
+// Includes the certificate files' mtime and size so a SIGHUP after a
+// renewal loads the new certificate even though the paths are the same.
+std::string TlsContext::signature(const ServerConfig& server) {
+    return server.ssl_certificate + "|" + fileVersion(server.ssl_certificate) + "|"
+        + server.ssl_certificate_key + "|" + fileVersion(server.ssl_certificate_key) + "|"
+        + size_t_to_string(server.ssl_session_cache) + "|" + size_t_to_string(server.ssl_session_timeout) + "|"
+        + (server.ssl_session_tickets ? "t" : "-") + (server.ssl_ktls ? "k" : "-") + (server.http2 ? "2" : "-");
+}
+
+TlsConnection::TlsConnection(SSL* ssl)
+    : _ssl(ssl), _established(false), _failed(false), _wants_write(false), _kernel_send(false) {
+}
+
+TlsConnection::~TlsConnection() {
+    SSL_free(_ssl);
+}
+
+int TlsConnection::handshake() {
+    ERR_clear_error();
+    int ret = SSL_accept(_ssl);
+    if (ret == 1) {
+        _established = true;
+        _wants_write = false;
+        _kernel_send = BIO_get_ktls_send(SSL_get_wbio(_ssl));
+        return 1;
+    }
+    int error = SSL_get_error(_ssl, ret);
+    if (error == SSL_ERROR_WANT_READ || error == SSL_ERROR_WANT_WRITE) {
+        _wants_write = (error == SSL_ERROR_WANT_WRITE);
+        return 0;
+    }
+    _failed = true;
+    return -1;
+}
+
+ssize_t TlsConnection::result(int ret) {
+    if (ret > 0) {
+        return ret;
+    }
+    int saved_errno = errno;
+    switch (SSL_get_error(_ssl, ret)) {
+        case SSL_ERROR_WANT_READ:
+            _wants_write = false;
+            errno = EAGAIN;
+            return -1;
+        case SSL_ERROR_WANT_WRITE:
+            _wants_write = true;
+            errno = EAGAIN;
+            return -1;
+        case SSL_ERROR_ZERO_RETURN:
+            return 0;
+        case SSL_ERROR_SYSCALL:
+            _failed = true;
+            errno = saved_errno ? saved_errno : ECONNRESET;
+            return -1;
+        default:
+            _failed = true;
+            errno = EPROTO;
+            return -1;
+    }
+}
+
+ssize_t TlsConnection::read(char* buffer, size_t length) {
+    ERR_clear_error();
+    return result(SSL_read(_ssl, buffer, length > INT_MAX ? INT_MAX : (int)length));
+}
+
+ssize_t TlsConnection::write(const char* data, size_t length) {
+    ERR_clear_error();
+    ssize_t written = result(SSL_write(_ssl, data, length > INT_MAX ? INT_MAX : (int)length));
+    if (written == 0) {
+        errno = EPIPE; // the peer sent close_notify
+        return -1;
+    }
+    return written;
+}
+
+size_t TlsConnection::pending() const {
+    return SSL_pending(_ssl);
+}
+
+void TlsConnection::shutdown() {
+    if (!_established || _failed) {
+        return;
+    }
+    ERR_clear_error();
+    SSL_shutdown(_ssl);
+}
+
+bool TlsConnection::resumed() const {
+    return SSL_session_reused(_ssl) == 1;
+}
+
+std::string TlsConnection::protocol() const {
+    const unsigned char* protocol;
+    unsigned int length;
+    SSL_get0_alpn_selected(_ssl, &protocol, &length);
+    return protocol ? std::string((const char*)protocol, length) : "";
+}
+
+std::string TlsConnection::description() const {
+    return std::string(SSL_get_version(_ssl)) + " " + SSL_get_cipher_name(_ssl);
+}
+
+std::string TlsConnection::lastError() {
+    unsigned long code = ERR_get_error();
+    if (code == 0) {
+        return "unknown error";
+    }
+    char buffer[256];
+    ERR_error_string_n(code, buffer, sizeof(buffer));
+    ERR_clear_error();
+    return std::string(buffer);
+}
+
+std::string TlsStats::statsLine() const {
+    char buffer[256];
+    std::snprintf(buffer, sizeof(buffer), "%lu handshakes, %lu resumed (%.1f%%), %lu with kTLS send, %lu failed",
+                  (unsigned long)handshakes, (unsigned long)resumed,
+                  handshakes ? (double)resumed * 100.0 / (double)handshakes : 0.0,
+                  (unsigned long)kernel_send, (unsigned long)failed);
+    return std::string(buffer);
+}
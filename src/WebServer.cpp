@@ -14,10 +14,73 @@
 #include "Config.hpp"
 #include "HttpRequest.hpp"
 #include <sstream>
+#include <algorithm>
+#include <cstdlib>
 #include <dirent.h>
+#include <csignal>
+#include <netinet/tcp.h>
+#include <sys/wait.h>
+
+// Identity bodies at least this large skip the read-into-string path and go
+// out with sendfile().
+static const off_t SENDFILE_MIN_SIZE = 64 * 1024;
+
+// Below this a copy into the response string is cheaper than a mapping
+// lookup; locations with "mmap on" serve [MMAP_MIN_SIZE, mmap_max_size]
+// from _mapped_files and leave anything larger to sendfile().
+static const off_t MMAP_MIN_SIZE = 16 * 1024;
+
+// Set from the SIGHUP handler; run() picks it up between poll() rounds.
+static volatile sig_atomic_t g_reload_requested = 0;
+
+// Proxied response bytes buffered for a slow client before the upstream
+// socket stops being read, and the largest upstream response head.
+static const size_t PROXY_BUFFER_LIMIT = 256 * 1024;
+static const size_t PROXY_HEADER_LIMIT = 64 * 1024;
+
+// Frames an HTTP/2 connection queues per flush: enough to keep the socket
+// busy, small enough that one connection does not hog the loop
+static const size_t HTTP2_OUTPUT_BUDGET = 256 * 1024;
+
+static void handleSighup(int) {
+	g_reload_requested = 1;
+}
+
+static volatile sig_atomic_t g_upgrade_requested = 0;
+static volatile sig_atomic_t g_shutdown_requested = 0;
+
+static void handleSigusr2(int) {
+	g_upgrade_requested = 1;
+}
+
+static void handleSigquit(int) {
+	g_shutdown_requested = 1;
+}
+
+// The old binary waits this long for a new one to load its configuration
+static const int UPGRADE_START_TIMEOUT_MS = 10000;
+// A script that closed its stdout is usually exiting; without a pidfd to
+// poll, it is reaped this often
+static const int CGI_REAP_INTERVAL_MS = 5;
 
 WebServer::WebServer() {
     _config = NULL;
+    _events = NULL;
+    _request_config = NULL;
+    _proxy_location = NULL;
+    _next_upload_sweep = 0;
+    _draining = false;
+    _drain_deadline = 0;
+    _drain_idle_close = 0;
+    _upgrade_fd = -1;
+    _upgrade_pid = -1;
+    _upgrade_deadline = 0;
+    _timing = NULL;
+    _head_only = false;
+    _access_log_fd = -1;
+    _cgi_client = -1;
+    _cgi_stream = 0;
+    _cgi_started = false;
     _cgi_handler = new CgiHandler();
 }
 
@@ -28,36 +91,624 @@ WebServer::~WebServer() {
 }
 
 bool WebServer::initialize(const std::string& config_file) {
+	_config_file = config_file;
 	_config = new Config();
-	
+
 	if (!_config->parseConfigFile(config_file)) {
+		if (getenv("WEBSERV_UPGRADE_FD")) {
+			// Replacing a running server: better keep the old one
+			LOG_ERROR("Binary upgrade: " + config_file + " is invalid");
+			return false;
+		}
 		LOG_INFO("Using default configuration");
 		_config->setDefaultConfig();
 	}
-	
+
+	std::cout << "=== Loaded Configuration ===" << std::endl;
+	_config->printConfig();
+	std::cout << "============================" << std::endl;
+
+	applyCacheSettings();
+	applyEventBackend();
+	std::map<std::string, StaticBundle*> bundles;
+	if (!loadBundles(_config->getServers(), bundles)) {
+		return false;
+	}
+	std::map<std::string, TlsContext*> tls_contexts;
+	if (!loadTlsContexts(_config->getServers(), tls_contexts)) {
+		discardBundles(bundles);
+		return false;
+	}
+	adoptInheritedListeners();
+	if (!syncListeners(_config->getServers())) {
+		discardTlsContexts(tls_contexts);
+		discardBundles(bundles);
+		return false;
+	}
+	installTlsContexts(tls_contexts);
+	installBundles(bundles);
+	for (std::map<std::string, int>::iterator it = _inherited_fds.begin(); it != _inherited_fds.end(); ++it) {
+		LOG_INFO("Closing inherited listener " + it->first + ", not in the configuration");
+		close(it->second);
+	}
+	_inherited_fds.clear();
+
+	// No SA_RESTART: the signal has to interrupt poll() so the reload is
+	// not delayed until the next client event.
+	struct sigaction action;
+	std::memset(&action, 0, sizeof(action));
+	action.sa_handler = handleSighup;
+	sigemptyset(&action.sa_mask);
+	sigaction(SIGHUP, &action, NULL);
+	action.sa_handler = handleSigusr2;
+	sigaction(SIGUSR2, &action, NULL);
+	action.sa_handler = handleSigquit;
+	sigaction(SIGQUIT, &action, NULL);
+
+	notifyUpgradeParent();
+	return true;
+}
+
+void WebServer::setExecutable(const std::string& path) {
+	_executable = path;
+	// A relative path would not survive a later chdir; PATH lookups
+	// (no slash) are left to execvp
+	if (!path.empty() && path[0] != '/' && path.find('/') != std::string::npos) {
+		char cwd[4096];
+		if (getcwd(cwd, sizeof(cwd))) {
+			_executable = std::string(cwd) + "/" + path;
+		}
+	}
+}
+
+void WebServer::applyCacheSettings() {
+	openRequestLogs();
+	_memory.setLimit(_config->getMemoryBudget());
+	_upstreams.configure(_config->getUpstreams());
+	applyLimitZones();
 	const std::vector<ServerConfig>& servers = _config->getServers();
-	
+	if (servers.empty()) {
+		return;
+	}
+	_gzip_cache.setMaxBytes(servers[0].gzip_cache_size);
+	_mapped_files.setLimits(1024, servers[0].mmap_cache_size);
+	_cgi_cache.setMaxBytes(servers[0].cgi_cache_size);
+	_open_files.configure(servers[0].open_file_cache, servers[0].open_file_cache_valid,
+	                      servers[0].open_file_cache_errors);
+	_next_upload_sweep = 0;
+	for (size_t i = 0; i < servers.size(); ++i) {
+		for (size_t j = 0; j < servers[i].locations.size(); ++j) {
+			if (servers[i].locations[j].upload_resumable) {
+				_next_upload_sweep = time(NULL); // sweep right away
+			}
+		}
+	}
+}
+
+// Reopened on every reload, so SIGHUP after moving a file starts a new one
+void WebServer::openRequestLogs() {
+	if (_access_log_fd != -1) {
+		close(_access_log_fd);
+		_access_log_fd = -1;
+	}
+	const std::string& path = _config->getAccessLog();
+	if (!path.empty()) {
+		_access_log_fd = open(path.c_str(), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+		if (_access_log_fd == -1) {
+			LOG_ERROR("access_log: cannot open " + path + ": " + std::string(strerror(errno)));
+		}
+	}
+	if (!_capture.open(_config->getCapturePath(), _config->getCaptureSample())) {
+		LOG_ERROR("capture_requests: cannot open " + _config->getCapturePath() + ": " + std::string(strerror(errno)));
+	}
+}
+
+// The request line for the log, and the client's own X-Request-Id when it
+// sent a usable one, so the id follows the request through a front proxy.
+// Sampled requests are described for capture_requests here, while the
+// request is at hand.
+void WebServer::identifyRequest(RequestTiming& timing, const HttpRequest& request, size_t body_bytes) {
+	timing.request = request.methodToString() + " " + request.getUri();
+	std::string id = request.getHeader("X-Request-Id");
+	if (RequestTiming::validId(id)) {
+		timing.id = id;
+	}
+	if (_capture.sample()) {
+		timing.capture = _capture.describe(request, timing.id, timing.startUs(), body_bytes);
+	}
+}
+
+// One line per response: client, id, [time], "request", status, bytes and
+// the phase breakdown in milliseconds
+void WebServer::logRequest(const RequestTiming& timing, int client_fd) {
+	_timing_stats.record(timing);
+	if (!timing.capture.empty()) {
+		_capture.write(timing.capture, timing);
+	}
+	if (_access_log_fd == -1) {
+		return;
+	}
+	char date[64];
+	time_t now = time(NULL);
+	struct tm local;
+	localtime_r(&now, &local);
+	strftime(date, sizeof(date), "%d/%b/%Y:%H:%M:%S %z", &local);
+	std::map<int, std::string>::const_iterator addr = _client_addrs.find(client_fd);
+	std::string line = (addr != _client_addrs.end() ? addr->second : "-") + " " + timing.id + " [" + date + "] \""
+		+ (timing.request.empty() ? "-" : timing.request) + "\" " + int_to_string(timing.status) + " "
+		+ toString(timing.bytes) + " " + timing.breakdown() + "\n";
+	if (write(_access_log_fd, line.data(), line.size()) == -1) {
+		LOG_ERROR("access_log: " + std::string(strerror(errno)));
+	}
+}
+
+// A new backend is told the whole set, so switching on reload needs
+// nothing else. io_uring that is unavailable is retried on reload.
+void WebServer::applyEventBackend() {
+	if (_events && _config->getEventBackend() == _events->name()) {
+		return;
+	}
+	if (_events) {
+		LOG_INFO(std::string("events (") + _events->name() + "): " + _events->statsLine());
+		delete _events;
+	}
+	_events = EventBackend::create(_config->getEventBackend());
+	for (size_t i = 0; i < _poll_fds.size(); ++i) {
+		_poll_fds[i].revents = 0;
+		_events->watch(_poll_fds[i].fd, _poll_fds[i].events, i);
+	}
+}
+
+// Makes the listening sockets match `servers`: addresses already bound are
+// kept (their accept queues survive a reload), new ones are bound first and
+// removed ones closed last, so a failed bind leaves everything untouched.
+bool WebServer::syncListeners(const std::vector<ServerConfig>& servers) {
+	std::map<std::string, int> listeners;
+	std::vector<int> created;
+
 	for (size_t i = 0; i < servers.size(); ++i) {
-		int server_fd = createServerSocket(servers[i].host, servers[i].port);
+		std::string address = servers[i].host + ":" + toString(servers[i].port);
+		if (listeners.count(address)) {
+			continue;
+		}
+		std::map<std::string, int>::iterator existing = _listen_fds.find(address);
+		if (existing != _listen_fds.end()) {
+			listeners[address] = existing->second;
+			continue;
+		}
+		int server_fd;
+		std::map<std::string, int>::iterator inherited = _inherited_fds.find(address);
+		if (inherited != _inherited_fds.end()) {
+			server_fd = inherited->second;
+			_inherited_fds.erase(inherited);
+			LOG_INFO("Inherited listener " + address + " (fd " + toString(server_fd) + ")");
+		} else {
+			server_fd = createServerSocket(servers[i].host, servers[i].port);
+		}
 		if (server_fd == -1) {
-			LOG_ERROR("Failed to create server socket for " + servers[i].host + ":" + toString(servers[i].port));
+			LOG_ERROR("Failed to create server socket for " + address);
+			for (size_t j = 0; j < created.size(); ++j) {
+				close(created[j]);
+			}
 			return false;
 		}
-		
-		_server_sockets.push_back(server_fd);
-		
-		struct pollfd pfd;
-		pfd.fd = server_fd;
-		pfd.events = POLLIN;
-		pfd.revents = 0;
-		_poll_fds.push_back(pfd);
-		
-		LOG_INFO("Server listening on " + servers[i].host + ":" + toString(servers[i].port));
+		created.push_back(server_fd);
+		listeners[address] = server_fd;
+	}
+
+	for (std::map<std::string, int>::iterator it = _listen_fds.begin(); it != _listen_fds.end(); ++it) {
+		if (listeners.count(it->first)) {
+			continue;
+		}
+		for (size_t i = 0; i < _poll_fds.size(); ++i) {
+			if (_poll_fds[i].fd == it->second) {
+				_events->remove(it->second);
+				_poll_fds.erase(_poll_fds.begin() + i);
+				break;
+			}
+		}
+		close(it->second);
+		LOG_INFO("Stopped listening on " + it->first);
+	}
+
+	_listen_fds = listeners;
+	_server_sockets.clear();
+	for (std::map<std::string, int>::iterator it = listeners.begin(); it != listeners.end(); ++it) {
+		_server_sockets.push_back(it->second);
+		if (std::find(created.begin(), created.end(), it->second) == created.end()) {
+			continue;
+		}
+		addPollFd(it->second, POLLIN);
+		LOG_INFO("Server listening on " + it->first);
+	}
+	return true;
+}
+
+// Contexts for every ssl address of `servers`. The running context of an
+// address is reused while its settings and certificate files are unchanged,
+// which keeps its session cache and ticket keys valid across reloads.
+bool WebServer::loadTlsContexts(const std::vector<ServerConfig>& servers,
+                                std::map<std::string, TlsContext*>& contexts) {
+	for (size_t i = 0; i < servers.size(); ++i) {
+		if (!servers[i].ssl) {
+			continue;
+		}
+		std::string address = servers[i].host + ":" + toString(servers[i].port);
+		if (contexts.count(address)) {
+			continue;
+		}
+		std::map<std::string, TlsContext*>::iterator running = _tls_contexts.find(address);
+		if (running != _tls_contexts.end() && running->second->signature() == TlsContext::signature(servers[i])) {
+			contexts[address] = running->second;
+			continue;
+		}
+		TlsContext* context = new TlsContext();
+		if (!context->configure(servers[i])) {
+			delete context;
+			discardTlsContexts(contexts);
+			return false;
+		}
+		contexts[address] = context;
 	}
-	
 	return true;
 }
 
+// Frees the contexts loadTlsContexts() created for a configuration that
+// is not going to be used.
+void WebServer::discardTlsContexts(std::map<std::string, TlsContext*>& contexts) {
+	for (std::map<std::string, TlsContext*>::iterator it = contexts.begin(); it != contexts.end(); ++it) {
+		std::map<std::string, TlsContext*>::iterator running = _tls_contexts.find(it->first);
+		if (running == _tls_contexts.end() || running->second != it->second) {
+			delete it->second;
+		}
+	}
+	contexts.clear();
+}
+
+// Switches to `contexts` once the listeners match them. Handshakes still
+// running on a replaced context keep its SSL_CTX alive through their SSL.
+void WebServer::installTlsContexts(std::map<std::string, TlsContext*>& contexts) {
+	for (std::map<std::string, TlsContext*>::iterator it = _tls_contexts.begin(); it != _tls_contexts.end(); ++it) {
+		std::map<std::string, TlsContext*>::iterator kept = contexts.find(it->first);
+		if (kept == contexts.end() || kept->second != it->second) {
+			delete it->second;
+		}
+	}
+	_tls_contexts.swap(contexts);
+	contexts.clear();
+	_tls_listeners.clear();
+	for (std::map<std::string, TlsContext*>::iterator it = _tls_contexts.begin(); it != _tls_contexts.end(); ++it) {
+		_tls_listeners[_listen_fds[it->first]] = it->second;
+	}
+}
+
+// Maps the archive of every location with a bundle. One unchanged on disk
+// keeps its running mapping; one that cannot be loaded fails the whole
+// configuration, as a missing certificate does.
+bool WebServer::loadBundles(const std::vector<ServerConfig>& servers, std::map<std::string, StaticBundle*>& bundles) {
+	for (size_t i = 0; i < servers.size(); ++i) {
+		for (size_t j = 0; j < servers[i].locations.size(); ++j) {
+			const std::string& path = servers[i].locations[j].bundle;
+			if (path.empty() || bundles.count(path)) {
+				continue;
+			}
+			std::map<std::string, StaticBundle*>::iterator running = _bundles.find(path);
+			if (running != _bundles.end() && running->second->signature() == StaticBundle::signature(path)) {
+				bundles[path] = running->second;
+				continue;
+			}
+			std::string error;
+			StaticBundle* bundle = StaticBundle::load(path, error);
+			if (!bundle) {
+				LOG_ERROR("Cannot load bundle: " + error);
+				discardBundles(bundles);
+				return false;
+			}
+			LOG_INFO("Bundle " + path + ": " + toString(bundle->entryCount()) + " files");
+			bundles[path] = bundle;
+		}
+	}
+	return true;
+}
+
+// Frees the bundles loadBundles() mapped for a configuration that is not
+// going to be used.
+void WebServer::discardBundles(std::map<std::string, StaticBundle*>& bundles) {
+	for (std::map<std::string, StaticBundle*>::iterator it = bundles.begin(); it != bundles.end(); ++it) {
+		std::map<std::string, StaticBundle*>::iterator running = _bundles.find(it->first);
+		if (running == _bundles.end() || running->second != it->second) {
+			delete it->second;
+		}
+	}
+	bundles.clear();
+}
+
+// Responses still sending from a replaced bundle hold their own reference
+// to its mapping, so it is unmapped only after their last byte.
+void WebServer::installBundles(std::map<std::string, StaticBundle*>& bundles) {
+	for (std::map<std::string, StaticBundle*>::iterator it = _bundles.begin(); it != _bundles.end(); ++it) {
+		std::map<std::string, StaticBundle*>::iterator kept = bundles.find(it->first);
+		if (kept == bundles.end() || kept->second != it->second) {
+			LOG_INFO("bundle " + it->second->statsLine());
+			delete it->second;
+		}
+	}
+	_bundles.swap(bundles);
+	bundles.clear();
+}
+
+// SIGHUP: parse and validate the file into a fresh snapshot and swap it in
+// for new connections. Connections accepted earlier keep the snapshot they
+// started with; it is freed when the last of them closes. Any parse,
+// validation or bind failure keeps the running configuration.
+void WebServer::reloadConfig() {
+	LOG_INFO("Reloading configuration from " + _config_file);
+
+	Config* next = new Config();
+	if (!next->parseConfigFile(_config_file)) {
+		LOG_ERROR("Configuration reload rejected: " + _config_file + " is invalid");
+		delete next;
+		return;
+	}
+	std::map<std::string, StaticBundle*> bundles;
+	if (!loadBundles(next->getServers(), bundles)) {
+		LOG_ERROR("Configuration reload rejected: cannot load all bundles");
+		delete next;
+		return;
+	}
+	std::map<std::string, TlsContext*> tls_contexts;
+	if (!loadTlsContexts(next->getServers(), tls_contexts)) {
+		LOG_ERROR("Configuration reload rejected: cannot load all TLS certificates");
+		discardBundles(bundles);
+		delete next;
+		return;
+	}
+	if (!syncListeners(next->getServers())) {
+		LOG_ERROR("Configuration reload rejected: cannot bind all listeners");
+		discardTlsContexts(tls_contexts);
+		discardBundles(bundles);
+		delete next;
+		return;
+	}
+	installTlsContexts(tls_contexts);
+	installBundles(bundles);
+
+	Config* previous = _config;
+	_config = next;
+	applyCacheSettings();
+	applyEventBackend();
+	_open_files.clear(); // roots and index files may have moved
+	if (!_config_users.count(previous)) {
+		delete previous;
+	}
+	LOG_INFO("Configuration reloaded: " + toString(_config->getServers().size()) + " server(s), "
+		+ toString(_listen_fds.size()) + " listener(s), "
+		+ toString(_client_configs.size()) + " connection(s) finishing on older snapshots");
+}
+
+// Binary upgrade. SIGUSR2 forks and execs the binary again, with the
+// listening sockets left open and listed in WEBSERV_LISTEN_FDS as
+// "host:port=fd;...". The new process binds nothing it inherited, and once
+// its configuration is loaded writes a byte to the pipe named by
+// WEBSERV_UPGRADE_FD; only then does the old one close its listeners and
+// drain. If the new binary fails to start, nothing changes.
+
+void WebServer::adoptInheritedListeners() {
+	const char* inherited = getenv("WEBSERV_LISTEN_FDS");
+	if (!inherited) {
+		return;
+	}
+	std::string list = inherited;
+	unsetenv("WEBSERV_LISTEN_FDS"); // not for CGI scripts or a later upgrade
+	size_t start = 0;
+	while (start < list.size()) {
+		size_t end = list.find(';', start);
+		if (end == std::string::npos) {
+			end = list.size();
+		}
+		std::string entry = list.substr(start, end - start);
+		start = end + 1;
+		size_t equals = entry.rfind('=');
+		if (equals == std::string::npos) {
+			continue;
+		}
+		int fd = std::atoi(entry.c_str() + equals + 1);
+		int listening = 0;
+		socklen_t length = sizeof(listening);
+		if (getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &listening, &length) == -1 || !listening) {
+			LOG_ERROR("Ignoring inherited fd " + toString(fd) + ": not a listening socket");
+			continue;
+		}
+		fcntl(fd, F_SETFD, FD_CLOEXEC);
+		_inherited_fds[entry.substr(0, equals)] = fd;
+	}
+}
+
+void WebServer::notifyUpgradeParent() {
+	const char* notify = getenv("WEBSERV_UPGRADE_FD");
+	if (!notify) {
+		return;
+	}
+	int fd = std::atoi(notify);
+	unsetenv("WEBSERV_UPGRADE_FD");
+	if (write(fd, "1", 1) != 1) {
+		LOG_ERROR("Cannot tell the previous binary we are ready: " + std::string(strerror(errno)));
+	}
+	close(fd);
+}
+
+void WebServer::upgradeBinary() {
+	if (_executable.empty() || _listen_fds.empty()) {
+		LOG_ERROR("Binary upgrade impossible: no executable or no listener");
+		return;
+	}
+	if (_upgrade_fd != -1) {
+		LOG_ERROR("Binary upgrade already in progress: pid " + toString(_upgrade_pid));
+		return;
+	}
+	int ready[2];
+	if (pipe2(ready, O_CLOEXEC) == -1) {
+		LOG_ERROR("Binary upgrade failed: pipe: " + std::string(strerror(errno)));
+		return;
+	}
+	std::string listen_fds;
+	for (std::map<std::string, int>::iterator it = _listen_fds.begin(); it != _listen_fds.end(); ++it) {
+		listen_fds += (listen_fds.empty() ? "" : ";") + it->first + "=" + toString(it->second);
+	}
+	std::string notify_fd = toString(ready[1]);
+
+	pid_t pid = fork();
+	if (pid == -1) {
+		LOG_ERROR("Binary upgrade failed: fork: " + std::string(strerror(errno)));
+		close(ready[0]);
+		close(ready[1]);
+		return;
+	}
+	if (pid == 0) {
+		// Only the listeners and the pipe cross over: client sockets left
+		// open in the new process would never see their close
+		std::set<int> keep;
+		for (std::map<std::string, int>::iterator it = _listen_fds.begin(); it != _listen_fds.end(); ++it) {
+			keep.insert(it->second);
+		}
+		keep.insert(ready[1]);
+		std::vector<int> open_fds;
+		DIR* fds = opendir("/proc/self/fd");
+		if (fds) {
+			struct dirent* entry;
+			while ((entry = readdir(fds)) != NULL) {
+				if (entry->d_name[0] != '.') {
+					open_fds.push_back(std::atoi(entry->d_name));
+				}
+			}
+			closedir(fds);
+		}
+		for (size_t i = 0; i < open_fds.size(); ++i) {
+			if (open_fds[i] > 2 && !keep.count(open_fds[i])) {
+				close(open_fds[i]);
+			}
+		}
+		for (std::set<int>::iterator it = keep.begin(); it != keep.end(); ++it) {
+			fcntl(*it, F_SETFD, 0);
+		}
+		setenv("WEBSERV_LISTEN_FDS", listen_fds.c_str(), 1);
+		setenv("WEBSERV_UPGRADE_FD", notify_fd.c_str(), 1);
+		char* argv[] = { const_cast<char*>(_executable.c_str()), const_cast<char*>(_config_file.c_str()), NULL };
+		execvp(argv[0], argv);
+		_exit(127);
+	}
+
+	close(ready[1]);
+	LOG_INFO("Binary upgrade: started " + _executable + " as pid " + toString(pid));
+	// The ready byte is waited for in the poll loop, so requests in flight
+	// keep being served while the new binary loads its configuration
+	_upgrade_fd = ready[0];
+	_upgrade_pid = pid;
+	_upgrade_deadline = RateLimit::nowMs() + UPGRADE_START_TIMEOUT_MS;
+	addPollFd(_upgrade_fd, POLLIN);
+}
+
+// The ready pipe became readable: one byte once the new binary is
+// serving, EOF if it died first.
+void WebServer::finishUpgrade(bool started) {
+	pid_t pid = _upgrade_pid;
+	removePollFd(_upgrade_fd);
+	close(_upgrade_fd);
+	_upgrade_fd = -1;
+	_upgrade_pid = -1;
+	if (!started) {
+		LOG_ERROR("Binary upgrade failed: pid " + toString(pid) + " did not start, still serving");
+		kill(pid, SIGKILL);
+		waitpid(pid, NULL, 0);
+		return;
+	}
+	startDraining("binary upgrade, pid " + toString(pid) + " took over");
+}
+
+void WebServer::checkUpgrade() {
+	if (_upgrade_fd != -1 && RateLimit::nowMs() >= _upgrade_deadline) {
+		finishUpgrade(false);
+	}
+}
+
+// Graceful stop: listeners are closed (the kernel keeps their queues for
+// a process that inherited them), requests in flight run to completion,
+// HTTP/2 connections get a GOAWAY, and run() returns once every client is
+// gone or shutdown_timeout has passed.
+void WebServer::startDraining(const std::string& reason) {
+	if (_draining) {
+		return;
+	}
+	for (std::map<std::string, int>::iterator it = _listen_fds.begin(); it != _listen_fds.end(); ++it) {
+		removePollFd(it->second);
+		close(it->second);
+	}
+	_listen_fds.clear();
+	_server_sockets.clear();
+	_tls_listeners.clear();
+	_draining = true;
+	time_t now = time(NULL);
+	_drain_deadline = now + _config->getShutdownTimeout();
+	_drain_idle_close = now + 1; // a request already on the wire still gets in
+	LOG_INFO("Draining (" + reason + "): " + toString(_client_addrs.size()) + " connection(s), up to "
+		+ toString(static_cast<size_t>(_config->getShutdownTimeout())) + "s");
+
+	std::vector<int> sessions;
+	for (std::map<int, Http2Session*>::iterator it = _h2_sessions.begin(); it != _h2_sessions.end(); ++it) {
+		it->second->goAway();
+		sessions.push_back(it->first);
+	}
+	for (size_t i = 0; i < sessions.size(); ++i) {
+		flushHttp2(sessions[i], pollIndex(sessions[i]));
+	}
+}
+
+bool WebServer::drainFinished() {
+	time_t now = time(NULL);
+	if (_drain_idle_close && now >= _drain_idle_close) {
+		_drain_idle_close = 0;
+		std::vector<int> idle;
+		for (std::map<int, std::string>::iterator it = _client_buffers.begin(); it != _client_buffers.end(); ++it) {
+			int fd = it->first;
+			if (it->second.empty() && !_h2_sessions.count(fd) && !_uploads.count(fd) && !_proxy_clients.count(fd)
+				&& !_client_outputs.count(fd) && !_delayed_clients.count(fd) && !_cgi_clients.count(fd)) {
+				idle.push_back(fd);
+			}
+		}
+		for (size_t i = 0; i < idle.size(); ++i) {
+			closeClient(idle[i], pollIndex(idle[i]));
+		}
+		if (!idle.empty()) {
+			LOG_INFO("Draining: closed " + toString(idle.size()) + " idle connection(s)");
+		}
+	}
+	if (_poll_fds.empty()) {
+		LOG_INFO("Drained, exiting");
+		return true;
+	}
+	if (now >= _drain_deadline) {
+		LOG_INFO("shutdown_timeout reached with " + toString(_client_addrs.size()) + " connection(s) open, exiting");
+		return true;
+	}
+	return false;
+}
+
+void WebServer::releaseClientConfig(int client_fd) {
+	std::map<int, Config*>::iterator it = _client_configs.find(client_fd);
+	if (it == _client_configs.end()) {
+		return;
+	}
+	Config* snapshot = it->second;
+	_client_configs.erase(it);
+	if (--_config_users[snapshot] == 0) {
+		_config_users.erase(snapshot);
+		if (snapshot != _config) {
+			LOG_DEBUG("Freed retired configuration snapshot");
+			delete snapshot;
+		}
+	}
+}
+
 int WebServer::createServerSocket(const std::string& host, int port) {
 	int server_fd = socket(AF_INET, SOCK_STREAM, 0);
 	if (server_fd == -1) {
@@ -102,32 +753,92 @@ int WebServer::createServerSocket(const std::string& host, int port) {
 void WebServer::run() {
 	LOG_INFO("Server entering main loop...");
 	while (true) {
+		if (g_reload_requested) {
+			g_reload_requested = 0;
+			if (!_draining) {
+				reloadConfig();
+			}
+		}
+		if (g_upgrade_requested) {
+			g_upgrade_requested = 0;
+			if (!_draining) {
+				upgradeBinary();
+			}
+		}
+		if (g_shutdown_requested) {
+			g_shutdown_requested = 0;
+			startDraining("graceful shutdown");
+		}
+		if (_draining && drainFinished()) {
+			break;
+		}
+		admitQueuedCgi();
+		applyBackpressure();
 		LOG_DEBUG("Calling poll with " + toString(_poll_fds.size()) + " file descriptors...");
-		int poll_count = poll(&_poll_fds[0], _poll_fds.size(), -1);
+		int poll_count = _events->wait(_poll_fds, pollTimeout());
 		LOG_DEBUG("Poll returned: " + toString(poll_count));
-		
+
 		if (poll_count == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
 			LOG_ERROR("Poll error: " + std::string(strerror(errno)));
 			break;
 		}
-		
+		checkProxyTimeouts();
+		checkCgiJobs();
+		checkUpgrade();
+		resumeDelayedClients();
+		expireResumableUploads();
+
 		for (size_t i = 0; i < _poll_fds.size(); ++i) {
-			if (_poll_fds[i].revents & POLLIN) {
-				LOG_DEBUG("Activity on fd " + toString(_poll_fds[i].fd));
-				bool is_server = false;
-				for (size_t j = 0; j < _server_sockets.size(); ++j) {
-					if (_poll_fds[i].fd == _server_sockets[j]) {
-						LOG_DEBUG("New connection on server socket " + toString(_poll_fds[i].fd));
-						handleNewConnection(_poll_fds[i].fd);
-						is_server = true;
-						break;
-					}
+			short revents = _poll_fds[i].revents;
+			if (!revents) {
+				continue;
+			}
+			LOG_DEBUG("Activity on fd " + toString(_poll_fds[i].fd));
+			int fd = _poll_fds[i].fd;
+			bool is_server = false;
+			for (size_t j = 0; j < _server_sockets.size(); ++j) {
+				if (_poll_fds[i].fd == _server_sockets[j]) {
+					is_server = true;
+					break;
+				}
+			}
+			
+			if (is_server) {
+				if (revents & POLLIN) {
+					LOG_DEBUG("New connection on server socket " + toString(_poll_fds[i].fd));
+					handleNewConnection(_poll_fds[i].fd);
 				}
-				
-				if (!is_server) {
-					LOG_DEBUG("Client data on fd " + toString(_poll_fds[i].fd));
-					handleClientData(_poll_fds[i].fd, i);
+			} else if (fd == _upgrade_fd) {
+				char byte = 0;
+				finishUpgrade(read(fd, &byte, 1) == 1);
+			} else if (_proxy_upstreams.count(_poll_fds[i].fd)) {
+				int client_fd = _proxy_upstreams[fd]->client_fd;
+				handleUpstreamEvent(_poll_fds[i].fd, revents);
+				trackMemory(client_fd);
+			} else if (_cgi_outputs.count(_poll_fds[i].fd)) {
+				handleCgiOutput(_poll_fds[i].fd);
+			} else if (_cgi_inputs.count(_poll_fds[i].fd)) {
+				handleCgiInput(_poll_fds[i].fd);
+			} else if (_cgi_exits.count(_poll_fds[i].fd)) {
+				handleCgiExit(_poll_fds[i].fd);
+			} else if (_cgi_clients.count(_poll_fds[i].fd)) {
+				if (revents & (POLLRDHUP | POLLHUP | POLLERR)) {
+					LOG_DEBUG("Client " + toString(fd) + " left while its CGI script ran");
+					closeClient(fd, i);
 				}
+			} else if (_h2_sessions.count(_poll_fds[i].fd)) {
+				handleHttp2(_poll_fds[i].fd, i, revents);
+				trackMemory(fd);
+			} else if (_client_outputs.count(_poll_fds[i].fd)) {
+				handleClientWrite(_poll_fds[i].fd, i);
+				trackMemory(fd);
+			} else if (revents & (POLLIN | POLLOUT | POLLHUP | POLLERR)) {
+				LOG_DEBUG("Client data on fd " + toString(_poll_fds[i].fd));
+				handleClientData(_poll_fds[i].fd, i);
+				trackMemory(fd);
 			}
 		}
 	}
@@ -151,105 +862,1304 @@ void WebServer::handleNewConnection(int server_fd) {
 		close(client_fd);
 		return;
 	}
+
+	std::map<int, TlsContext*>::iterator tls = _tls_listeners.find(server_fd);
+	if (tls != _tls_listeners.end()) {
+		SSL* ssl = tls->second->accept(client_fd);
+		if (!ssl) {
+			LOG_ERROR("ssl: cannot start a session: " + TlsConnection::lastError());
+			close(client_fd);
+			return;
+		}
+		_tls_clients[client_fd] = new TlsConnection(ssl); // handshake starts with the ClientHello
+	}
 	
-	struct pollfd pfd;
-	pfd.fd = client_fd;
-	pfd.events = POLLIN;
-	pfd.revents = 0;
-	_poll_fds.push_back(pfd);
+	addPollFd(client_fd, POLLIN);
 	
 	_client_buffers[client_fd] = "";
+	char address[INET_ADDRSTRLEN];
+	if (inet_ntop(AF_INET, &client_addr.sin_addr, address, sizeof(address))) {
+		_client_addrs[client_fd] = address;
+	}
+	_client_ips[client_fd] = client_addr.sin_addr.s_addr;
+	_client_configs[client_fd] = _config;
+	_config_users[_config]++;
 
 	LOG_DEBUG("Client " + toString(client_fd) + " added to poll list");
 }
 
-void WebServer::handleClientData(int client_fd, int poll_index) {
-	LOG_DEBUG("Reading data from client " + toString(client_fd));
-	char buffer[8192];
-	ssize_t bytes_read = recv(client_fd, buffer, sizeof(buffer) - 1, 0);
-
-	LOG_DEBUG("recv() returned " + toString(bytes_read) + " bytes");
-
-	if (bytes_read <= 0) {
-		if (bytes_read == 0) {
-			LOG_INFO("Client " + toString(client_fd) + " disconnected");
-		} else {
-			LOG_ERROR("recv() error: " + std::string(strerror(errno)));
+// Blocks in poll() until something happens, but wakes up for the next
+// delayed client, once a second while upstream requests or CGI scripts can
+// time out or the server drains, soon after a script closed its output, and
+// for the next sweep of idle resumable uploads.
+int WebServer::pollTimeout() {
+	int timeout = _proxy_upstreams.empty() ? -1 : 1000;
+	if (!_delayed_clients.empty()) {
+		uint64_t now = RateLimit::nowMs();
+		uint64_t next = _delayed_clients.begin()->second;
+		for (std::map<int, uint64_t>::iterator it = _delayed_clients.begin(); it != _delayed_clients.end(); ++it) {
+			next = std::min(next, it->second);
+		}
+		int wait = next > now ? (int)(next - now) : 0;
+		if (timeout == -1 || wait < timeout) {
+			timeout = wait;
 		}
-		close(client_fd);
-		_poll_fds.erase(_poll_fds.begin() + poll_index);
-		_client_buffers.erase(client_fd);
-		return;
 	}
-	
-	buffer[bytes_read] = '\0';
-	_client_buffers[client_fd] += buffer;
-	LOG_DEBUG("Buffer for client " + toString(client_fd) + " now has " + toString(_client_buffers[client_fd].length()) + " bytes");
-
-	std::string& client_buffer = _client_buffers[client_fd];
-	size_t header_end_pos = client_buffer.find("\r\n\r\n");
-	if (header_end_pos == std::string::npos) {
-		header_end_pos = client_buffer.find("\n\n");
-		if (header_end_pos != std::string::npos) {
-			header_end_pos += 2;
+	if (!_cgi_jobs.empty()) {
+		int wait = _cgi_outputs.size() + _cgi_exits.size() < _cgi_jobs.size() ? CGI_REAP_INTERVAL_MS : 1000;
+		uint64_t now = RateLimit::nowMs();
+		for (std::map<pid_t, CgiJob>::const_iterator it = _cgi_jobs.begin(); it != _cgi_jobs.end(); ++it) {
+			if (it->second.deadline) {
+				wait = std::min(wait, it->second.deadline > now ? (int)(it->second.deadline - now) : 0);
+			}
+		}
+		if (timeout == -1 || wait < timeout) {
+			timeout = wait;
+		}
+	}
+	if (_draining && (timeout == -1 || timeout > 1000)) {
+		timeout = 1000;
+	}
+	if (_upgrade_fd != -1) {
+		uint64_t now = RateLimit::nowMs();
+		int wait = _upgrade_deadline > now ? (int)(_upgrade_deadline - now) : 0;
+		if (timeout == -1 || wait < timeout) {
+			timeout = wait;
+		}
+	}
+	if (_next_upload_sweep) {
+		time_t now = time(NULL);
+		int wait = _next_upload_sweep > now ? (int)(_next_upload_sweep - now) * 1000 : 0;
+		if (timeout == -1 || wait < timeout) {
+			timeout = wait;
 		}
-	} else {
-		header_end_pos += 4;
 	}
+	return timeout;
+}
 
-	if (header_end_pos == std::string::npos) {
-		LOG_DEBUG("Headers not complete yet, waiting for more data from client " + toString(client_fd));
-		return;
+// Zones keep their client state across reloads unless their definition
+// changed. Clients holding a limit_conn slot in a dropped zone simply
+// release it into nothing.
+void WebServer::applyLimitZones() {
+	const std::map<std::string, LimitZoneConfig>& configs = _config->getLimitZones();
+	std::map<std::string, LimitZone*> zones;
+	for (std::map<std::string, LimitZoneConfig>::const_iterator it = configs.begin(); it != configs.end(); ++it) {
+		std::map<std::string, LimitZone*>::iterator old = _limit_zones.find(it->first);
+		if (old != _limit_zones.end() && old->second->config().requests == it->second.requests
+			&& old->second->config().rate == it->second.rate && old->second->config().size == it->second.size) {
+			zones[it->first] = old->second;
+			_limit_zones.erase(old);
+		} else {
+			zones[it->first] = new LimitZone(it->second);
+		}
+	}
+	for (std::map<std::string, LimitZone*>::iterator it = _limit_zones.begin(); it != _limit_zones.end(); ++it) {
+		delete it->second;
 	}
+	_limit_zones.swap(zones);
+}
 
-	LOG_DEBUG("Headers complete, checking for request body...");
+WebServer::LimitResult WebServer::checkLimits(int client_fd, const std::string& request_line, int& status_code,
+                                              uint64_t& delay_ms) {
+	_limits_checked.insert(client_fd);
+	if (_limit_zones.empty()) {
+		return LIMIT_PASS;
+	}
+	Config* config = _client_configs.count(client_fd) ? _client_configs[client_fd] : _config;
+	if (config->getServers().empty()) {
+		return LIMIT_PASS;
+	}
+	size_t uri_start = request_line.find(' ');
+	if (uri_start == std::string::npos) {
+		return LIMIT_PASS; // the parser rejects it
+	}
+	size_t uri_end = request_line.find_first_of(" ?\r", uri_start + 1);
+	std::string path = request_line.substr(uri_start + 1, uri_end == std::string::npos ? std::string::npos : uri_end - uri_start - 1);
+	const LocationConfig* location = config->findLocationConfig(config->getServers()[0], path);
+	if (!location) {
+		return LIMIT_PASS;
+	}
+	uint32_t key = _client_ips[client_fd];
+
+	if (!location->limit_conn.empty()) {
+		std::map<std::string, LimitZone*>::iterator zone = _limit_zones.find(location->limit_conn);
+		if (zone != _limit_zones.end()) {
+			if (!zone->second->openConnection(key, location->limit_conn_max)) {
+				LOG_INFO("limit_conn " + location->limit_conn + ": rejecting " + _client_addrs[client_fd]);
+				status_code = location->limit_conn_status;
+				return LIMIT_REJECT;
+			}
+			_conn_limits[client_fd] = location->limit_conn;
+		}
+	}
+
+	if (!location->limit_req.empty()) {
+		std::map<std::string, LimitZone*>::iterator zone = _limit_zones.find(location->limit_req);
+		if (zone != _limit_zones.end()) {
+			LimitZone::Verdict verdict = zone->second->request(key, RateLimit::nowMs(), location->limit_req_burst,
+			                                                   location->limit_req_delay, delay_ms);
+			if (verdict == LimitZone::REJECT) {
+				LOG_INFO("limit_req " + location->limit_req + ": rejecting " + _client_addrs[client_fd]);
+				status_code = location->limit_req_status;
+				return LIMIT_REJECT;
+			}
+			if (verdict == LimitZone::DELAY) {
+				return LIMIT_DELAY;
+			}
+		}
+	}
+	return LIMIT_PASS;
+}
+
+void WebServer::resumeDelayedClients() {
+	if (_delayed_clients.empty()) {
+		return;
+	}
+	uint64_t now = RateLimit::nowMs();
+	std::vector<int> due;
+	for (std::map<int, uint64_t>::iterator it = _delayed_clients.begin(); it != _delayed_clients.end(); ++it) {
+		if (it->second <= now) {
+			due.push_back(it->first);
+		}
+	}
+	for (size_t i = 0; i < due.size(); ++i) {
+		_delayed_clients.erase(due[i]);
+		size_t index = pollIndex(due[i]);
+		if (index == _poll_fds.size()) {
+			continue;
+		}
+		_timings[due[i]].mark(RequestTiming::DELAY);
+		setPollEventsAt(index, POLLIN);
+		processClientBuffer(due[i], index);
+	}
+}
+
+void WebServer::releaseConnLimit(int client_fd) {
+	std::map<int, std::string>::iterator it = _conn_limits.find(client_fd);
+	if (it == _conn_limits.end()) {
+		return;
+	}
+	std::map<std::string, LimitZone*>::iterator zone = _limit_zones.find(it->second);
+	if (zone != _limit_zones.end()) {
+		zone->second->closeConnection(_client_ips[client_fd]);
+	}
+	_conn_limits.erase(it);
+}
+
+void WebServer::handleClientData(int client_fd, int poll_index) {
+	if (_proxy_clients.count(client_fd)) {
+		// Only hangups and errors are polled while a proxied request is in flight
+		LOG_INFO("Client " + toString(client_fd) + " went away during a proxied request");
+		closeClient(client_fd, poll_index);
+		return;
+	}
+	std::map<int, TlsConnection*>::iterator tls = _tls_clients.find(client_fd);
+	if (tls != _tls_clients.end() && !tls->second->established()) {
+		if (!continueHandshake(client_fd, poll_index)) {
+			return;
+		}
+		if (tls->second->protocol() == "h2") {
+			startHttp2(client_fd)->start();
+			handleHttp2(client_fd, poll_index, POLLIN);
+			return;
+		}
+	}
+	LOG_DEBUG("Reading data from client " + toString(client_fd));
+	ssize_t bytes_read = readClient(client_fd);
+
+	LOG_DEBUG("recv() returned " + toString(bytes_read) + " bytes");
+
+	if (bytes_read == -1 && errno == EAGAIN) {
+		return; // only part of a TLS record has arrived
+	}
+	if (bytes_read <= 0) {
+		if (bytes_read == 0) {
+			LOG_INFO("Client " + toString(client_fd) + " disconnected");
+		} else {
+			LOG_ERROR("recv() error: " + std::string(strerror(errno)));
+		}
+		closeClient(client_fd, poll_index);
+		return;
+	}
+
+	LOG_DEBUG("Buffer for client " + toString(client_fd) + " now has " + toString(_client_buffers[client_fd].length()) + " bytes");
+	RequestTiming& timing = _timings[client_fd];
+	if (!timing.started()) {
+		timing.begin(RequestTiming::newId());
+	}
+	processClientBuffer(client_fd, poll_index);
+}
+
+// Drives the handshake of a new TLS connection one step per poll event,
+// waiting for whichever direction OpenSSL needs next. True once it is done
+// and request bytes can be read.
+bool WebServer::continueHandshake(int client_fd, int poll_index) {
+	TlsConnection* tls = _tls_clients[client_fd];
+	int result = tls->handshake();
+	if (result == 0) {
+		setPollEventsAt(poll_index, tls->wantsWrite() ? POLLOUT : POLLIN);
+		return false;
+	}
+	if (result < 0) {
+		_tls_stats.failed++;
+		LOG_INFO("TLS handshake with client " + toString(client_fd) + " failed: " + TlsConnection::lastError());
+		closeClient(client_fd, poll_index);
+		return false;
+	}
+	setPollEventsAt(poll_index, POLLIN);
+	_tls_stats.handshakes++;
+	if (tls->resumed()) {
+		_tls_stats.resumed++;
+	}
+	if (tls->kernelSend()) {
+		_tls_stats.kernel_send++;
+	}
+	LOG_DEBUG("TLS handshake with client " + toString(client_fd) + ": " + tls->description()
+		+ (tls->resumed() ? " (resumed)" : "") + (tls->kernelSend() ? " (kTLS)" : ""));
+	return true;
+}
+
+// Appends what the client sent to its buffer; same results as recv(). A
+// TLS connection is read until OpenSSL holds no more decrypted bytes, as
+// poll() only sees what is still in the socket.
+ssize_t WebServer::readClient(int client_fd) {
+	char buffer[8192];
+	std::map<int, TlsConnection*>::iterator tls = _tls_clients.find(client_fd);
+	if (tls == _tls_clients.end()) {
+		ssize_t bytes_read = recv(client_fd, buffer, sizeof(buffer), 0);
+		if (bytes_read > 0) {
+			_client_buffers[client_fd].append(buffer, bytes_read);
+		}
+		return bytes_read;
+	}
+	ssize_t total = 0;
+	do {
+		ssize_t bytes_read = tls->second->read(buffer, sizeof(buffer));
+		if (bytes_read <= 0) {
+			return total > 0 ? total : bytes_read;
+		}
+		_client_buffers[client_fd].append(buffer, bytes_read);
+		total += bytes_read;
+	} while (tls->second->pending() > 0);
+	return total;
+}
+
+void WebServer::processClientBuffer(int client_fd, int poll_index) {
+	std::string& client_buffer = _client_buffers[client_fd];
+
+	std::map<int, PendingUpload>::iterator upload = _uploads.find(client_fd);
+	if (upload != _uploads.end()) {
+		continueUpload(client_fd, poll_index, upload->second);
+		return;
+	}
+
+	// HTTP/2 with prior knowledge opens with the connection preface
+	if (!_limits_checked.count(client_fd) && !_tls_clients.count(client_fd)
+		&& client_buffer.compare(0, std::min(client_buffer.size(), Http2::PREFACE_LENGTH), Http2::PREFACE,
+		                         std::min(client_buffer.size(), Http2::PREFACE_LENGTH)) == 0
+		&& http2Enabled(client_fd)) {
+		if (client_buffer.size() < Http2::PREFACE_LENGTH) {
+			return;
+		}
+		Http2Session* session = startHttp2(client_fd);
+		session->start();
+		receiveHttp2(client_fd, session);
+		flushHttp2(client_fd, poll_index);
+		return;
+	}
+
+	size_t header_end_pos = findHeaderEnd(client_fd, client_buffer);
+	int oversized = headerSizeStatus(client_fd, client_buffer, header_end_pos);
+	if (oversized) {
+		LOG_INFO("Request head from client " + toString(client_fd) + " exceeds large_client_header_buffers");
+		sendResponse(client_fd, poll_index, generateErrorResponse(oversized,
+			oversized == 414 ? "URI Too Long" : "Request Header Fields Too Large"));
+		return;
+	}
+
+	// limit_req / limit_conn run on the request line alone, before headers
+	// are parsed or anything touches the disk
+	if (!_limits_checked.count(client_fd)) {
+		size_t line_end = client_buffer.find('\n');
+		if (line_end == std::string::npos) {
+			return;
+		}
+		int status_code = 0;
+		uint64_t delay_ms = 0;
+		LimitResult limit = checkLimits(client_fd, client_buffer.substr(0, line_end), status_code, delay_ms);
+		if (limit == LIMIT_REJECT) {
+			sendResponse(client_fd, poll_index, generateErrorResponse(status_code,
+				status_code == 429 ? "Too Many Requests" : "Service Unavailable"));
+			return;
+		}
+		if (limit == LIMIT_DELAY) {
+			LOG_DEBUG("Delaying client " + toString(client_fd) + " by " + toString(delay_ms) + "ms");
+			_delayed_clients[client_fd] = RateLimit::nowMs() + delay_ms;
+			_timings[client_fd].mark(RequestTiming::HEADERS);
+			setPollEventsAt(poll_index, 0);
+			return;
+		}
+	}
+
+	if (header_end_pos == Scan::npos) {
+		LOG_DEBUG("Headers not complete yet, waiting for more data from client " + toString(client_fd));
+		return;
+	}
+
+	LOG_DEBUG("Headers complete, checking for request body...");
+	RequestTiming& timing = _timings[client_fd];
+	timing.headersComplete();
 
 	std::string headers = client_buffer.substr(0, header_end_pos);
 	size_t content_length = getContentLength(headers);
 	
 	LOG_DEBUG("Content-Length: " + toString(content_length));
 
+	if (content_length > 0 && startUpload(client_fd, poll_index, header_end_pos, content_length)) {
+		return;
+	}
+	// Checked before the body is buffered, not once it has all arrived
+	Config* config = _client_configs.count(client_fd) ? _client_configs[client_fd] : _config;
+	if (!config->getServers().empty() && content_length > config->getServers()[0].client_max_body_size) {
+		sendResponse(client_fd, poll_index, generateErrorResponse(413, "Payload Too Large"));
+		return;
+	}
+
 	size_t expected_total_size = header_end_pos + content_length;
 	size_t current_size = client_buffer.length();
 
 	LOG_DEBUG("Expected total size: " + toString(expected_total_size) + ", current size: " + toString(current_size));
 
-	if (current_size >= expected_total_size) {
-		LOG_DEBUG("Complete HTTP request received from client " + toString(client_fd));
-		
-		if (current_size > expected_total_size) {
-			client_buffer = client_buffer.substr(0, expected_total_size);
-			LOG_DEBUG("Trimmed buffer to exact request size");
+	if (current_size >= expected_total_size) {
+		LOG_DEBUG("Complete HTTP request received from client " + toString(client_fd));
+		
+		if (current_size > expected_total_size) {
+			client_buffer = client_buffer.substr(0, expected_total_size);
+			LOG_DEBUG("Trimmed buffer to exact request size");
+		}
+
+		HttpRequest request;
+		_response_body.clear();
+		_request_config = _client_configs.count(client_fd) ? _client_configs[client_fd] : _config;
+		timing.mark(RequestTiming::BODY);
+		if (request.parseRequest(client_buffer)) {
+			LOG_DEBUG("Request parsed successfully");
+			if (timing.request.empty()) { // not when it comes back from the CGI queue
+				identifyRequest(timing, request, request.getBody().size());
+			}
+			if (upgradeHttp2(client_fd, request)) {
+				// The upgrade request is answered as stream 1; each stream
+				// is admitted by limit_req / limit_conn on its own from here
+				if (serveHttp2Stream(client_fd, _h2_sessions[client_fd], 1, request, timing)) {
+					logRequest(timing, client_fd);
+				}
+				_timings.erase(client_fd);
+				releaseConnLimit(client_fd);
+				_limits_checked.erase(client_fd);
+				flushHttp2(client_fd, poll_index);
+				return;
+			}
+			_proxy_location = NULL;
+			_timing = &timing;
+			_cgi_client = client_fd;
+			_cgi_started = false;
+			std::string response = generateResponse(request);
+			_cgi_client = -1;
+			_timing = NULL;
+			if (_proxy_location) {
+				timing.mark(RequestTiming::HANDLER);
+				startProxy(client_fd, request, client_buffer.substr(0, header_end_pos),
+				           client_buffer.substr(header_end_pos));
+				return;
+			}
+			if (_cgi_started) {
+				LOG_DEBUG("Client " + toString(client_fd) + " waits for a CGI script");
+				return;
+			}
+			LOG_DEBUG("Generated response for client " + toString(client_fd));
+			sendResponse(client_fd, poll_index, response);
+		} else {
+			LOG_ERROR("HTTP request parse error for client " + toString(client_fd));
+			std::string error_response = generateErrorResponse(400, "Bad Request");
+			sendResponse(client_fd, poll_index, error_response);
+		}
+	} else {
+		LOG_DEBUG("Waiting for " + toString(expected_total_size - current_size) + " more bytes from client " + toString(client_fd));
+	}
+}
+
+// Offset past the blank line ending the request head, Scan::npos while it
+// has not arrived. The search resumes where the previous read's stopped,
+// so a head trickling in is scanned once instead of on every read.
+size_t WebServer::findHeaderEnd(int client_fd, const std::string& buffer) {
+	std::map<int, size_t>::iterator scanned = _header_scans.find(client_fd);
+	size_t from = scanned != _header_scans.end() && scanned->second <= buffer.size() ? scanned->second : 0;
+	size_t end = Scan::headerEnd(buffer.data(), buffer.size(), from);
+	if (end == Scan::npos) {
+		_header_scans[client_fd] = buffer.size();
+	}
+	return end;
+}
+
+// large_client_header_buffers: the request line has to fit in one buffer
+// and the whole head in all of them. Returns the status to answer with,
+// 0 while the head is within both.
+int WebServer::headerSizeStatus(int client_fd, const std::string& buffer, size_t header_end_pos) {
+	Config* config = _client_configs.count(client_fd) ? _client_configs[client_fd] : _config;
+	if (config->getServers().empty()) {
+		return 0;
+	}
+	const ServerConfig& server = config->getServers()[0];
+	size_t line_end = buffer.find('\n');
+	if ((line_end == std::string::npos ? buffer.size() : line_end) > server.header_buffer_size) {
+		return 414;
+	}
+	if ((header_end_pos == Scan::npos ? buffer.size() : header_end_pos) > server.header_buffers * server.header_buffer_size) {
+		return 431;
+	}
+	return 0;
+}
+
+// Charges what a connection holds in memory to the budget, after each of
+// its events; closeClient releases it.
+void WebServer::trackMemory(int client_fd) {
+	if (!_client_ips.count(client_fd)) {
+		return; // closed while handling the event
+	}
+	size_t bytes = 0;
+	std::map<int, std::string>::const_iterator input = _client_buffers.find(client_fd);
+	if (input != _client_buffers.end()) {
+		bytes += input->second.capacity();
+	}
+	std::map<int, OutputQueue*>::const_iterator output = _client_outputs.find(client_fd);
+	if (output != _client_outputs.end()) {
+		bytes += output->second->memoryBytes();
+	}
+	std::map<int, Http2Session*>::const_iterator h2 = _h2_sessions.find(client_fd);
+	if (h2 != _h2_sessions.end()) {
+		bytes += h2->second->memoryBytes();
+	}
+	std::map<int, ProxySession*>::const_iterator proxy = _proxy_clients.find(client_fd);
+	if (proxy != _proxy_clients.end()) {
+		bytes += proxy->second->request.capacity() + proxy->second->header_buffer.capacity();
+	}
+	std::map<int, pid_t>::const_iterator cgi = _cgi_clients.find(client_fd);
+	if (cgi != _cgi_clients.end() && cgi->second) {
+		bytes += _cgi_jobs[cgi->second].output.capacity();
+	}
+	_memory.charge(client_fd, bytes);
+}
+
+// Whether reading the connection now would start a new request (or a
+// new connection's TLS handshake), rather than continue one under way
+bool WebServer::betweenRequests(int client_fd) {
+	if (!_client_ips.count(client_fd) || _uploads.count(client_fd) || _client_outputs.count(client_fd)
+		|| _proxy_clients.count(client_fd) || _delayed_clients.count(client_fd) || _cgi_clients.count(client_fd)) {
+		return false;
+	}
+	std::map<int, Http2Session*>::const_iterator h2 = _h2_sessions.find(client_fd);
+	if (h2 != _h2_sessions.end()) {
+		return h2->second->streamCount() == 0 && h2->second->output().empty();
+	}
+	std::map<int, std::string>::const_iterator input = _client_buffers.find(client_fd);
+	return input == _client_buffers.end() || input->second.empty();
+}
+
+// memory_budget: while it is exceeded, connections between requests are
+// not read, so what is buffered drains before more work is admitted.
+// Requests under way keep reading; each is bounded by
+// large_client_header_buffers and client_max_body_size, and holding them
+// back could leave the budget taken by requests that never complete.
+void WebServer::applyBackpressure() {
+	if (_memory.update()) {
+		LOG_INFO(std::string(_memory.paused() ? "memory budget exceeded, pausing reads: " : "memory back under budget: ")
+			+ _memory.statsLine());
+	}
+	if (!_memory.paused()) {
+		for (std::set<int>::iterator it = _paused_reads.begin(); it != _paused_reads.end(); ++it) {
+			size_t index = pollIndex(*it);
+			if (index < _poll_fds.size()) {
+				setPollEventsAt(index, _poll_fds[index].events | POLLIN);
+			}
+		}
+		_paused_reads.clear();
+		return;
+	}
+	for (size_t i = 0; i < _poll_fds.size(); ++i) {
+		int fd = _poll_fds[i].fd;
+		if ((_poll_fds[i].events & POLLIN) && betweenRequests(fd)) {
+			setPollEventsAt(i, _poll_fds[i].events & ~POLLIN);
+			_paused_reads.insert(fd);
+		}
+	}
+}
+
+// Whether generateResponse would hand this request to handleFileUpload
+// (UPLOAD_FORM) or append its body to a resumable upload (UPLOAD_APPEND)
+WebServer::UploadKind WebServer::uploadKind(const HttpRequest& request, const LocationConfig*& location) {
+	const std::string& uri = request.getUri();
+	if (!request.getHeader("Upgrade").empty() || _request_config->getServers().empty()) {
+		return UPLOAD_NONE;
+	}
+	location = _request_config->findLocationConfig(_request_config->getServers()[0], request.getPath());
+	if (!_request_config->isMethodAllowed(request.methodToString(), location)) {
+		return UPLOAD_NONE;
+	}
+	if (location && (location->cgi_cache_purge || !location->proxy_pass.empty())) {
+		return UPLOAD_NONE;
+	}
+	if (location && location->upload_resumable && isResumableRequest(request, location)) {
+		bool append = request.getMethod() == PUT || request.getMethod() == PATCH;
+		return append && !resumableId(request, location).empty() ? UPLOAD_APPEND : UPLOAD_NONE;
+	}
+	if (request.getMethod() != POST || uri.find("/upload") != 0) {
+		return UPLOAD_NONE;
+	}
+	if (location && !location->cgi_path.empty() && uri.find(location->cgi_extension) != std::string::npos) {
+		return UPLOAD_NONE;
+	}
+	return _cgi_handler && _cgi_handler->isCgiRequest(uri) ? UPLOAD_NONE : UPLOAD_FORM;
+}
+
+// Uploads are not buffered: once the headers are in, the body goes to
+// disk as it arrives, one read at a time, so memory stays flat whatever
+// the size of the files.
+bool WebServer::startUpload(int client_fd, int poll_index, size_t header_end_pos, size_t content_length) {
+	std::string& client_buffer = _client_buffers[client_fd];
+	HttpRequest request;
+	if (!request.parseRequest(client_buffer.substr(0, header_end_pos))) {
+		return false;
+	}
+	_request_config = _client_configs.count(client_fd) ? _client_configs[client_fd] : _config;
+	const LocationConfig* location = NULL;
+	UploadKind kind = uploadKind(request, location);
+	if (kind == UPLOAD_NONE) {
+		return false;
+	}
+	RequestTiming& timing = _timings[client_fd];
+	identifyRequest(timing, request, content_length);
+	timing.mark(RequestTiming::ROUTE);
+	_response_body.clear();
+	if (content_length > _request_config->getServers()[0].client_max_body_size) {
+		sendResponse(client_fd, poll_index, generateErrorResponse(413, "Payload Too Large"));
+		return true;
+	}
+	ResumableUpload* resumable = NULL;
+	if (kind == UPLOAD_APPEND) {
+		// The offset is checked before the body is read
+		std::string response;
+		resumable = openResumableAppend(request, location, content_length, response);
+		if (!resumable) {
+			sendResponse(client_fd, poll_index, response);
+			return true;
+		}
+	}
+	PendingUpload& upload = _uploads[client_fd];
+	upload.writer = resumable ? NULL : new UploadWriter(uploadDir(location), request.getHeader("Content-Type"));
+	upload.resumable = resumable;
+	upload.location = location;
+	upload.remaining = content_length;
+	upload.json = request.getHeader("Accept").find("application/json") != std::string::npos;
+	client_buffer.erase(0, header_end_pos);
+	LOG_DEBUG("Streaming " + toString(content_length) + " byte upload from client " + toString(client_fd));
+	continueUpload(client_fd, poll_index, upload);
+	return true;
+}
+
+void WebServer::continueUpload(int client_fd, int poll_index, PendingUpload& upload) {
+	std::string& input = _client_buffers[client_fd];
+	size_t length = std::min(input.size(), upload.remaining);
+	bool written = upload.resumable ? upload.resumable->append(input.data(), length)
+	                                : upload.writer->write(input.data(), length);
+	upload.remaining -= length;
+	input.clear(); // anything past the body is dropped, as on the buffered path
+	if (written && upload.remaining > 0) {
+		return;
+	}
+	_timings[client_fd].mark(RequestTiming::BODY);
+	_response_body.clear();
+	std::string response = upload.resumable ? finishResumableAppend(*upload.resumable, upload.location)
+	                                        : finishUpload(*upload.writer, upload.location, upload.json);
+	delete upload.writer;
+	delete upload.resumable;
+	_uploads.erase(client_fd);
+	sendResponse(client_fd, poll_index, response);
+}
+
+// Queues the response (plus any file ranges the handler left in
+// _response_body) and sends as much as the socket takes right now; the
+// rest is flushed from run() on POLLOUT.
+void WebServer::sendResponse(int client_fd, size_t poll_index, const std::string& response) {
+	RequestTiming& timing = _timings[client_fd];
+	timing.mark(RequestTiming::HANDLER);
+	timing.status = RequestTiming::statusOf(response);
+	OutputQueue* output = new OutputQueue();
+	output->push(RequestTiming::addHeader(response, timing.id));
+	timing.bytes = output->pendingBytes() + _response_body.pendingBytes();
+	output->splice(_response_body);
+	_client_outputs[client_fd] = output;
+	_client_buffers.erase(client_fd);
+	setPollEventsAt(poll_index, POLLOUT);
+	handleClientWrite(client_fd, poll_index);
+}
+
+void WebServer::handleClientWrite(int client_fd, size_t poll_index) {
+	OutputQueue* output = _client_outputs[client_fd];
+	std::map<int, TlsConnection*>::iterator tls = _tls_clients.find(client_fd);
+	OutputQueue::FlushResult result = output->flush(client_fd, tls != _tls_clients.end() ? tls->second : NULL);
+
+	std::map<int, ProxySession*>::iterator proxy = _proxy_clients.find(client_fd);
+	if (proxy != _proxy_clients.end() && result != OutputQueue::FLUSH_ERROR) {
+		ProxySession* session = proxy->second;
+		if (session->paused && output->pendingBytes() < PROXY_BUFFER_LIMIT / 2) {
+			session->paused = false;
+			session->deadline = time(NULL) + session->read_timeout;
+			setPollEvents(session->upstream_fd, POLLIN);
+		}
+		if (result == OutputQueue::FLUSH_DONE && session->state != ProxySession::FINISHED) {
+			if (_poll_fds[poll_index].revents & (POLLHUP | POLLERR)) {
+				closeClient(client_fd, poll_index);
+				return;
+			}
+			setPollEventsAt(poll_index, 0); // drained, the upstream has more
+			return;
+		}
+	}
+
+	if (result == OutputQueue::FLUSH_AGAIN) {
+		LOG_DEBUG("Client " + toString(client_fd) + " has " + toString(output->pendingBytes()) + " bytes pending");
+		return;
+	}
+	if (result == OutputQueue::FLUSH_ERROR) {
+		LOG_ERROR("Failed to send response to client " + toString(client_fd) + ": " + std::string(strerror(errno)));
+	} else {
+		LOG_DEBUG("Response sent to client " + toString(client_fd));
+	}
+	closeClient(client_fd, poll_index);
+	LOG_INFO("Client " + toString(client_fd) + " connection closed");
+}
+
+void WebServer::closeClient(int client_fd, size_t poll_index) {
+	std::map<int, ProxySession*>::iterator proxy = _proxy_clients.find(client_fd);
+	if (proxy != _proxy_clients.end()) {
+		detachUpstream(proxy->second, false);
+		delete proxy->second;
+		_proxy_clients.erase(proxy);
+		poll_index = pollIndex(client_fd); // removing the upstream may have shifted it
+	}
+	std::map<int, Http2Session*>::iterator h2 = _h2_sessions.find(client_fd);
+	if (h2 != _h2_sessions.end()) {
+		releaseCgiStreams(client_fd);
+		delete h2->second;
+		_h2_sessions.erase(h2);
+	}
+	std::map<int, PendingUpload>::iterator upload = _uploads.find(client_fd);
+	if (upload != _uploads.end()) {
+		delete upload->second.writer; // removes the partial files
+		delete upload->second.resumable; // keeps what arrived, to be resumed
+		_uploads.erase(upload);
+	}
+	std::map<int, TlsConnection*>::iterator tls = _tls_clients.find(client_fd);
+	if (tls != _tls_clients.end()) {
+		tls->second->shutdown();
+		delete tls->second;
+		_tls_clients.erase(tls);
+	}
+	std::map<int, RequestTiming>::iterator timing = _timings.find(client_fd);
+	if (timing != _timings.end()) {
+		if (timing->second.status) {
+			timing->second.mark(RequestTiming::SEND);
+			logRequest(timing->second, client_fd);
+		}
+		_timings.erase(timing);
+	}
+	_events->remove(client_fd);
+	close(client_fd);
+	_poll_fds.erase(_poll_fds.begin() + poll_index);
+	_client_buffers.erase(client_fd);
+	_client_addrs.erase(client_fd);
+	releaseConnLimit(client_fd);
+	_client_ips.erase(client_fd);
+	_limits_checked.erase(client_fd);
+	_delayed_clients.erase(client_fd);
+	_header_scans.erase(client_fd);
+	_memory.release(client_fd);
+	_paused_reads.erase(client_fd);
+	releaseClientConfig(client_fd);
+	releaseCgiClient(client_fd);
+
+	std::map<int, OutputQueue*>::iterator it = _client_outputs.find(client_fd);
+	if (it != _client_outputs.end()) {
+		delete it->second;
+		_client_outputs.erase(it);
+	}
+}
+
+// HTTP/2. A session turns frames into complete requests; each one is
+// rendered as HTTP/1.1, run through generateResponse like any other, and
+// its response converted back into HEADERS plus a body the session frames
+// within the flow-control windows.
+
+bool WebServer::http2Enabled(int client_fd) {
+	Config* config = _client_configs.count(client_fd) ? _client_configs[client_fd] : _config;
+	return !config->getServers().empty() && config->getServers()[0].http2;
+}
+
+Http2Session* WebServer::startHttp2(int client_fd) {
+	Config* config = _client_configs.count(client_fd) ? _client_configs[client_fd] : _config;
+	size_t max_body = config->getServers().empty() ? 0 : config->getServers()[0].client_max_body_size;
+	Http2Session* session = new Http2Session(max_body);
+	_h2_sessions[client_fd] = session;
+	// Small frames (WINDOW_UPDATE, SETTINGS ACK, the tail of a window's
+	// worth of DATA) must not wait for the client's delayed ACK
+	int one = 1;
+	setsockopt(client_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	LOG_DEBUG("Client " + toString(client_fd) + " switched to HTTP/2");
+	return session;
+}
+
+// h2c: "Upgrade: h2c" with an HTTP2-Settings header on a cleartext
+// connection. The 101 goes out ahead of the server preface.
+bool WebServer::upgradeHttp2(int client_fd, const HttpRequest& request) {
+	if (_tls_clients.count(client_fd) || !http2Enabled(client_fd)) {
+		return false;
+	}
+	std::string upgrade = request.getHeader("Upgrade");
+	std::string connection = request.getHeader("Connection");
+	for (size_t i = 0; i < upgrade.size(); ++i) {
+		upgrade[i] = std::tolower(upgrade[i]);
+	}
+	for (size_t i = 0; i < connection.size(); ++i) {
+		connection[i] = std::tolower(connection[i]);
+	}
+	if (upgrade.find("h2c") == std::string::npos || connection.find("http2-settings") == std::string::npos) {
+		return false;
+	}
+	Http2Session* session = startHttp2(client_fd);
+	if (!session->upgrade(request.getHeader("HTTP2-Settings"))) {
+		delete session;
+		_h2_sessions.erase(client_fd);
+		return false; // answered as plain HTTP/1.1
+	}
+	session->output().push("HTTP/1.1 101 Switching Protocols\r\nConnection: Upgrade\r\nUpgrade: h2c\r\n\r\n");
+	session->start();
+	_client_buffers[client_fd].clear();
+	return true;
+}
+
+void WebServer::handleHttp2(int client_fd, size_t poll_index, short revents) {
+	Http2Session* session = _h2_sessions[client_fd];
+	if (revents & (POLLIN | POLLHUP | POLLERR)) {
+		ssize_t bytes_read = readClient(client_fd);
+		if (bytes_read == 0 || (bytes_read == -1 && errno != EAGAIN)) {
+			LOG_DEBUG("HTTP/2 client " + toString(client_fd) + " disconnected");
+			closeClient(client_fd, poll_index);
+			return;
+		}
+		receiveHttp2(client_fd, session);
+	}
+	flushHttp2(client_fd, poll_index);
+}
+
+// Feeds what was read to the session and answers every request it
+// completed. A connection error leaves a GOAWAY in the output.
+void WebServer::receiveHttp2(int client_fd, Http2Session* session) {
+	std::string& input = _client_buffers[client_fd];
+	if (input.empty()) {
+		return;
+	}
+	if (!session->receive(input.data(), input.size())) {
+		LOG_INFO("HTTP/2 protocol error from client " + toString(client_fd));
+	}
+	input.clear();
+
+	Http2Request stream;
+	while (session->nextRequest(stream)) {
+		// A connection lives across reloads; each request takes the
+		// current configuration, like a new connection would
+		std::map<int, Config*>::iterator pinned = _client_configs.find(client_fd);
+		if (pinned != _client_configs.end() && pinned->second != _config) {
+			releaseClientConfig(client_fd);
+			_client_configs[client_fd] = _config;
+			_config_users[_config]++;
+		}
+		_request_config = _config;
+		_response_body.clear();
+
+		// Streams are timed from the moment they are complete; the
+		// connection's frames are not attributed to any one of them
+		RequestTiming timing;
+		timing.begin(RequestTiming::newId());
+		std::string raw;
+		HttpRequest request;
+		bool answered = true;
+		if (stream.oversized) {
+			respondHttp2(session, stream.stream_id, generateErrorResponse(413, "Payload Too Large"), false, timing);
+		} else if (!Http2::toHttp1(stream.headers, stream.body, raw) || !request.parseRequest(raw)) {
+			respondHttp2(session, stream.stream_id, generateErrorResponse(400, "Bad Request"), false, timing);
+		} else {
+			// limit_conn counts the request while it is generated; a
+			// limit_req delay cannot hold one stream back without stalling
+			// the others, so it is served right away
+			identifyRequest(timing, request, request.getBody().size());
+			int status_code = 0;
+			uint64_t delay_ms = 0;
+			LimitResult limit = checkLimits(client_fd, raw.substr(0, raw.find('\r')), status_code, delay_ms);
+			if (limit == LIMIT_REJECT) {
+				respondHttp2(session, stream.stream_id, generateErrorResponse(status_code,
+					status_code == 429 ? "Too Many Requests" : "Service Unavailable"), false, timing);
+			} else {
+				answered = serveHttp2Stream(client_fd, session, stream.stream_id, request, timing);
+			}
+			releaseConnLimit(client_fd);
+			_limits_checked.erase(client_fd);
+		}
+		if (answered) {
+			logRequest(timing, client_fd);
+		}
+	}
+}
+
+// False when the stream was left to a CGI job, which answers it (and
+// logs it) when the script is done
+bool WebServer::serveHttp2Stream(int client_fd, Http2Session* session, uint32_t stream_id,
+                                 const HttpRequest& request, RequestTiming& timing) {
+	_proxy_location = NULL;
+	_timing = &timing;
+	_cgi_client = client_fd;
+	_cgi_stream = stream_id;
+	_cgi_started = false;
+	std::string response = generateResponse(request);
+	_cgi_client = -1;
+	_cgi_stream = 0;
+	_timing = NULL;
+	if (_cgi_started) {
+		return false;
+	}
+	if (_proxy_location) {
+		// The upstream connection pool relays HTTP/1.1 byte streams
+		LOG_ERROR("proxy_pass is not available over HTTP/2: " + request.getUri());
+		_proxy_location = NULL;
+		response = generateErrorResponse(502, "Bad Gateway");
+	}
+	respondHttp2(session, stream_id, response, request.getMethod() == HEAD, timing);
+	return true;
+}
+
+// `response` and _response_body as a handler left them; the stream's
+// timing ends here, its frames are sent with the other streams'
+void WebServer::respondHttp2(Http2Session* session, uint32_t stream_id, std::string response, bool head,
+                             RequestTiming& timing) {
+	timing.mark(RequestTiming::HANDLER);
+	response = RequestTiming::addHeader(response, timing.id);
+	HeaderList headers;
+	size_t body_start = 0;
+	if (!Http2::fromHttp1(response, headers, body_start)) {
+		_response_body.clear();
+		response = generateErrorResponse(500, "Internal Server Error");
+		headers.clear();
+		Http2::fromHttp1(response, headers, body_start);
+	}
+	OutputQueue body;
+	if (!head) {
+		body.push(response.substr(body_start));
+		body.splice(_response_body);
+	}
+	_response_body.clear();
+	timing.status = RequestTiming::statusOf(response);
+	timing.bytes = body.pendingBytes();
+	session->respond(stream_id, headers, body);
+}
+
+// Writes frames until the socket is full or nothing is left that the
+// windows allow; POLLOUT only while frames are waiting.
+void WebServer::flushHttp2(int client_fd, size_t poll_index) {
+	Http2Session* session = _h2_sessions[client_fd];
+	OutputQueue& output = session->output();
+	std::map<int, TlsConnection*>::iterator tls = _tls_clients.find(client_fd);
+	while (true) {
+		session->fill(HTTP2_OUTPUT_BUDGET);
+		if (output.empty()) {
+			break;
+		}
+		OutputQueue::FlushResult result = output.flush(client_fd, tls != _tls_clients.end() ? tls->second : NULL);
+		if (result == OutputQueue::FLUSH_ERROR) {
+			LOG_ERROR("Failed to send HTTP/2 frames to client " + toString(client_fd) + ": " + std::string(strerror(errno)));
+			closeClient(client_fd, poll_index);
+			return;
+		}
+		if (result == OutputQueue::FLUSH_AGAIN) {
+			break;
+		}
+	}
+	if (output.empty() && session->finished()) {
+		LOG_DEBUG("HTTP/2 connection " + toString(client_fd) + " finished");
+		closeClient(client_fd, poll_index);
+		return;
+	}
+	setPollEventsAt(poll_index, output.empty() ? POLLIN : (POLLIN | POLLOUT));
+}
+
+// Reverse proxy. The client request is complete when this runs; from here
+// on the client socket only waits for output while the upstream socket goes
+// through connect, send and read in the poll loop.
+void WebServer::startProxy(int client_fd, const HttpRequest& request, const std::string& raw_head,
+                           const std::string& body) {
+	const LocationConfig* location = _proxy_location;
+	std::string target = location->proxy_pass.substr(7); // "http://" checked by the config
+	std::string uri = request.getUri();
+	size_t slash = target.find('/');
+	if (slash != std::string::npos) {
+		// A URI in proxy_pass replaces the matched location prefix
+		std::string prefix = target.substr(slash);
+		target.erase(slash);
+		std::string rest = uri.substr(std::min(location->path.length(), uri.length()));
+		if (!rest.empty() && rest[0] == '/' && prefix[prefix.length() - 1] == '/') {
+			rest.erase(0, 1);
+		}
+		uri = prefix + rest;
+	}
+
+	ProxySession* session = new ProxySession();
+	session->client_fd = client_fd;
+	session->group = target;
+	session->idempotent = request.getMethod() != POST;
+	session->head = request.getMethod() == HEAD;
+	session->connect_timeout = location->proxy_connect_timeout;
+	session->read_timeout = location->proxy_read_timeout;
+	_proxy_clients[client_fd] = session;
+	_client_buffers.erase(client_fd);
+	setPollEvents(client_fd, 0); // hangups and errors are still reported
+
+	UpstreamGroup* group = _upstreams.group(target);
+	if (!group) {
+		LOG_ERROR("proxy_pass target " + target + " cannot be resolved");
+		respondProxyError(session, 502, "Bad Gateway");
+		return;
+	}
+	const std::string& client_addr = _client_addrs[client_fd];
+	session->hash_value = Proxy::expandKey(group->config.hash_key, request.getUri(),
+	                                       request.getHeader("Host"), client_addr);
+	session->request = Proxy::buildRequest(raw_head, body, uri, client_addr,
+	                                       _tls_clients.count(client_fd) ? "https" : "http",
+	                                       group->config.keepalive > 0, _timings[client_fd].id);
+	if (!connectUpstream(session)) {
+		respondProxyError(session, 502, "Bad Gateway");
+	}
+}
+
+// Picks the next untried peer and starts talking to it; false when the
+// group has no peer left to try.
+bool WebServer::connectUpstream(ProxySession* session) {
+	UpstreamGroup* group = _upstreams.group(session->group);
+	while (group) {
+		int peer = _upstreams.select(*group, session->hash_value, session->tried);
+		if (peer == -1) {
+			break;
+		}
+		session->tried.insert(peer);
+		std::string address = group->peers[peer].address();
+		bool reused = false;
+		int fd = _upstreams.connect(*group, peer, reused);
+		if (fd == -1) {
+			_upstreams.reportFailure(session->group, peer, address);
+			continue;
+		}
+		session->peer = peer;
+		session->peer_address = address;
+		session->upstream_fd = fd;
+		session->reused = reused;
+		session->request_sent = 0;
+		session->header_buffer.clear();
+		session->state = reused ? ProxySession::SENDING : ProxySession::CONNECTING;
+		session->deadline = time(NULL) + (reused ? session->read_timeout : session->connect_timeout);
+		_proxy_upstreams[fd] = session;
+		addPollFd(fd, POLLOUT);
+		LOG_DEBUG("Client " + toString(session->client_fd) + " proxied to " + address
+			+ (reused ? " over a kept-alive connection" : ""));
+		return true;
+	}
+	return false;
+}
+
+void WebServer::handleUpstreamEvent(int upstream_fd, short revents) {
+	ProxySession* session = _proxy_upstreams[upstream_fd];
+
+	if (session->state == ProxySession::CONNECTING) {
+		int error = 0;
+		socklen_t length = sizeof(error);
+		if (getsockopt(upstream_fd, SOL_SOCKET, SO_ERROR, &error, &length) == -1 || error != 0) {
+			LOG_ERROR("connect to upstream " + session->peer_address + " failed: "
+				+ std::string(strerror(error ? error : errno)));
+			upstreamFailed(session, false);
+			return;
+		}
+		session->state = ProxySession::SENDING;
+		session->deadline = time(NULL) + session->read_timeout;
+	}
+
+	if (session->state == ProxySession::SENDING) {
+		while (session->request_sent < session->request.length()) {
+			ssize_t sent = send(upstream_fd, session->request.data() + session->request_sent,
+			                    session->request.length() - session->request_sent, MSG_NOSIGNAL);
+			if (sent == -1) {
+				if (errno == EAGAIN || errno == EWOULDBLOCK) {
+					return;
+				}
+				LOG_ERROR("send to upstream " + session->peer_address + " failed: " + std::string(strerror(errno)));
+				upstreamFailed(session, false);
+				return;
+			}
+			session->request_sent += sent;
+		}
+		session->state = ProxySession::READING_HEADERS;
+		session->deadline = time(NULL) + session->read_timeout;
+		setPollEvents(upstream_fd, POLLIN);
+		return;
+	}
+
+	if (revents & (POLLIN | POLLHUP | POLLERR)) {
+		readUpstream(session);
+	}
+}
+
+void WebServer::readUpstream(ProxySession* session) {
+	char buffer[65536];
+	ssize_t bytes_read = recv(session->upstream_fd, buffer, sizeof(buffer), 0);
+	if (bytes_read == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+		return;
+	}
+	if (bytes_read <= 0) {
+		if (bytes_read == 0 && session->state == ProxySession::STREAMING
+			&& session->framing == ProxySession::FRAME_CLOSE) {
+			finishProxy(session, false);
+			flushProxyClient(session);
+			return;
+		}
+		LOG_ERROR("upstream " + session->peer_address + (bytes_read == 0
+			? std::string(" closed the connection prematurely")
+			: " read failed: " + std::string(strerror(errno))));
+		upstreamFailed(session, false);
+		return;
+	}
+	session->deadline = time(NULL) + session->read_timeout;
+
+	if (session->state == ProxySession::STREAMING) {
+		deliverUpstream(session, buffer, bytes_read);
+		flushProxyClient(session);
+		return;
+	}
+
+	session->header_buffer.append(buffer, bytes_read);
+	std::string client_head;
+	size_t head_length;
+	while (true) {
+		head_length = Scan::headerEnd(session->header_buffer.data(), session->header_buffer.size());
+		if (head_length == Scan::npos) {
+			if (session->header_buffer.length() > PROXY_HEADER_LIMIT) {
+				LOG_ERROR("upstream " + session->peer_address + " sent too large a response head");
+				upstreamFailed(session, false);
+			}
+			return;
+		}
+		if (!Proxy::parseResponseHead(session->header_buffer.substr(0, head_length), *session, client_head)) {
+			LOG_ERROR("upstream " + session->peer_address + " sent an invalid response head");
+			upstreamFailed(session, false);
+			return;
+		}
+		if (session->status >= 200) {
+			break;
+		}
+		session->header_buffer.erase(0, head_length); // 100 Continue and the like stay here
+	}
+
+	UpstreamGroup* group = _upstreams.group(session->group);
+	if (session->status >= 502 && session->status <= 504 && session->idempotent
+		&& group && session->tried.size() < group->peers.size()) {
+		LOG_INFO("upstream " + session->peer_address + " answered " + toString(session->status)
+			+ ", trying the next server");
+		_upstreams.reportFailure(session->group, session->peer, session->peer_address);
+		detachUpstream(session, false);
+		if (!connectUpstream(session)) {
+			respondProxyError(session, 502, "Bad Gateway");
+		}
+		return;
+	}
+	_upstreams.reportSuccess(session->group, session->peer, session->peer_address);
+
+	session->state = ProxySession::STREAMING;
+	session->forwarded = true;
+	RequestTiming& timing = _timings[session->client_fd];
+	timing.mark(RequestTiming::UPSTREAM);
+	timing.status = session->status;
+	client_head = RequestTiming::addHeader(client_head, timing.id);
+	timing.bytes = client_head.size();
+	OutputQueue* output = new OutputQueue();
+	output->push(client_head);
+	_client_outputs[session->client_fd] = output;
+	std::string rest = session->header_buffer.substr(head_length);
+	session->header_buffer.clear();
+	if (!rest.empty() || session->framing == ProxySession::FRAME_NONE) {
+		deliverUpstream(session, rest.data(), rest.length());
+	}
+	flushProxyClient(session);
+}
+
+// Queues response body bytes for the client and finishes the session once
+// the framing says the response is complete.
+void WebServer::deliverUpstream(ProxySession* session, const char* data, size_t length) {
+	if (session->framing == ProxySession::FRAME_NONE) {
+		finishProxy(session, session->upstream_keepalive && length == 0);
+		return;
+	}
+	if (session->framing == ProxySession::FRAME_LENGTH && (long long)length > session->remaining) {
+		length = session->remaining; // never pass on more than was announced
+		session->upstream_keepalive = false;
+	}
+	bool done = session->consumeBody(data, length);
+	OutputQueue* output = _client_outputs[session->client_fd];
+	if (length > 0) {
+		output->push(std::string(data, length));
+		_timings[session->client_fd].bytes += length;
+	}
+	if (done) {
+		finishProxy(session, session->upstream_keepalive);
+	} else if (!session->paused && output->pendingBytes() > PROXY_BUFFER_LIMIT) {
+		session->paused = true;
+		setPollEvents(session->upstream_fd, 0);
+	}
+}
+
+// Failover: before anything reached the client the request is retried on
+// the next peer if that cannot run it twice (idempotent, never sent, or a
+// pooled connection that had gone stale). Otherwise 502/504, or a cut-short
+// response once bytes are out.
+void WebServer::upstreamFailed(ProxySession* session, bool timed_out) {
+	bool stale = session->reused && !timed_out;
+	bool retry = stale || session->state == ProxySession::CONNECTING || session->idempotent;
+	if (timed_out) {
+		LOG_ERROR("upstream " + session->peer_address + " timed out");
+	}
+	if (stale) {
+		session->tried.erase(session->peer); // the pooled socket failed, not the server
+	} else {
+		_upstreams.reportFailure(session->group, session->peer, session->peer_address);
+	}
+	detachUpstream(session, false);
+
+	if (session->forwarded) {
+		session->state = ProxySession::FINISHED;
+		flushProxyClient(session);
+		return;
+	}
+	if (retry && connectUpstream(session)) {
+		return;
+	}
+	if (timed_out) {
+		respondProxyError(session, 504, "Gateway Timeout");
+	} else {
+		respondProxyError(session, 502, "Bad Gateway");
+	}
+}
+
+void WebServer::detachUpstream(ProxySession* session, bool reusable) {
+	if (session->upstream_fd == -1) {
+		return;
+	}
+	removePollFd(session->upstream_fd);
+	_proxy_upstreams.erase(session->upstream_fd);
+	_upstreams.release(session->group, session->peer, session->peer_address, session->upstream_fd, reusable);
+	session->upstream_fd = -1;
+	session->paused = false;
+}
+
+void WebServer::finishProxy(ProxySession* session, bool reusable) {
+	LOG_DEBUG("Proxied response from " + session->peer_address + " complete"
+		+ (reusable ? ", connection kept alive" : ""));
+	detachUpstream(session, reusable);
+	session->state = ProxySession::FINISHED;
+}
+
+void WebServer::respondProxyError(ProxySession* session, int status_code, const std::string& status_text) {
+	RequestTiming& timing = _timings[session->client_fd];
+	timing.mark(RequestTiming::UPSTREAM);
+	timing.status = status_code;
+	OutputQueue* output = new OutputQueue();
+	output->push(RequestTiming::addHeader(generateErrorResponse(status_code, status_text), timing.id));
+	timing.bytes = output->pendingBytes();
+	_client_outputs[session->client_fd] = output;
+	session->state = ProxySession::FINISHED;
+	flushProxyClient(session);
+}
+
+// Writes what is queued for the proxied client. May close the client and
+// free the session, so callers must not touch it afterwards.
+void WebServer::flushProxyClient(ProxySession* session) {
+	int client_fd = session->client_fd;
+	if (!_client_outputs.count(client_fd)) {
+		return;
+	}
+	size_t index = pollIndex(client_fd);
+	setPollEventsAt(index, POLLOUT);
+	handleClientWrite(client_fd, index);
+}
+
+void WebServer::checkProxyTimeouts() {
+	if (_proxy_upstreams.empty()) {
+		return;
+	}
+	time_t now = time(NULL);
+	std::vector<int> expired;
+	for (std::map<int, ProxySession*>::iterator it = _proxy_upstreams.begin(); it != _proxy_upstreams.end(); ++it) {
+		if (!it->second->paused && it->second->deadline <= now) {
+			expired.push_back(it->first);
 		}
+	}
+	for (size_t i = 0; i < expired.size(); ++i) {
+		std::map<int, ProxySession*>::iterator it = _proxy_upstreams.find(expired[i]);
+		if (it != _proxy_upstreams.end()) {
+			upstreamFailed(it->second, true);
+		}
+	}
+}
 
-		HttpRequest request;
-		if (request.parseRequest(client_buffer)) {
-			LOG_DEBUG("Request parsed successfully");
-			std::string response = generateResponse(request);
-			LOG_DEBUG("Generated response for client " + toString(client_fd));
-			sendResponse(client_fd, response);
-			LOG_DEBUG("Response sent to client " + toString(client_fd));
-		} else {
-			LOG_ERROR("HTTP request parse error for client " + toString(client_fd));
-			std::string error_response = generateErrorResponse(400, "Bad Request");
-			sendResponse(client_fd, error_response);
+size_t WebServer::pollIndex(int fd) const {
+	for (size_t i = 0; i < _poll_fds.size(); ++i) {
+		if (_poll_fds[i].fd == fd) {
+			return i;
 		}
-		
-		close(client_fd);
-		_poll_fds.erase(_poll_fds.begin() + poll_index);
-		_client_buffers.erase(client_fd);
-		LOG_INFO("Client " + toString(client_fd) + " connection closed");
-	} else {
-		LOG_DEBUG("Waiting for " + toString(expected_total_size - current_size) + " more bytes from client " + toString(client_fd));
 	}
+	return _poll_fds.size();
 }
 
-void WebServer::sendResponse(int client_fd, const std::string& response) {
-	ssize_t bytes_sent = send(client_fd, response.c_str(), response.length(), 0);
-	if (bytes_sent == -1) {
-		LOG_ERROR("Failed to send response to client " + toString(client_fd) + ": " + std::string(strerror(errno)));
-	} else {
-		LOG_DEBUG("Sent " + toString(bytes_sent) + " bytes to client " + toString(client_fd));
+void WebServer::setPollEvents(int fd, short events) {
+	size_t index = pollIndex(fd);
+	if (index < _poll_fds.size()) {
+		setPollEventsAt(index, events);
+	}
+}
+
+void WebServer::setPollEventsAt(size_t poll_index, short events) {
+	if (_poll_fds[poll_index].events != events) {
+		_poll_fds[poll_index].events = events;
+		_events->watch(_poll_fds[poll_index].fd, events, poll_index);
+	}
+}
+
+void WebServer::addPollFd(int fd, short events) {
+	struct pollfd pfd;
+	pfd.fd = fd;
+	pfd.events = events;
+	pfd.revents = 0;
+	_poll_fds.push_back(pfd);
+	_events->watch(fd, events, _poll_fds.size() - 1);
+}
+
+void WebServer::removePollFd(int fd) {
+	size_t index = pollIndex(fd);
+	if (index < _poll_fds.size()) {
+		_events->remove(fd);
+		_poll_fds.erase(_poll_fds.begin() + index);
 	}
 }
 
@@ -266,8 +2176,8 @@ std::string WebServer::generateResponse(const HttpRequest& request) {
     
     // Find server config (use first server for now - can be enhanced later)
     const ServerConfig* server_config = NULL;
-    if (!_config->getServers().empty()) {
-        server_config = &_config->getServers()[0];
+    if (!_request_config->getServers().empty()) {
+        server_config = &_request_config->getServers()[0];
     }
     
     if (!server_config) {
@@ -275,7 +2185,7 @@ std::string WebServer::generateResponse(const HttpRequest& request) {
     }
     
     // Find best matching location from config
-    const LocationConfig* location = _config->findLocationConfig(*server_config, uri);
+    const LocationConfig* location = _request_config->findLocationConfig(*server_config, request.getPath());
     if (location) {
         std::cout << "Matched location: " << location->path << std::endl;
         std::cout << "Location root: " << location->root << std::endl;
@@ -284,10 +2194,33 @@ std::string WebServer::generateResponse(const HttpRequest& request) {
     }
     
     // Check method restrictions
-    if (!_config->isMethodAllowed(method, location)) {
+    if (!_request_config->isMethodAllowed(method, location)) {
         std::cout << "Method " << method << " not allowed for this location" << std::endl;
         return generateErrorResponse(405, "Method Not Allowed");
     }
+    if (_timing) {
+        _timing->mark(RequestTiming::ROUTE);
+    }
+
+    if (location && location->cgi_cache_purge) {
+        // "/purge/cgi-bin/x" drops cached CGI responses under "/cgi-bin/x"
+        std::string prefix = request.getPath().substr(std::min(location->path.length(), request.getPath().length()));
+        if (prefix.empty() || prefix[0] != '/') {
+            prefix = "/" + prefix;
+        }
+        size_t purged = _cgi_cache.purge(prefix);
+        return generateSuccessResponse("{\"purged\":" + toString(purged) + "}\n", "application/json");
+    }
+
+    // proxy_pass: handleClientData hands the request to startProxy
+    if (location && !location->proxy_pass.empty()) {
+        _proxy_location = location;
+        return "";
+    }
+
+    if (location && location->upload_resumable && isResumableRequest(request, location)) {
+        return handleResumableUpload(request, location);
+    }
     
     // Route to method-specific handlers with location context
     if (request.getMethod() == GET) {
@@ -309,37 +2242,29 @@ std::string WebServer::toString(size_t value) {
 	return oss.str();
 }
 
+// Matches the field name at the start of each header line in place, so
+// the head is neither copied nor lowercased
 size_t WebServer::getContentLength(const std::string& headers) {
-	std::string headers_lower = headers;
-	for (size_t i = 0; i < headers_lower.length(); ++i) {
-		headers_lower[i] = std::tolower(headers_lower[i]);
-	}
-	
-	size_t pos = headers_lower.find("content-length:");
-	if (pos == std::string::npos) {
-		return 0;
-	}
-
-	pos += 15;
-	while (pos < headers.length() && (headers[pos] == ' ' || headers[pos] == '\t')) {
-		pos++;
-	}
-	
-	size_t end_pos = headers.find('\r', pos);
-	if (end_pos == std::string::npos) {
-		end_pos = headers.find('\n', pos);
-	}
-	if (end_pos == std::string::npos) {
-		end_pos = headers.length();
+	static const char name[] = "content-length:";
+	const size_t name_length = sizeof(name) - 1;
+	size_t line = headers.find('\n');
+	while (line != std::string::npos) {
+		line++;
+		if (headers.size() - line >= name_length && Scan::equalsIgnoreCase(headers.data() + line, name, name_length)) {
+			size_t pos = line + name_length;
+			while (pos < headers.length() && (headers[pos] == ' ' || headers[pos] == '\t')) {
+				pos++;
+			}
+			size_t content_length = 0;
+			while (pos < headers.length() && headers[pos] >= '0' && headers[pos] <= '9') {
+				content_length = content_length * 10 + (headers[pos] - '0');
+				pos++;
+			}
+			return content_length;
+		}
+		line = headers.find('\n', line);
 	}
-	
-	std::string value = headers.substr(pos, end_pos - pos);
-	
-	size_t content_length = 0;
-	std::istringstream iss(value);
-	iss >> content_length;
-	
-	return content_length;
+	return 0;
 }
 
 std::string WebServer::generateErrorResponse(int status_code, const std::string& status_text) {
@@ -357,131 +2282,998 @@ std::string WebServer::generateErrorResponse(int status_code, const std::string&
 	return response;
 }
 
-std::string WebServer::getContentType(const std::string& file_path) {
-    size_t dot_pos = file_path.find_last_of('.');
-    if (dot_pos == std::string::npos) {
-        return "application/octet-stream";
+std::string WebServer::getContentType(const std::string& file_path) {
+    return mime_type(file_path);
+}
+
+std::string WebServer::getFilePath(const std::string& uri, const LocationConfig* location) {
+    std::string root;
+    
+    // Use location-specific root if available, otherwise server default
+    if (location && !location->root.empty()) {
+        root = location->root;
+        // Remove the location path from URI to get relative path
+        std::string relative_path = uri;
+        if (uri.find(location->path) == 0) {
+            relative_path = uri.substr(location->path.length());
+            if (relative_path.empty() || relative_path[0] != '/') relative_path = "/" + relative_path;
+        }
+        return root + relative_path;
+    } else {
+        // Use server root (your existing logic)
+        root = "./www";
+        if (uri == "/") {
+            return root + "/index.html";
+        }
+        return root + uri;
+    }
+}
+
+
+bool WebServer::fileExists(const std::string& path) {
+	return _open_files.lookup(path).exists();
+}
+
+bool WebServer::isDirectory(const std::string& path) {
+	return _open_files.lookup(path).isDirectory();
+}
+
+std::string WebServer::readFile(const std::string& file_path) {
+	int fd = open(file_path.c_str(), O_RDONLY);
+	if (fd == -1) {
+		LOG_ERROR("Cannot open file: " + file_path);
+		return "";
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) != 0) {
+		close(fd);
+		LOG_ERROR("Cannot stat file: " + file_path);
+		return "";
+	}
+
+	// One read() into the final buffer instead of going through ifstream
+	std::string buffer(st.st_size, '\0');
+	size_t total = 0;
+	while (total < buffer.length()) {
+		ssize_t n = read(fd, &buffer[total], buffer.length() - total);
+		if (n <= 0) {
+			if (n == -1 && errno == EINTR)
+				continue;
+			close(fd);
+			LOG_ERROR("Failed to read file: " + file_path);
+			return "";
+		}
+		total += n;
+	}
+	close(fd);
+	return buffer;
+}
+
+// GET/HEAD of a CGI script through the location's cgi_cache. A stale hit
+// is answered from the cache at once and starts at most one refresh, which
+// runs through the poll loop instead of blocking on the fork.
+std::string WebServer::serveCgi(const HttpRequest& request, const LocationConfig* location) {
+    if (!location || !location->cgi_cache || !request.getHeader("Authorization").empty()) {
+        return runCgi(request, location, "");
+    }
+    std::string key = cgiCacheKey(request, location);
+    std::string cached;
+    time_t age = 0;
+    ResponseCache::Status status = _cgi_cache.lookup(key, cached, age);
+    if (status == ResponseCache::HIT) {
+        return ResponseCache::annotate(cached, "HIT", age);
+    }
+    // A script run for HEAD may leave the body out, so only GET runs fill
+    // or refresh the entry the two share
+    bool head = request.getMethod() == HEAD;
+    if (status == ResponseCache::STALE) {
+        if (!head && _cgi_cache.beginRefresh(key)) {
+            startCgiRefresh(key, request, location);
+            return ResponseCache::annotate(cached, "STALE", age);
+        }
+        return ResponseCache::annotate(cached, head ? "STALE" : "UPDATING", age);
+    }
+    return runCgi(request, location, head ? "" : key);
+}
+
+// HEAD is answered from the GET representation, so both share an entry.
+std::string WebServer::cgiCacheKey(const HttpRequest& request, const LocationConfig* location) {
+    std::string key = "GET " + request.getHeader("Host") + " " + request.getUri();
+    for (size_t i = 0; i < location->cgi_cache_vary.size(); ++i) {
+        key += "\n" + location->cgi_cache_vary[i] + ": " + request.getHeader(location->cgi_cache_vary[i]);
+    }
+    return key;
+}
+
+// Runs the script under its location's cgi_* limits. The request is left
+// to a job in the poll loop, or queued until the location has a slot for
+// it, and "" returned with _cgi_started set. An HTTP/2 stream waits for
+// its job while the session's other streams go on; it is not queued, as
+// the queue replays a client's buffered HTTP/1.1 request. A cache_key
+// stores the response in cgi_cache.
+std::string WebServer::runCgi(const HttpRequest& request, const LocationConfig* location, const std::string& cache_key) {
+    LocationConfig defaults;
+    const LocationConfig& config = location ? *location : defaults;
+    if (config.cgi_max_concurrent && _cgi_running[config.path] >= config.cgi_max_concurrent) {
+        CgiQueue& waiting = _cgi_waiting[config.path];
+        if (!_cgi_stream && waiting.clients.size() < config.cgi_queue) {
+            waiting.max_running = config.cgi_max_concurrent;
+            waiting.clients.push_back(_cgi_client);
+            _cgi_clients[_cgi_client] = 0;
+            _cgi_stats.queued();
+            setPollEvents(_cgi_client, POLLRDHUP);
+            _cgi_started = true;
+            return "";
+        }
+        _cgi_stats.rejected();
+        LOG_INFO("cgi_max_concurrent " + config.path + ": rejecting " + request.getPath());
+        return generateErrorResponse(503, "Service Unavailable");
+    }
+
+    CgiLimits limits = cgiLimits(config);
+    pid_t pid;
+    int output_fd;
+    int input_fd;
+    std::string error = _cgi_handler->startCgiRequest(request, limits, pid, output_fd, _timing ? _timing->id : "",
+                                                      &input_fd);
+    if (_timing) {
+        _timing->mark(RequestTiming::CGI_SPAWN);
+    }
+    if (!error.empty()) {
+        return error;
+    }
+    CgiJob& job = addCgiJob(pid, output_fd, config.path, limits);
+    if (input_fd != -1) {
+        // Fed as the script reads it: one that never does only holds
+        // its own request until cgi_timeout
+        fcntl(input_fd, F_SETFL, O_NONBLOCK);
+        fcntl(input_fd, F_SETFD, FD_CLOEXEC);
+        job.input_fd = input_fd;
+        job.input = request.getBody();
+        _cgi_inputs[input_fd] = pid;
+        addPollFd(input_fd, POLLOUT);
+    }
+    job.client_fd = _cgi_client;
+    job.head = request.getMethod() == HEAD;
+    job.key = cache_key;
+    job.uri = request.getPath();
+    job.valid = config.cgi_cache_valid;
+    job.stale = config.cgi_cache_stale;
+    if (_cgi_stream) {
+        // The session keeps being polled; closing it kills the script
+        job.stream_id = _cgi_stream;
+        job.timing = *_timing;
+        _cgi_streams[std::make_pair(_cgi_client, _cgi_stream)] = pid;
+    } else {
+        _cgi_clients[_cgi_client] = pid;
+        setPollEvents(_cgi_client, POLLRDHUP); // a client that leaves takes its script with it
+    }
+    _cgi_started = true;
+    return "";
+}
+
+CgiLimits WebServer::cgiLimits(const LocationConfig& location) const {
+    CgiLimits limits;
+    limits.timeout = location.cgi_timeout;
+    limits.cpu = location.cgi_limit_cpu;
+    limits.memory = location.cgi_limit_memory;
+    limits.files = location.cgi_limit_files;
+    return limits;
+}
+
+WebServer::CgiJob& WebServer::addCgiJob(pid_t pid, int output_fd, const std::string& slot, const CgiLimits& limits) {
+    fcntl(output_fd, F_SETFL, O_NONBLOCK);
+    fcntl(output_fd, F_SETFD, FD_CLOEXEC);
+    CgiJob& job = _cgi_jobs[pid];
+    job.client_fd = -1;
+    job.stream_id = 0;
+    job.input_fd = -1;
+    job.input_sent = 0;
+    job.output_fd = output_fd;
+    job.exit_fd = -1;
+    job.slot = slot;
+    job.deadline = limits.timeout > 0 ? RateLimit::nowMs() + (uint64_t)limits.timeout * 1000 : 0;
+    job.head = false;
+    job.valid = 0;
+    job.stale = 0;
+    _cgi_outputs[output_fd] = pid;
+    _cgi_running[slot]++;
+    addPollFd(output_fd, POLLIN);
+    return job;
+}
+
+// A refresh takes a cgi_max_concurrent slot like any script, but never
+// waits for one: without a free slot the entry stays stale a while longer.
+void WebServer::startCgiRefresh(const std::string& key, const HttpRequest& request, const LocationConfig* location) {
+    if (location->cgi_max_concurrent && _cgi_running[location->path] >= location->cgi_max_concurrent) {
+        _cgi_cache.endRefresh(key);
+        return;
+    }
+    CgiLimits limits = cgiLimits(*location);
+    pid_t pid;
+    int output_fd;
+    if (!_cgi_handler->startCgiRequest(request, limits, pid, output_fd).empty()) {
+        _cgi_cache.endRefresh(key);
+        return;
+    }
+    CgiJob& job = addCgiJob(pid, output_fd, location->path, limits);
+    job.key = key;
+    job.uri = request.getPath();
+    job.valid = location->cgi_cache_valid;
+    job.stale = location->cgi_cache_stale;
+    LOG_DEBUG("cgi cache: refreshing " + job.uri + " in pid " + toString(pid));
+}
+
+void WebServer::handleCgiInput(int input_fd) {
+    CgiJob& job = _cgi_jobs[_cgi_inputs[input_fd]];
+    while (job.input_sent < job.input.length()) {
+        ssize_t sent = write(input_fd, job.input.data() + job.input_sent, job.input.length() - job.input_sent);
+        if (sent == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return;
+            }
+            break; // the script closed its stdin; what it did read is its request
+        }
+        job.input_sent += sent;
+    }
+    removePollFd(input_fd);
+    close(input_fd);
+    _cgi_inputs.erase(input_fd);
+    job.input_fd = -1;
+    std::string().swap(job.input);
+}
+
+void WebServer::handleCgiOutput(int output_fd) {
+    pid_t pid = _cgi_outputs[output_fd];
+    CgiJob& job = _cgi_jobs[pid];
+    char buffer[8192];
+    ssize_t bytes_read;
+    while ((bytes_read = read(output_fd, buffer, sizeof(buffer))) > 0) {
+        job.output.append(buffer, bytes_read);
+    }
+    if (bytes_read == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        if (job.client_fd != -1) {
+            trackMemory(job.client_fd);
+        }
+        return;
+    }
+
+    // EOF (or a read error): the script is done with its stdout and is
+    // most likely exiting. If it has not yet, its pidfd says when it has
+    // (checkCgiJobs reaps it otherwise).
+    removePollFd(output_fd);
+    close(output_fd);
+    _cgi_outputs.erase(output_fd);
+    job.output_fd = -1;
+    CgiUsage usage;
+    if (CgiExecutor::reap(pid, false, usage)) {
+        finishCgiJob(pid, usage);
+        return;
+    }
+    job.exit_fd = CgiExecutor::exitFd(pid);
+    if (job.exit_fd != -1) {
+        _cgi_exits[job.exit_fd] = pid;
+        addPollFd(job.exit_fd, POLLIN);
+    }
+}
+
+void WebServer::handleCgiExit(int exit_fd) {
+    pid_t pid = _cgi_exits[exit_fd];
+    CgiUsage usage;
+    if (CgiExecutor::reap(pid, false, usage)) {
+        finishCgiJob(pid, usage);
+    }
+}
+
+// Reaps scripts that closed their output and kills the ones past their
+// cgi_timeout, with everything they started
+void WebServer::checkCgiJobs() {
+    if (_cgi_jobs.empty()) {
+        return;
+    }
+    uint64_t now = RateLimit::nowMs();
+    std::vector<pid_t> pids;
+    for (std::map<pid_t, CgiJob>::iterator it = _cgi_jobs.begin(); it != _cgi_jobs.end(); ++it) {
+        pids.push_back(it->first);
+    }
+    for (size_t i = 0; i < pids.size(); ++i) {
+        std::map<pid_t, CgiJob>::iterator it = _cgi_jobs.find(pids[i]);
+        if (it == _cgi_jobs.end()) {
+            continue;
+        }
+        CgiJob& job = it->second;
+        CgiUsage usage;
+        if (job.deadline && now >= job.deadline) {
+            LOG_INFO("cgi: " + job.uri + " ran past cgi_timeout, killing pid " + toString(pids[i]));
+            CgiExecutor::killGroup(pids[i]);
+            CgiExecutor::reap(pids[i], true, usage);
+            usage.timed_out = true;
+            finishCgiJob(pids[i], usage);
+        } else if (job.output_fd == -1 && CgiExecutor::reap(pids[i], false, usage)) {
+            finishCgiJob(pids[i], usage);
+        }
+    }
+}
+
+// The script is reaped: its slot is freed, its usage recorded and its
+// response goes to the client, the cache or both
+void WebServer::finishCgiJob(pid_t pid, CgiUsage& usage) {
+    std::map<pid_t, CgiJob>::iterator it = _cgi_jobs.find(pid);
+    std::string output;
+    output.swap(it->second.output);
+    CgiJob job = it->second;
+    _cgi_jobs.erase(it);
+    if (job.input_fd != -1) {
+        removePollFd(job.input_fd);
+        close(job.input_fd);
+        _cgi_inputs.erase(job.input_fd);
+    }
+    if (job.output_fd != -1) {
+        removePollFd(job.output_fd);
+        close(job.output_fd);
+        _cgi_outputs.erase(job.output_fd);
+    }
+    if (job.exit_fd != -1) {
+        removePollFd(job.exit_fd);
+        close(job.exit_fd);
+        _cgi_exits.erase(job.exit_fd);
+    }
+    if (--_cgi_running[job.slot] == 0) {
+        _cgi_running.erase(job.slot);
+    }
+    _cgi_stats.record(usage);
+    LOG_DEBUG("cgi: " + job.uri + " " + CgiStats::describe(usage));
+
+    std::string response = _cgi_handler->finishCgiRequest(output, usage);
+    if (!job.key.empty()) {
+        bool stored = _cgi_cache.store(job.key, job.uri, response, job.valid, job.stale);
+        if (job.client_fd == -1) {
+            if (stored) {
+                LOG_DEBUG("cgi cache: refreshed " + job.uri);
+            } else {
+                LOG_INFO("cgi cache: refresh of " + job.uri + " not stored");
+            }
+        }
+        response = ResponseCache::annotate(response, "MISS", 0);
+    }
+    if (job.client_fd == -1) {
+        return;
+    }
+    if (job.stream_id) {
+        _cgi_streams.erase(std::make_pair(job.client_fd, job.stream_id));
+        std::map<int, Http2Session*>::iterator h2 = _h2_sessions.find(job.client_fd);
+        if (h2 == _h2_sessions.end()) {
+            return;
+        }
+        job.timing.mark(RequestTiming::CGI_RUN);
+        _response_body.clear();
+        respondHttp2(h2->second, job.stream_id, response, job.head, job.timing);
+        logRequest(job.timing, job.client_fd);
+        flushHttp2(job.client_fd, pollIndex(job.client_fd));
+        return;
+    }
+    _cgi_clients.erase(job.client_fd);
+    _timings[job.client_fd].mark(RequestTiming::CGI_RUN);
+    if (job.head) {
+        size_t header_end = response.find("\r\n\r\n");
+        if (header_end != std::string::npos) {
+            response.erase(header_end + 4);
+        }
+    }
+    _response_body.clear();
+    sendResponse(job.client_fd, pollIndex(job.client_fd), response);
+}
+
+// Requests queued by cgi_max_concurrent run again, oldest first, as their
+// location frees slots; the buffered request is generated from scratch.
+void WebServer::admitQueuedCgi() {
+    std::vector<std::string> slots;
+    for (std::map<std::string, CgiQueue>::iterator it = _cgi_waiting.begin(); it != _cgi_waiting.end(); ++it) {
+        slots.push_back(it->first);
+    }
+    for (size_t i = 0; i < slots.size(); ++i) {
+        CgiQueue& waiting = _cgi_waiting[slots[i]];
+        while (!waiting.clients.empty()
+               && (!_cgi_running.count(slots[i]) || _cgi_running[slots[i]] < waiting.max_running)) {
+            int client_fd = waiting.clients.front();
+            waiting.clients.pop_front();
+            _cgi_clients.erase(client_fd);
+            _timings[client_fd].mark(RequestTiming::DELAY);
+            processClientBuffer(client_fd, pollIndex(client_fd));
+        }
+        if (waiting.clients.empty()) {
+            _cgi_waiting.erase(slots[i]);
+        }
+    }
+}
+
+// The client went away: its script is killed, or it leaves the queue
+void WebServer::releaseCgiClient(int client_fd) {
+    std::map<int, pid_t>::iterator it = _cgi_clients.find(client_fd);
+    if (it == _cgi_clients.end()) {
+        return;
+    }
+    pid_t pid = it->second;
+    _cgi_clients.erase(it);
+    if (!pid) {
+        for (std::map<std::string, CgiQueue>::iterator slot = _cgi_waiting.begin(); slot != _cgi_waiting.end(); ++slot) {
+            std::deque<int>& clients = slot->second.clients;
+            std::deque<int>::iterator queued = std::find(clients.begin(), clients.end(), client_fd);
+            if (queued != clients.end()) {
+                clients.erase(queued);
+            }
+        }
+        return;
+    }
+    LOG_DEBUG("cgi: client " + toString(client_fd) + " closed, killing pid " + toString(pid));
+    _cgi_jobs[pid].client_fd = -1;
+    _cgi_jobs[pid].key.clear();
+    CgiExecutor::killGroup(pid);
+    CgiUsage usage;
+    CgiExecutor::reap(pid, true, usage);
+    finishCgiJob(pid, usage);
+}
+
+// An HTTP/2 session closed: the scripts of its streams are killed
+void WebServer::releaseCgiStreams(int client_fd) {
+    std::vector<pid_t> pids;
+    std::map<std::pair<int, uint32_t>, pid_t>::iterator it = _cgi_streams.lower_bound(std::make_pair(client_fd, 0u));
+    while (it != _cgi_streams.end() && it->first.first == client_fd) {
+        pids.push_back(it->second);
+        _cgi_streams.erase(it++);
+    }
+    for (size_t i = 0; i < pids.size(); ++i) {
+        LOG_DEBUG("cgi: HTTP/2 client " + toString(client_fd) + " closed, killing pid " + toString(pids[i]));
+        _cgi_jobs[pids[i]].client_fd = -1;
+        _cgi_jobs[pids[i]].key.clear();
+        CgiExecutor::killGroup(pids[i]);
+        CgiUsage usage;
+        CgiExecutor::reap(pids[i], true, usage);
+        finishCgiJob(pids[i], usage);
+    }
+}
+
+std::string WebServer::handleGetRequest(const HttpRequest& request, const LocationConfig* location) {
+    std::string uri = request.getUri();
+    std::string file_path = getFilePath(request.getPath(), location);
+
+	std::cout << "GET request - URI: " << uri << " -> File path: " << file_path << std::endl;
+    // Check for CGI request first
+	if (uri == "/cgi-bin/" || uri == "/cgi-bin"){
+		std::string cgi_dir = "./www/cgi-bin";
+		if (isDirectory(cgi_dir))
+			return handleDirectoryRequest(request, cgi_dir, uri, location);
+	}
+    if (location && !location->cgi_path.empty() && 
+        uri.find(location->cgi_extension) != std::string::npos) {
+        // Use location-specific CGI handling
+        return serveCgi(request, location);
+    } else if (_cgi_handler && _cgi_handler->isCgiRequest(uri)) {
+        return serveCgi(request, location);
+    }
+    
+    // std::string file_path = getFilePath(uri, location);
+    
+    StaticBundle* bundle = NULL;
+    const BundleEntry* entry = findBundled(request.getPath(), location, bundle);
+    if (entry) {
+        return serveBundled(request, *bundle, *entry, location);
+    }
+
+    FileInfo info = _open_files.lookup(file_path);
+    if (!info.exists()) {
+        return generateErrorResponse(info.error == EACCES ? 403 : 404,
+                                     info.error == EACCES ? "Forbidden" : "Not Found");
+    }
+    
+    if (info.isDirectory()) {
+        return handleDirectoryRequest(request, file_path, request.getPath(), location);
+    }
+    
+    if (!info.readable) {
+        return generateErrorResponse(403, "Forbidden");
+    }
+    
+    return serveFile(request, file_path, location);
+}
+
+// Static file body with content negotiation: precompressed siblings
+// (gzip_static) first, then on-the-fly gzip through _gzip_cache, so each
+// file version is compressed once rather than per request. Validators come
+// from the stat of the representation being served, and a matching
+// conditional request is answered with 304 before the file is opened.
+std::string WebServer::serveFile(const HttpRequest& request, const std::string& file_path, const LocationConfig* location) {
+    FileInfo info = _open_files.lookup(file_path);
+    if (!info.exists()) {
+        return generateErrorResponse(404, "Not Found");
+    }
+    struct stat st = info.st;
+
+    std::string content_type = getContentType(file_path);
+    std::string body_path = file_path;
+    std::string encoding;
+    bool compress = false;
+    std::string headers;
+
+    bool compressible = location && location->gzip
+        && Compression::isCompressibleType(content_type, location->gzip_types);
+    if (location && (location->gzip_static || compressible)) {
+        std::string accept_encoding = request.getHeader("Accept-Encoding");
+        headers += "Vary: Accept-Encoding\r\n";
+
+        if (location->gzip_static) {
+            static const char* const encodings[] = { "br", "gzip" };
+            static const char* const suffixes[] = { ".br", ".gz" };
+            for (size_t i = 0; i < 2 && encoding.empty(); ++i) {
+                if (!Compression::acceptsEncoding(accept_encoding, encodings[i])) {
+                    continue;
+                }
+                std::string sibling = file_path + suffixes[i];
+                const FileInfo& sibling_info = _open_files.lookup(sibling);
+                if (sibling_info.exists() && S_ISREG(sibling_info.st.st_mode) && sibling_info.readable) {
+                    body_path = sibling;
+                    encoding = encodings[i];
+                    st = sibling_info.st;
+                }
+            }
+        }
+        if (encoding.empty() && compressible && (size_t)st.st_size >= location->gzip_min_length
+            && Compression::acceptsEncoding(accept_encoding, "gzip")) {
+            encoding = "gzip";
+            compress = true;
+        }
+    }
+
+    // On-the-fly gzip is settled before the validators are: a file it does
+    // not shrink goes out as identity, under the identity ETag, and the
+    // cache remembers not to try again.
+    std::string content;
+    bool content_read = false;
+    std::string compressed;
+    if (compress) {
+        const std::string* cached = _gzip_cache.get(file_path, encoding, st.st_mtime, st.st_size);
+        if (cached) {
+            LOG_DEBUG("gzip cache hit for " + file_path);
+            compressed = *cached;
+        } else {
+            content = readFile(body_path);
+            content_read = true;
+            if (content.empty() && st.st_size != 0) {
+                return generateErrorResponse(500, "Internal Server Error");
+            }
+            if (!Compression::gzip(content, compressed) || compressed.length() >= content.length()) {
+                compressed.clear(); // cached as such: not compressed again
+            }
+            _gzip_cache.put(file_path, encoding, st.st_mtime, st.st_size, compressed);
+            LOG_DEBUG("gzip cache miss for " + file_path + ", " + toString(content.length())
+                + (compressed.empty() ? " bytes, incompressible" : " -> " + toString(compressed.length()) + " bytes"));
+        }
+        if (compressed.empty()) {
+            encoding.clear();
+            compress = false;
+        }
+    }
+    if (!encoding.empty()) {
+        headers += "Content-Encoding: " + encoding + "\r\n";
+    }
+
+    std::string etag = makeETag(st, compress ? encoding : "");
+    headers += "Last-Modified: " + http_date(st.st_mtime) + "\r\n";
+    headers += "ETag: " + etag + "\r\n";
+    headers += getCacheHeaders(location);
+    if (!compress) {
+        headers += "Accept-Ranges: bytes\r\n";
+    }
+
+    if (isNotModified(request, etag, st.st_mtime)) {
+        LOG_DEBUG("Not modified: " + body_path);
+        return generateNotModifiedResponse(headers);
+    }
+
+    if (!compress) {
+        std::vector<ByteRange> ranges;
+        RangeResult range_result = RANGE_NONE;
+        std::string range_header = request.getHeader("Range");
+        if (!range_header.empty() && ifRangeMatches(request, etag, st.st_mtime)) {
+            range_result = parseRangeHeader(range_header, st.st_size, ranges);
+        }
+        if (range_result == RANGE_UNSATISFIABLE) {
+            std::string body = "<html><body><h1>416 Range Not Satisfiable</h1></body></html>";
+            return generateHeaders(416, "Range Not Satisfiable", "text/html", body.length(),
+                "Content-Range: bytes */" + toString(st.st_size) + "\r\n") + body;
+        }
+        if (range_result == RANGE_NONE && location && location->mmap
+            && st.st_size >= MMAP_MIN_SIZE && (size_t)st.st_size <= location->mmap_max_size) {
+            MappedFile* mapping = _mapped_files.acquire(body_path, st);
+            if (mapping) {
+                _response_body.pushMapping(mapping, 0, st.st_size);
+                return generateHeaders(200, "OK", content_type, st.st_size, headers);
+            }
+        }
+        if (range_result == RANGE_OK || st.st_size >= SENDFILE_MIN_SIZE) {
+            int fd = _open_files.open(body_path);
+            if (fd == -1) {
+                LOG_ERROR("Cannot open file: " + body_path + ": " + std::string(strerror(errno)));
+                return generateErrorResponse(500, "Internal Server Error");
+            }
+            _response_body.adoptFd(fd);
+            if (range_result == RANGE_OK) {
+                for (size_t i = 0; i < ranges.size(); ++i) {
+                    posix_fadvise(fd, ranges[i].first, ranges[i].second - ranges[i].first + 1, POSIX_FADV_WILLNEED);
+                }
+                return serveRanges(fd, ranges, st.st_size, content_type, headers);
+            }
+            posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+            _response_body.pushFile(fd, 0, st.st_size);
+            return generateHeaders(200, "OK", content_type, st.st_size, headers);
+        }
+    }
+
+    if (_head_only) { // no need to read it
+        return generateHeaders(200, "OK", content_type, compress ? (off_t)compressed.length() : st.st_size, headers);
+    }
+    if (compress) {
+        size_t length = compressed.length();
+        _response_body.pushOwned(compressed);
+        return generateHeaders(200, "OK", content_type, length, headers);
+    }
+
+    if (!content_read) {
+        content = readFile(body_path);
+        if (content.empty() && st.st_size != 0) {
+            return generateErrorResponse(500, "Internal Server Error");
+        }
+    }
+    size_t length = content.length();
+    _response_body.pushOwned(content); // read into memory once, not copied again
+    return generateHeaders(200, "OK", content_type, length, headers);
+}
+
+// The entry of the location's bundle for `uri`, mapped the way getFilePath
+// maps it under the root; a directory is tried with its index file. A miss
+// falls back to the root, so a bundle may hold only part of it.
+const BundleEntry* WebServer::findBundled(const std::string& uri, const LocationConfig* location, StaticBundle*& bundle) {
+    if (!location || location->bundle.empty()) {
+        return NULL;
+    }
+    std::map<std::string, StaticBundle*>::iterator it = _bundles.find(location->bundle);
+    if (it == _bundles.end()) {
+        return NULL;
+    }
+    bundle = it->second;
+    std::string path = uri;
+    if (path.empty()) {
+        return NULL;
+    }
+    if (!location->root.empty() && uri.find(location->path) == 0) {
+        path = uri.substr(location->path.length());
+        if (path.empty() || path[0] != '/') path = "/" + path;
+    }
+    if (path[path.length() - 1] != '/') {
+        return bundle->find(path);
+    }
+    if (!location->index.empty()) {
+        return bundle->find(path + location->index);
+    }
+    const BundleEntry* entry = bundle->find(path + "index.html");
+    return entry ? entry : bundle->find(path + "index.htm");
+}
+
+// serveFile for a file packed by mkbundle: one hash lookup, headers the
+// bundler rendered, and a body that is a slice of the bundle's mapping, so
+// no system call is made. The gzip variant is picked when accepted; ranges
+// are narrower slices of it, sent as serveFile sends them.
+std::string WebServer::serveBundled(const HttpRequest& request, StaticBundle& bundle, const BundleEntry& entry,
+                                    const LocationConfig* location) {
+    const BundleVariant* variant = &entry.identity;
+    if (entry.gzip.body_length > 0
+        && Compression::acceptsEncoding(request.getHeader("Accept-Encoding"), "gzip")) {
+        variant = &entry.gzip;
     }
-    
-    std::string extension = file_path.substr(dot_pos);
-    
-    for (size_t i = 0; i < extension.length(); ++i) {
-        extension[i] = std::tolower(extension[i]);
+    std::string etag = bundle.slice(variant->etag_offset, variant->etag_length);
+    std::string validators = bundle.slice(variant->head_offset + variant->validators_offset,
+                                          variant->head_length - variant->validators_offset)
+        + getCacheHeaders(location);
+
+    if (isNotModified(request, etag, entry.mtime)) {
+        return generateNotModifiedResponse(validators);
     }
-    
-    if (extension == ".html" || extension == ".htm") return "text/html";
-    if (extension == ".css") return "text/css";
-    if (extension == ".js") return "application/javascript";
-    if (extension == ".json") return "application/json";
-    if (extension == ".txt") return "text/plain";
-    if (extension == ".png") return "image/png";
-    if (extension == ".jpg" || extension == ".jpeg") return "image/jpeg";
-    if (extension == ".gif") return "image/gif";
-    if (extension == ".ico") return "image/x-icon";
-    
-    return "application/octet-stream";
-}
 
-std::string WebServer::getFilePath(const std::string& uri, const LocationConfig* location) {
-    std::string root;
-    
-    // Use location-specific root if available, otherwise server default
-    if (location && !location->root.empty()) {
-        root = location->root;
-        // Remove the location path from URI to get relative path
-        std::string relative_path = uri;
-        if (uri.find(location->path) == 0) {
-            relative_path = uri.substr(location->path.length());
-            if (relative_path.empty()) relative_path = "/";
+    std::string range_header = request.getHeader("Range");
+    if (variant == &entry.identity && !range_header.empty() && ifRangeMatches(request, etag, entry.mtime)) {
+        std::vector<ByteRange> ranges;
+        off_t size = variant->body_length;
+        RangeResult range_result = parseRangeHeader(range_header, size, ranges);
+        if (range_result == RANGE_UNSATISFIABLE) {
+            std::string body = "<html><body><h1>416 Range Not Satisfiable</h1></body></html>";
+            return generateHeaders(416, "Range Not Satisfiable", "text/html", body.length(),
+                "Content-Range: bytes */" + toString(size) + "\r\n") + body;
         }
-        return root + relative_path;
-    } else {
-        // Use server root (your existing logic)
-        root = "./www";
-        if (uri == "/") {
-            return root + "/index.html";
+        if (range_result == RANGE_OK) {
+            MappedFile* mapping = bundle.acquire();
+            std::string response = serveRanges(-1, ranges, size, bundle.slice(entry.type_offset, entry.type_length),
+                                               validators, mapping, variant->body_offset);
+            mapping->release();
+            return response;
         }
-        return root + uri;
     }
+
+    if (!_head_only) {
+        _response_body.pushMapping(bundle.acquire(), variant->body_offset, variant->body_length);
+    }
+    std::string head = "HTTP/1.1 200 OK\r\n";
+    head.append(bundle.data(variant->head_offset), variant->validators_offset);
+    head += validators;
+    head += "Connection: close\r\n";
+    head += "Server: Webserv/1.0\r\n\r\n";
+    return head;
 }
 
+// Parses "bytes=a-b, c-, -n" against a file of `size` bytes. Syntax errors
+// make the header be ignored (full 200), as RFC 9110 requires. Overlapping
+// ranges are coalesced so a client cannot make us send a file many times.
+WebServer::RangeResult WebServer::parseRangeHeader(const std::string& header, off_t size, std::vector<ByteRange>& ranges) {
+    size_t eq = header.find('=');
+    if (eq == std::string::npos) {
+        return RANGE_NONE;
+    }
+    std::string unit = header.substr(0, eq);
+    size_t unit_start = unit.find_first_not_of(" \t");
+    size_t unit_end = unit.find_last_not_of(" \t");
+    if (unit_start == std::string::npos || unit.substr(unit_start, unit_end - unit_start + 1) != "bytes") {
+        return RANGE_NONE;
+    }
 
-bool WebServer::fileExists(const std::string& path) {
-	struct stat buffer;
-	return (stat(path.c_str(), &buffer) == 0);
+    std::string spec_list = header.substr(eq + 1);
+    size_t pos = 0;
+    size_t spec_count = 0;
+    while (pos <= spec_list.length()) {
+        size_t comma = spec_list.find(',', pos);
+        if (comma == std::string::npos) {
+            comma = spec_list.length();
+        }
+        std::string spec = spec_list.substr(pos, comma - pos);
+        pos = comma + 1;
+
+        size_t start = spec.find_first_not_of(" \t");
+        if (start == std::string::npos) {
+            continue;
+        }
+        size_t end = spec.find_last_not_of(" \t");
+        spec = spec.substr(start, end - start + 1);
+        if (++spec_count > MAX_RANGES) {
+            return RANGE_NONE;
+        }
+
+        size_t dash = spec.find('-');
+        if (dash == std::string::npos) {
+            return RANGE_NONE;
+        }
+        std::string first_str = spec.substr(0, dash);
+        std::string last_str = spec.substr(dash + 1);
+        if (first_str.find_first_not_of("0123456789") != std::string::npos
+            || last_str.find_first_not_of("0123456789") != std::string::npos
+            || (first_str.empty() && last_str.empty())) {
+            return RANGE_NONE;
+        }
+
+        off_t first;
+        off_t last;
+        if (first_str.empty()) {
+            off_t suffix = std::strtoll(last_str.c_str(), NULL, 10);
+            if (suffix == 0) {
+                continue;
+            }
+            first = suffix >= size ? 0 : size - suffix;
+            last = size - 1;
+        } else {
+            first = std::strtoll(first_str.c_str(), NULL, 10);
+            last = last_str.empty() ? size - 1 : std::strtoll(last_str.c_str(), NULL, 10);
+            if (!last_str.empty() && last < first) {
+                return RANGE_NONE;
+            }
+            if (last >= size) {
+                last = size - 1;
+            }
+        }
+        if (first >= size) {
+            continue; // unsatisfiable on its own, others may still apply
+        }
+        ranges.push_back(ByteRange(first, last));
+    }
+
+    if (ranges.empty()) {
+        return spec_count ? RANGE_UNSATISFIABLE : RANGE_NONE;
+    }
+
+    if (ranges.size() > 1) {
+        std::vector<ByteRange> sorted = ranges;
+        std::sort(sorted.begin(), sorted.end());
+        bool overlapping = false;
+        for (size_t i = 1; i < sorted.size(); ++i) {
+            if (sorted[i].first <= sorted[i - 1].second + 1) {
+                overlapping = true;
+                break;
+            }
+        }
+        if (overlapping) {
+            ranges.clear();
+            ranges.push_back(sorted[0]);
+            for (size_t i = 1; i < sorted.size(); ++i) {
+                if (sorted[i].first <= ranges.back().second + 1) {
+                    ranges.back().second = std::max(ranges.back().second, sorted[i].second);
+                } else {
+                    ranges.push_back(sorted[i]);
+                }
+            }
+        }
+    }
+    return RANGE_OK;
 }
 
-bool WebServer::isDirectory(const std::string& path) {
-	struct stat buffer;
-	if (stat(path.c_str(), &buffer) != 0) {
-		return false;
-	}
-	return S_ISDIR(buffer.st_mode);
+// If-Range: the range applies only if the validator still matches; ETags
+// need a strong match, dates an exact one.
+bool WebServer::ifRangeMatches(const HttpRequest& request, const std::string& etag, time_t mtime) {
+    std::string if_range = request.getHeader("If-Range");
+    if (if_range.empty()) {
+        return true;
+    }
+    if (if_range[0] == '"' || if_range.substr(0, 2) == "W/") {
+        return if_range == etag;
+    }
+    time_t date;
+    return parse_http_date(if_range, date) && date == mtime;
 }
 
-std::string WebServer::readFile(const std::string& file_path) {
-	std::ifstream file(file_path.c_str(), std::ios::binary);
-	if (!file.is_open()) {
-		LOG_ERROR("Cannot open file: " + file_path);
-		return "";
-	}
-	
-	file.seekg(0, std::ios::end);
-	std::streamsize size = file.tellg();
-	file.seekg(0, std::ios::beg);
-	
-	std::string buffer(size, '\0');
-	if (!file.read(&buffer[0], size)) {
-		LOG_ERROR("Failed to read file: " + file_path);
-		return "";
-	}
-	
-	file.close();
-	return buffer;
+// A range of the body: from the file, or from a mapping the caller holds
+// (a bundle, whose body starts `offset` bytes into it).
+void WebServer::pushRange(int fd, MappedFile* mapping, off_t offset, off_t length) {
+    if (mapping) {
+        mapping->retain();
+        _response_body.pushMapping(mapping, offset, length);
+    } else {
+        _response_body.pushFile(fd, offset, length);
+    }
 }
 
-std::string WebServer::handleGetRequest(const HttpRequest& request, const LocationConfig* location) {
-    std::string uri = request.getUri();
-    std::string file_path = getFilePath(uri, location);
+std::string WebServer::serveRanges(int fd, const std::vector<ByteRange>& ranges, off_t size,
+                                   const std::string& content_type, const std::string& headers,
+                                   MappedFile* mapping, off_t mapping_offset) {
+    if (ranges.size() == 1) {
+        const ByteRange& range = ranges[0];
+        off_t length = range.second - range.first + 1;
+        pushRange(fd, mapping, mapping_offset + range.first, length);
+        return generateHeaders(206, "Partial Content", content_type, length,
+            headers + "Content-Range: bytes " + toString(range.first) + "-"
+            + toString(range.second) + "/" + toString(size) + "\r\n");
+    }
 
-	std::cout << "GET request - URI: " << uri << " -> File path: " << file_path << std::endl;
-    // Check for CGI request first
-	if (uri == "/cgi-bin/" || uri == "/cgi-bin"){
-		std::string cgi_dir = "./www/cgi-bin";
-		if (isDirectory(cgi_dir))
-			return handleDirectoryRequest(cgi_dir, uri, location);
-	}
-    if (location && !location->cgi_path.empty() && 
-        uri.find(location->cgi_extension) != std::string::npos) {
-        // Use location-specific CGI handling
-        return _cgi_handler->handleCgiRequest(request);
-    } else if (_cgi_handler && _cgi_handler->isCgiRequest(uri)) {
-        return _cgi_handler->handleCgiRequest(request);
+    static unsigned long boundary_counter = 0;
+    std::ostringstream boundary_stream;
+    boundary_stream << std::hex << "webserv" << time(NULL) << "x" << ++boundary_counter;
+    std::string boundary = boundary_stream.str();
+
+    off_t total = 0;
+    for (size_t i = 0; i < ranges.size(); ++i) {
+        std::string part = "\r\n--" + boundary + "\r\n"
+            + "Content-Type: " + content_type + "\r\n"
+            + "Content-Range: bytes " + toString(ranges[i].first) + "-" + toString(ranges[i].second)
+            + "/" + toString(size) + "\r\n\r\n";
+        off_t length = ranges[i].second - ranges[i].first + 1;
+        _response_body.push(part);
+        pushRange(fd, mapping, mapping_offset + ranges[i].first, length);
+        total += part.length() + length;
     }
+    std::string closing = "\r\n--" + boundary + "--\r\n";
+    _response_body.push(closing);
+    total += closing.length();
+
+    return generateHeaders(206, "Partial Content", "multipart/byteranges; boundary=" + boundary, total, headers);
+}
+
+std::string WebServer::generateHeaders(int status_code, const std::string& status_text, const std::string& content_type,
+                                       off_t content_length, const std::string& extra_headers) {
+    std::ostringstream response;
     
-    // std::string file_path = getFilePath(uri, location);
+    response << "HTTP/1.1 " << status_code << " " << status_text << "\r\n";
+    response << "Content-Type: " << content_type << "\r\n";
+    response << "Content-Length: " << content_length << "\r\n";
+    response << extra_headers;
+    response << "Connection: close\r\n";
+    response << "Server: Webserv/1.0\r\n";
+    response << "\r\n";
     
-    if (!fileExists(file_path)) {
-        return generateErrorResponse(404, "Not Found");
+    return response.str();
+}
+
+// Strong validator from (inode, size, mtime); representations compressed
+// on the fly get their own tag so caches never mix them up with identity.
+std::string WebServer::makeETag(const struct stat& st, const std::string& encoding) {
+    std::ostringstream etag;
+    etag << std::hex << "\"" << st.st_ino << "-" << st.st_size << "-" << st.st_mtime;
+    if (!encoding.empty()) {
+        etag << "-" << encoding;
     }
-    
-    if (isDirectory(file_path)) {
-        return handleDirectoryRequest(file_path, uri, location);
+    etag << "\"";
+    return etag.str();
+}
+
+bool WebServer::isNotModified(const HttpRequest& request, const std::string& etag, time_t mtime) {
+    std::string if_none_match = request.getHeader("If-None-Match");
+    if (!if_none_match.empty()) {
+        // If-None-Match takes precedence; weak comparison per RFC 9110
+        std::string tag = etag.substr(0, 2) == "W/" ? etag.substr(2) : etag;
+        size_t pos = 0;
+        while (pos < if_none_match.length()) {
+            size_t comma = if_none_match.find(',', pos);
+            if (comma == std::string::npos) {
+                comma = if_none_match.length();
+            }
+            std::string candidate = if_none_match.substr(pos, comma - pos);
+            pos = comma + 1;
+            size_t start = candidate.find_first_not_of(" \t");
+            if (start == std::string::npos) {
+                continue;
+            }
+            size_t end = candidate.find_last_not_of(" \t");
+            candidate = candidate.substr(start, end - start + 1);
+            if (candidate.substr(0, 2) == "W/") {
+                candidate = candidate.substr(2);
+            }
+            if (candidate == "*" || candidate == tag) {
+                return true;
+            }
+        }
+        return false;
     }
-    
-    if (access(file_path.c_str(), R_OK) != 0) {
-        return generateErrorResponse(403, "Forbidden");
+
+    std::string if_modified_since = request.getHeader("If-Modified-Since");
+    time_t since;
+    if (!if_modified_since.empty() && parse_http_date(if_modified_since, since)) {
+        return mtime <= since;
     }
-    
-    std::string content = readFile(file_path);
-    if (content.empty() && fileExists(file_path)) {
-        return generateErrorResponse(500, "Internal Server Error");
+    return false;
+}
+
+std::string WebServer::getCacheHeaders(const LocationConfig* location) {
+    if (!location) {
+        return "";
     }
-    
-    return generateSuccessResponse(content, getContentType(file_path));
+    std::string headers;
+    long expires = location->expires;
+    if (expires == LocationConfig::EXPIRES_EPOCH) {
+        headers += "Expires: Thu, 01 Jan 1970 00:00:01 GMT\r\n";
+        if (location->cache_control.empty()) {
+            headers += "Cache-Control: no-cache\r\n";
+        }
+    } else if (expires == LocationConfig::EXPIRES_MAX) {
+        headers += "Expires: Thu, 31 Dec 2037 23:55:55 GMT\r\n";
+        if (location->cache_control.empty()) {
+            headers += "Cache-Control: max-age=315360000\r\n";
+        }
+    } else if (expires >= 0) {
+        headers += "Expires: " + http_date(time(NULL) + expires) + "\r\n";
+        if (location->cache_control.empty()) {
+            headers += "Cache-Control: max-age=" + toString(expires) + "\r\n";
+        }
+    }
+    if (!location->cache_control.empty()) {
+        headers += "Cache-Control: " + location->cache_control + "\r\n";
+    }
+    return headers;
+}
+
+std::string WebServer::generateNotModifiedResponse(const std::string& headers) {
+    std::string response = "HTTP/1.1 304 Not Modified\r\n";
+    response += headers;
+    response += "Connection: close\r\n";
+    response += "Server: Webserv/1.0\r\n";
+    response += "\r\n";
+    return response;
 }
 
-std::string WebServer::handleDirectoryRequest(const std::string& dir_path, const std::string& uri , const LocationConfig* location) {
+std::string WebServer::handleDirectoryRequest(const HttpRequest& request, const std::string& dir_path, const std::string& uri , const LocationConfig* location) {
     // Use location-specific index if available
     std::vector<std::string> index_files;
     if (location && !location->index.empty()) {
@@ -491,55 +3283,71 @@ std::string WebServer::handleDirectoryRequest(const std::string& dir_path, const
         index_files.push_back("index.htm");
     }
     
-    for (size_t i = 0; i < index_files.size(); ++i) {
-        std::string index_path = dir_path;
-        if (index_path[index_path.length() - 1] != '/') {
-            index_path += "/";
-        }
-        index_path += index_files[i];
-
-		std::cout << "Trying index file: " << index_path << std::endl;
-        
-        if (fileExists(index_path) && access(index_path.c_str(), R_OK) == 0) {
-            std::string content = readFile(index_path);
-            if (!content.empty()) {
-				std::cout << "Found index file: " << index_path << std::endl;
-                return generateSuccessResponse(content, "text/html");
-            }
-        }
+    std::string index_path = _open_files.resolveIndex(dir_path, index_files);
+    if (!index_path.empty()) {
+        LOG_DEBUG("Found index file: " + index_path);
+        return serveFile(request, index_path, location);
     }
-	std::cout << "No index file found in directory: " << dir_path << std::endl;
+	LOG_DEBUG("No index file found in directory: " + dir_path);
 
 	if (location && location->autoindex)
-		return generateDirectoryListing(dir_path, uri);
+		return generateDirectoryListing(request, dir_path, uri, location);
     return generateErrorResponse(403, "Forbidden");
 }
 
-std::string WebServer::generateDirectoryListing(const std::string& dir_path, const std::string& uri) {
-    std::ostringstream html;
-    html << "<html><head><title>Index of " << uri << "</title></head><body>";
-    html << "<h1>Index of " << uri << "</h1><hr><pre>";
-    
-    DIR* dir = opendir(dir_path.c_str());
-    if (dir) {
-        struct dirent* entry;
-        while ((entry = readdir(dir)) != NULL) {
-            std::string name = entry->d_name;
-            if (name != ".") {
-                html << "<a href=\"" << uri;
-                if (uri[uri.length()-1] != '/') html << "/";
-                html << name << "\">" << name << "</a>\n";
-            }
+// Autoindex page. Entries come from _listings, which rereads the directory
+// only when its mtime changes and keeps rendered pages, so repeated hits on
+// a large directory cost one stat. The body is queued in chunks.
+std::string WebServer::generateDirectoryListing(const HttpRequest& request, const std::string& dir_path, const std::string& uri, const LocationConfig* location) {
+    FileInfo dir_info = _open_files.lookup(dir_path);
+    if (!dir_info.exists()) {
+        return generateErrorResponse(404, "Not Found");
+    }
+    const struct stat& dir_st = dir_info.st;
+
+    ListingView view;
+    std::string sort = request.getQueryParam("sort");
+    if (sort == "size") {
+        view.sort = ListingView::SORT_SIZE;
+    } else if (sort == "mtime") {
+        view.sort = ListingView::SORT_MTIME;
+    }
+    view.descending = (request.getQueryParam("order") == "desc");
+    view.offset = std::strtoul(request.getQueryParam("offset").c_str(), NULL, 10);
+    view.limit = std::strtoul(request.getQueryParam("limit").c_str(), NULL, 10);
+    size_t page_size = location ? location->autoindex_page_size : 0;
+    if (page_size && (view.limit == 0 || view.limit > page_size)) {
+        view.limit = page_size;
+    }
+
+    std::string headers;
+    std::string format = request.getQueryParam("format");
+    if (!format.empty()) {
+        view.json = (format == "json");
+    } else {
+        view.json = location && location->autoindex_json;
+        if (request.getHeader("Accept").find("application/json") != std::string::npos) {
+            view.json = true;
         }
-        closedir(dir);
+        headers += "Vary: Accept\r\n";
     }
-    
-    html << "</pre><hr></body></html>";
-    return generateSuccessResponse(html.str(), "text/html");
+    headers += "Last-Modified: " + http_date(dir_st.st_mtime) + "\r\n";
+
+    size_t length = 0;
+    if (!_listings.render(dir_path, dir_st, uri, view, _response_body, length)) {
+        _response_body.clear();
+        return generateErrorResponse(500, "Internal Server Error");
+    }
+    return generateHeaders(200, "OK", view.json ? "application/json" : "text/html", length, headers);
 }
 
+// The GET response without its body segments; serveFile leaves files
+// unread. Error pages and the like still carry theirs inline.
 std::string WebServer::handleHeadRequest(const HttpRequest& request, const LocationConfig* location) {
+    _head_only = true;
     std::string response = handleGetRequest(request, location);
+    _head_only = false;
+    _response_body.clear();
     size_t header_end = response.find("\r\n\r\n");
     if (header_end != std::string::npos) {
         return response.substr(0, header_end + 4);
@@ -547,18 +3355,10 @@ std::string WebServer::handleHeadRequest(const HttpRequest& request, const Locat
     return response;
 }
 
-std::string WebServer::generateSuccessResponse(const std::string& content, const std::string& content_type) {
-    std::ostringstream response;
-    
-    response << "HTTP/1.1 200 OK\r\n";
-    response << "Content-Type: " << content_type << "\r\n";
-    response << "Content-Length: " << content.length() << "\r\n";
-    response << "Connection: close\r\n";
-    response << "Server: Webserv/1.0\r\n";
-    response << "\r\n";
-    response << content;
-    
-    return response.str();
+// The head is returned, the body queued in _response_body behind it
+std::string WebServer::generateSuccessResponse(const std::string& content, const std::string& content_type, const std::string& extra_headers) {
+    _response_body.push(content);
+    return generateHeaders(200, "OK", content_type, content.length(), extra_headers);
 }
 
 std::string WebServer::handlePostRequest(const HttpRequest& request, const LocationConfig* location) {
@@ -567,9 +3367,9 @@ std::string WebServer::handlePostRequest(const HttpRequest& request, const Locat
     // Check for CGI request first
     if (location && !location->cgi_path.empty() && 
         uri.find(location->cgi_extension) != std::string::npos) {
-        return _cgi_handler->handleCgiRequest(request);
+        return runCgi(request, location, "");
     } else if (_cgi_handler && _cgi_handler->isCgiRequest(uri)) {
-        return _cgi_handler->handleCgiRequest(request);
+        return runCgi(request, location, "");
     }
     
     std::string body = request.getBody();
@@ -579,7 +3379,7 @@ std::string WebServer::handlePostRequest(const HttpRequest& request, const Locat
     
     // Simple file upload handling - save POST data to a file
     if (uri.find("/upload") == 0) {
-        return handleFileUpload(request);
+        return handleFileUpload(request, location);
     }
     
     // Simple form processing
@@ -597,6 +3397,7 @@ std::string WebServer::handleDeleteRequest(const HttpRequest& request, const Loc
     
     std::cout << "DELETE request for: " << file_path << std::endl;
     
+    _open_files.invalidate(file_path);
     if (!fileExists(file_path)) {
         return generateErrorResponse(404, "Not Found");
     }
@@ -611,6 +3412,8 @@ std::string WebServer::handleDeleteRequest(const HttpRequest& request, const Loc
     }
     
     if (unlink(file_path.c_str()) == 0) {
+        _open_files.invalidate(file_path);
+        _open_files.invalidate(parent_dir);
 
         std::ostringstream response;
         response << "HTTP/1.1 200 OK\r\n";
@@ -627,34 +3430,54 @@ std::string WebServer::handleDeleteRequest(const HttpRequest& request, const Loc
 }
 
 
-std::string WebServer::handleFileUpload(const HttpRequest& request) {
-    std::string body = request.getBody();
-    std::string content_type = request.getHeader("Content-Type");
-    
-    std::string upload_dir = "./www/uploads";
-    mkdir(upload_dir.c_str(), 0755);
-    
-    std::ostringstream filename;
-    filename << "upload_" << time(NULL) << ".txt";
-    
-    std::string file_path = upload_dir + "/" + filename.str();
-    
-    std::ofstream outfile(file_path.c_str());
-    if (!outfile.is_open()) {
-        return generateErrorResponse(500, "Internal Server Error");
+// Bodies that arrived whole (HTTP/2 streams, empty bodies); HTTP/1.1
+// uploads are streamed by startUpload instead
+std::string WebServer::handleFileUpload(const HttpRequest& request, const LocationConfig* location) {
+    UploadWriter upload(uploadDir(location), request.getHeader("Content-Type"));
+    const std::string& body = request.getBody();
+    upload.write(body.data(), body.size());
+    return finishUpload(upload, location, request.getHeader("Accept").find("application/json") != std::string::npos);
+}
+
+// Completes an upload and reports every part: 201 with the first stored
+// file as Location, 200 when the form carried no file.
+std::string WebServer::finishUpload(UploadWriter& upload, const LocationConfig* location, bool json) {
+    bool finished = upload.finish();
+    std::string upload_dir = uploadDir(location);
+    const std::vector<UploadedPart>& parts = upload.parts();
+    for (size_t i = 0; i < parts.size(); ++i) {
+        if (!parts[i].saved_as.empty()) {
+            _open_files.invalidate(upload_dir + "/" + parts[i].saved_as);
+        }
     }
-    
-    outfile << body;
-    outfile.close();
+    _open_files.invalidate(upload_dir);
 
-	std::string body_content = "<html><body><h1>File uploaded successfully</h1>";
-    body_content += "<p>Saved as: " + filename.str() + "</p></body></html>";
-    
+    if (!finished) {
+        int status = upload.errorStatus();
+        if (status == 400) {
+            LOG_INFO("Upload rejected: " + upload.error());
+            return generateErrorResponse(400, "Bad Request");
+        }
+        LOG_ERROR("Upload failed: " + upload.error());
+        return generateErrorResponse(status, status == 507 ? "Insufficient Storage" : "Internal Server Error");
+    }
+
+    std::string body_content = upload.report(json);
     std::ostringstream response;
-    response << "HTTP/1.1 201 Created\r\n";
-    response << "Content-Type: text/html\r\n";
+    if (upload.filesSaved()) {
+        response << "HTTP/1.1 201 Created\r\n";
+    } else {
+        response << "HTTP/1.1 200 OK\r\n";
+    }
+    response << "Content-Type: " << (json ? "application/json" : "text/html") << "\r\n";
     response << "Content-Length: " << body_content.length() << "\r\n";
-    response << "Location: /uploads/" << filename.str() << "\r\n";
+    for (size_t i = 0; i < parts.size(); ++i) {
+        std::string url = parts[i].saved_as.empty() ? "" : uploadUrl(location, parts[i].saved_as);
+        if (!url.empty()) {
+            response << "Location: " << url << "\r\n";
+            break;
+        }
+    }
     response << "Connection: close\r\n";
     response << "Server: Webserv/1.0\r\n";
     response << "\r\n";
@@ -663,6 +3486,255 @@ std::string WebServer::handleFileUpload(const HttpRequest& request) {
     return response.str();
 }
 
+std::string WebServer::uploadDir(const LocationConfig* location) {
+    std::string dir = location && !location->upload_path.empty() ? location->upload_path : "./www/uploads";
+    while (dir.size() > 1 && dir[dir.size() - 1] == '/') {
+        dir.erase(dir.size() - 1);
+    }
+    return dir;
+}
+
+// The URI a stored file is served at, "" when upload_path lies outside
+// the document root
+std::string WebServer::uploadUrl(const LocationConfig* location, const std::string& saved_as) {
+    std::string dir = uploadDir(location);
+    std::string root = location && !location->root.empty() ? location->root : "./www";
+    std::string prefix = location && !location->root.empty() ? location->path : "";
+    while (!root.empty() && root[root.size() - 1] == '/') {
+        root.erase(root.size() - 1);
+    }
+    while (!prefix.empty() && prefix[prefix.size() - 1] == '/') {
+        prefix.erase(prefix.size() - 1);
+    }
+    if (dir.compare(0, root.size(), root) != 0 || (dir.size() > root.size() && dir[root.size()] != '/')) {
+        return "";
+    }
+    return prefix + dir.substr(root.size()) + "/" + saved_as;
+}
+
+// Resumable uploads. POST with Upload-Length (and optionally a
+// Content-Disposition filename) creates <location>/.partial/<id>; PUT or
+// PATCH append the next piece at the offset given by Content-Range
+// ("bytes first-last/total") or Upload-Offset, and only at the offset the
+// server has (409 with the right one otherwise); HEAD tells that offset;
+// DELETE abandons the upload. The piece that completes it moves the file
+// into upload_path and answers 201 with its Location.
+
+std::string WebServer::resumableBase(const LocationConfig* location) {
+    std::string base = location->path;
+    while (!base.empty() && base[base.size() - 1] == '/') {
+        base.erase(base.size() - 1);
+    }
+    return base + "/.partial";
+}
+
+// The upload id of a request for an upload resource, "" otherwise
+std::string WebServer::resumableId(const HttpRequest& request, const LocationConfig* location) {
+    std::string base = resumableBase(location) + "/";
+    std::string path = request.getPath();
+    return path.compare(0, base.size(), base) == 0 ? path.substr(base.size()) : "";
+}
+
+bool WebServer::isResumableRequest(const HttpRequest& request, const LocationConfig* location) {
+    std::string base = resumableBase(location);
+    std::string path = request.getPath();
+    if (path.compare(0, base.size(), base) == 0 && (path.size() == base.size() || path[base.size()] == '/')) {
+        return true;
+    }
+    return request.getMethod() == POST && !request.getHeader("Upload-Length").empty();
+}
+
+std::string WebServer::resumableHeaders(const ResumableUpload& upload, const LocationConfig* location) {
+    std::ostringstream headers;
+    headers << "Upload-Offset: " << upload.offset() << "\r\n";
+    headers << "Upload-Length: " << upload.length() << "\r\n";
+    headers << "Upload-Expires: " << http_date(upload.expires(location->upload_resumable_timeout)) << "\r\n";
+    headers << "Cache-Control: no-store\r\n";
+    return headers.str();
+}
+
+std::string WebServer::handleResumableUpload(const HttpRequest& request, const LocationConfig* location) {
+    std::string upload_dir = uploadDir(location);
+    long timeout = location->upload_resumable_timeout;
+    std::string id = resumableId(request, location);
+
+    if (id.empty()) {
+        if (request.getMethod() != POST) {
+            return generateErrorResponse(404, "Not Found");
+        }
+        std::string length_header = request.getHeader("Upload-Length");
+        char* end = NULL;
+        long long length = std::strtoll(length_header.c_str(), &end, 10);
+        if (length_header.empty() || *end != '\0' || length < 0 || !request.getBody().empty()) {
+            return generateErrorResponse(400, "Bad Request");
+        }
+        std::string filename = MultipartParser::parameter(request.getHeader("Content-Disposition"), "filename");
+        std::string error;
+        ResumableUpload* upload = ResumableUpload::create(upload_dir, UploadWriter::sanitizeFilename(filename),
+                                                          length, error);
+        if (!upload) {
+            LOG_ERROR("Resumable upload: " + error);
+            return generateErrorResponse(500, "Internal Server Error");
+        }
+        LOG_INFO("Resumable upload " + upload->id() + " created for " + toString(static_cast<size_t>(length)) + " bytes");
+        if (upload->complete()) {
+            std::string response = finishResumableAppend(*upload, location); // nothing to wait for
+            delete upload;
+            return response;
+        }
+        std::string headers = "Location: " + resumableBase(location) + "/" + upload->id() + "\r\n"
+            + resumableHeaders(*upload, location);
+        delete upload;
+        return generateHeaders(201, "Created", "text/plain", 0, headers);
+    }
+
+    if (request.getMethod() == PUT || request.getMethod() == PATCH) {
+        std::string response;
+        ResumableUpload* upload = openResumableAppend(request, location, request.getBody().size(), response);
+        if (!upload) {
+            return response;
+        }
+        upload->append(request.getBody().data(), request.getBody().size());
+        response = finishResumableAppend(*upload, location);
+        delete upload;
+        return response;
+    }
+
+    ResumableUpload::OpenResult result;
+    ResumableUpload* upload = ResumableUpload::open(upload_dir, id, timeout, result);
+    if (!upload) {
+        if (result == ResumableUpload::OPEN_BUSY) {
+            return generateErrorResponse(409, "Conflict");
+        }
+        return result == ResumableUpload::OPEN_MISSING ? generateErrorResponse(404, "Not Found")
+                                                       : generateErrorResponse(500, "Internal Server Error");
+    }
+    std::string response;
+    if (request.getMethod() == GET || request.getMethod() == HEAD) {
+        response = generateHeaders(200, "OK", "text/plain", 0, resumableHeaders(*upload, location));
+    } else if (request.getMethod() == DELETE) {
+        upload->cancel();
+        LOG_INFO("Resumable upload " + id + " cancelled at " + toString(static_cast<size_t>(upload->offset())) + " bytes");
+        response = generateHeaders(204, "No Content", "text/plain", 0);
+    } else {
+        response = generateErrorResponse(405, "Method Not Allowed");
+    }
+    delete upload;
+    return response;
+}
+
+// Opens the upload a PUT/PATCH of `content_length` bytes appends to and
+// checks the piece fits where the upload stands; NULL with the response
+// to send when it does not.
+ResumableUpload* WebServer::openResumableAppend(const HttpRequest& request, const LocationConfig* location,
+                                                size_t content_length, std::string& response) {
+    long long first = -1;
+    long long total = -1;
+    std::string range = request.getHeader("Content-Range");
+    std::string offset = request.getHeader("Upload-Offset");
+    if (!range.empty()) {
+        long long last = -1;
+        char star = 0;
+        int fields = std::sscanf(range.c_str(), "bytes %lld-%lld/%lld", &first, &last, &total);
+        if (fields < 3 && std::sscanf(range.c_str(), "bytes %lld-%lld/%c", &first, &last, &star) == 3 && star == '*') {
+            fields = 3;
+        }
+        if (fields < 3 || first < 0 || last < first || static_cast<size_t>(last - first + 1) != content_length) {
+            response = generateErrorResponse(400, "Bad Request");
+            return NULL;
+        }
+    } else if (!offset.empty()) {
+        char* end = NULL;
+        first = std::strtoll(offset.c_str(), &end, 10);
+        if (*end != '\0' || first < 0) {
+            first = -1;
+        }
+    }
+    if (first < 0) {
+        response = generateErrorResponse(400, "Bad Request");
+        return NULL;
+    }
+
+    ResumableUpload::OpenResult result;
+    ResumableUpload* upload = ResumableUpload::open(uploadDir(location), resumableId(request, location),
+                                                    location->upload_resumable_timeout, result);
+    if (!upload) {
+        if (result == ResumableUpload::OPEN_MISSING) {
+            response = generateErrorResponse(404, "Not Found");
+        } else if (result == ResumableUpload::OPEN_BUSY) {
+            response = generateErrorResponse(409, "Conflict"); // another request is appending
+        } else {
+            response = generateErrorResponse(500, "Internal Server Error");
+        }
+        return NULL;
+    }
+    if (first != upload->offset()) {
+        response = generateHeaders(409, "Conflict", "text/plain", 0, resumableHeaders(*upload, location));
+        delete upload;
+        return NULL;
+    }
+    if ((total >= 0 && total != upload->length())
+        || upload->offset() + static_cast<off_t>(content_length) > upload->length()) {
+        response = generateErrorResponse(400, "Bad Request");
+        delete upload;
+        return NULL;
+    }
+    return upload;
+}
+
+// After the body of a PUT/PATCH went in: 204 with the new offset, 201
+// once the upload is complete and in place
+std::string WebServer::finishResumableAppend(ResumableUpload& upload, const LocationConfig* location) {
+    if (upload.writeError()) {
+        int error = upload.writeError();
+        LOG_ERROR("Resumable upload " + upload.id() + ": " + strerror(error));
+        return generateHeaders(error == ENOSPC || error == EDQUOT ? 507 : 500,
+                               error == ENOSPC || error == EDQUOT ? "Insufficient Storage" : "Internal Server Error",
+                               "text/plain", 0, resumableHeaders(upload, location));
+    }
+    if (!upload.complete()) {
+        return generateHeaders(204, "No Content", "text/plain", 0, resumableHeaders(upload, location));
+    }
+    std::string saved_as;
+    if (!upload.finish(saved_as)) {
+        LOG_ERROR("Resumable upload " + upload.id() + " cannot be stored: " + strerror(errno));
+        return generateErrorResponse(500, "Internal Server Error");
+    }
+    std::string upload_dir = uploadDir(location);
+    _open_files.invalidate(upload_dir + "/" + saved_as);
+    _open_files.invalidate(upload_dir);
+    LOG_INFO("Resumable upload " + upload.id() + " complete: " + saved_as);
+
+    std::string headers = "Upload-Offset: " + toString(static_cast<size_t>(upload.offset())) + "\r\n";
+    std::string url = uploadUrl(location, saved_as);
+    if (!url.empty()) {
+        headers += "Location: " + url + "\r\n";
+    }
+    return generateHeaders(201, "Created", "text/plain", 0, headers);
+}
+
+// Idle uploads are also refused as they are opened; the sweep, once a
+// minute when some location has upload_resumable, reclaims their space.
+void WebServer::expireResumableUploads() {
+    time_t now = time(NULL);
+    if (!_next_upload_sweep || now < _next_upload_sweep) {
+        return;
+    }
+    _next_upload_sweep = now + 60;
+    const std::vector<ServerConfig>& servers = _config->getServers();
+    for (size_t i = 0; i < servers.size(); ++i) {
+        for (size_t j = 0; j < servers[i].locations.size(); ++j) {
+            const LocationConfig& location = servers[i].locations[j];
+            if (location.upload_resumable) {
+                size_t removed = ResumableUpload::expire(uploadDir(&location), location.upload_resumable_timeout);
+                if (removed > 0) {
+                    LOG_INFO("Expired " + toString(removed) + " idle upload(s) in " + uploadDir(&location));
+                }
+            }
+        }
+    }
+}
+
 std::string WebServer::handleFormSubmission(const HttpRequest& request) {
     std::string body = request.getBody();
     
@@ -694,12 +3766,119 @@ std::string WebServer::handlePostEcho(const HttpRequest& request) {
 
 void WebServer::cleanup() {
 	LOG_INFO("Cleaning up WebServer...");
+	if (_upgrade_fd != -1) {
+		close(_upgrade_fd); // a binary upgrade still starting
+		_upgrade_fd = -1;
+	}
 	for (size_t i = 0; i < _server_sockets.size(); ++i) {
 		close(_server_sockets[i]);
 		LOG_DEBUG("Closed server socket " + toString(_server_sockets[i]));
 	}
+	_server_sockets.clear();
+	_listen_fds.clear();
+	
+	for (std::map<int, OutputQueue*>::iterator it = _client_outputs.begin(); it != _client_outputs.end(); ++it) {
+		delete it->second;
+	}
+	_client_outputs.clear();
+	_response_body.clear();
+	for (std::map<int, Http2Session*>::iterator it = _h2_sessions.begin(); it != _h2_sessions.end(); ++it) {
+		delete it->second;
+	}
+	_h2_sessions.clear();
+	for (std::map<int, PendingUpload>::iterator it = _uploads.begin(); it != _uploads.end(); ++it) {
+		delete it->second.writer;
+		delete it->second.resumable;
+	}
+	_uploads.clear();
+	for (std::map<int, ProxySession*>::iterator it = _proxy_clients.begin(); it != _proxy_clients.end(); ++it) {
+		if (it->second->upstream_fd != -1) {
+			close(it->second->upstream_fd);
+		}
+		delete it->second;
+	}
+	_proxy_clients.clear();
+	_proxy_upstreams.clear();
+	_upstreams.clear();
+	for (std::map<std::string, LimitZone*>::iterator it = _limit_zones.begin(); it != _limit_zones.end(); ++it) {
+		delete it->second;
+	}
+	_limit_zones.clear();
+	for (std::map<int, TlsConnection*>::iterator it = _tls_clients.begin(); it != _tls_clients.end(); ++it) {
+		delete it->second;
+	}
+	_tls_clients.clear();
+	for (std::map<std::string, TlsContext*>::iterator it = _tls_contexts.begin(); it != _tls_contexts.end(); ++it) {
+		delete it->second;
+	}
+	_tls_contexts.clear();
+	_tls_listeners.clear();
+	if (_events) {
+		LOG_INFO(std::string("events (") + _events->name() + "): " + _events->statsLine());
+		delete _events;
+		_events = NULL;
+	}
+	if (_tls_stats.handshakes + _tls_stats.failed > 0) {
+		LOG_INFO("tls: " + _tls_stats.statsLine());
+	}
+	if (_timing_stats.requests() > 0) {
+		LOG_INFO("timing: " + _timing_stats.statsLine());
+	}
+	LOG_INFO("memory: " + _memory.statsLine());
+	if (_access_log_fd != -1) {
+		close(_access_log_fd);
+		_access_log_fd = -1;
+	}
+	_capture.close();
+	if (_mapped_files.hits() + _mapped_files.misses() > 0) {
+		LOG_INFO("mmap cache: " + _mapped_files.statsLine());
+	}
+	_mapped_files.clear();
+	_open_files.clear();
+	for (std::map<std::string, StaticBundle*>::iterator it = _bundles.begin(); it != _bundles.end(); ++it) {
+		LOG_INFO("bundle " + it->second->statsLine());
+		delete it->second;
+	}
+	_bundles.clear();
+	for (std::map<pid_t, CgiJob>::iterator it = _cgi_jobs.begin(); it != _cgi_jobs.end(); ++it) {
+		if (it->second.input_fd != -1) {
+			close(it->second.input_fd);
+		}
+		if (it->second.output_fd != -1) {
+			close(it->second.output_fd);
+		}
+		if (it->second.exit_fd != -1) {
+			close(it->second.exit_fd);
+		}
+		CgiExecutor::killGroup(it->first);
+		CgiUsage usage;
+		CgiExecutor::reap(it->first, true, usage);
+	}
+	_cgi_jobs.clear();
+	_cgi_inputs.clear();
+	_cgi_outputs.clear();
+	_cgi_exits.clear();
+	_cgi_clients.clear();
+	_cgi_streams.clear();
+	_cgi_running.clear();
+	_cgi_waiting.clear();
+	if (!_cgi_stats.empty()) {
+		LOG_INFO("cgi: " + _cgi_stats.statsLine());
+	}
+	if (_cgi_cache.size() > 0) {
+		LOG_INFO("cgi cache: " + _cgi_cache.statsLine());
+	}
+	_cgi_cache.clear();
 	
+	for (std::map<Config*, size_t>::iterator it = _config_users.begin(); it != _config_users.end(); ++it) {
+		if (it->first != _config) {
+			delete it->first;
+		}
+	}
+	_config_users.clear();
+	_client_configs.clear();
 	delete _config;
 	_config = NULL;
+	_request_config = NULL;
 	LOG_INFO("WebServer cleanup complete");
 }
\ No newline at end of file
@@ -1,6 +1,7 @@
 #include "WebServer.hpp"
 #include "Config.hpp"
 #include <iostream>
+#include <csignal>
 
 int main(int argc, char** argv) {
     std::string config_file = "config/default.conf";
@@ -14,26 +15,18 @@ int main(int argc, char** argv) {
         config_file = argv[1];
     }
     
-    // Parse configuration first
-    Config config;
-    if (!config.parseConfigFile(config_file)) {
-        log_error("failed to parse config file, using defaults");
-        config.setDefaultConfig();
-    }
-    
-    // Show what was parsed (optional - remove in production)
-    std::cout << "=== Loaded Configuration ===" << std::endl;
-    config.printConfig();
-    std::cout << "============================" << std::endl;
-    
     WebServer server;
+    server.setExecutable(argv[0]);
     
-    // Pass the parsed config instead of the file path
+    // Parses the file once and keeps the path for SIGHUP reloads
     if (!server.initialize(config_file)) {
         log_error("failed to initialize");
         return 1;
     }
     
+    // A client hanging up mid-sendfile must not kill the server
+    signal(SIGPIPE, SIG_IGN);
+    
     log_info("starting webserver...");
     server.run();
     
@@ -11,6 +11,8 @@
 /* ************************************************************************** */
 
 #include "utils.hpp"
+#include <cstring>
+#include <cctype>
 
 std::string get_timestamp()
 {
@@ -53,4 +55,49 @@ std::string size_t_to_string(size_t value){
 	std::ostringstream oss;
 	oss << value;
 	return oss.str();
-}
\ No newline at end of file
+}
+
+std::string http_date(time_t t){
+	struct tm gmt;
+	char buffer[64];
+
+	gmtime_r(&t, &gmt);
+	strftime(buffer, sizeof(buffer), "%a, %d %b %Y %H:%M:%S GMT", &gmt);
+	return std::string(buffer);
+}
+
+bool parse_http_date(const std::string &str, time_t &out){
+	struct tm gmt;
+
+	std::memset(&gmt, 0, sizeof(gmt));
+	const char *end = strptime(str.c_str(), "%a, %d %b %Y %H:%M:%S GMT", &gmt);
+	if (!end)
+		return false;
+	out = timegm(&gmt);
+	return out != (time_t)-1;
+}
+
+std::string mime_type(const std::string &path){
+	size_t dot_pos = path.find_last_of('.');
+	if (dot_pos == std::string::npos)
+		return "application/octet-stream";
+
+	std::string extension = path.substr(dot_pos);
+	for (size_t i = 0; i < extension.length(); ++i)
+		extension[i] = std::tolower(extension[i]);
+
+	if (extension == ".html" || extension == ".htm") return "text/html";
+	if (extension == ".css") return "text/css";
+	if (extension == ".js") return "application/javascript";
+	if (extension == ".json") return "application/json";
+	if (extension == ".txt") return "text/plain";
+	if (extension == ".png") return "image/png";
+	if (extension == ".jpg" || extension == ".jpeg") return "image/jpeg";
+	if (extension == ".gif") return "image/gif";
+	if (extension == ".ico") return "image/x-icon";
+	if (extension == ".svg") return "image/svg+xml";
+	if (extension == ".xml") return "application/xml";
+	if (extension == ".gz") return "application/gzip";
+	if (extension == ".br") return "application/x-brotli";
+	return "application/octet-stream";
+}
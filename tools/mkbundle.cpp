@@ -0,0 +1,72 @@
+/* ************************************************************************** */
+/*                                                                            */
+/*   mkbundle.cpp - packs a location root into a bundle for webserv           */
+/*                                                                            */
+/*   Every regular file under ROOT becomes an entry of one archive, indexed   */
+/*   by its path under ROOT, with its response headers and ETag rendered     */
+/*   and, for compressible types, a gzip variant. The server maps the        */
+/*   archive once (bundle directive) and serves it without touching the      */
+/*   filesystem. Rebuild and send SIGHUP after changing the root.            */
+/*                                                                            */
+/* ************************************************************************** */
+
+#include "StaticBundle.hpp"
+#include <cstdlib>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace {
+
+void usage() {
+    std::cerr <<
+        "Usage: mkbundle [options] ROOT OUTPUT\n"
+        "  --no-gzip              no precompressed variants\n"
+        "  --gzip-types 'T1 T2'   types given a gzip variant (built-in text types)\n";
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+    bool gzip = true;
+    std::vector<std::string> gzip_types;
+    std::vector<std::string> paths;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--no-gzip") {
+            gzip = false;
+        } else if (arg == "--gzip-types" && i + 1 < argc) {
+            std::istringstream types(argv[++i]);
+            std::string type;
+            while (types >> type) {
+                gzip_types.push_back(type);
+            }
+        } else if (!arg.empty() && arg[0] == '-') {
+            usage();
+            return 1;
+        } else {
+            paths.push_back(arg);
+        }
+    }
+    if (paths.size() != 2) {
+        usage();
+        return 1;
+    }
+
+    size_t files = 0;
+    std::string error;
+    if (!StaticBundle::build(paths[0], paths[1], gzip, gzip_types, files, error)) {
+        std::cerr << "mkbundle: " << error << std::endl;
+        return 1;
+    }
+    std::string load_error;
+    StaticBundle* bundle = StaticBundle::load(paths[1], load_error);
+    if (!bundle) {
+        std::cerr << "mkbundle: " << load_error << std::endl;
+        return 1;
+    }
+    std::cout << bundle->statsLine() << std::endl;
+    delete bundle;
+    return 0;
+}